@@ -0,0 +1,173 @@
+// Times UV map color registration against the per-pixel loop that used to
+// live in OnNewColorSample, on its own and together with the vertex
+// conversion the pipeline does on the same cloud. Exits with 1 when the
+// table's colors, strided or packed, differ from the per-pixel loop's.
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <pcl/point_types.h>
+
+#include "color_registration.h"
+#include "depth_conversion.h"
+
+static const int DEPTH_WIDTH = 320;
+static const int DEPTH_HEIGHT = 240;
+static const int COLOR_WIDTH = 640;
+static const int COLOR_HEIGHT = 480;
+const int c_PIXEL_COUNT = DEPTH_WIDTH * DEPTH_HEIGHT;
+const int c_ITERATIONS = 1000;
+const int c_STRIDE = sizeof(pcl::PointXYZRGB)/sizeof(uint32_t);
+const int16_t c_MIN_Z = 150;
+const int16_t c_MAX_Z = 3000;
+
+typedef std::vector<pcl::PointXYZRGB, Eigen::aligned_allocator<pcl::PointXYZRGB> > Points;
+
+// The loop this replaces, with its bounds check tightened so it doesn't read
+// past the color image.
+void RegisterLegacy(const float* uv, const uint8_t* color_map, Points& points) {
+  for (int depth_index = 0; depth_index < c_PIXEL_COUNT; depth_index++) {
+    int color_col = ((float)uv[2*depth_index + 0])*COLOR_WIDTH;
+    int color_row = ((float)uv[2*depth_index + 1])*COLOR_HEIGHT;
+    if (color_row < 0 || color_row >= COLOR_HEIGHT || color_col < 0 || color_col >= COLOR_WIDTH) {
+      points[depth_index].b = 0;
+      points[depth_index].g = 0;
+      points[depth_index].r = 0;
+    } else {
+      int color_index = color_row*COLOR_WIDTH + color_col;
+      points[depth_index].b = color_map[3*color_index + 0];
+      points[depth_index].g = color_map[3*color_index + 1];
+      points[depth_index].r = color_map[3*color_index + 2];
+    }
+  }
+}
+
+// The depth camera sees a bit more than the color camera, so the UV map runs
+// off the color image along the left and bottom edges.
+void MakeInputs(std::vector<float>& uv, std::vector<uint8_t>& color_map) {
+  srand(325);
+  uv.resize(2*c_PIXEL_COUNT);
+  for (int row = 0; row < DEPTH_HEIGHT; row++) {
+    for (int col = 0; col < DEPTH_WIDTH; col++) {
+      int i = row*DEPTH_WIDTH + col;
+      uv[2*i + 0] = (col - 12)/(float)(DEPTH_WIDTH - 20) + (rand() % 100)*1e-5f;
+      uv[2*i + 1] = (row + 6)/(float)(DEPTH_HEIGHT - 4) + (rand() % 100)*1e-5f;
+    }
+  }
+  // Exercise the last color pixel, the one a 4 byte gather can't touch
+  uv[0] = (COLOR_WIDTH - 0.5f)/COLOR_WIDTH;
+  uv[1] = (COLOR_HEIGHT - 0.5f)/COLOR_HEIGHT;
+  color_map.resize(3*COLOR_WIDTH*COLOR_HEIGHT);
+  for (size_t i = 0; i < color_map.size(); i++) {
+    color_map[i] = rand() & 0xff;
+  }
+}
+
+// A slanted plane, with some pixels out of range
+void MakeVertices(std::vector<int16_t>& vertices) {
+  vertices.resize(3*c_PIXEL_COUNT);
+  for (int row = 0; row < DEPTH_HEIGHT; row++) {
+    for (int col = 0; col < DEPTH_WIDTH; col++) {
+      int i = row*DEPTH_WIDTH + col;
+      int z = (col % 37 == 0) ? 0 : 400 + 3*row + col;
+      vertices[3*i + 0] = (col - DEPTH_WIDTH/2)*z/224;
+      vertices[3*i + 1] = (DEPTH_HEIGHT/2 - row)*z/230;
+      vertices[3*i + 2] = z;
+    }
+  }
+}
+
+template <typename F>
+double Time(F f) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < c_ITERATIONS; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count()/c_ITERATIONS;
+}
+
+bool Matches(const Points& expected, const Points& actual) {
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    if (expected[i].r != actual[i].r || expected[i].g != actual[i].g || expected[i].b != actual[i].b) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The same for colors registered into a packed plane
+bool PlaneMatches(const Points& expected, const std::vector<uint32_t>& plane) {
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    if ((expected[i].rgba & 0xffffff) != (plane[i] & 0xffffff)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  std::vector<float> uv;
+  std::vector<uint8_t> color_map;
+  MakeInputs(uv, color_map);
+  Points expected(c_PIXEL_COUNT);
+  Points points(c_PIXEL_COUNT);
+  uint32_t* rgba = &points[0].rgba;
+
+  double legacy = Time([&]() { RegisterLegacy(&uv[0], &color_map[0], expected); });
+  printf("%-20s %8.1f us/frame\n", "legacy", legacy);
+
+  ColorRegistration nearest(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT);
+  double build = Time([&]() { nearest.SetUVMap(&uv[0]); });
+  double apply = Time([&]() { nearest.Apply(&color_map[0], rgba, c_STRIDE); });
+  bool ok = Matches(expected, points);
+  printf("%-20s %8.1f us/frame\n", "nearest table", build);
+  printf("%-20s %8.1f us/frame  %5.2fx%s\n", "nearest apply", apply, legacy/apply, ok ? "" : "  MISMATCH");
+  printf("%-20s %8.1f us/frame  %5.2fx\n", "nearest total", build + apply, legacy/(build + apply));
+
+  std::vector<uint32_t> plane(c_PIXEL_COUNT);
+  double apply_plane = Time([&]() { nearest.Apply(&color_map[0], &plane[0], 1); });
+  bool plane_ok = PlaneMatches(expected, plane);
+  ok = ok && plane_ok;
+  printf("%-20s %8.1f us/frame  %5.2fx%s\n", "nearest apply plane", apply_plane, legacy/apply_plane,
+      plane_ok ? "" : "  MISMATCH");
+  printf("%-20s %8.1f us/frame  %5.2fx\n", "nearest total plane", build + apply_plane,
+      legacy/(build + apply_plane));
+
+  // What the pipeline does per frame: the legacy loop colored the cloud in
+  // a pass of its own, now the table is built, applied into a packed plane
+  // and the conversion interleaves that.
+  std::vector<int16_t> vertices;
+  MakeVertices(vertices);
+  const int float_stride = sizeof(pcl::PointXYZRGB)/sizeof(float);
+  double legacy_pipeline = Time([&]() {
+    ConvertVertices(&vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z, expected[0].data, float_stride);
+    RegisterLegacy(&uv[0], &color_map[0], expected);
+  });
+  double pipeline = Time([&]() {
+    nearest.SetUVMap(&uv[0]);
+    nearest.Apply(&color_map[0], &plane[0], 1);
+    ConvertVertices(&vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z, points[0].data, float_stride, &plane[0]);
+  });
+  bool pipeline_ok = Matches(expected, points);
+  ok = ok && pipeline_ok;
+  printf("%-20s %8.1f us/frame\n", "legacy pipeline", legacy_pipeline);
+  printf("%-20s %8.1f us/frame  %5.2fx%s\n", "nearest pipeline", pipeline, legacy_pipeline/pipeline,
+      pipeline_ok ? "" : "  MISMATCH");
+
+  double blend = Time([&]() { nearest.Apply(&color_map[0], &color_map[0], 0.5f, rgba, c_STRIDE); });
+  printf("%-20s %8.1f us/frame\n", "nearest blend", blend);
+
+  ColorRegistration bilinear(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT, true);
+  double bilinear_build = Time([&]() { bilinear.SetUVMap(&uv[0]); });
+  double bilinear_apply = Time([&]() { bilinear.Apply(&color_map[0], rgba, c_STRIDE); });
+  printf("%-20s %8.1f us/frame\n", "bilinear table", bilinear_build);
+  printf("%-20s %8.1f us/frame  %5.2fx\n", "bilinear apply", bilinear_apply, legacy/bilinear_apply);
+  if (!ok) {
+    printf("nearest registration doesn't match the legacy loop\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+// Measures the depth codec on a recording, or on the synthetic scene when no
+// recording is given: compression ratio, and encode and decode speed with one
+// and two threads. Every frame is checked to decode to exactly what went in.
+//
+//   bench_depth_codec [recording.ds325]
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "bench_frames.h"
+#include "depth_codec.h"
+#include "recording.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_SYNTHETIC_FRAMES = 300;
+const int c_PLANE_COUNT = 4;
+// Key frame interval used by the recorder
+const int c_KEYFRAME_INTERVAL = 60;
+
+// The 16-bit planes of one depth frame: vertex x, y, z and confidence
+struct Planes {
+  std::vector<Vertex> vertices;
+  std::vector<int16_t> confidence;
+
+  void Copy(const DepthFrame& frame) {
+    vertices.assign(frame.vertices, frame.vertices + c_PIXEL_COUNT);
+    confidence.assign(frame.confidence, frame.confidence + c_PIXEL_COUNT);
+  }
+
+  int16_t* Plane(int plane, int* stride) {
+    *stride = plane < 3 ? 3 : 1;
+    return plane < 3 ? &vertices[0].x + plane : &confidence[0];
+  }
+
+  bool operator==(const Planes& other) const {
+    return memcmp(&vertices[0], &other.vertices[0], c_PIXEL_COUNT*sizeof(Vertex)) == 0 &&
+        memcmp(&confidence[0], &other.confidence[0], c_PIXEL_COUNT*sizeof(int16_t)) == 0;
+  }
+};
+
+bool LoadRecording(const char* path, std::vector<Planes>* frames) {
+  RecordingReader reader;
+  if (!reader.Open(path)) {
+    return false;
+  }
+  DepthFrame frame;
+  for (int i = 0; i < reader.FrameCount(recording::STREAM_DEPTH); i++) {
+    if (reader.GetDepth(i, &frame)) {
+      frames->push_back(Planes());
+      frames->back().Copy(frame);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  std::vector<Planes> frames;
+  if (argc > 1) {
+    if (!LoadRecording(argv[1], &frames)) {
+      return 1;
+    }
+    printf("%s: %d depth frames\n", argv[1], (int)frames.size());
+  } else {
+    SyntheticSource source(c_SYNTHETIC_FRAMES, false);
+    ForEachFrame(&source, [&](const DepthFrame& frame) {
+      frames.push_back(Planes());
+      frames.back().Copy(frame);
+    });
+    printf("synthetic scene: %d depth frames\n", (int)frames.size());
+  }
+  if (frames.empty()) {
+    return 1;
+  }
+
+  const double raw_bytes = (double)frames.size()*c_PIXEL_COUNT*(sizeof(Vertex) + sizeof(int16_t));
+  int failures = 0;
+  for (int threads = 1; threads <= 2; threads++) {
+    ThreadPool pool(threads);
+    DepthCodec codec(DEPTH_WIDTH, DEPTH_HEIGHT);
+
+    std::vector<std::vector<uint8_t> > encoded(frames.size());
+    std::vector<size_t> plane_sizes(frames.size()*c_PLANE_COUNT);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames.size(); f++) {
+      bool key = f % c_KEYFRAME_INTERVAL == 0;
+      for (int p = 0; p < c_PLANE_COUNT; p++) {
+        int stride;
+        const int16_t* plane = frames[f].Plane(p, &stride);
+        const int16_t* previous = key ? NULL : frames[f - 1].Plane(p, &stride);
+        plane_sizes[f*c_PLANE_COUNT + p] = codec.Encode(plane, previous, stride, &encoded[f], &pool);
+      }
+    }
+    std::chrono::duration<double> encode_time = std::chrono::steady_clock::now() - start;
+
+    size_t encoded_bytes = 0;
+    for (size_t f = 0; f < frames.size(); f++) {
+      encoded_bytes += encoded[f].size();
+    }
+
+    // Decodes in place over the previous frame, like the recording reader
+    Planes decoded = frames[0];
+    bool ok = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames.size(); f++) {
+      bool key = f % c_KEYFRAME_INTERVAL == 0;
+      const uint8_t* data = &encoded[f][0];
+      for (int p = 0; p < c_PLANE_COUNT; p++) {
+        size_t size = plane_sizes[f*c_PLANE_COUNT + p];
+        int stride;
+        int16_t* plane = decoded.Plane(p, &stride);
+        ok &= codec.Decode(data, size, key ? NULL : plane, stride, plane, &pool);
+        data += size;
+      }
+      ok &= decoded == frames[f];
+    }
+    std::chrono::duration<double> decode_time = std::chrono::steady_clock::now() - start;
+    failures += !ok;
+
+    printf("%d thread%s: ratio %.2f, encode %6.1f MB/s %6.0f fps, decode %6.1f MB/s %6.0f fps%s\n",
+        threads, threads > 1 ? "s" : " ", raw_bytes/encoded_bytes,
+        raw_bytes/1e6/encode_time.count(), frames.size()/encode_time.count(),
+        raw_bytes/1e6/decode_time.count(), frames.size()/decode_time.count(),
+        ok ? "" : "  MISMATCH");
+  }
+  return failures > 0;
+}
@@ -0,0 +1,199 @@
+// Times the vertex to point cloud conversion kernels against the original
+// per-field loop from OnNewDepthSample. Every kernel is checked against that
+// loop too, with and without colors, and the bench exits with 1 when any of
+// them disagrees. The kernels converting into StreamPoints are timed and
+// checked the same way.
+
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <pcl/point_types.h>
+
+#include "depth_conversion.h"
+
+static const int DEPTH_WIDTH = 320;
+static const int DEPTH_HEIGHT = 240;
+const int c_PIXEL_COUNT = DEPTH_WIDTH * DEPTH_HEIGHT;
+const int c_MIN_Z = 100;
+const int c_MAX_Z = 2000;
+const int c_ITERATIONS = 2000;
+
+typedef std::vector<pcl::PointXYZRGB, Eigen::aligned_allocator<pcl::PointXYZRGB> > Points;
+
+// The loop this replaces, kept verbatim for comparison
+void ConvertLegacy(const int16_t* vertices, Points& points) {
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    const int16_t* vertex = vertices + 3*i;
+    if (vertex[2] > c_MAX_Z || vertex[2] < c_MIN_Z) {
+      points[i] = pcl::PointXYZRGB(0, 0, 0);
+      continue;
+    }
+    points[i].x = vertex[0];
+    points[i].y = vertex[1];
+    points[i].z = vertex[2];
+  }
+}
+
+// A close mode scene: a tilted plane with a band of out of range pixels and
+// some saturated noise, so the range test isn't trivially predictable.
+void MakeVertices(std::vector<int16_t>& vertices) {
+  srand(325);
+  vertices.resize(3*c_PIXEL_COUNT);
+  for (int row = 0; row < DEPTH_HEIGHT; row++) {
+    for (int col = 0; col < DEPTH_WIDTH; col++) {
+      int i = row*DEPTH_WIDTH + col;
+      int z = 300 + 4*row + col;
+      if (rand() % 10 == 0) {
+        z = 32001;
+      } else if (col < 20) {
+        z = 50;
+      }
+      vertices[3*i + 0] = (col - DEPTH_WIDTH/2)*z/224;
+      vertices[3*i + 1] = (DEPTH_HEIGHT/2 - row)*z/230;
+      vertices[3*i + 2] = z;
+    }
+  }
+}
+
+typedef void (*ConvertFunc)(const int16_t*, int, int16_t, int16_t, float*, int, const uint32_t*);
+
+double TimeKernel(ConvertFunc func, const std::vector<int16_t>& vertices, Points& points) {
+  const int stride = sizeof(pcl::PointXYZRGB)/sizeof(float);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < c_ITERATIONS; i++) {
+    func(&vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z, points[0].data, stride, NULL);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count()/c_ITERATIONS;
+}
+
+// Checks a kernel's output against the legacy loop, with NaN where the
+// legacy loop wrote the origin.
+bool Matches(const Points& expected, const Points& actual) {
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    bool rejected = expected[i].x == 0 && expected[i].y == 0 && expected[i].z == 0;
+    if (rejected) {
+      if (!std::isnan(actual[i].x) || !std::isnan(actual[i].y) || !std::isnan(actual[i].z)) {
+        return false;
+      }
+    } else if (expected[i].x != actual[i].x || expected[i].y != actual[i].y || expected[i].z != actual[i].z) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs a kernel with colors to interleave, which have to land in every
+// point's rgba without disturbing its xyz
+bool ColorsMatch(ConvertFunc func, const std::vector<int16_t>& vertices, const Points& expected) {
+  std::vector<uint32_t> colors(c_PIXEL_COUNT);
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    colors[i] = 2654435761u*(i + 1);
+  }
+  Points points(c_PIXEL_COUNT);
+  func(&vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z, points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float),
+      &colors[0]);
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    if (points[i].rgba != colors[i]) {
+      return false;
+    }
+  }
+  return Matches(expected, points);
+}
+
+typedef void (*StreamFunc)(const int16_t*, int, int16_t, int16_t, const uint32_t*, StreamPoint*);
+
+// Runs a stream kernel, which has to write the points of the legacy loop
+// with the colors as the bytes R, G, B, A
+double TimeStreamKernel(StreamFunc func, const std::vector<int16_t>& vertices, const Points& expected,
+                        bool* ok) {
+  std::vector<uint32_t> colors(c_PIXEL_COUNT);
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    colors[i] = 2654435761u*(i + 1);
+  }
+  std::vector<StreamPoint> stream(c_PIXEL_COUNT);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < c_ITERATIONS; i++) {
+    func(&vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z, &colors[0], &stream[0]);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+  Points points(c_PIXEL_COUNT);
+  *ok = true;
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    points[i].x = stream[i].x;
+    points[i].y = stream[i].y;
+    points[i].z = stream[i].z;
+    const uint8_t* bytes = (const uint8_t*)&stream[i].rgba;
+    const uint32_t color = colors[i];
+    *ok = *ok && bytes[0] == ((color >> 16) & 0xff) && bytes[1] == ((color >> 8) & 0xff) &&
+          bytes[2] == (color & 0xff) && bytes[3] == color >> 24;
+  }
+  *ok = *ok && Matches(expected, points);
+  return elapsed.count()/c_ITERATIONS;
+}
+
+int main(int argc, char** argv) {
+  std::vector<int16_t> vertices;
+  MakeVertices(vertices);
+  Points expected(c_PIXEL_COUNT);
+  Points points(c_PIXEL_COUNT);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < c_ITERATIONS; i++) {
+    ConvertLegacy(&vertices[0], expected);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  double legacy = elapsed.count()/c_ITERATIONS;
+  printf("%-13s %8.1f us/frame\n", "legacy", legacy);
+
+  __builtin_cpu_init();
+  struct {
+    const char* name;
+    ConvertFunc func;
+    bool supported;
+  } kernels[] = {
+    {"scalar", &ConvertVerticesScalar, true},
+    {"sse4.1", &ConvertVerticesSSE41, __builtin_cpu_supports("sse4.1") != 0},
+    {"avx2", &ConvertVerticesAVX2, __builtin_cpu_supports("avx2") != 0},
+  };
+
+  int failures = 0;
+  for (int k = 0; k < 3; k++) {
+    if (!kernels[k].supported) {
+      printf("%-13s unsupported\n", kernels[k].name);
+      continue;
+    }
+    double us = TimeKernel(kernels[k].func, vertices, points);
+    bool ok = Matches(expected, points) && ColorsMatch(kernels[k].func, vertices, expected);
+    failures += !ok;
+    printf("%-13s %8.1f us/frame  %5.2fx%s\n", kernels[k].name, us, legacy/us, ok ? "" : "  MISMATCH");
+  }
+  struct {
+    const char* name;
+    StreamFunc func;
+    bool supported;
+  } stream_kernels[] = {
+    {"stream scalar", &ConvertStreamPointsScalar, true},
+    {"stream avx2", &ConvertStreamPointsAVX2, __builtin_cpu_supports("avx2") != 0},
+  };
+  for (int k = 0; k < 2; k++) {
+    if (!stream_kernels[k].supported) {
+      printf("%-13s unsupported\n", stream_kernels[k].name);
+      continue;
+    }
+    bool ok;
+    double us = TimeStreamKernel(stream_kernels[k].func, vertices, expected, &ok);
+    failures += !ok;
+    printf("%-13s %8.1f us/frame  %5.2fx%s\n", stream_kernels[k].name, us, legacy/us, ok ? "" : "  MISMATCH");
+  }
+  printf("dispatch: %s\n", ConvertVerticesKernelName());
+  if (failures > 0) {
+    printf("%d kernels don't match the legacy loop\n", failures);
+    return 1;
+  }
+  return 0;
+}
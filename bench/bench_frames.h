@@ -0,0 +1,132 @@
+#ifndef BENCH_FRAMES_H_
+#define BENCH_FRAMES_H_
+
+// Gathers the frames of a source up front, so the benches can time a stage
+// on them without the source in the loop.
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include "depth_conversion.h"
+#include "frame_source.h"
+
+// Hands every frame of a source to a pair of callbacks, either of which may
+// be empty.
+class CallbackSink : public FrameSink {
+  std::function<void(const DepthFrame&)> on_depth;
+  std::function<void(const ColorFrame&)> on_color;
+
+public:
+  CallbackSink(const std::function<void(const DepthFrame&)>& on_depth,
+               const std::function<void(const ColorFrame&)>& on_color)
+      : on_depth(on_depth), on_color(on_color) {}
+
+  void OnDepthFrame(const DepthFrame& frame) {
+    if (on_depth) {
+      on_depth(frame);
+    }
+  }
+
+  void OnColorFrame(const ColorFrame& frame) {
+    if (on_color) {
+      on_color(frame);
+    }
+  }
+};
+
+// Runs source to the end with the callbacks as its sink. Returns what
+// FrameSource::Run returned.
+inline bool ForEachFrame(FrameSource* source, const std::function<void(const DepthFrame&)>& on_depth,
+                         const std::function<void(const ColorFrame&)>& on_color =
+                             std::function<void(const ColorFrame&)>()) {
+  CallbackSink sink(on_depth, on_color);
+  source->SetSink(&sink);
+  bool ok = source->Run();
+  source->SetSink(NULL);
+  return ok;
+}
+
+// A copy of a depth or color frame
+struct StoredFrame {
+  bool depth;
+  uint64_t timestamp;
+  Intrinsics intrinsics;
+  std::vector<Vertex> vertices;
+  std::vector<UV> uv_map;
+  std::vector<int16_t> confidence;
+  // The color frame's image, or for a depth frame collected with color the
+  // last one before it (black before the first)
+  std::vector<uint8_t> bgr;
+};
+
+// Copies the arrays of a depth frame, which are only valid during the callback
+inline void StoreDepth(const DepthFrame& frame, StoredFrame* stored) {
+  stored->depth = true;
+  stored->timestamp = frame.timestamp;
+  stored->intrinsics = frame.intrinsics;
+  stored->vertices.assign(frame.vertices, frame.vertices + c_PIXEL_COUNT);
+  stored->uv_map.assign(frame.uv_map, frame.uv_map + c_PIXEL_COUNT);
+  if (frame.confidence != NULL) {
+    stored->confidence.assign(frame.confidence, frame.confidence + c_PIXEL_COUNT);
+  } else {
+    stored->confidence.assign(c_PIXEL_COUNT, 0);
+  }
+}
+
+// Every frame of both streams, in the order the source delivered them
+inline bool CollectFrames(FrameSource* source, std::vector<StoredFrame>* frames) {
+  return ForEachFrame(source, [&](const DepthFrame& frame) {
+    frames->push_back(StoredFrame());
+    StoreDepth(frame, &frames->back());
+  }, [&](const ColorFrame& frame) {
+    frames->push_back(StoredFrame());
+    StoredFrame& stored = frames->back();
+    stored.depth = false;
+    stored.timestamp = frame.timestamp;
+    stored.bgr.assign(frame.bgr, frame.bgr + 3*c_COLOR_PIXEL_COUNT);
+  });
+}
+
+// The depth frames only, each with a copy of the color image before it when
+// with_color is set
+inline bool CollectDepth(FrameSource* source, std::vector<StoredFrame>* frames, bool with_color = false) {
+  std::vector<uint8_t> bgr(with_color ? 3*c_COLOR_PIXEL_COUNT : 0);
+  return ForEachFrame(source, [&](const DepthFrame& frame) {
+    frames->push_back(StoredFrame());
+    StoreDepth(frame, &frames->back());
+    frames->back().bgr = bgr;
+  }, [&](const ColorFrame& frame) {
+    if (with_color) {
+      bgr.assign(frame.bgr, frame.bgr + bgr.size());
+    }
+  });
+}
+
+// Depth frames converted to organized clouds, point_stride floats per point
+// as ConvertVertices writes them
+struct StoredClouds {
+  int point_stride;
+  std::vector<std::vector<float> > points;
+  std::vector<uint64_t> timestamps;
+  // Of the last frame added
+  Intrinsics intrinsics;
+
+  explicit StoredClouds(int point_stride) : point_stride(point_stride) {}
+
+  void Add(const DepthFrame& frame) {
+    points.push_back(std::vector<float>(c_PIXEL_COUNT*point_stride));
+    ConvertVertices((const int16_t*)frame.vertices, c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z,
+        &points.back()[0], point_stride);
+    timestamps.push_back(frame.timestamp);
+    intrinsics = frame.intrinsics;
+  }
+};
+
+inline bool CollectClouds(FrameSource* source, StoredClouds* clouds) {
+  return ForEachFrame(source, [&](const DepthFrame& frame) {
+    clouds->Add(frame);
+  });
+}
+
+#endif // BENCH_FRAMES_H_
@@ -0,0 +1,80 @@
+// Runs the synthetic scene through the capture pipeline with the exporter
+// writing to stdout, then measures what a timed scope costs, from 1 thread up
+// to one per core.
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "capture_pipeline.h"
+#include "metrics.h"
+#include "synthetic_source.h"
+
+const int c_SCOPES = 10000000;
+const int c_FRAME_COUNT = 240;
+
+// Takes the clouds off the pipeline as the display would
+class Display : public FrameSink {
+  CapturePipeline& pipeline;
+
+public:
+  explicit Display(CapturePipeline& pipeline) : pipeline(pipeline) {}
+
+  void Show() {
+    TripleBuffer<CapturePipeline::Frame>& frames = pipeline.GetFrames();
+    if (frames.Acquire()) {
+      METRICS_RECORD(STAGE_END_TO_END, metrics::Now() - frames.Front().received);
+    }
+  }
+
+  void OnDepthFrame(const DepthFrame& frame) {
+    pipeline.OnDepthFrame(frame);
+    Show();
+  }
+
+  void OnColorFrame(const ColorFrame& frame) {
+    pipeline.OnColorFrame(frame);
+    Show();
+  }
+};
+
+void TimeScopes(int count) {
+  for (int i = 0; i < count; i++) {
+    METRICS_SCOPE(STAGE_CONVERSION);
+  }
+}
+
+int main(int argc, char** argv) {
+#ifndef DS325_ENABLE_METRICS
+  printf("built without DS325_ENABLE_METRICS, nothing to measure\n");
+  return 0;
+#endif
+  CapturePipeline pipeline;
+  pipeline.EnableTemporalFilter(TEMPORAL_EXPONENTIAL);
+  pipeline.EnableNormals(NORMALS_INTEGRAL);
+  Display display(pipeline);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  source.SetSink(&display);
+  MetricsExporter exporter;
+  exporter.Start("-", 500);
+  source.Run();
+  exporter.Stop();
+
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1; threads <= cores; threads *= 2) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.push_back(std::thread(TimeScopes, c_SCOPES/threads));
+    }
+    for (int t = 0; t < threads; t++) {
+      workers[t].join();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%d thread%s: %.1f ns per scope\n", threads, threads > 1 ? "s" : " ",
+        elapsed.count()*threads/c_SCOPES);
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+// Records the synthetic scene once, then replays it as a rig of 1 to 4
+// cameras: the clouds per second all cameras process together, and the time
+// to merge their clouds. With a core per camera the rate should grow about
+// linearly with the camera count.
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "multi_camera.h"
+#include "recording.h"
+#include "replay_source.h"
+#include "synthetic_source.h"
+
+const char* c_RECORDING = "/tmp/bench_multi_camera.ds325";
+const int c_FRAME_COUNT = 300;
+const int c_MAX_CAMERAS = 4;
+const int c_MERGES = 200;
+// The cameras stand on a circle around the scene, this far apart
+const float c_CAMERA_ANGLE = 0.5f;
+
+// A camera turned about the y axis of the rig
+Pose CameraExtrinsics(int camera) {
+  const float angle = c_CAMERA_ANGLE*camera;
+  const float c = cosf(angle);
+  const float s = sinf(angle);
+  Pose pose = {{c, 0, s, 0, 0, 1, 0, 0, -s, 0, c, 0}};
+  return pose;
+}
+
+int main(int argc, char** argv) {
+  {
+    RecordingWriter writer;
+    if (!writer.Open(c_RECORDING)) {
+      return 1;
+    }
+    SyntheticSource source(c_FRAME_COUNT, false);
+    source.SetSink(&writer);
+    source.Run();
+    if (!writer.Close()) {
+      return 1;
+    }
+  }
+
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  printf("%d cores, %d depth frames per camera\n", cores, c_FRAME_COUNT);
+  double single_rate = 0;
+  for (int cameras = 1; cameras <= c_MAX_CAMERAS; cameras++) {
+    MultiCameraCapture capture(std::max(1, cores/cameras));
+    for (int c = 0; c < cameras; c++) {
+      capture.AddCamera(new ReplaySource(c_RECORDING, false), CameraExtrinsics(c));
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!capture.Run()) {
+      return 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t published = 0;
+    for (int c = 0; c < cameras; c++) {
+      published += capture.GetPipeline(c).GetFrames().GetStats().published;
+    }
+    const double rate = published/elapsed.count();
+    if (cameras == 1) {
+      single_rate = rate;
+    }
+
+    // Every merge after the first finds nothing new, so each camera gets a
+    // fresh cloud published into its buffer first
+    MultiCameraCapture::Cloud merged;
+    double merge_time = 0;
+    for (int m = 0; m < c_MERGES; m++) {
+      for (int c = 0; c < cameras; c++) {
+        capture.GetPipeline(c).GetFrames().Publish();
+      }
+      std::chrono::steady_clock::time_point merge_start = std::chrono::steady_clock::now();
+      capture.Merge(&merged);
+      merge_time += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - merge_start).count();
+    }
+    printf("%d camera%s: %6.1f clouds/s (%.2fx one camera), merge %.2f ms for %d points\n", cameras,
+        cameras > 1 ? "s" : " ", rate, rate/single_rate, merge_time/c_MERGES, (int)merged.points.size());
+  }
+  remove(c_RECORDING);
+  return 0;
+}
@@ -0,0 +1,93 @@
+// Times normal estimation on clouds from the synthetic scene with 1 thread up
+// to one per core, and checks the normals against the scene's wall and floor,
+// whose normals are known.
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "bench_frames.h"
+#include "normal_estimator.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_FRAME_COUNT = 120;
+// Same layout as pcl::PointXYZRGB and pcl::Normal
+const int c_STRIDE = 8;
+
+// Where the synthetic scene puts its wall and floor, in mm
+const float c_WALL_Z = 1500.0f;
+const float c_FLOOR_Y = -400.0f;
+// Points this close to the wall or floor are taken to be on it
+const float c_SURFACE_TOLERANCE = 8.0f;
+
+// Mean angle in degrees between the normals and the known ones, and the share
+// of the wall and floor points that got a normal
+void Score(const std::vector<float>& cloud, const std::vector<float>& normals,
+           double* angle_sum, long* scored, long* on_surface) {
+  for (int i = 0; i < c_PIXEL_COUNT; i++) {
+    const float* p = &cloud[i*c_STRIDE];
+    const float* n = &normals[i*c_STRIDE];
+    float dot;
+    if (fabsf(p[2] - c_WALL_Z) < c_SURFACE_TOLERANCE) {
+      dot = -n[2];
+    } else if (fabsf(p[1] - c_FLOOR_Y) < c_SURFACE_TOLERANCE) {
+      dot = n[1];
+    } else {
+      continue;
+    }
+    (*on_surface)++;
+    if (dot == dot) {
+      *angle_sum += acos(std::min(1.0f, dot))*180/M_PI;
+      (*scored)++;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  StoredClouds stored(c_STRIDE);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  CollectClouds(&source, &stored);
+  const std::vector<std::vector<float> >& clouds = stored.points;
+  printf("%d clouds\n", (int)clouds.size());
+
+  struct Config {
+    NormalMethod method;
+    int radius;
+    const char* name;
+  };
+  const Config configs[] = {
+    {NORMALS_CROSS_PRODUCT, 0, "cross product"},
+    {NORMALS_INTEGRAL, 2, "integral 5x5"},
+    {NORMALS_INTEGRAL, 3, "integral 7x7"},
+    {NORMALS_INTEGRAL, 7, "integral 15x15"}
+  };
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<float> normals(c_PIXEL_COUNT*c_STRIDE);
+  for (int c = 0; c < 4; c++) {
+    NormalEstimator estimator(DEPTH_WIDTH, DEPTH_HEIGHT, configs[c].method, configs[c].radius);
+    printf("%-15s", configs[c].name);
+    for (int threads = 1; threads <= cores; threads *= 2) {
+      ThreadPool pool(threads);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (size_t f = 0; f < clouds.size(); f++) {
+        estimator.Compute(&clouds[f][0], c_STRIDE, &normals[0], c_STRIDE, &pool);
+      }
+      std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+      printf("  %d thread%s %6.0f us", threads, threads > 1 ? "s" : " ", elapsed.count()/clouds.size());
+    }
+
+    double angle_sum = 0;
+    long scored = 0;
+    long on_surface = 0;
+    for (size_t f = 0; f < clouds.size(); f++) {
+      estimator.Compute(&clouds[f][0], c_STRIDE, &normals[0], c_STRIDE);
+      Score(clouds[f], normals, &angle_sum, &scored, &on_surface);
+    }
+    printf("  wall and floor: mean error %5.2f deg, %5.1f%% with a normal\n",
+        angle_sum/scored, 100.0*scored/on_surface);
+  }
+  return 0;
+}
@@ -0,0 +1,164 @@
+// Runs ICP odometry over a recording, or over the synthetic scene with the
+// camera swaying when no recording is given: time per frame with 1 thread up
+// to one per core, agreement of the scalar and AVX2 reductions, and for the
+// synthetic scene the drift from the true camera path.
+//
+//   bench_odometry [recording.ds325]
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "bench_frames.h"
+#include "icp_odometry.h"
+#include "normal_estimator.h"
+#include "recording.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_SYNTHETIC_FRAMES = 300;
+// Same layout as pcl::PointXYZRGB
+const int c_STRIDE = 8;
+// Relative difference the float lanes of the AVX2 reduction may add
+const double c_KERNEL_TOLERANCE = 1e-4;
+
+bool LoadRecording(const char* path, StoredClouds* clouds) {
+  RecordingReader reader;
+  if (!reader.Open(path)) {
+    return false;
+  }
+  DepthFrame frame;
+  for (int i = 0; i < reader.FrameCount(recording::STREAM_DEPTH); i++) {
+    if (reader.GetDepth(i, &frame)) {
+      clouds->Add(frame);
+    }
+  }
+  return true;
+}
+
+float TranslationError(const Pose& a, const Pose& b) {
+  float dx = a.m[3] - b.m[3];
+  float dy = a.m[7] - b.m[7];
+  float dz = a.m[11] - b.m[11];
+  return sqrtf(dx*dx + dy*dy + dz*dz);
+}
+
+// Angle of the rotation between a and b in degrees
+float RotationError(const Pose& a, const Pose& b) {
+  Pose difference = ComposePoses(InvertPose(a), b);
+  const float* m = difference.m;
+  float cosine = std::max(-1.0f, std::min(1.0f, (m[0] + m[5] + m[10] - 1)*0.5f));
+  return acosf(cosine)*180/M_PI;
+}
+
+// The first width columns of an organized cloud
+std::vector<float> Crop(const std::vector<float>& points, int width) {
+  std::vector<float> cropped(width*DEPTH_HEIGHT*c_STRIDE);
+  for (int y = 0; y < DEPTH_HEIGHT; y++) {
+    std::copy(points.begin() + y*DEPTH_WIDTH*c_STRIDE, points.begin() + (y*DEPTH_WIDTH + width)*c_STRIDE,
+        cropped.begin() + y*width*c_STRIDE);
+  }
+  return cropped;
+}
+
+// Sums the normal equations for the second cloud against the first with both
+// kernels, on the first width columns so rows that don't fill the AVX2 lanes
+// get checked too, and returns the largest difference relative to the sum's
+// size
+double CompareKernels(const StoredClouds& clouds, int width) {
+  std::vector<float> reference_points = Crop(clouds.points[0], width);
+  std::vector<float> current_points = Crop(clouds.points[1], width);
+  std::vector<float> normals(width*DEPTH_HEIGHT*4);
+  NormalEstimator estimator(width, DEPTH_HEIGHT, NORMALS_INTEGRAL, 2);
+  estimator.Compute(&reference_points[0], c_STRIDE, &normals[0], 4);
+  IcpLevel reference = {width, DEPTH_HEIGHT, clouds.intrinsics, &reference_points[0], c_STRIDE,
+                        &normals[0], 4};
+  IcpLevel current = {width, DEPTH_HEIGHT, clouds.intrinsics, &current_points[0], c_STRIDE,
+                      NULL, 0};
+  const float identity[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+  double scalar[c_ICP_SUMS] = {0};
+  double avx2[c_ICP_SUMS] = {0};
+  IcpReduceScalar(current, reference, identity, 100.0f, 0, DEPTH_HEIGHT, scalar);
+  IcpReduceAVX2(current, reference, identity, 100.0f, 0, DEPTH_HEIGHT, avx2);
+  double worst = 0;
+  for (int k = 0; k < c_ICP_SUMS; k++) {
+    double size = std::max(1.0, fabs(scalar[k]));
+    worst = std::max(worst, fabs(scalar[k] - avx2[k])/size);
+  }
+  printf("width %d: %.0f correspondences, scalar and avx2 sums differ by up to %.2g relative\n",
+      width, scalar[c_ICP_SUMS - 1], worst);
+  return worst;
+}
+
+int main(int argc, char** argv) {
+  StoredClouds clouds(c_STRIDE);
+  const bool synthetic = argc <= 1;
+  if (!synthetic) {
+    if (!LoadRecording(argv[1], &clouds)) {
+      return 1;
+    }
+    printf("%s: %d depth frames\n", argv[1], (int)clouds.points.size());
+  } else {
+    SyntheticSource source(c_SYNTHETIC_FRAMES, false);
+    source.SetCameraMotion(true);
+    CollectClouds(&source, &clouds);
+    printf("synthetic scene, moving camera: %d depth frames\n", (int)clouds.points.size());
+  }
+  if (clouds.points.size() < 2) {
+    return 1;
+  }
+
+  printf("kernel: %s\n", IcpKernelName());
+  bool agree = CompareKernels(clouds, DEPTH_WIDTH) <= c_KERNEL_TOLERANCE;
+  agree = CompareKernels(clouds, DEPTH_WIDTH - 3) <= c_KERNEL_TOLERANCE && agree;
+  if (!agree) {
+    printf("MISMATCH between the scalar and avx2 reductions\n");
+  }
+
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<Pose> poses(clouds.points.size());
+  for (int threads = 1; threads <= cores; threads *= 2) {
+    ThreadPool pool(threads);
+    IcpOdometry odometry(clouds.intrinsics);
+    int lost = 0;
+    long iterations = 0;
+    double worst = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < clouds.points.size(); f++) {
+      std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+      if (!odometry.Track(&clouds.points[f][0], c_STRIDE, &pool) && f > 0) {
+        lost++;
+      }
+      std::chrono::duration<double, std::milli> frame_time = std::chrono::steady_clock::now() - frame_start;
+      worst = std::max(worst, frame_time.count());
+      iterations += odometry.GetStats().iterations;
+      poses[f] = odometry.GetPose();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%d thread%s: %5.2f ms per frame, %5.2f ms worst, %.1f iterations per frame, lost %d times\n",
+        threads, threads > 1 ? "s" : " ", elapsed.count()/clouds.points.size(), worst,
+        (double)iterations/clouds.points.size(), lost);
+  }
+
+  if (synthetic) {
+    // The true path, relative to where the first frame was taken
+    const Pose start = InvertPose(SyntheticSource::CameraPose(clouds.timestamps[0]));
+    float max_translation = 0;
+    float max_rotation = 0;
+    float path_length = 0;
+    Pose last_truth = ComposePoses(start, SyntheticSource::CameraPose(clouds.timestamps[0]));
+    for (size_t f = 0; f < poses.size(); f++) {
+      Pose truth = ComposePoses(start, SyntheticSource::CameraPose(clouds.timestamps[f]));
+      max_translation = std::max(max_translation, TranslationError(poses[f], truth));
+      max_rotation = std::max(max_rotation, RotationError(poses[f], truth));
+      path_length += TranslationError(truth, last_truth);
+      last_truth = truth;
+    }
+    printf("drift: %.1f mm and %.2f deg at most over a %.0f mm path\n",
+        max_translation, max_rotation, path_length);
+  }
+  return agree ? 0 : 1;
+}
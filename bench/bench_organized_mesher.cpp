@@ -0,0 +1,111 @@
+// Meshes the clouds of the synthetic scene: checks that the scalar and AVX2
+// kernels agree and that updating the index buffer in place is exact, then
+// prints how long a frame takes, how many triangles it has and how many
+// quads change from one frame to the next.
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "bench_frames.h"
+#include "organized_mesher.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_FRAME_COUNT = 300;
+const int c_THREADS[] = {1, 2, 4};
+
+// Whether the kernels classify every row of every cloud the same
+bool KernelsAgree(const std::vector<std::vector<float> >& clouds) {
+  const int quads = DEPTH_WIDTH - 1;
+  std::vector<float> z0(DEPTH_WIDTH);
+  std::vector<float> z1(DEPTH_WIDTH);
+  std::vector<uint8_t> scalar(quads);
+  std::vector<uint8_t> avx2(quads);
+  for (size_t f = 0; f < clouds.size(); f++) {
+    for (int row = 0; row + 1 < DEPTH_HEIGHT; row++) {
+      for (int col = 0; col < DEPTH_WIDTH; col++) {
+        const float a = clouds[f][3*(row*DEPTH_WIDTH + col) + 2];
+        const float b = clouds[f][3*((row + 1)*DEPTH_WIDTH + col) + 2];
+        z0[col] = a == a ? a : 0.0f;
+        z1[col] = b == b ? b : 0.0f;
+      }
+      MeshRowScalar(&z0[0], &z1[0], quads, 0.05f, &scalar[0]);
+      MeshRowAVX2(&z0[0], &z1[0], quads, 0.05f, &avx2[0]);
+      if (memcmp(&scalar[0], &avx2[0], quads) != 0) {
+        printf("Kernels disagree on row %d of frame %d\n", row, (int)f);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Whether updating the index buffer frame by frame ends up with the same
+// buffer as meshing every frame afresh
+bool UpdatesAgree(const std::vector<std::vector<float> >& clouds) {
+  OrganizedMesher updated(DEPTH_WIDTH, DEPTH_HEIGHT);
+  for (size_t f = 0; f < clouds.size(); f++) {
+    OrganizedMesher fresh(DEPTH_WIDTH, DEPTH_HEIGHT);
+    updated.Compute(&clouds[f][0], 3, DEPTH_WIDTH, DEPTH_HEIGHT);
+    fresh.Compute(&clouds[f][0], 3, DEPTH_WIDTH, DEPTH_HEIGHT);
+    if (updated.GetStats().triangles != fresh.GetStats().triangles ||
+        memcmp(updated.Indices(), fresh.Indices(), updated.IndexCount()*sizeof(uint32_t)) != 0) {
+      printf("Updated index buffer differs on frame %d\n", (int)f);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  StoredClouds stored(3);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  CollectClouds(&source, &stored);
+  const std::vector<std::vector<float> >& clouds = stored.points;
+  printf("%d clouds of %dx%d, kernel %s\n", (int)clouds.size(), DEPTH_WIDTH, DEPTH_HEIGHT,
+      OrganizedMesherKernelName());
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    if (!KernelsAgree(clouds)) {
+      return 1;
+    }
+    printf("scalar and avx2 kernels agree\n");
+  }
+
+  if (!UpdatesAgree(clouds)) {
+    return 1;
+  }
+  printf("updated and fresh index buffers agree\n");
+
+  for (size_t t = 0; t < sizeof(c_THREADS)/sizeof(c_THREADS[0]); t++) {
+    ThreadPool pool(c_THREADS[t]);
+    OrganizedMesher mesher(DEPTH_WIDTH, DEPTH_HEIGHT);
+    std::vector<uint32_t> compact(6*(DEPTH_WIDTH - 1)*(DEPTH_HEIGHT - 1));
+    double mesh_ms = 0;
+    double compact_ms = 0;
+    double triangles = 0;
+    double changed = 0;
+    for (size_t f = 0; f < clouds.size(); f++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      mesher.Compute(&clouds[f][0], 3, DEPTH_WIDTH, DEPTH_HEIGHT, &pool);
+      std::chrono::steady_clock::time_point meshed = std::chrono::steady_clock::now();
+      mesher.CompactIndices(&compact[0]);
+      std::chrono::steady_clock::time_point compacted = std::chrono::steady_clock::now();
+      mesh_ms += std::chrono::duration<double, std::milli>(meshed - start).count();
+      compact_ms += std::chrono::duration<double, std::milli>(compacted - meshed).count();
+      triangles += mesher.GetStats().triangles;
+      // The first frame writes every quad
+      if (f > 0) {
+        changed += mesher.GetStats().changed_quads;
+      }
+    }
+    const int frames = clouds.size();
+    printf("%d thread%s: mesh %.3f ms, compact %.3f ms, %.0f triangles, %.1f%% of quads changed per frame\n",
+        c_THREADS[t], c_THREADS[t] > 1 ? "s" : " ", mesh_ms/frames, compact_ms/frames, triangles/frames,
+        100.0*changed/(frames - 1)/((DEPTH_WIDTH - 1)*(DEPTH_HEIGHT - 1)));
+  }
+  return 0;
+}
@@ -0,0 +1,68 @@
+// Segments the planes of the synthetic scene, a back wall and a floor, with
+// the ball still and with the camera moving. Prints the planes of the first
+// frame, how often a plane changes its id from one frame to the next, and
+// how long a frame takes.
+
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include "bench_frames.h"
+#include "plane_segmenter.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_FRAME_COUNT = 300;
+const int c_THREADS[] = {1, 2, 4};
+
+void Run(bool moving_camera) {
+  StoredClouds stored(3);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  source.SetCameraMotion(moving_camera);
+  CollectClouds(&source, &stored);
+  const std::vector<std::vector<float> >& clouds = stored.points;
+  printf("%s, %d frames\n", moving_camera ? "moving camera" : "moving ball", (int)clouds.size());
+
+  std::vector<uint8_t> labels(c_PIXEL_COUNT);
+  for (size_t t = 0; t < sizeof(c_THREADS)/sizeof(c_THREADS[0]); t++) {
+    ThreadPool pool(c_THREADS[t]);
+    PlaneSegmenter segmenter(DEPTH_WIDTH, DEPTH_HEIGHT);
+    double total_ms = 0;
+    double planes = 0;
+    int id_changes = 0;
+    std::vector<int> last_ids;
+    for (size_t f = 0; f < clouds.size(); f++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      segmenter.Compute(&clouds[f][0], 3, &labels[0], &pool);
+      total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      const std::vector<Plane>& found = segmenter.Planes();
+      planes += found.size();
+      // Planes keep their place while they are tracked
+      for (size_t i = 0; i < found.size(); i++) {
+        if (f > 0 && (i >= last_ids.size() || found[i].id != last_ids[i])) {
+          id_changes++;
+        }
+      }
+      last_ids.clear();
+      for (size_t i = 0; i < found.size(); i++) {
+        last_ids.push_back(found[i].id);
+      }
+      if (f == 0 && t == 0) {
+        for (size_t i = 0; i < found.size(); i++) {
+          const Plane& p = found[i];
+          printf("  plane %d: normal %6.3f %6.3f %6.3f, offset %7.1f mm, %5d points, rms %.2f mm\n", p.id,
+              p.normal[0], p.normal[1], p.normal[2], p.offset, p.points, p.rms_error);
+        }
+      }
+    }
+    const int frames = clouds.size();
+    printf("  %d thread%s: %.3f ms per frame, %.2f planes per frame, %d id changes\n", c_THREADS[t],
+        c_THREADS[t] > 1 ? "s" : " ", total_ms/frames, planes/frames, id_changes);
+  }
+}
+
+int main(int argc, char** argv) {
+  Run(false);
+  Run(true);
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Drives the capture pipeline with a point budget from a simulated display,
+// whose frame time grows with the points it is given and which gets three
+// times slower for a while, as if the machine were loaded. Prints how the
+// detail follows, and how long pipeline and display take per frame.
+
+#include <chrono>
+#include <stdio.h>
+
+#include "capture_pipeline.h"
+#include "synthetic_source.h"
+
+const int c_FRAME_COUNT = 600;
+const double c_TARGET_MS = 16.0;
+// The simulated display: a fixed cost plus a cost per point, in ms
+const double c_DISPLAY_FIXED_MS = 2.0;
+const double c_DISPLAY_POINT_MS = 0.00015;
+// Depth frames during which the display is this much slower
+const int c_LOAD_BEGIN = 200;
+const int c_LOAD_END = 400;
+const double c_LOAD = 3.0;
+const int c_PRINT_INTERVAL = 25;
+
+class Display : public FrameSink {
+  CapturePipeline& pipeline;
+  int depth_frames;
+  double pipeline_ms;
+  double display_ms;
+  int shown;
+
+public:
+  explicit Display(CapturePipeline& pipeline)
+      : pipeline(pipeline), depth_frames(0), pipeline_ms(0), display_ms(0), shown(0) {}
+
+  void Show() {
+    TripleBuffer<CapturePipeline::Frame>& frames = pipeline.GetFrames();
+    if (!frames.Acquire()) {
+      return;
+    }
+    const int points = frames.Front().cloud->points.size();
+    const bool loaded = depth_frames >= c_LOAD_BEGIN && depth_frames < c_LOAD_END;
+    const double frame_ms = (c_DISPLAY_FIXED_MS + c_DISPLAY_POINT_MS*points)*(loaded ? c_LOAD : 1.0);
+    pipeline.GetPointBudget()->Update(frame_ms);
+    display_ms += frame_ms;
+    shown++;
+    if (shown % c_PRINT_INTERVAL == 0) {
+      printf("frame %3d%s: stride %d, %5d points, display %5.1f ms, pipeline %4.2f ms\n", depth_frames,
+          loaded ? " (loaded)" : "         ", pipeline.GetPointBudget()->Stride(), points,
+          display_ms/c_PRINT_INTERVAL, pipeline_ms/c_PRINT_INTERVAL);
+      display_ms = 0;
+      pipeline_ms = 0;
+    }
+  }
+
+  void OnDepthFrame(const DepthFrame& frame) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pipeline.OnDepthFrame(frame);
+    pipeline_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    depth_frames++;
+    Show();
+  }
+
+  void OnColorFrame(const ColorFrame& frame) {
+    pipeline.OnColorFrame(frame);
+    Show();
+  }
+};
+
+int main(int argc, char** argv) {
+  CapturePipeline pipeline;
+  pipeline.EnablePointBudget(c_TARGET_MS);
+  printf("target %.1f ms, full cloud %.1f ms, loaded %.1f ms\n", c_TARGET_MS,
+      c_DISPLAY_FIXED_MS + c_DISPLAY_POINT_MS*c_PIXEL_COUNT,
+      (c_DISPLAY_FIXED_MS + c_DISPLAY_POINT_MS*c_PIXEL_COUNT)*c_LOAD);
+  Display display(pipeline);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  source.SetSink(&display);
+  source.Run();
+  return 0;
+}
@@ -0,0 +1,140 @@
+// Publishes synthetic frames to a shared memory ring as fast as it can, and
+// then at the camera's rate, with two subscriber processes reading them: one
+// that keeps up and one that takes 25 ms per frame. Reports the publisher's
+// throughput and what each subscriber got, skipped and how late.
+
+#include <chrono>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "bench_frames.h"
+#include "shared_frames.h"
+#include "synthetic_source.h"
+
+const char* c_RING_NAME = "/ds325_bench";
+const int c_FRAME_COUNT = 120;
+const int c_PASSES = 10;
+// Time the slow subscriber takes per frame
+const int c_SLOW_MS = 25;
+
+// Reads a little of every frame, and optionally takes its time about it
+class Reader : public FrameSink {
+  const int delay_ms;
+
+public:
+  uint32_t checksum;
+
+  explicit Reader(int delay_ms) : delay_ms(delay_ms), checksum(0) {}
+
+  void OnDepthFrame(const DepthFrame& frame) {
+    checksum += frame.vertices[c_PIXEL_COUNT/2].z;
+    Wait();
+  }
+
+  void OnColorFrame(const ColorFrame& frame) {
+    checksum += frame.bgr[c_COLOR_PIXEL_COUNT];
+    Wait();
+  }
+
+  void Wait() {
+    if (delay_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    }
+  }
+};
+
+int Subscribe(const char* label, int delay_ms) {
+  Reader reader(delay_ms);
+  SharedFrameSubscriber subscriber(c_RING_NAME);
+  subscriber.SetSink(&reader);
+  if (!subscriber.Run()) {
+    return 1;
+  }
+  SharedFrameSubscriber::Stats stats = subscriber.GetStats();
+  printf("%s subscriber: received %lu, skipped %lu, torn %lu, latency mean/max %.0f/%ld us\n", label,
+      (unsigned long)stats.received, (unsigned long)stats.skipped, (unsigned long)stats.torn,
+      stats.mean_latency, (long)stats.max_latency);
+  // The process leaves through _exit
+  fflush(stdout);
+  return 0;
+}
+
+void Publish(SharedFramePublisher* publisher, const std::vector<StoredFrame>& frames, bool paced) {
+  for (size_t f = 0; f < frames.size(); f++) {
+    const StoredFrame& stored = frames[f];
+    if (stored.depth) {
+      DepthFrame frame;
+      frame.timestamp = stored.timestamp;
+      frame.vertices = &stored.vertices[0];
+      frame.uv_map = &stored.uv_map[0];
+      frame.confidence = &stored.confidence[0];
+      frame.intrinsics = c_DS325_DEPTH_INTRINSICS;
+      frame.dropped = 0;
+      publisher->OnDepthFrame(frame);
+    } else {
+      ColorFrame frame;
+      frame.timestamp = stored.timestamp;
+      frame.bgr = &stored.bgr[0];
+      frame.dropped = 0;
+      publisher->OnColorFrame(frame);
+    }
+    if (paced && f + 1 < frames.size()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(frames[f + 1].timestamp - stored.timestamp));
+    }
+  }
+}
+
+// One run with fresh subscribers, published as fast as possible or paced
+// like the camera
+void Run(const std::vector<StoredFrame>& frames, bool paced) {
+  printf("%s:\n", paced ? "paced like the camera" : "as fast as possible");
+  fflush(stdout);
+  SharedFramePublisher publisher;
+  if (!publisher.Open(c_RING_NAME)) {
+    return;
+  }
+  pid_t children[2];
+  for (int c = 0; c < 2; c++) {
+    children[c] = fork();
+    if (children[c] == 0) {
+      _exit(Subscribe(c == 0 ? "  fast" : "  slow", c == 0 ? 0 : c_SLOW_MS));
+    }
+  }
+  // Gives the subscribers time to start waiting
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  const int passes = paced ? 1 : c_PASSES;
+  size_t bytes = 0;
+  for (size_t f = 0; f < frames.size(); f++) {
+    bytes += frames[f].depth ? c_PIXEL_COUNT*(sizeof(Vertex) + sizeof(UV) + sizeof(int16_t)) :
+        3*c_COLOR_PIXEL_COUNT;
+  }
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int pass = 0; pass < passes; pass++) {
+    Publish(&publisher, frames, paced);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("  published %d frames, %.0f frames/s, %.2f GB/s\n", (int)(passes*frames.size()),
+      passes*frames.size()/elapsed.count(), passes*bytes/elapsed.count()/1e9);
+  fflush(stdout);
+  // Lets the subscribers drain the ring before it closes
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  publisher.Close();
+  for (int c = 0; c < 2; c++) {
+    waitpid(children[c], NULL, 0);
+  }
+}
+
+int main(int argc, char** argv) {
+  std::vector<StoredFrame> frames;
+  SyntheticSource source(c_FRAME_COUNT, false);
+  CollectFrames(&source, &frames);
+  printf("%d frames\n", (int)frames.size());
+
+  Run(frames, false);
+  Run(frames, true);
+  return 0;
+}
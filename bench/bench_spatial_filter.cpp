@@ -0,0 +1,198 @@
+// Times the spatial filter on frames from the synthetic scene: the bilateral
+// kernels against each other, then every mode on 1 thread up to one per
+// core. Flying pixels are planted on the scene's depth edges first, as the
+// midpoint of the two surfaces, to see how many of them get dropped.
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "bench_frames.h"
+#include "color_registration.h"
+#include "spatial_filter.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+
+const int c_FRAME_COUNT = 120;
+// Neighbors further apart than this in depth are on different surfaces
+const int c_EDGE_JUMP = 100;
+
+struct Sample {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> rgba;
+  // Pixels made into flying pixels
+  std::vector<bool> flying;
+};
+
+inline bool Valid(int z) {
+  return z >= c_MIN_Z && z <= c_MAX_Z;
+}
+
+void PlantFlyingPixels(Sample* sample) {
+  sample->flying.assign(c_PIXEL_COUNT, false);
+  std::vector<Vertex>& v = sample->vertices;
+  for (int y = 0; y < DEPTH_HEIGHT; y++) {
+    for (int x = 0; x + 2 < DEPTH_WIDTH; x++) {
+      int i = y*DEPTH_WIDTH + x;
+      int a = v[i].z;
+      int b = v[i + 2].z;
+      if (Valid(a) && Valid(b) && abs(a - b) > c_EDGE_JUMP && !sample->flying[i]) {
+        float scale = (a + b)*0.5f/v[i + 1].z;
+        v[i + 1].x = lrintf(v[i + 1].x*scale);
+        v[i + 1].y = lrintf(v[i + 1].y*scale);
+        v[i + 1].z = (a + b)/2;
+        sample->flying[i + 1] = true;
+        x += 2;
+      }
+    }
+  }
+}
+
+// Bilateral kernel input built straight from a frame, without color
+struct Planes {
+  std::vector<int16_t> depth;
+  std::vector<float> spatial_weights;
+  std::vector<float> depth_weights;
+  std::vector<float> luma_weights;
+  BilateralPlanes planes;
+
+  Planes(const std::vector<Vertex>& vertices, int radius) {
+    const int stride = DEPTH_WIDTH + 2*radius;
+    const int size = 2*radius + 1;
+    depth.assign(stride*(DEPTH_HEIGHT + 2*radius), 0);
+    for (int i = 0; i < c_PIXEL_COUNT; i++) {
+      int z = vertices[i].z;
+      depth[(i/DEPTH_WIDTH + radius)*stride + i%DEPTH_WIDTH + radius] = Valid(z) ? z : 0;
+    }
+    for (int k = 0; k < size*size; k++) {
+      int dx = k%size - radius;
+      int dy = k/size - radius;
+      spatial_weights.push_back(expf(-(dx*dx + dy*dy)/4.5f));
+    }
+    for (int d = 0; d < c_DEPTH_WEIGHTS; d++) {
+      depth_weights.push_back(d < c_DEPTH_WEIGHTS - 1 ? expf(-d*d/800.0f) : 0.0f);
+    }
+    luma_weights.assign(256, 1.0f);
+    planes.width = DEPTH_WIDTH;
+    planes.height = DEPTH_HEIGHT;
+    planes.stride = stride;
+    planes.radius = radius;
+    planes.depth = &depth[radius*stride + radius];
+    planes.luma = NULL;
+    planes.spatial_weights = &spatial_weights[0];
+    planes.depth_weights = &depth_weights[0];
+    planes.luma_weights = &luma_weights[0];
+    planes.min_support = 1.5f;
+  }
+};
+
+typedef void (*BilateralFunc)(const BilateralPlanes&, int, int, int16_t*);
+
+double RunKernel(BilateralFunc func, const std::vector<Planes*>& planes, std::vector<std::vector<int16_t> >* out) {
+  out->assign(planes.size(), std::vector<int16_t>(c_PIXEL_COUNT));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t f = 0; f < planes.size(); f++) {
+    func(planes[f]->planes, 0, DEPTH_HEIGHT, &(*out)[f][0]);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count()/planes.size();
+}
+
+int main(int argc, char** argv) {
+  // Every depth frame paired with the last color frame, registered through
+  // the depth frame's UV map
+  std::vector<Sample> samples;
+  ColorRegistration registration(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT);
+  std::vector<uint8_t> bgr(3*c_COLOR_PIXEL_COUNT);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  ForEachFrame(&source, [&](const DepthFrame& frame) {
+    samples.push_back(Sample());
+    Sample& sample = samples.back();
+    sample.vertices.assign(frame.vertices, frame.vertices + c_PIXEL_COUNT);
+    sample.rgba.resize(c_PIXEL_COUNT);
+    registration.SetUVMap((const float*)frame.uv_map);
+    registration.Apply(&bgr[0], &sample.rgba[0], 1);
+  }, [&](const ColorFrame& frame) {
+    bgr.assign(frame.bgr, frame.bgr + bgr.size());
+  });
+  long planted = 0;
+  long valid = 0;
+  for (size_t f = 0; f < samples.size(); f++) {
+    PlantFlyingPixels(&samples[f]);
+    for (int i = 0; i < c_PIXEL_COUNT; i++) {
+      planted += samples[f].flying[i];
+      valid += Valid(samples[f].vertices[i].z) && !samples[f].flying[i];
+    }
+  }
+  printf("%d frames, %.0f flying pixels planted per frame\n", (int)samples.size(), (double)planted/samples.size());
+
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  int failures = 0;
+  for (int radius = 1; radius <= 3; radius++) {
+    std::vector<Planes*> planes;
+    for (size_t f = 0; f < samples.size(); f++) {
+      planes.push_back(new Planes(samples[f].vertices, radius));
+    }
+    std::vector<std::vector<int16_t> > scalar_out, avx2_out;
+    double scalar_us = RunKernel(&BilateralRowsScalar, planes, &scalar_out);
+    printf("bilateral %dx%d  scalar %7.1f us/frame", 2*radius + 1, 2*radius + 1, scalar_us);
+    if (avx2) {
+      double avx2_us = RunKernel(&BilateralRowsAVX2, planes, &avx2_out);
+      bool ok = scalar_out == avx2_out;
+      failures += !ok;
+      printf("  avx2 %7.1f us/frame  %5.2fx%s", avx2_us, scalar_us/avx2_us, ok ? "" : "  MISMATCH");
+    }
+    printf("\n");
+    for (size_t f = 0; f < planes.size(); f++) {
+      delete planes[f];
+    }
+  }
+
+  // Whole stage, from vertices to vertices, on more and more threads
+  struct Config {
+    SpatialMode mode;
+    bool color;
+    const char* name;
+  };
+  const Config configs[] = {
+    {SPATIAL_BILATERAL, false, "bilateral"},
+    {SPATIAL_BILATERAL, true, "bilateral, color"},
+    {SPATIAL_GUIDED, false, "guided"},
+    {SPATIAL_GUIDED, true, "guided, color"}
+  };
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<Vertex> out(c_PIXEL_COUNT);
+  for (int c = 0; c < 4; c++) {
+    SpatialFilter filter(DEPTH_WIDTH, DEPTH_HEIGHT, configs[c].mode);
+    printf("%-17s", configs[c].name);
+    for (int threads = 1; threads <= cores; threads *= 2) {
+      ThreadPool pool(threads);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (size_t f = 0; f < samples.size(); f++) {
+        filter.Apply(&samples[f].vertices[0], configs[c].color ? &samples[f].rgba[0] : NULL, &out[0], &pool);
+      }
+      std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+      printf("  %d thread%s %6.0f us", threads, threads > 1 ? "s" : " ", elapsed.count()/samples.size());
+    }
+
+    // Dropped pixels, flying and good
+    long removed = 0;
+    long lost = 0;
+    for (size_t f = 0; f < samples.size(); f++) {
+      filter.Apply(&samples[f].vertices[0], configs[c].color ? &samples[f].rgba[0] : NULL, &out[0]);
+      for (int i = 0; i < c_PIXEL_COUNT; i++) {
+        bool dropped = Valid(samples[f].vertices[i].z) && !Valid(out[i].z);
+        removed += dropped && samples[f].flying[i];
+        lost += dropped && !samples[f].flying[i];
+      }
+    }
+    printf("  flying pixels dropped %5.1f%%, good pixels dropped %5.2f%%\n",
+        100.0*removed/planted, 100.0*lost/valid);
+  }
+  printf("dispatch: %s\n", SpatialFilterKernelName());
+  return failures > 0;
+}
@@ -0,0 +1,136 @@
+// Times the temporal filter kernels on depth from the synthetic scene, checks
+// that they agree, and reports how much they calm the depth noise. Exits with
+// 1 when an AVX2 kernel's output differs from the scalar one.
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "bench_frames.h"
+#include "synthetic_source.h"
+#include "temporal_filter.h"
+
+const int c_FRAME_COUNT = 240;
+
+// Mean over pixels of the frame to frame change in z, for pixels valid in
+// both frames. Flicker shows up as a large mean change on a static scene.
+double MeanChange(const std::vector<std::vector<Vertex> >& frames) {
+  double total = 0;
+  long pairs = 0;
+  for (size_t f = 1; f < frames.size(); f++) {
+    for (int i = 0; i < c_PIXEL_COUNT; i++) {
+      int a = frames[f - 1][i].z;
+      int b = frames[f][i].z;
+      if (a >= c_MIN_Z && a <= c_MAX_Z && b >= c_MIN_Z && b <= c_MAX_Z) {
+        total += abs(a - b);
+        pairs++;
+      }
+    }
+  }
+  return total/pairs;
+}
+
+typedef void (*MedianFunc)(const TemporalParams&, const int16_t*, int, int16_t* const*, int, int,
+                           int16_t*, int16_t*);
+typedef void (*ExponentialFunc)(const TemporalParams&, const int16_t*, int, int16_t*, int16_t*);
+
+// Runs a kernel over every frame's z, returning us per frame and the outputs
+double RunMedian(MedianFunc func, const TemporalParams& params, const std::vector<std::vector<int16_t> >& z,
+                 std::vector<std::vector<int16_t> >* out) {
+  std::vector<int16_t> history(5*c_PIXEL_COUNT, 0);
+  std::vector<int16_t> last(c_PIXEL_COUNT, 0);
+  int16_t* slots[5];
+  for (int k = 0; k < 5; k++) {
+    slots[k] = &history[k*c_PIXEL_COUNT];
+  }
+  out->assign(z.size(), std::vector<int16_t>(c_PIXEL_COUNT));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t f = 0; f < z.size(); f++) {
+    func(params, &z[f][0], c_PIXEL_COUNT, slots, 5, f % 5, &last[0], &(*out)[f][0]);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count()/z.size();
+}
+
+double RunExponential(ExponentialFunc func, const TemporalParams& params,
+                      const std::vector<std::vector<int16_t> >& z, std::vector<std::vector<int16_t> >* out) {
+  std::vector<int16_t> average(c_PIXEL_COUNT, 0);
+  out->assign(z.size(), std::vector<int16_t>(c_PIXEL_COUNT));
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (size_t f = 0; f < z.size(); f++) {
+    func(params, &z[f][0], c_PIXEL_COUNT, &average[0], &(*out)[f][0]);
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count()/z.size();
+}
+
+int main(int argc, char** argv) {
+  std::vector<StoredFrame> stored;
+  SyntheticSource source(c_FRAME_COUNT, false);
+  CollectDepth(&source, &stored);
+  std::vector<std::vector<Vertex> > frames(stored.size());
+  for (size_t f = 0; f < stored.size(); f++) {
+    frames[f].swap(stored[f].vertices);
+  }
+
+  std::vector<std::vector<int16_t> > z(frames.size(), std::vector<int16_t>(c_PIXEL_COUNT));
+  for (size_t f = 0; f < frames.size(); f++) {
+    for (int i = 0; i < c_PIXEL_COUNT; i++) {
+      z[f][i] = frames[f][i].z;
+    }
+  }
+
+  TemporalParams params;
+  params.min_z = c_MIN_Z;
+  params.max_z = c_MAX_Z;
+  params.motion_threshold = 30;
+  params.alpha = 0.3f*32768;
+
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  int failures = 0;
+  std::vector<std::vector<int16_t> > scalar_out, avx2_out;
+
+  double scalar_us = RunMedian(&MedianFilterScalar, params, z, &scalar_out);
+  printf("median of 5  scalar %7.1f us/frame", scalar_us);
+  if (avx2) {
+    double avx2_us = RunMedian(&MedianFilterAVX2, params, z, &avx2_out);
+    bool ok = scalar_out == avx2_out;
+    failures += !ok;
+    printf("  avx2 %7.1f us/frame  %5.2fx%s", avx2_us, scalar_us/avx2_us, ok ? "" : "  MISMATCH");
+  }
+  printf("\n");
+
+  scalar_us = RunExponential(&ExponentialFilterScalar, params, z, &scalar_out);
+  printf("exponential  scalar %7.1f us/frame", scalar_us);
+  if (avx2) {
+    double avx2_us = RunExponential(&ExponentialFilterAVX2, params, z, &avx2_out);
+    bool ok = scalar_out == avx2_out;
+    failures += !ok;
+    printf("  avx2 %7.1f us/frame  %5.2fx%s", avx2_us, scalar_us/avx2_us, ok ? "" : "  MISMATCH");
+  }
+  printf("\n");
+
+  // Whole stage, including pulling z out of the vertices and rescaling x, y
+  TemporalMode modes[] = {TEMPORAL_MEDIAN, TEMPORAL_EXPONENTIAL};
+  const char* names[] = {"median", "exponential"};
+  printf("mean frame to frame change in z: raw %.2f mm", MeanChange(frames));
+  for (int m = 0; m < 2; m++) {
+    TemporalFilter filter(c_PIXEL_COUNT, modes[m]);
+    std::vector<std::vector<Vertex> > filtered(frames.size(), std::vector<Vertex>(c_PIXEL_COUNT));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames.size(); f++) {
+      filter.Apply(&frames[f][0], &filtered[f][0]);
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    printf(", %s %.2f mm (%.0f us/frame)", names[m], MeanChange(filtered), elapsed.count()/frames.size());
+  }
+  printf("\ndispatch: %s\n", TemporalFilterKernelName());
+  if (failures > 0) {
+    printf("%d AVX2 kernels don't match the scalar ones\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Fuses the synthetic scene, seen by a swaying camera, into a TSDF volume
+// from the true camera poses: time to integrate a frame and to mesh with 1
+// thread up to one per core, memory, and how far the mesh is from the
+// scene's wall, floor and ball.
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "bench_frames.h"
+#include "icp_odometry.h"
+#include "synthetic_source.h"
+#include "thread_pool.h"
+#include "tsdf_volume.h"
+
+const int c_FRAME_COUNT = 300;
+// Frames between meshes, as the capture pipeline does it
+const int c_MESH_INTERVAL = 30;
+// Same layout as pcl::PointXYZRGB
+const int c_STRIDE = 8;
+
+// Where the synthetic scene puts its surfaces, in mm. With the camera moving
+// the ball stays where it starts.
+const float c_WALL_Z = 1500.0f;
+const float c_FLOOR_Y = -400.0f;
+const float c_BALL[3] = {250.0f, -150.0f, 900.0f};
+const float c_BALL_RADIUS = 150.0f;
+
+// Distance from a point in scene coordinates to the nearest surface
+float SurfaceDistance(const float* p) {
+  float wall = fabsf(p[2] - c_WALL_Z);
+  float floor = fabsf(p[1] - c_FLOOR_Y);
+  float dx = p[0] - c_BALL[0];
+  float dy = p[1] - c_BALL[1];
+  float dz = p[2] - c_BALL[2];
+  float ball = fabsf(sqrtf(dx*dx + dy*dy + dz*dz) - c_BALL_RADIUS);
+  return std::min(wall, std::min(floor, ball));
+}
+
+int main(int argc, char** argv) {
+  StoredClouds stored(c_STRIDE);
+  SyntheticSource source(c_FRAME_COUNT, false);
+  source.SetCameraMotion(true);
+  CollectClouds(&source, &stored);
+  const std::vector<std::vector<float> >& clouds = stored.points;
+  printf("%d clouds\n", (int)clouds.size());
+
+  std::vector<Pose> poses;
+  for (size_t f = 0; f < clouds.size(); f++) {
+    poses.push_back(SyntheticSource::CameraPose(stored.timestamps[f]));
+  }
+
+  const int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<float> triangles;
+  for (int threads = 1; threads <= cores; threads *= 2) {
+    ThreadPool pool(threads);
+    TsdfVolume volume;
+    double integrate_time = 0;
+    double mesh_time = 0;
+    int meshes = 0;
+    long meshed_blocks = 0;
+    long visible_blocks = 0;
+    for (size_t f = 0; f < clouds.size(); f++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      volume.Integrate(&clouds[f][0], c_STRIDE, DEPTH_WIDTH, DEPTH_HEIGHT, c_DS325_DEPTH_INTRINSICS,
+          poses[f], &pool);
+      std::chrono::steady_clock::time_point integrated = std::chrono::steady_clock::now();
+      integrate_time += std::chrono::duration<double, std::milli>(integrated - start).count();
+      visible_blocks += volume.GetStats().visible_blocks;
+      if ((f + 1) % c_MESH_INTERVAL == 0) {
+        volume.ExtractMesh(&triangles, &pool);
+        std::chrono::duration<double, std::milli> meshed = std::chrono::steady_clock::now() - integrated;
+        mesh_time += meshed.count();
+        meshes++;
+        meshed_blocks += volume.GetStats().meshed_blocks;
+      }
+    }
+    TsdfVolume::Stats stats = volume.GetStats();
+    printf("%d thread%s: integrate %5.2f ms per frame (%ld blocks), mesh %5.2f ms (%ld of %d blocks)\n",
+        threads, threads > 1 ? "s" : " ", integrate_time/clouds.size(), visible_blocks/(long)clouds.size(),
+        mesh_time/meshes, meshed_blocks/meshes, stats.blocks);
+    if (threads == 1) {
+      printf("%d blocks in %.1f MB, %d triangles\n", stats.blocks, stats.bytes/1e6, stats.triangles);
+    }
+  }
+
+  double distance_sum = 0;
+  float max_distance = 0;
+  int vertex_count = triangles.size()/3;
+  for (int i = 0; i < vertex_count; i++) {
+    float d = SurfaceDistance(&triangles[3*i]);
+    distance_sum += d;
+    max_distance = std::max(max_distance, d);
+  }
+  printf("mesh to scene: mean %.2f mm, max %.1f mm\n", distance_sum/vertex_count, max_distance);
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Times VoxelDownsampler against pcl::VoxelGrid on clouds from the synthetic
+// scene, at a few leaf sizes.
+
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include <pcl/filters/voxel_grid.h>
+
+#include "bench_frames.h"
+#include "capture_pipeline.h"
+#include "synthetic_source.h"
+#include "voxel_downsampler.h"
+
+typedef CapturePipeline::Cloud Cloud;
+
+const int c_FRAME_COUNT = 120;
+const float c_LEAF_SIZES[] = {5.0f, 10.0f, 20.0f};
+
+int main(int argc, char** argv) {
+  // Keeps a copy of the newest cloud after every frame
+  CapturePipeline pipeline;
+  std::vector<Cloud::Ptr> clouds;
+  auto collect = [&]() {
+    if (pipeline.GetFrames().Acquire()) {
+      clouds.push_back(Cloud::Ptr(new Cloud(*pipeline.GetFrames().Front().cloud)));
+    }
+  };
+  SyntheticSource source(c_FRAME_COUNT, false);
+  ForEachFrame(&source, [&](const DepthFrame& frame) {
+    pipeline.OnDepthFrame(frame);
+    collect();
+  }, [&](const ColorFrame& frame) {
+    pipeline.OnColorFrame(frame);
+    collect();
+  });
+  printf("%d clouds of %d points\n", (int)clouds.size(), c_PIXEL_COUNT);
+
+  for (int l = 0; l < 3; l++) {
+    float leaf_size = c_LEAF_SIZES[l];
+    Cloud output;
+
+    VoxelDownsampler downsampler(leaf_size);
+    size_t points = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clouds.size(); i++) {
+      downsampler.Apply(*clouds[i], &output);
+      points += output.points.size();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    double ours = elapsed.count()/clouds.size();
+
+    pcl::VoxelGrid<pcl::PointXYZRGB> grid;
+    grid.setLeafSize(leaf_size, leaf_size, leaf_size);
+    size_t pcl_points = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < clouds.size(); i++) {
+      grid.setInputCloud(clouds[i]);
+      grid.filter(output);
+      pcl_points += output.points.size();
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    double theirs = elapsed.count()/clouds.size();
+
+    printf("leaf %4.0f mm: hashed %7.1f us/frame %6d points, pcl::VoxelGrid %7.1f us/frame %6d points, %5.2fx\n",
+        leaf_size, ours, (int)(points/clouds.size()), theirs, (int)(pcl_points/clouds.size()), theirs/ours);
+  }
+  return 0;
+}
@@ -0,0 +1,387 @@
+// Runs the capture and processing kernels on a fixed set of frames, from the
+// synthetic scene or a recording, and reports for each the time per frame,
+// the depth points it gets through per second and the heap allocations it
+// makes per frame.
+//
+// With --json the results are also written to a file, which a later run can
+// compare itself against with --baseline. The run then fails if a kernel got
+// slower than the tolerance allows or allocates more than it did.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "bench_frames.h"
+#include "capture_pipeline.h"
+#include "color_registration.h"
+#include "depth_conversion.h"
+#include "normal_estimator.h"
+#include "organized_mesher.h"
+#include "plane_segmenter.h"
+#include "replay_source.h"
+#include "spatial_filter.h"
+#include "synthetic_source.h"
+#include "temporal_filter.h"
+#include "thread_pool.h"
+#include "voxel_downsampler.h"
+
+typedef CapturePipeline::Cloud Cloud;
+
+const int c_DEFAULT_FRAMES = 120;
+// Every kernel runs over all frames until at least this much time has passed
+const double c_MIN_SECONDS = 0.5;
+const float c_LEAF_SIZE = 10.0f;
+// Slowdown in percent that --baseline lets pass, timings vary between runs
+const double c_DEFAULT_TOLERANCE = 10.0;
+
+std::atomic<uint64_t> g_allocations(0);
+
+// Counts every allocation of the process, including the aligned ones Eigen
+// and PCL make, by standing in for glibc's allocator functions
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) {
+  *pointer = memalign(alignment, size);
+  return *pointer == NULL ? ENOMEM : 0;
+}
+
+}
+
+struct Result {
+  std::string name;
+  double ns_per_frame;
+  double points_per_second;
+  double allocations_per_frame;
+};
+
+// Calls run(f) for every frame, once to warm up and then until
+// c_MIN_SECONDS have passed
+Result Measure(const std::string& name, int frame_count, const std::function<void(int)>& run) {
+  for (int f = 0; f < frame_count; f++) {
+    run(f);
+  }
+  const uint64_t allocations = g_allocations.load();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed;
+  int frames = 0;
+  do {
+    for (int f = 0; f < frame_count; f++) {
+      run(f);
+    }
+    frames += frame_count;
+    elapsed = std::chrono::steady_clock::now() - start;
+  } while (elapsed.count() < c_MIN_SECONDS);
+
+  Result result;
+  result.name = name;
+  result.ns_per_frame = elapsed.count()*1e9/frames;
+  result.points_per_second = (double)frames*c_PIXEL_COUNT/elapsed.count();
+  result.allocations_per_frame = (double)(g_allocations.load() - allocations)/frames;
+  return result;
+}
+
+bool WriteJson(const std::string& path, const std::string& source, int frame_count, int threads,
+               const std::vector<Result>& results) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == NULL) {
+    printf("Couldn't open %s for writing\n", path.c_str());
+    return false;
+  }
+  fprintf(file, "{\n  \"source\": \"%s\",\n  \"frames\": %d,\n  \"threads\": %d,\n  \"kernels\": [\n",
+      source.c_str(), frame_count, threads);
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& result = results[i];
+    fprintf(file, "    {\"name\": \"%s\", \"ns_per_frame\": %.0f, \"points_per_s\": %.0f, "
+        "\"allocs_per_frame\": %.2f}%s\n", result.name.c_str(), result.ns_per_frame,
+        result.points_per_second, result.allocations_per_frame, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return true;
+}
+
+// The number after "key": in text, searching from position
+bool FindNumber(const std::string& text, size_t position, const char* key, double* value) {
+  size_t at = text.find(std::string("\"") + key + "\":", position);
+  if (at == std::string::npos) {
+    return false;
+  }
+  *value = strtod(text.c_str() + at + strlen(key) + 3, NULL);
+  return true;
+}
+
+// Reads the kernels of a file written by WriteJson
+bool ReadJson(const std::string& path, std::vector<Result>* results) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    printf("Couldn't open %s\n", path.c_str());
+    return false;
+  }
+  std::string text;
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    text.append(buffer, size);
+  }
+  fclose(file);
+
+  const std::string name_key = "\"name\": \"";
+  size_t at = 0;
+  while ((at = text.find(name_key, at)) != std::string::npos) {
+    at += name_key.size();
+    size_t end = text.find('"', at);
+    if (end == std::string::npos) {
+      break;
+    }
+    Result result;
+    result.name = text.substr(at, end - at);
+    if (!FindNumber(text, end, "ns_per_frame", &result.ns_per_frame) ||
+        !FindNumber(text, end, "points_per_s", &result.points_per_second) ||
+        !FindNumber(text, end, "allocs_per_frame", &result.allocations_per_frame)) {
+      break;
+    }
+    results->push_back(result);
+  }
+  if (results->empty()) {
+    printf("%s has no benchmark results\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Prints how every result compares to the baseline, and returns false if
+// any of them regressed
+bool Compare(const std::vector<Result>& results, const std::vector<Result>& baseline, double tolerance) {
+  bool ok = true;
+  printf("\n%-22s %12s %12s %8s %s\n", "against baseline", "ns/frame", "was", "change", "allocs/frame");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& result = results[i];
+    const Result* before = NULL;
+    for (size_t j = 0; j < baseline.size(); j++) {
+      if (baseline[j].name == result.name) {
+        before = &baseline[j];
+      }
+    }
+    if (before == NULL) {
+      printf("%-22s %12.0f %12s\n", result.name.c_str(), result.ns_per_frame, "new");
+      continue;
+    }
+    const double change = 100.0*(result.ns_per_frame/before->ns_per_frame - 1);
+    const bool slower = change > tolerance;
+    // Allocations are exact, but averaged over a varying number of passes
+    const bool allocates = result.allocations_per_frame > before->allocations_per_frame + 0.01;
+    printf("%-22s %12.0f %12.0f %+7.1f%% %.2f (was %.2f)%s\n", result.name.c_str(), result.ns_per_frame,
+        before->ns_per_frame, change, result.allocations_per_frame, before->allocations_per_frame,
+        slower || allocates ? "  REGRESSED" : "");
+    ok = ok && !slower && !allocates;
+  }
+  return ok;
+}
+
+void PrintUsage(const char* name) {
+  printf("usage: %s [options]\n", name);
+  printf("  --replay FILE     take the frames from a recording instead of the synthetic scene\n");
+  printf("  --frames N        use the first N depth frames, %d by default\n", c_DEFAULT_FRAMES);
+  printf("  --threads N       threads for the kernels that split their work, 1 by default\n");
+  printf("  --only NAME       run only the kernels whose name contains NAME\n");
+  printf("  --json FILE       write the results to FILE\n");
+  printf("  --baseline FILE   compare against the results in FILE and fail on regressions\n");
+  printf("  --tolerance PCT   slowdown the baseline comparison allows, %.0f%% by default\n",
+      c_DEFAULT_TOLERANCE);
+}
+
+int main(int argc, char** argv) {
+  std::string replay_path;
+  int frame_count = c_DEFAULT_FRAMES;
+  int threads = 1;
+  std::string only;
+  std::string json_path;
+  std::string baseline_path;
+  double tolerance = c_DEFAULT_TOLERANCE;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frame_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Result> baseline;
+  if (!baseline_path.empty() && !ReadJson(baseline_path, &baseline)) {
+    return 1;
+  }
+
+  // Depth frames, each with the last color frame before it
+  std::vector<StoredFrame> samples;
+  FrameSource* source;
+  if (replay_path.empty()) {
+    source = new SyntheticSource(frame_count, false);
+  } else {
+    source = new ReplaySource(replay_path, false);
+  }
+  bool ok = CollectDepth(source, &samples, true);
+  delete source;
+  if (!ok || samples.empty()) {
+    printf("No frames to run on\n");
+    return 1;
+  }
+  if ((int)samples.size() > frame_count) {
+    samples.resize(frame_count);
+  }
+  const int count = samples.size();
+  printf("%d frames from %s, %d thread%s, conversion kernel %s\n\n", count,
+      replay_path.empty() ? "the synthetic scene" : replay_path.c_str(), threads, threads > 1 ? "s" : "",
+      ConvertVerticesKernelName());
+
+  // Inputs for the kernels that start from a cloud
+  std::vector<Cloud> clouds(count);
+  {
+    ColorRegistration registration(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT);
+    std::vector<uint32_t> colors(c_PIXEL_COUNT);
+    for (int f = 0; f < count; f++) {
+      Cloud& cloud = clouds[f];
+      cloud.points.resize(c_PIXEL_COUNT);
+      cloud.width = DEPTH_WIDTH;
+      cloud.height = DEPTH_HEIGHT;
+      cloud.is_dense = false;
+      registration.SetUVMap((const float*)&samples[f].uv_map[0]);
+      registration.Apply(&samples[f].bgr[0], &colors[0], 1);
+      ConvertVertices((const int16_t*)&samples[f].vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z,
+          cloud.points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), &colors[0]);
+    }
+  }
+
+  ThreadPool pool(threads);
+  Cloud cloud;
+  cloud.points.resize(c_PIXEL_COUNT);
+  std::vector<uint32_t> rgba(c_PIXEL_COUNT);
+  std::vector<Vertex> smoothed(c_PIXEL_COUNT);
+  std::vector<float> normals(4*c_PIXEL_COUNT);
+  ColorRegistration nearest(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT);
+  ColorRegistration bilinear(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT, true);
+  TemporalFilter median(c_PIXEL_COUNT, TEMPORAL_MEDIAN);
+  TemporalFilter exponential(c_PIXEL_COUNT, TEMPORAL_EXPONENTIAL);
+  SpatialFilter spatial_bilateral(DEPTH_WIDTH, DEPTH_HEIGHT, SPATIAL_BILATERAL);
+  SpatialFilter spatial_guided(DEPTH_WIDTH, DEPTH_HEIGHT, SPATIAL_GUIDED);
+  VoxelDownsampler downsampler(c_LEAF_SIZE);
+  NormalEstimator normal_estimator(DEPTH_WIDTH, DEPTH_HEIGHT, NORMALS_INTEGRAL);
+  OrganizedMesher mesher(DEPTH_WIDTH, DEPTH_HEIGHT);
+  PlaneSegmenter plane_segmenter(DEPTH_WIDTH, DEPTH_HEIGHT);
+  std::vector<uint8_t> plane_labels(c_PIXEL_COUNT);
+  Cloud downsampled;
+
+  typedef std::pair<std::string, std::function<void(int)> > Kernel;
+  std::vector<Kernel> kernels;
+  kernels.push_back(Kernel("conversion", [&](int f) {
+    ConvertVertices((const int16_t*)&samples[f].vertices[0], c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z,
+        cloud.points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float));
+  }));
+  kernels.push_back(Kernel("registration", [&](int f) {
+    nearest.SetUVMap((const float*)&samples[f].uv_map[0]);
+    nearest.Apply(&samples[f].bgr[0], &rgba[0], 1);
+  }));
+  kernels.push_back(Kernel("registration_bilinear", [&](int f) {
+    bilinear.SetUVMap((const float*)&samples[f].uv_map[0]);
+    bilinear.Apply(&samples[f].bgr[0], &rgba[0], 1);
+  }));
+  kernels.push_back(Kernel("temporal_median", [&](int f) {
+    median.Apply(&samples[f].vertices[0], &smoothed[0]);
+  }));
+  kernels.push_back(Kernel("temporal_exponential", [&](int f) {
+    exponential.Apply(&samples[f].vertices[0], &smoothed[0]);
+  }));
+  kernels.push_back(Kernel("spatial_bilateral", [&](int f) {
+    spatial_bilateral.Apply(&samples[f].vertices[0], NULL, &smoothed[0], &pool);
+  }));
+  kernels.push_back(Kernel("spatial_guided", [&](int f) {
+    spatial_guided.Apply(&samples[f].vertices[0], NULL, &smoothed[0], &pool);
+  }));
+  kernels.push_back(Kernel("voxel_downsampling", [&](int f) {
+    downsampler.Apply(clouds[f], &downsampled);
+  }));
+  kernels.push_back(Kernel("normals", [&](int f) {
+    normal_estimator.Compute(clouds[f].points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float),
+        &normals[0], 4, &pool);
+  }));
+  kernels.push_back(Kernel("organized_mesh", [&](int f) {
+    mesher.Compute(clouds[f].points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), DEPTH_WIDTH, DEPTH_HEIGHT,
+        &pool);
+  }));
+  kernels.push_back(Kernel("plane_segmentation", [&](int f) {
+    plane_segmenter.Compute(clouds[f].points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), &plane_labels[0],
+        &pool);
+  }));
+
+  std::vector<Result> results;
+  printf("%-22s %12s %14s %12s\n", "kernel", "ns/frame", "points/s", "allocs/frame");
+  for (size_t k = 0; k < kernels.size(); k++) {
+    if (kernels[k].first.find(only) == std::string::npos) {
+      continue;
+    }
+    Result result = Measure(kernels[k].first, count, kernels[k].second);
+    printf("%-22s %12.0f %14.3g %12.2f\n", result.name.c_str(), result.ns_per_frame, result.points_per_second,
+        result.allocations_per_frame);
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  if (!json_path.empty() && !WriteJson(json_path, replay_path.empty() ? "synthetic" : replay_path, count,
+      threads, results)) {
+    return 1;
+  }
+  if (!baseline.empty() && !Compare(results, baseline, tolerance)) {
+    printf("\nslower or allocating more than %s\n", baseline_path.c_str());
+    return 1;
+  }
+  return 0;
+}
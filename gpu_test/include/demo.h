@@ -0,0 +1,21 @@
+#ifndef DEMO_H_
+#define DEMO_H_
+
+class GLCanvas;
+class PointRenderer;
+
+// The pipelines the viewer can run, in a window or headless. They need a
+// current GL context and live until the program exits.
+
+// A 2x2 texture blurred and made to glow at size x size
+void BuildGlowDemo(GLCanvas* canvas, int size);
+
+// A point cloud drawn at width x height. Clouds come from StartProducer.
+PointRenderer* BuildPointDemo(GLCanvas* canvas, int width, int height);
+
+// Streams a moving surface into the renderer's ring from another thread,
+// like the capture thread would, until StopProducer
+void StartProducer(PointRenderer* renderer);
+void StopProducer();
+
+#endif // DEMO_H_
@@ -1,9 +1,15 @@
+#ifndef GL_CANVAS_H_
+#define GL_CANVAS_H_
+
 #include <GL/glew.h>
 #include <GL/gl.h>
+#include <algorithm>
 #include <assert.h>
 #include <map>
+#include <stdint.h>
 
 #include "shaderloader.h"
+#include "stream_ring.h"
 
 class PipelineInput {
 protected:
@@ -11,8 +17,10 @@ protected:
   const int height;
 
   GLuint texture;
+  // Goes up every time the contents of the texture change
+  uint64_t generation;
 public:
-  PipelineInput(int width, int height) : width(width), height(height) {
+  PipelineInput(int width, int height) : width(width), height(height), generation(0) {
     glGenTextures(1, &texture);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
@@ -20,26 +28,99 @@ public:
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+      // Immutable, so updates only ever copy into it
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
   }
 
   GLuint GetTexture() {
     return texture;
   }
+
+  uint64_t GetGeneration() {
+    return generation;
+  }
+
+  // Call after drawing into the texture
+  void MarkChanged() {
+    generation++;
+  }
 };
 
 // Functions as an input, but allows you to set the input data directly.
+//
+// Data comes either from SetData, which copies it on the spot, or streamed
+// through a ring of pixel unpack buffers: a producer thread fills a buffer
+// from BeginWrite and publishes it with EndWrite while the GPU copies the
+// one before into the texture, and the canvas picks the newest up in
+// Update.
 class PipelineSource : public PipelineInput {
   const std::string output_name;
+  // RGBA frames on their way to the texture, after EnableStreaming
+  StreamRing<uint8_t>* frames;
 public:
-  PipelineSource(std::string output_name, int width, int height) : PipelineInput(width, height), output_name(output_name) {}
+  PipelineSource(std::string output_name, int width, int height) : PipelineInput(width, height), output_name(output_name), frames(NULL) {}
+  ~PipelineSource() {
+    delete frames;
+  }
 
   void SetData(uint8_t* data) {
     // Send Texture data to GPU
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)data);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)data);
+    generation++;
+  }
+
+  // Sets up the ring for BeginWrite and EndWrite. Needs the GL context.
+  void EnableStreaming() {
+    if (frames == NULL) {
+      frames = new StreamRing<uint8_t>(GL_PIXEL_UNPACK_BUFFER, width*height*4);
+    }
+  }
+
+  // Producer side: room for one width x height RGBA frame, or NULL when
+  // every buffer is still busy and the frame has to be dropped. Follow with
+  // EndWrite.
+  uint8_t* BeginWrite() {
+    return frames->BeginWrite();
+  }
+
+  void EndWrite(uint8_t* frame) {
+    frames->EndWrite(frame, width*height*4);
+  }
+
+  // Whether a streamed frame is waiting for Update
+  bool HasNewData() {
+    return frames != NULL && frames->HasReady();
+  }
+
+  // Starts copying the newest streamed frame into the texture. The copy
+  // comes from a buffer the GPU can read, so this returns without waiting
+  // for it. Returns whether there was a new frame.
+  bool Update() {
+    if (frames == NULL || !frames->Update()) {
+      return false;
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frames->GetBuffer());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+        (GLvoid*)(size_t)frames->GetFirst());
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    frames->Fence();
+    generation++;
+    return true;
+  }
+
+  // The ring of streamed frames, NULL before EnableStreaming
+  StreamRing<uint8_t>* GetStream() {
+    return frames;
   }
 
   std::string GetOutputName() {
@@ -74,9 +155,13 @@ class PipelineStage {
   const int width;
   const int height;
 
-  // Input texture
+  // Input textures and the texture units they are bound to
   std::vector<PipelineInput*> inputs;
-  std::vector<GLuint> input_unis;
+  std::vector<int> input_units;
+  // The generation of each input when the stage last ran, and whether it
+  // has to run regardless
+  std::vector<uint64_t> input_generations;
+  bool stale;
 
   GLuint data_tex;
 
@@ -132,7 +217,7 @@ class PipelineStage {
   }
 
 public:
-  PipelineStage(std::string output_name, int width, int height, std::string fragment_shader) : output_name(output_name), width(width), height(height) {
+  PipelineStage(std::string output_name, int width, int height, std::string fragment_shader) : output_name(output_name), width(width), height(height), stale(true) {
     printf("Initializing shader: %s\n", output_name.c_str());
     // Compile Shader
     shader_prog = LoadShader("shaders/basic.vert", fragment_shader.c_str());
@@ -150,36 +235,69 @@ public:
     delete output; 
   }
 
-  void AddInput(std::string glsl_var_name, PipelineInput* input) {
+  // Reads input as the sampler glsl_var_name, from texture unit unit
+  void AddInput(std::string glsl_var_name, PipelineInput* input, int unit) {
     inputs.push_back(input);
-    input_unis.push_back(glGetUniformLocation(shader_prog, glsl_var_name.c_str()));
+    input_units.push_back(unit);
+    input_generations.push_back(0);
+    stale = true;
+    glUseProgram(shader_prog);
+    glUniform1i(glGetUniformLocation(shader_prog, glsl_var_name.c_str()), unit);
+  }
+
+  // Whether an input changed since the stage last ran
+  bool IsDirty() {
+    for (uint i = 0; i < inputs.size(); i++) {
+      if (inputs[i]->GetGeneration() != input_generations[i]) {
+        return true;
+      }
+    }
+    return stale;
+  }
+
+  // Makes the stage run next time, as when its uniforms change
+  void Invalidate() {
+    stale = true;
+  }
+
+  // Call after running the stage
+  void MarkRendered() {
+    for (uint i = 0; i < inputs.size(); i++) {
+      input_generations[i] = inputs[i]->GetGeneration();
+    }
+    stale = false;
   }
 
   // Just generate output the in the interal FBO
-  void BindForOutput() {
+  void BindForOutput(std::vector<GLuint>* bound_textures) {
     glUseProgram(shader_prog);
-    BindInputs();
+    BindInputs(bound_textures);
     glBindFramebuffer(GL_FRAMEBUFFER, output->GetFramebuffer());
     glViewport(0, 0, width, height);
     glClear(GL_COLOR_BUFFER_BIT);
   }
 
   // Use the supplied FBO
-  void BindForDisplay(int disp_width, int disp_height, GLuint fbo) {
+  void BindForDisplay(int disp_width, int disp_height, GLuint fbo, std::vector<GLuint>* bound_textures) {
     glUseProgram(shader_prog);
     glUniform2f(resolution_uni, disp_width, disp_height);
-    BindInputs();
+    BindInputs(bound_textures);
     glBindFramebuffer(GL_FRAMEBUFFER, fbo);
     glViewport(0, 0, disp_width, disp_height);
     glClear(GL_COLOR_BUFFER_BIT);
   }
 
-  void BindInputs() {
+  // Binds the inputs that aren't bound yet. bound_textures holds the
+  // texture on each unit.
+  void BindInputs(std::vector<GLuint>* bound_textures) {
     int n_textures = inputs.size();
     for (int i = 0; i < n_textures; i++) {
-      glActiveTexture(GL_TEXTURE0 + i);
-      glBindTexture(GL_TEXTURE_2D, inputs[i]->GetTexture());
-      glUniform1i(input_unis[i], i);
+      const GLuint texture = inputs[i]->GetTexture();
+      if ((*bound_textures)[input_units[i]] != texture) {
+        glActiveTexture(GL_TEXTURE0 + input_units[i]);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        (*bound_textures)[input_units[i]] = texture;
+      }
     }
   }
 
@@ -212,7 +330,22 @@ public:
   }
 };
 
-void LinkStages(std::vector<PipelineSource*> sources, std::vector<PipelineStage*> stages) {
+// Works out what each stage reads from the sampler names of its shader and
+// the output names of the sources and stages, and the order to run them in.
+// The stage shown is the one whose output no other stage reads, the last
+// given of them if there are several, and stages it doesn't depend on are
+// left out of order. Stages needn't be given in any particular order.
+//
+// Every texture read gets a texture unit of its own, set in the shaders
+// here, so a texture read by several stages is bound only once per frame.
+// The number of units used goes to texture_units.
+//
+// Returns false, with order empty, when the stages read each other in a
+// cycle or read more textures than there are units.
+inline bool LinkStages(const std::vector<PipelineSource*>& sources, const std::vector<PipelineStage*>& stages,
+                       std::vector<PipelineStage*>* order, int* texture_units) {
+  order->clear();
+  *texture_units = 0;
   std::map<std::string, PipelineInput*> input_lookup;
   // Add all of the immediate sources
   for (uint i = 0; i < sources.size(); i++) {
@@ -223,27 +356,137 @@ void LinkStages(std::vector<PipelineSource*> sources, std::vector<PipelineStage*
   }
 
   // Add outputs of intermediate stages
+  std::map<PipelineInput*, int> producers;
   for (uint i = 0; i < stages.size(); i++) {
     if (input_lookup.count(stages[i]->GetOutputName()) > 0) {
       printf("Multiple definition of source/output %s\n", stages[i]->GetOutputName().c_str());  
     }
     input_lookup[stages[i]->GetOutputName()] = stages[i]->GetOutput();
+    producers[stages[i]->GetOutput()] = i;
   }
 
-
+  // Find the inputs of every stage, and the stages each one reads from
+  std::vector<std::vector<std::string> > input_names(stages.size());
+  std::vector<std::vector<PipelineInput*> > inputs(stages.size());
+  std::vector<std::vector<int> > reads(stages.size());
+  std::vector<bool> is_read(stages.size(), false);
   for (uint i = 0; i < stages.size(); i++) {
-    std::vector<std::string> input_names = stages[i]->GetInputNames();
-    for (uint j = 0; j < input_names.size(); j++) {
-      auto iter = input_lookup.find(input_names[j]);
+    std::vector<std::string> names = stages[i]->GetInputNames();
+    for (uint j = 0; j < names.size(); j++) {
+      auto iter = input_lookup.find(names[j]);
       if (iter == input_lookup.end()) {
-        printf("Couldn't find input %s for shader: %s\n", input_names[j].c_str(), stages[i]->GetOutputName().c_str());  
-      } else {
-        PipelineInput* input = iter->second;
-        // This is the line that actually links the output -> input
-        stages[i]->AddInput(input_names[j], input);
+        printf("Couldn't find input %s for shader: %s\n", names[j].c_str(), stages[i]->GetOutputName().c_str());  
+        continue;
+      }
+      input_names[i].push_back(names[j]);
+      inputs[i].push_back(iter->second);
+      auto producer = producers.find(iter->second);
+      if (producer != producers.end()) {
+        reads[i].push_back(producer->second);
+        is_read[producer->second] = true;
       }
     }
   }
+  if (stages.empty()) {
+    return false;
+  }
+
+  int final_stage = -1;
+  for (int i = stages.size() - 1; i >= 0 && final_stage < 0; i--) {
+    if (!is_read[i]) {
+      final_stage = i;
+    }
+  }
+  if (final_stage < 0) {
+    printf("Every stage is read by another, so the stages read each other in a cycle\n");
+    return false;
+  }
+
+  // Keep the stages the final one depends on
+  std::vector<bool> live(stages.size(), false);
+  std::vector<int> pending(1, final_stage);
+  live[final_stage] = true;
+  while (!pending.empty()) {
+    const int stage = pending.back();
+    pending.pop_back();
+    for (uint j = 0; j < reads[stage].size(); j++) {
+      if (!live[reads[stage][j]]) {
+        live[reads[stage][j]] = true;
+        pending.push_back(reads[stage][j]);
+      }
+    }
+  }
+  int live_count = 0;
+  for (uint i = 0; i < stages.size(); i++) {
+    if (live[i]) {
+      live_count++;
+    } else {
+      printf("Stage %s doesn't reach %s, skipping it\n", stages[i]->GetOutputName().c_str(),
+          stages[final_stage]->GetOutputName().c_str());
+    }
+  }
+
+  // Run a stage once all it reads has run. Ties keep the order given, so
+  // pipelines given in render order render as before. The final stage
+  // depends on every other, so it comes last.
+  std::vector<bool> done(stages.size(), false);
+  std::vector<int> scheduled;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (uint i = 0; i < stages.size(); i++) {
+      if (!live[i] || done[i]) {
+        continue;
+      }
+      bool ready = true;
+      for (uint j = 0; j < reads[i].size() && ready; j++) {
+        ready = done[reads[i][j]];
+      }
+      if (ready) {
+        done[i] = true;
+        scheduled.push_back(i);
+        progress = true;
+      }
+    }
+  }
+  if ((int)scheduled.size() < live_count) {
+    printf("Stages that wait on a cycle of stages reading each other:");
+    for (uint i = 0; i < stages.size(); i++) {
+      if (live[i] && !done[i]) {
+        printf(" %s", stages[i]->GetOutputName().c_str());
+      }
+    }
+    printf("\n");
+    return false;
+  }
+
+  // Give each texture a unit, in the order they are first read
+  GLint max_units;
+  glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &max_units);
+  std::map<PipelineInput*, int> units;
+  for (uint k = 0; k < scheduled.size(); k++) {
+    const int i = scheduled[k];
+    for (uint j = 0; j < inputs[i].size(); j++) {
+      if (units.count(inputs[i][j]) == 0) {
+        const int unit = units.size();
+        units[inputs[i][j]] = unit;
+      }
+    }
+  }
+  if ((int)units.size() > max_units) {
+    printf("The stages read %d textures, but there are only %d texture units\n", (int)units.size(), max_units);
+    return false;
+  }
+  for (uint k = 0; k < scheduled.size(); k++) {
+    const int i = scheduled[k];
+    for (uint j = 0; j < inputs[i].size(); j++) {
+      // This is the line that actually links the output -> input
+      stages[i]->AddInput(input_names[i][j], inputs[i][j], units[inputs[i][j]]);
+    }
+    order->push_back(stages[i]);
+  }
+  *texture_units = units.size();
+  return true;
 }
 
 
@@ -272,9 +515,16 @@ class GLCanvas {
   // The input to the whole pipeline.
   std::vector<PipelineSource*> sources; 
   std::vector<PipelineStage*> stages;
+  // The stages that reach the output, in the order they run
+  std::vector<PipelineStage*> order;
+  // The texture on each unit the stages read from
+  std::vector<GLuint> bound_textures;
+  // Where the final stage drew last
+  GLuint last_framebuffer;
+  int last_width, last_height;
 
 public:
-  GLCanvas() {
+  GLCanvas() : last_framebuffer(0), last_width(0), last_height(0) {
     // Init VAO
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
@@ -293,7 +543,9 @@ public:
   void SetStages(std::vector<PipelineSource*> _sources, std::vector<PipelineStage*> _stages) {
     sources = _sources;
     stages = _stages;
-    LinkStages(sources, stages);
+    int texture_units;
+    LinkStages(sources, stages, &order, &texture_units);
+    bound_textures.assign(texture_units, 0);
   }
 
   /*
@@ -314,30 +566,87 @@ public:
   }
   */
 
-  void Render(GLuint framebuffer, int s_width, int s_height) {
+  // Whether a stage has to run because its inputs changed since the last
+  // Render, so the output would change
+  bool IsDirty() {
+    for (uint i = 0; i < sources.size(); i++) {
+      if (sources[i]->HasNewData()) {
+        return true;
+      }
+    }
+    for (uint i = 0; i < order.size(); i++) {
+      if (order[i]->IsDirty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Makes every stage run on the next Render
+  void Invalidate() {
+    for (uint i = 0; i < order.size(); i++) {
+      order[i]->Invalidate();
+    }
+  }
+
+  int GetStageCount() {
+    return order.size();
+  }
+
+  // Runs the stages whose inputs changed since they last ran. Their outputs
+  // keep the last result otherwise. The final stage runs as well when the
+  // framebuffer or its size changed, or when force is set, as for a window
+  // whose back buffer is undefined after a swap. Returns the number of
+  // stages run, 0 when framebuffer was left alone.
+  int Render(GLuint framebuffer, int s_width, int s_height, bool force = false) {
+    if (order.empty()) {
+      return 0;
+    }
+    for (uint i = 0; i < sources.size(); i++) {
+      sources[i]->Update();
+    }
+    uint final_stage = order.size() - 1;
+    if (framebuffer != last_framebuffer || s_width != last_width || s_height != last_height) {
+      order[final_stage]->Invalidate();
+      last_framebuffer = framebuffer;
+      last_width = s_width;
+      last_height = s_height;
+    }
+    if (!force && !IsDirty()) {
+      return 0;
+    }
+
     // Bind the reused canvas geometry
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
 
-    uint final_stage = stages.size() - 1;
+    // Sources bind their own textures when their data changes, so whatever
+    // was bound last frame can't be trusted
+    std::fill(bound_textures.begin(), bound_textures.end(), 0);
+    int rendered = 0;
     for (uint i = 0; i < final_stage; i++) {
-      stages[i]->BindForOutput();
-      glClear(GL_COLOR_BUFFER_BIT);
+      // Stages run in dependency order, so a changed output is seen by the
+      // stages after it in this same pass
+      if (!order[i]->IsDirty()) {
+        continue;
+      }
+      order[i]->BindForOutput(&bound_textures);
       glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+      order[i]->MarkRendered();
+      order[i]->GetOutput()->MarkChanged();
+      rendered++;
     }
-    stages[final_stage]->BindForDisplay(s_width, s_height, framebuffer);
-  /*
-
-    stages[final_stage].SetRenderResolution(s_width, s_height);
-    stages[final_stage].BindOutput();
-    glViewport(0, 0, s_width, s_height);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    */
+    order[final_stage]->BindForDisplay(s_width, s_height, framebuffer, &bound_textures);
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    order[final_stage]->MarkRendered();
+    order[final_stage]->GetOutput()->MarkChanged();
+    return rendered + 1;
   }
 
-  void Render(GLuint framebuffer) {
-    Render(framebuffer, width, height);
+  int Render(GLuint framebuffer) {
+    return Render(framebuffer, width, height);
   }
 };
+
+#endif // GL_CANVAS_H_
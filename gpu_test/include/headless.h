@@ -0,0 +1,25 @@
+#ifndef HEADLESS_H_
+#define HEADLESS_H_
+
+// Runs one of the demo pipelines without a window: on an EGL context with
+// no surface, rendering the whole GLCanvas into an offscreen framebuffer of
+// width x height as fast as it goes, for frame_count frames. Prints the
+// frame rate, the GPU time per frame and how many frames and stages had
+// anything new to draw. With redraw_all, every stage runs every frame
+// whether its inputs changed or not. When image_path isn't NULL, the last
+// frame is written there as a binary PPM.
+//
+// Needs no display server, so pipelines can be profiled and checked on a
+// build machine, with Mesa's surfaceless platform even without a GPU.
+// Returns 0 on success, 1 when no context could be made.
+int RunHeadless(bool show_points, bool redraw_all, int frame_count, int width, int height, const char* image_path);
+
+// Compares the ways a PipelineSource can get width x height RGBA frames to
+// the GPU, over frame_count frames: SetData, copying from client memory on
+// the GL thread, and streaming, with another thread filling the mapped
+// buffers of its ring. Prints the upload bandwidth and the time the GL
+// thread spends per frame. Returns 0 on success, 1 when no context could be
+// made.
+int RunUploadBenchmark(int frame_count, int width, int height);
+
+#endif // HEADLESS_H_
@@ -0,0 +1,150 @@
+#ifndef POINT_RENDERER_H_
+#define POINT_RENDERER_H_
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "gl_canvas.h"
+#include "shaderloader.h"
+#include "stream_ring.h"
+
+// One point as the renderer reads it: position in mm in camera coordinates
+// (x right, y up, z forward), NaN where there is no point, and the color as
+// the bytes R, G, B, A.
+struct PointVertex {
+  float x, y, z;
+  uint32_t rgba;
+};
+
+// Carries clouds from the capture thread to the GPU, one cloud per region
+typedef StreamRing<PointVertex> PointRing;
+
+// Renders the clouds of a PointRing into a texture, as a source for the
+// stages of a GLCanvas under its output name. Points are projected with a
+// pinhole camera at the origin looking down z.
+class PointRenderer : public PipelineSource {
+  PointRing ring;
+
+  GLuint shader_prog;
+  GLuint vao;
+  GLuint fbo;
+  GLuint depth_buffer;
+
+  GLint focal_uni;
+  GLint depth_range_uni;
+  // Whether the texture has to be drawn again though no new cloud came
+  bool stale;
+
+public:
+  // The nominal DS325 depth camera, focal lengths over half the image size
+  static constexpr float c_FOCAL_X = 2*224.5f/320;
+  static constexpr float c_FOCAL_Y = 2*230.9f/240;
+
+  PointRenderer(std::string output_name, int width, int height, int max_points)
+      : PipelineSource(output_name, width, height), ring(GL_ARRAY_BUFFER, max_points), stale(true) {
+    shader_prog = LoadShader("shaders/points.vert", "shaders/points.frag");
+    glUseProgram(shader_prog);
+    focal_uni = glGetUniformLocation(shader_prog, "focal");
+    depth_range_uni = glGetUniformLocation(shader_prog, "depth_range");
+    SetProjection(c_FOCAL_X, c_FOCAL_Y, 100.0f, 4000.0f);
+
+    // Other stages set their attributes up in the canvas's vertex array and
+    // buffer, so both stay bound afterwards
+    GLint previous_vao;
+    GLint previous_buffer;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &previous_buffer);
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ring.GetBuffer());
+    GLint position_attrib = glGetAttribLocation(shader_prog, "position");
+    GLint color_attrib = glGetAttribLocation(shader_prog, "color");
+    if (position_attrib == -1 || color_attrib == -1) {
+      printf("Couldn't find position and color in the point shader\n");
+    } else {
+      glEnableVertexAttribArray(position_attrib);
+      glVertexAttribPointer(position_attrib, 3, GL_FLOAT, GL_FALSE, sizeof(PointVertex), 0);
+      glEnableVertexAttribArray(color_attrib);
+      glVertexAttribPointer(color_attrib, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PointVertex),
+          (GLvoid*)(3*sizeof(GLfloat)));
+    }
+    glBindVertexArray(previous_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, previous_buffer);
+
+    // Render into the source texture, with a depth buffer so near points
+    // cover far ones
+    glGenRenderbuffers(1, &depth_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      printf("Point framebuffer is incomplete\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    printf("Point ring: %d regions of %d points, %s\n", PointRing::c_REGIONS, max_points,
+        ring.IsPersistent() ? "persistently mapped" : "uploaded");
+  }
+
+  ~PointRenderer() {
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &depth_buffer);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(shader_prog);
+  }
+
+  // focal_x and focal_y are the focal lengths over half the image size,
+  // near and far the depth range drawn, in mm
+  void SetProjection(float focal_x, float focal_y, float near, float far) {
+    glUseProgram(shader_prog);
+    glUniform2f(focal_uni, focal_x, focal_y);
+    glUniform2f(depth_range_uni, (far + near)/(far - near), -2*far*near/(far - near));
+    stale = true;
+  }
+
+  PointRing& GetRing() {
+    return ring;
+  }
+
+  // Makes the next Render draw even without a new cloud
+  void Invalidate() {
+    stale = true;
+  }
+
+  // Whether Render would draw
+  bool HasNewCloud() {
+    return stale || ring.HasReady();
+  }
+
+  // Draws the newest cloud into the texture, if there is a new one or the
+  // projection changed, so the stages reading it run. Call before rendering
+  // the canvas. Returns whether it drew.
+  bool Render() {
+    if (!ring.Update() && !stale) {
+      return false;
+    }
+    stale = false;
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glUseProgram(shader_prog);
+    GLint previous_vao;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
+    glBindVertexArray(vao);
+    glDrawArrays(GL_POINTS, ring.GetFirst(), ring.GetCount());
+    ring.Fence();
+    glBindVertexArray(previous_vao);
+    glDisable(GL_DEPTH_TEST);
+    generation++;
+    return true;
+  }
+};
+
+#endif // POINT_RENDERER_H_
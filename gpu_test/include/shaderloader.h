@@ -12,13 +12,19 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 
+// Shader paths are relative to this, the working directory unless a build
+// that runs from elsewhere sets it, with a trailing slash
+#ifndef SHADER_ROOT
+#define SHADER_ROOT ""
+#endif
 
-std::string ReadFile(const char *filePath) {
+inline std::string ReadFile(const char *filePath) {
     std::string content;
-    std::ifstream fileStream(filePath, std::ios::in);
+    const std::string path = std::string(SHADER_ROOT) + filePath;
+    std::ifstream fileStream(path.c_str(), std::ios::in);
 
     if(!fileStream.is_open()) {
-        std::cerr << "Could not read file " << filePath << ". File does not exist." << std::endl;
+        std::cerr << "Could not read file " << path << ". File does not exist." << std::endl;
         return "";
     }
 
@@ -33,7 +39,7 @@ std::string ReadFile(const char *filePath) {
 }
 
 
-GLuint LoadShader(const char *vertex_path, const char *fragment_path) {
+inline GLuint LoadShader(const char *vertex_path, const char *fragment_path) {
     GLuint vertShader = glCreateShader(GL_VERTEX_SHADER);
     GLuint fragShader = glCreateShader(GL_FRAGMENT_SHADER);
 
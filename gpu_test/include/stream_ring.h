@@ -0,0 +1,242 @@
+#ifndef STREAM_RING_H_
+#define STREAM_RING_H_
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// A ring of regions in one GL buffer, each big enough for max_items items of
+// type T, that carries data from a producer thread to the GPU.
+//
+// The producer asks for a free region, writes into it and publishes it, and
+// the GL thread uses the newest published region, as vertices or as pixels
+// to copy into a texture. With GL 4.4 or ARB_buffer_storage the buffer is
+// mapped once, persistently and coherently, so the producer writes straight
+// into memory the GPU reads from, and a fence after every use tells when the
+// GPU is done with a region. Without it, regions are kept in system memory
+// and uploaded when they are first used.
+//
+// The constructor, Update, Fence and the destructor make GL calls, so they
+// belong on the GL thread. BeginWrite and EndWrite can be called from any
+// one thread.
+template <typename T>
+class StreamRing {
+public:
+  static const int c_REGIONS = 4;
+
+  struct Stats {
+    uint64_t published;
+    // Published regions replaced by a newer one before they were used
+    uint64_t overwritten;
+    // BeginWrite calls that found every region busy
+    uint64_t dropped;
+    // Published regions that made it to the GPU
+    uint64_t used;
+  };
+
+private:
+  enum RegionState {
+    REGION_FREE,
+    REGION_WRITING,
+    // Published, not used yet
+    REGION_READY,
+    // The one in use
+    REGION_CURRENT,
+    // Used before, until its fence signals
+    REGION_IN_FLIGHT
+  };
+
+  const GLenum target;
+  const int max_items;
+  GLuint buffer;
+  bool persistent;
+  T* regions;
+
+  std::mutex mutex;
+  RegionState states[c_REGIONS];
+  int counts[c_REGIONS];
+  GLsync fences[c_REGIONS];
+  int ready;
+  int current;
+  Stats stats;
+
+  // Frees the regions the GPU is done with. Called with mutex held.
+  void ReleaseFinished() {
+    for (int r = 0; r < c_REGIONS; r++) {
+      if (states[r] != REGION_IN_FLIGHT) {
+        continue;
+      }
+      if (fences[r] != 0) {
+        GLenum status = glClientWaitSync(fences[r], 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+          continue;
+        }
+        glDeleteSync(fences[r]);
+        fences[r] = 0;
+      }
+      states[r] = REGION_FREE;
+    }
+  }
+
+public:
+  // A ring bound to target, like GL_ARRAY_BUFFER or GL_PIXEL_UNPACK_BUFFER.
+  // Leaves the buffer bound to target as it was.
+  StreamRing(GLenum target, int max_items) : target(target), max_items(max_items), ready(-1), current(-1) {
+    memset(&stats, 0, sizeof(stats));
+    for (int r = 0; r < c_REGIONS; r++) {
+      states[r] = REGION_FREE;
+      counts[r] = 0;
+      fences[r] = 0;
+    }
+    const GLsizeiptr size = (GLsizeiptr)c_REGIONS*max_items*sizeof(T);
+    GLint previous_buffer;
+    glGetIntegerv(target == GL_PIXEL_UNPACK_BUFFER ? GL_PIXEL_UNPACK_BUFFER_BINDING : GL_ARRAY_BUFFER_BINDING,
+        &previous_buffer);
+    glGenBuffers(1, &buffer);
+    glBindBuffer(target, buffer);
+    persistent = GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+    if (persistent) {
+      const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(target, size, NULL, flags);
+      regions = (T*)glMapBufferRange(target, 0, size, flags);
+      if (regions == NULL) {
+        printf("Couldn't map the stream buffer, uploading instead\n");
+        persistent = false;
+        // Storage is immutable, so the buffer has to be made again
+        glDeleteBuffers(1, &buffer);
+        glGenBuffers(1, &buffer);
+        glBindBuffer(target, buffer);
+      }
+    }
+    if (!persistent) {
+      glBufferData(target, size, NULL, GL_STREAM_DRAW);
+      regions = new T[(size_t)c_REGIONS*max_items];
+    }
+    glBindBuffer(target, previous_buffer);
+  }
+
+  ~StreamRing() {
+    for (int r = 0; r < c_REGIONS; r++) {
+      if (fences[r] != 0) {
+        glDeleteSync(fences[r]);
+      }
+    }
+    if (persistent) {
+      glBindBuffer(target, buffer);
+      glUnmapBuffer(target);
+      glBindBuffer(target, 0);
+    } else {
+      delete[] regions;
+    }
+    glDeleteBuffers(1, &buffer);
+  }
+
+  GLuint GetBuffer() {
+    return buffer;
+  }
+
+  int GetMaxItems() {
+    return max_items;
+  }
+
+  bool IsPersistent() {
+    return persistent;
+  }
+
+  // Producer side: room for GetMaxItems() items, or NULL when every region
+  // is busy and the data has to be dropped. Follow with EndWrite.
+  T* BeginWrite() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int r = 0; r < c_REGIONS; r++) {
+      if (states[r] == REGION_FREE) {
+        states[r] = REGION_WRITING;
+        return regions + (size_t)r*max_items;
+      }
+    }
+    stats.dropped++;
+    return NULL;
+  }
+
+  // Producer side: publishes the first count items of the region from
+  // BeginWrite
+  void EndWrite(T* region, int count) {
+    const int r = (region - regions)/max_items;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ready >= 0) {
+      states[ready] = REGION_FREE;
+      stats.overwritten++;
+    }
+    states[r] = REGION_READY;
+    counts[r] = count;
+    ready = r;
+    stats.published++;
+  }
+
+  // Whether a region was published since the last Update
+  bool HasReady() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ready >= 0;
+  }
+
+  // GL side: switches to the newest published region, if there is one.
+  // Returns whether there was.
+  bool Update() {
+    int next;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ReleaseFinished();
+      if (ready < 0) {
+        return false;
+      }
+      if (current >= 0) {
+        states[current] = REGION_IN_FLIGHT;
+      }
+      next = ready;
+      states[next] = REGION_CURRENT;
+      ready = -1;
+      stats.used++;
+    }
+    current = next;
+    if (!persistent) {
+      // The region is ours while it is current, so this needs no lock
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, (GLintptr)current*max_items*sizeof(T), counts[current]*sizeof(T),
+          regions + (size_t)current*max_items);
+      glBindBuffer(target, 0);
+    }
+    return true;
+  }
+
+  // GL side: the current region, as an index of the first item and a count
+  // of items in the buffer. The count is 0 before the first Update.
+  int GetFirst() {
+    return current < 0 ? 0 : current*max_items;
+  }
+
+  int GetCount() {
+    return current < 0 ? 0 : counts[current];
+  }
+
+  // GL side: call after the commands that read the current region, so it
+  // isn't written again until the GPU is done with them
+  void Fence() {
+    if (current < 0 || !persistent) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fences[current] != 0) {
+      glDeleteSync(fences[current]);
+    }
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+};
+
+#endif // STREAM_RING_H_
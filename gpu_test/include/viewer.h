@@ -1,6 +1,8 @@
 #ifndef VIEWER_H_
 #define VIEWER_H_
 
-void StartWindow();
+// With show_points, draws a moving point cloud streamed from another thread
+// instead of the glow demo. Exits after frame_limit frames unless it is 0.
+void StartWindow(bool show_points, int frame_limit);
 
 #endif // VIEWER_H_
@@ -0,0 +1,7 @@
+#version 330
+in vec4 point_color;
+out vec4 color_out;
+
+void main() {
+  color_out = point_color;
+}
@@ -0,0 +1,19 @@
+#version 330
+uniform vec2 focal;
+uniform vec2 depth_range;
+in vec3 position;
+in vec4 color;
+out vec4 point_color;
+
+void main() {
+  if (isnan(position.z)) {
+    // No point, so nothing to draw: put it outside the clip volume
+    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+  } else {
+    // y is flipped so the texture reads top row first, like the sources
+    // the other stages sample
+    gl_Position = vec4(position.x*focal.x, -position.y*focal.y,
+                       position.z*depth_range.x + depth_range.y, position.z);
+  }
+  point_color = color;
+}
@@ -0,0 +1,10 @@
+#version 330
+
+uniform sampler2D points;
+uniform vec2 resolution;
+in vec2 texture_coord;
+out vec4 color_out;
+
+void main(void) {
+  color_out = texture(points, texture_coord);
+}
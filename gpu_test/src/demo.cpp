@@ -0,0 +1,95 @@
+#include "demo.h"
+
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#include <thread>
+
+#include "gl_canvas.h"
+#include "point_renderer.h"
+
+// The streamed cloud is the size of a DS325 depth frame
+const int CLOUD_WIDTH = 320;
+const int CLOUD_HEIGHT = 240;
+
+std::thread producer;
+std::atomic<bool> producing;
+
+void BuildGlowDemo(GLCanvas* canvas, int size) {
+  uint8_t texture[] = {
+    // R, G, B
+    0, 0, 255, 0,   255, 0, 0, 255,
+    255, 0, 0, 255,   0, 0, 255, 0
+  };
+
+  // Create the immediate sources to the pipeline
+  PipelineSource* diffuse_texture = new PipelineSource("diffuse_texture", 2, 2);
+  std::vector<PipelineSource*> sources;
+  sources.push_back(diffuse_texture);
+
+  // Create the intermediate stages
+  // The canvas works out the order from the textures each shader samples
+  std::vector<PipelineStage*> stages;
+  stages.push_back(new PipelineStage("blur_x", size, size, "shaders/blur_x.frag"));
+  stages.push_back(new PipelineStage("blur_y", size, size, "shaders/blur_y.frag"));
+  stages.push_back(new PipelineStage("glow", size, size, "shaders/glow.frag"));
+
+  // Link
+  canvas->SetStages(sources, stages);
+
+  // Set the initial data
+  diffuse_texture->SetData(texture);
+}
+
+PointRenderer* BuildPointDemo(GLCanvas* canvas, int width, int height) {
+  PointRenderer* renderer = new PointRenderer("points", width, height, CLOUD_WIDTH*CLOUD_HEIGHT);
+  std::vector<PipelineSource*> sources;
+  sources.push_back(renderer);
+  std::vector<PipelineStage*> stages;
+  stages.push_back(new PipelineStage("show_points", width, height, "shaders/show_points.frag"));
+  canvas->SetStages(sources, stages);
+  return renderer;
+}
+
+// Writes a rippling surface with a hole in it straight into the point ring,
+// at about 60 clouds per second
+void ProduceClouds(PointRing* ring) {
+  float time = 0;
+  while (producing) {
+    PointVertex* points = ring->BeginWrite();
+    if (points != NULL) {
+      for (int row = 0; row < CLOUD_HEIGHT; row++) {
+        for (int col = 0; col < CLOUD_WIDTH; col++) {
+          PointVertex& p = points[row*CLOUD_WIDTH + col];
+          const float u = col - CLOUD_WIDTH/2;
+          const float v = CLOUD_HEIGHT/2 - row;
+          if (u*u + v*v < 30*30) {
+            p.x = p.y = p.z = NAN;
+            continue;
+          }
+          const float ripple = sinf(sqrtf(u*u + v*v)/10 - time);
+          p.z = 1000 + 60*ripple;
+          p.x = u*p.z/224.5f;
+          p.y = v*p.z/230.9f;
+          const uint8_t shade = 128 + 127*ripple;
+          p.rgba = 0xff000000 | (shade << 8) | (255 - shade);
+        }
+      }
+      ring->EndWrite(points, CLOUD_WIDTH*CLOUD_HEIGHT);
+    }
+    time += 0.1f;
+    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+  }
+}
+
+void StartProducer(PointRenderer* renderer) {
+  producing = true;
+  producer = std::thread(ProduceClouds, &renderer->GetRing());
+}
+
+void StopProducer() {
+  if (producer.joinable()) {
+    producing = false;
+    producer.join();
+  }
+}
@@ -0,0 +1,325 @@
+#include "headless.h"
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "demo.h"
+#include "gl_canvas.h"
+#include "point_renderer.h"
+
+// Prefers Mesa's surfaceless platform, which needs neither a display server
+// nor a GPU device, over whatever the default display is
+EGLDisplay OpenDisplay() {
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (extensions != NULL && strstr(extensions, "EGL_MESA_platform_surfaceless") != NULL) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display != NULL) {
+      EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+      if (display != EGL_NO_DISPLAY) {
+        return display;
+      }
+    }
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+// Makes a desktop GL 3.3 core context current without a surface, as the
+// GLUT window asks for
+bool CreateContext(EGLDisplay display, EGLContext* context) {
+  EGLint major, minor;
+  if (!eglInitialize(display, &major, &minor)) {
+    printf("Couldn't initialize EGL: 0x%x\n", eglGetError());
+    return false;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    printf("EGL %d.%d has no desktop GL\n", major, minor);
+    return false;
+  }
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint config_count = 0;
+  if (!eglChooseConfig(display, config_attribs, &config, 1, &config_count) || config_count == 0) {
+    printf("No EGL config for desktop GL\n");
+    return false;
+  }
+  const EGLint context_attribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  *context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+  if (*context == EGL_NO_CONTEXT) {
+    printf("Couldn't create a GL 3.3 context: 0x%x\n", eglGetError());
+    return false;
+  }
+  // Everything is drawn into framebuffer objects, so no surface is needed
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, *context)) {
+    printf("Couldn't make the context current without a surface: 0x%x\n", eglGetError());
+    eglDestroyContext(display, *context);
+    return false;
+  }
+  return true;
+}
+
+// Writes the color attachment of framebuffer as a binary PPM, top row first
+bool WriteImage(GLuint framebuffer, int width, int height, const char* path) {
+  std::vector<uint8_t> pixels(width*height*4);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Couldn't write %s\n", path);
+    return false;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", width, height);
+  std::vector<uint8_t> row(width*3);
+  int lit = 0;
+  for (int y = height - 1; y >= 0; y--) {
+    const uint8_t* p = &pixels[y*width*4];
+    for (int x = 0; x < width; x++, p += 4) {
+      row[3*x] = p[0];
+      row[3*x + 1] = p[1];
+      row[3*x + 2] = p[2];
+      if (p[0] != 0 || p[1] != 0 || p[2] != 0) {
+        lit++;
+      }
+    }
+    fwrite(&row[0], 1, row.size(), file);
+  }
+  fclose(file);
+  printf("Wrote the last frame to %s, %d of %d pixels lit\n", path, lit, width*height);
+  return true;
+}
+
+// Makes a context current and loads the GL functions
+bool StartGL(EGLDisplay* display, EGLContext* context) {
+  *display = OpenDisplay();
+  if (*display == EGL_NO_DISPLAY || !CreateContext(*display, context)) {
+    return false;
+  }
+  glewExperimental = GL_TRUE;
+  GLenum glew_error = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // GLEW built for GLX can't find a GLX display, but has loaded the GL
+  // functions by then
+  if (glew_error == GLEW_ERROR_NO_GLX_DISPLAY) {
+    glew_error = GLEW_OK;
+  }
+#endif
+  if (glew_error != GLEW_OK) {
+    printf("Error initializing GLEW! %s\n", glewGetErrorString(glew_error));
+    return false;
+  }
+  printf("Headless on %s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+  glClearColor(0, 0, 0, 0);
+  return true;
+}
+
+void StopGL(EGLDisplay display, EGLContext context) {
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(display, context);
+  eglTerminate(display);
+}
+
+int RunHeadless(bool show_points, bool redraw_all, int frame_count, int width, int height, const char* image_path) {
+  EGLDisplay display;
+  EGLContext context;
+  if (!StartGL(&display, &context)) {
+    return 1;
+  }
+
+  GLCanvas* canvas = new GLCanvas();
+  PointRenderer* point_renderer = NULL;
+  if (show_points) {
+    point_renderer = BuildPointDemo(canvas, width, height);
+    StartProducer(point_renderer);
+  } else {
+    BuildGlowDemo(canvas, std::max(width, height));
+  }
+  // Takes the place of the window
+  PipelineOutput target(width, height);
+
+  // One query per frame, so none has to be waited for until the end
+  std::vector<GLuint> queries(frame_count);
+  glGenQueries(frame_count, &queries[0]);
+
+  // The first frame compiles shaders lazily on some drivers, so it isn't
+  // counted
+  if (point_renderer != NULL) {
+    point_renderer->Render();
+  }
+  canvas->Render(target.GetFramebuffer(), width, height);
+  glFinish();
+
+  int frames_drawn = 0;
+  int stages_run = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int f = 0; f < frame_count; f++) {
+    glBeginQuery(GL_TIME_ELAPSED, queries[f]);
+    if (redraw_all) {
+      canvas->Invalidate();
+    }
+    if (point_renderer != NULL) {
+      if (redraw_all) {
+        point_renderer->Invalidate();
+      }
+      point_renderer->Render();
+    }
+    const int stages = canvas->Render(target.GetFramebuffer(), width, height);
+    if (stages > 0) {
+      frames_drawn++;
+      stages_run += stages;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+  }
+  glFinish();
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> gpu_ms(frame_count);
+  double gpu_total = 0;
+  for (int f = 0; f < frame_count; f++) {
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(queries[f], GL_QUERY_RESULT, &nanoseconds);
+    gpu_ms[f] = nanoseconds/1e6;
+    gpu_total += gpu_ms[f];
+  }
+  glDeleteQueries(frame_count, &queries[0]);
+  std::sort(gpu_ms.begin(), gpu_ms.end());
+  printf("%d frames of %dx%d in %.2f s: %.1f frames/s, %.3f ms per frame\n", frame_count, width, height,
+      seconds, frame_count/seconds, 1000*seconds/frame_count);
+  printf("GPU ms per frame: mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n", gpu_total/frame_count,
+      gpu_ms[frame_count/2], gpu_ms[frame_count*99/100], gpu_ms[frame_count - 1]);
+  printf("%d of %d frames drawn, %.2f of %d stages run per frame\n", frames_drawn, frame_count,
+      (double)stages_run/frame_count, canvas->GetStageCount());
+
+  StopProducer();
+  if (point_renderer != NULL) {
+    PointRing::Stats stats = point_renderer->GetRing().GetStats();
+    printf("clouds published: %lu, drawn: %lu, overwritten: %lu, dropped: %lu\n",
+        (unsigned long)stats.published, (unsigned long)stats.used, (unsigned long)stats.overwritten,
+        (unsigned long)stats.dropped);
+  }
+  if (image_path != NULL) {
+    WriteImage(target.GetFramebuffer(), width, height, image_path);
+  }
+  StopGL(display, context);
+  return 0;
+}
+
+// Prints what an upload run did. frame_ms holds the time the GL thread spent
+// on each frame.
+void PrintUploads(const char* name, int uploads, double seconds, size_t frame_bytes, std::vector<double>* frame_ms) {
+  std::sort(frame_ms->begin(), frame_ms->end());
+  double total = 0;
+  for (size_t f = 0; f < frame_ms->size(); f++) {
+    total += (*frame_ms)[f];
+  }
+  const int frames = frame_ms->size();
+  printf("%-8s %5d uploads in %.2f s, %7.1f MB/s; GL thread ms per frame: mean %.3f, p99 %.3f, max %.3f\n", name,
+      uploads, seconds, uploads*(double)frame_bytes/seconds/1e6, total/frames, (*frame_ms)[frames*99/100],
+      (*frame_ms)[frames - 1]);
+}
+
+int RunUploadBenchmark(int frame_count, int width, int height) {
+  EGLDisplay display;
+  EGLContext context;
+  if (!StartGL(&display, &context)) {
+    return 1;
+  }
+  // Two frames to alternate between, like a camera's buffers
+  const size_t frame_bytes = (size_t)width*height*4;
+  std::vector<uint8_t> frames(2*frame_bytes);
+  for (size_t i = 0; i < frames.size(); i++) {
+    frames[i] = i*7 + i/frame_bytes*64;
+  }
+  printf("Uploading %d frames of %dx%d RGBA, %.2f MB each\n", frame_count, width, height, frame_bytes/1e6);
+
+  for (int streamed = 0; streamed < 2; streamed++) {
+    // A source shown through one stage, so every upload is read
+    GLCanvas canvas;
+    PipelineSource source("points", width, height);
+    std::vector<PipelineSource*> sources(1, &source);
+    std::vector<PipelineStage*> stages(1, new PipelineStage("show", width, height, "shaders/show_points.frag"));
+    canvas.SetStages(sources, stages);
+    PipelineOutput target(width, height);
+    source.SetData(&frames[0]);
+    canvas.Render(target.GetFramebuffer(), width, height);
+    glFinish();
+
+    std::atomic<bool> producing(true);
+    std::thread producer;
+    if (streamed) {
+      source.EnableStreaming();
+      // Copies the next frame into a mapped buffer while the last one is
+      // uploaded, so none is copied only to be overwritten
+      producer = std::thread([&]() {
+        for (int f = 0; producing; ) {
+          uint8_t* frame = source.HasNewData() ? NULL : source.BeginWrite();
+          if (frame == NULL) {
+            std::this_thread::yield();
+            continue;
+          }
+          memcpy(frame, &frames[(f++%2)*frame_bytes], frame_bytes);
+          source.EndWrite(frame);
+        }
+      });
+    }
+
+    // Runs until frame_count frames were drawn, each with a new upload.
+    // Streamed frames are drawn as the producer publishes them.
+    std::vector<double> frame_ms(frame_count);
+    int uploads = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frame_count; ) {
+      std::chrono::steady_clock::time_point frame_start = std::chrono::steady_clock::now();
+      if (!streamed) {
+        source.SetData(&frames[(f%2)*frame_bytes]);
+        uploads++;
+      }
+      if (canvas.Render(target.GetFramebuffer(), width, height) > 0) {
+        frame_ms[f++] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    glFinish();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (streamed) {
+      producing = false;
+      producer.join();
+      StreamRing<uint8_t>::Stats stats = source.GetStream()->GetStats();
+      uploads = stats.used;
+      PrintUploads(source.GetStream()->IsPersistent() ? "mapped" : "buffered", uploads, seconds, frame_bytes,
+          &frame_ms);
+      printf("         frames published: %lu, overwritten: %lu, dropped: %lu\n", (unsigned long)stats.published,
+          (unsigned long)stats.overwritten, (unsigned long)stats.dropped);
+    } else {
+      PrintUploads("SetData", uploads, seconds, frame_bytes, &frame_ms);
+    }
+    delete stages[0];
+  }
+  StopGL(display, context);
+  return 0;
+}
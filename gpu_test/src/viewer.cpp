@@ -10,11 +10,16 @@
 #include <iomanip>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
 #include <stdio.h>
+#include <thread>
 #include "timer.h"
 #include "viewer.h"
 #include "shaderloader.h"
 #include "gl_canvas.h"
+#include "point_renderer.h"
+#include "demo.h"
+#include "headless.h"
 
 
 // GLUT CALLBACK functions ////////////////////////////////////////////////////
@@ -53,6 +58,11 @@ const int    IMAGE_HEIGHT    = 1024;
 const int    CHANNEL_COUNT   = 4;
 const int    DATA_SIZE       = IMAGE_WIDTH * IMAGE_HEIGHT * CHANNEL_COUNT;
 const GLenum PIXEL_FORMAT    = GL_BGRA;
+const int    GLOW_SIZE       = 500;
+const int    HEADLESS_FRAMES = 1000;
+const int    UPLOAD_WIDTH    = 640;
+const int    UPLOAD_HEIGHT   = 480;
+const int    IDLE_SLEEP_MS   = 2;
 
 // global variables
 int screenWidth;
@@ -65,6 +75,9 @@ float cam_distance;
 Timer timer;
 float fps;
 float last_draw_time;
+int frames_drawn;
+int frames_idle;
+int max_frames;
 
 void CheckGLError(int id) {
   GLenum error = glGetError();
@@ -76,7 +89,10 @@ void CheckGLError(int id) {
 
 ///////////////////////////////////////////////////////////////////////////////
 GLCanvas* canvas;
-void StartWindow() {
+PointRenderer* point_renderer;
+
+void StartWindow(bool show_points, int frame_limit) {
+  max_frames = frame_limit;
   // register exit callback
   atexit(exitCB);
 
@@ -90,50 +106,62 @@ void StartWindow() {
 
 
   canvas = new GLCanvas();
-
-  //canvas.AddStage(2, 2, "shaders/basic.frag");
-  //canvas.AddStage(2, 2, "shaders/glow.frag");
-  //canvas.Init();
-
   CheckGLError(8);
-  uint8_t texture[] = {
-    // R, G, B
-    0, 0, 255, 0,   255, 0, 0, 255,
-    255, 0, 0, 255,   0, 0, 255, 0 
-  };
-  //canvas.SetData(texture);
+  if (show_points) {
+    point_renderer = BuildPointDemo(canvas, SCREEN_WIDTH, SCREEN_HEIGHT);
+    StartProducer(point_renderer);
+  } else {
+    BuildGlowDemo(canvas, GLOW_SIZE);
+  }
   CheckGLError(9);
 
-  // Create the immediate sources to the pipeline
-  PipelineSource diffuse_texture("diffuse_texture", 2, 2);
-  std::vector<PipelineSource*> sources;
-  sources.push_back(&diffuse_texture);
-
-  // Create the intermediate stages
-  int upscale = 500;
-  PipelineStage blur_x("blur_x", upscale, upscale, "shaders/blur_x.frag");
-  PipelineStage blur_y("blur_y", upscale, upscale, "shaders/blur_y.frag");
-  PipelineStage glow("glow", upscale, upscale, "shaders/glow.frag");
-  //PipelineStage glow("glow", upscale, upscale, "shaders/autoglow.frag");
-  // These need to be added in render order
-  // (there isn't any smart dependency checking to determine that on the fly)
-  std::vector<PipelineStage*> stages;
-  stages.push_back(&blur_x);
-  stages.push_back(&blur_y);
-  stages.push_back(&glow);
-
-  // Link
-  canvas->SetStages(sources, stages);
-
-  // Set the initial data
-  diffuse_texture.SetData(texture);
-
   timer.start();
   glutMainLoop();
 }
 
 int main(int argc, char** argv) {
-  StartWindow();
+  bool show_points = false;
+  bool headless = false;
+  bool redraw_all = false;
+  bool uploads = false;
+  int frame_limit = 0;
+  int width = 0;
+  int height = 0;
+  const char* image_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--points") == 0) {
+      show_points = true;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--uploads") == 0) {
+      uploads = true;
+    } else if (strcmp(argv[i], "--redraw-all") == 0) {
+      redraw_all = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frame_limit = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc &&
+        sscanf(argv[i + 1], "%dx%d", &width, &height) == 2 && width > 0 && height > 0) {
+      i++;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      image_path = argv[++i];
+    } else {
+      printf("usage: %s [--points] [--frames N] [--headless [--size WxH] [--image FILE.ppm] [--redraw-all] [--uploads]]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (headless && uploads) {
+    // The size of the DS325's color frames by default
+    return RunUploadBenchmark(frame_limit > 0 ? frame_limit : HEADLESS_FRAMES, width > 0 ? width : UPLOAD_WIDTH,
+        height > 0 ? height : UPLOAD_HEIGHT);
+  }
+  if (width == 0) {
+    width = SCREEN_WIDTH;
+    height = SCREEN_HEIGHT;
+  }
+  if (headless) {
+    return RunHeadless(show_points, redraw_all, frame_limit > 0 ? frame_limit : HEADLESS_FRAMES, width, height, image_path);
+  }
+  StartWindow(show_points, frame_limit);
 }
 
 
@@ -199,7 +227,12 @@ void displayCB() {
   // clear buffer
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-  canvas->Render(0, screenWidth, screenHeight);
+  if (point_renderer != NULL) {
+    point_renderer->Render();
+  }
+  // The back buffer is undefined after a swap, so the last stage always
+  // draws. Stages whose inputs didn't change keep their output.
+  canvas->Render(0, screenWidth, screenHeight, true);
 
   // draw info messages
   float current_time = timer.getElapsedTimeInMicroSec();
@@ -209,6 +242,7 @@ void displayCB() {
 
   glutSwapBuffers();
   CheckGLError(10);
+  frames_drawn++;
 }
 
 void reshapeCB(int width, int height) {
@@ -221,8 +255,20 @@ void timerCB(int millisec) {
   glutPostRedisplay();
 }
 
+// Redraws only when something changed. A frame limit counts every pass,
+// whether it drew or not.
 void idleCB() {
-  glutPostRedisplay();
+  if (canvas->IsDirty() || (point_renderer != NULL && point_renderer->HasNewCloud())) {
+    glutPostRedisplay();
+  } else {
+    // Nothing to draw, so don't spin
+    frames_idle++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+  }
+  if (max_frames > 0 && frames_drawn + frames_idle >= max_frames) {
+    printf("%d frames in %.2f s, %d drawn\n", frames_drawn + frames_idle, timer.getElapsedTimeInSec(), frames_drawn);
+    exit(0);
+  }
 }
 
 void keyboardCB(unsigned char key, int x, int y) {
@@ -286,4 +332,11 @@ void mouseMotionCB(int x, int y) {
 }
 
 void exitCB() {
+  StopProducer();
+  if (point_renderer != NULL) {
+    PointRing::Stats stats = point_renderer->GetRing().GetStats();
+    printf("clouds published: %lu, drawn: %lu, overwritten: %lu, dropped: %lu\n",
+        (unsigned long)stats.published, (unsigned long)stats.used, (unsigned long)stats.overwritten,
+        (unsigned long)stats.dropped);
+  }
 }
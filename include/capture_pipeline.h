@@ -0,0 +1,243 @@
+#ifndef CAPTURE_PIPELINE_H_
+#define CAPTURE_PIPELINE_H_
+
+#include <memory>
+#include <pcl/Vertices.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <stdio.h>
+#include <string>
+
+#include "cloud_stream.h"
+#include "color_registration.h"
+#include "frame_source.h"
+#include "frame_synchronizer.h"
+#include "icp_odometry.h"
+#include "metrics.h"
+#include "normal_estimator.h"
+#include "organized_mesher.h"
+#include "plane_segmenter.h"
+#include "point_budget.h"
+#include "spatial_filter.h"
+#include "temporal_filter.h"
+#include "thread_pool.h"
+#include "triple_buffer.h"
+#include "tsdf_volume.h"
+#include "voxel_downsampler.h"
+
+// Turns the depth and color frames of a FrameSource into colored, organized
+// clouds. Frames are paired by timestamp, converted, colored and published
+// into a triple buffer that the display side reads from.
+class CapturePipeline : public FrameSink {
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+  typedef pcl::PointCloud<pcl::Normal> Normals;
+
+  // The fused surface as separate triangles, three vertices each
+  struct Mesh {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr vertices;
+    std::vector<pcl::Vertices> polygons;
+  };
+
+  // What the display side gets for every depth frame
+  struct Frame {
+    Cloud::Ptr cloud;
+    // The normals of cloud, point for point, with normal estimation on.
+    // Empty otherwise.
+    Normals::Ptr normals;
+    // Where the camera was, in the coordinates of the first frame, with
+    // odometry on. Identity otherwise.
+    Pose pose;
+    // The latest fused surface with fusion on, in the coordinates of the
+    // first frame. It is only remeshed every so many frames, and frames in
+    // between share it.
+    std::shared_ptr<const Mesh> mesh;
+    // The surface of cloud with surface meshing on, three indices into its
+    // points per triangle. Empty otherwise.
+    std::vector<uint32_t> triangles;
+    // The planes found in the frame with plane segmentation on, and for
+    // every point of cloud the index of its plane or
+    // PlaneSegmenter::c_NO_PLANE. Planes are found in the full cloud, so
+    // there are planes but no labels while clouds are downsampled. Empty
+    // otherwise.
+    std::vector<Plane> planes;
+    std::vector<uint8_t> plane_labels;
+    // metrics::Now() when the depth frame reached the pipeline, for the end
+    // to end latency
+    uint64_t received;
+  };
+
+private:
+  struct DepthSample {
+    Vertex vertices[c_PIXEL_COUNT];
+    UV uv_map[c_PIXEL_COUNT];
+    Intrinsics intrinsics;
+    uint64_t received;
+  };
+
+  struct ColorSample {
+    // BGR
+    uint8_t color_map[3*c_COLOR_PIXEL_COUNT];
+  };
+
+  typedef FrameSynchronizer<DepthSample, ColorSample> Synchronizer;
+
+  Synchronizer sync;
+  // Rebuilt from the UV map of every depth frame, then applied to the color
+  // frame(s) it was paired with.
+  ColorRegistration registration;
+  TripleBuffer<Frame> frames;
+
+  // Splits the per-frame work of the stages that can use more than one core
+  ThreadPool pool;
+
+  // Smooth depth before conversion when set, over time then across the image
+  TemporalFilter* temporal_filter;
+  SpatialFilter* spatial_filter;
+  std::vector<Vertex> smoothed;
+  // Colors are registered into this packed plane and interleaved into the
+  // cloud by the conversion, which writes the points anyway. A color guided
+  // spatial filter reads them from here too.
+  bool color_guided;
+  std::vector<uint32_t> colors;
+
+  // Fills in the normals of every frame when set
+  NormalEstimator* normal_estimator;
+
+  // Triangulates every published organized cloud when set
+  OrganizedMesher* surface_mesher;
+
+  // Finds the planes of every cloud when set
+  PlaneSegmenter* plane_segmenter;
+
+  // Tracks the camera when set, made with the intrinsics of the first depth
+  // frame. Poses also go to pose_file when it is open.
+  bool track_camera;
+  IcpOdometry* odometry;
+  FILE* pose_file;
+  uint64_t tracking_lost;
+
+  // Fuses every tracked cloud when set
+  TsdfVolume* volume;
+  uint32_t fused_frames;
+  std::shared_ptr<const Mesh> mesh;
+  std::vector<float> triangles;
+
+  // With a leaf size set, clouds are built here and the voxel averages are
+  // published instead.
+  bool downsample;
+  float leaf_size;
+  VoxelDownsampler downsampler;
+  Cloud organized;
+
+  // Lowers the detail of published clouds when set, to what the display
+  // reports it can keep up with
+  PointBudget* point_budget;
+
+  // Every cloud is also written here when set. With nothing else wanting
+  // the clouds, the points are converted straight into the stream's region
+  // and neither a pcl cloud nor the frames are filled in.
+  CloudStream* cloud_stream;
+  uint64_t streamed;
+  uint64_t stream_dropped;
+
+  uint32_t depth_frames;
+  uint32_t color_frames;
+  // Samples the source reports as lost before they reached the callbacks
+  uint64_t dropped_depth;
+  uint64_t dropped_color;
+  // Unpaired depth frames already counted as pairing drops
+  uint64_t reported_unmatched;
+
+  void PublishPairs();
+  void PublishMesh();
+  bool StreamsDirectly() const;
+  void StreamVertices(const Vertex* vertices, int stride);
+
+public:
+  // threads is how many cores the stages may split a frame over, including
+  // the calling thread, 0 for all of them
+  CapturePipeline(SyncPolicy policy = SYNC_NEAREST, int threads = 0);
+  ~CapturePipeline();
+
+  // Smooth depth over time before building clouds. Call before frames start
+  // arriving.
+  void EnableTemporalFilter(TemporalMode mode);
+
+  // Smooth depth across the image and drop flying pixels before building
+  // clouds, guided by the color image or by depth alone. Call before frames
+  // start arriving.
+  void EnableSpatialFilter(SpatialMode mode, bool color_guided);
+
+  // Estimate a normal for every point. Normals belong to the organized
+  // cloud, so there are none while clouds are downsampled. Call before frames
+  // start arriving.
+  void EnableNormals(NormalMethod method);
+
+  // Triangulate every cloud from its pixel grid and publish the triangles,
+  // leaving gaps where depth jumps by more than max_depth_jump times the
+  // depth. Only organized clouds are meshed, so there are none while clouds
+  // are downsampled. Call before frames start arriving.
+  void EnableSurfaceMesh(float max_depth_jump);
+
+  // Find the large planes of every cloud and publish them along with which
+  // points are on them. Call before frames start arriving.
+  void EnablePlaneSegmentation();
+
+  // Track the camera from cloud to cloud and publish its pose with every
+  // frame. With a pose_path, poses are also written there, one line per
+  // frame as "timestamp tx ty tz qx qy qz qw" in seconds and meters, the
+  // format of the TUM RGB-D benchmark tools. Returns false when the file
+  // can't be opened. Call before frames start arriving.
+  bool EnableOdometry(const std::string& pose_path = std::string());
+
+  // Fuse the clouds into one surface, with voxels of voxel_size mm, and
+  // publish it as a mesh. Turns odometry on for the poses. Call before frames
+  // start arriving.
+  void EnableFusion(float voxel_size);
+
+  // Publish clouds averaged into voxels of leaf_size mm rather than every
+  // pixel, 0 to turn it off. Call before frames start arriving.
+  void SetVoxelLeafSize(float leaf_size);
+
+  // Publish clouds only as detailed as the display can render in target_ms,
+  // by keeping every n-th pixel, or with voxels n times the leaf size when
+  // downsampling. The display reports its frame times to GetPointBudget.
+  // Call before frames start arriving.
+  void EnablePointBudget(double target_ms);
+
+  // NULL unless EnablePointBudget was called
+  PointBudget* GetPointBudget() {
+    return point_budget;
+  }
+
+  // Also write every cloud into stream, from the capture thread, for a
+  // display that reads points rather than the frames. Unless normals,
+  // surfaces, planes, odometry or downsampling need the cloud, the points go
+  // only to the stream and nothing is published to GetFrames. Call before
+  // frames start arriving.
+  void SetCloudStream(CloudStream* stream);
+
+  // Writes the points of cloud into a region of stream. Returns false when
+  // the stream had no free region or too little room, and the cloud was
+  // dropped.
+  static bool StreamCloud(const Cloud& cloud, CloudStream* stream);
+
+  void OnDepthFrame(const DepthFrame& frame);
+  void OnColorFrame(const ColorFrame& frame);
+
+  // The display side of the handoff: Acquire then read Front.
+  TripleBuffer<Frame>& GetFrames() {
+    return frames;
+  }
+
+  // Clouds that went straight into the cloud stream, rather than through
+  // the frames
+  uint64_t GetStreamedClouds() const {
+    return streamed;
+  }
+
+  void PrintStats();
+};
+
+#endif // CAPTURE_PIPELINE_H_
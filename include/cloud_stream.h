@@ -0,0 +1,31 @@
+#ifndef CLOUD_STREAM_H_
+#define CLOUD_STREAM_H_
+
+#include <stdint.h>
+
+// One point as a streaming display reads it: position in mm in camera
+// coordinates, NaN where there is no point, and the color as the bytes R, G,
+// B, A. 16 bytes, half of a pcl::PointXYZRGB.
+struct StreamPoint {
+  float x, y, z;
+  uint32_t rgba;
+};
+
+// A display that takes clouds as regions of points it hands out, like the
+// ring of a GPU buffer, so the capture side writes each cloud right where
+// the display reads it from.
+class CloudStream {
+public:
+  virtual ~CloudStream() {}
+
+  // Room for GetMaxPoints() points, or NULL when the display is behind and
+  // the cloud has to be dropped. Follow with EndWrite.
+  virtual StreamPoint* BeginWrite() = 0;
+
+  // Publishes the first count points of the region from BeginWrite
+  virtual void EndWrite(StreamPoint* points, int count) = 0;
+
+  virtual int GetMaxPoints() = 0;
+};
+
+#endif // CLOUD_STREAM_H_
@@ -0,0 +1,92 @@
+#ifndef COLOR_REGISTRATION_H_
+#define COLOR_REGISTRATION_H_
+
+#include <stdint.h>
+#include <vector>
+
+// Maps color onto depth pixels through the SDK's per-frame UV map.
+//
+// SetUVMap turns a depth frame's UV map into a table of byte offsets into the
+// BGR color image (-1 where the pixel doesn't land in the color image). The
+// color of each point is then a single table lookup, done with AVX2 gathers
+// where the CPU has them. In bilinear mode the table holds the top-left
+// neighbour and fixed point weights instead, and the four neighbours are
+// blended.
+//
+// Colors are written as packed 32 bit values in the layout of
+// pcl::PointXYZRGB::rgba (b in the low byte, alpha 255), at
+// rgba + i*point_stride. Unmapped pixels come out black. A packed plane
+// (point_stride 1) is much cheaper to fill than the colors of a cloud, which
+// are spread over 32 bytes per point; ConvertVertices can interleave the
+// plane into the cloud instead.
+class ColorRegistration {
+  struct BilinearEntry {
+    // Offset of the top-left neighbour, -1 if unmapped
+    int32_t offset;
+    // Byte steps to the right and bottom neighbours, 0 on the image border
+    int32_t step_x;
+    int32_t step_y;
+    // Sub-pixel position, 0 to c_WEIGHT_ONE
+    uint16_t weight_x;
+    uint16_t weight_y;
+  };
+
+  const int depth_count;
+  const int color_width;
+  const int color_height;
+  const bool bilinear;
+
+  std::vector<int32_t> offsets;
+  // Depth pixels mapped onto the very last color pixel. A 4 byte gather from
+  // there would read past the end of the image, so they get patched up
+  // separately.
+  std::vector<int32_t> edge_pixels;
+  std::vector<BilinearEntry> bilinear_entries;
+
+  void SetUVMapNearest(const float* uv);
+  void SetUVMapBilinear(const float* uv);
+  void ApplyBilinear(const uint8_t* bgr, const uint8_t* bgr_next, int weight,
+                     uint32_t* rgba, int point_stride) const;
+  void PatchEdgePixels(const uint8_t* bgr, const uint8_t* bgr_next, int weight,
+                       uint32_t* rgba, int point_stride) const;
+
+public:
+  // Fixed point scale of blend and sub-pixel weights. Blends are done in 16
+  // bit lanes, so 255*c_WEIGHT_ONE has to fit in an int16.
+  static const int c_WEIGHT_ONE = 128;
+
+  ColorRegistration(int depth_count, int color_width, int color_height, bool bilinear = false);
+
+  // Builds the lookup table from interleaved (u, v) pairs in [0, 1).
+  void SetUVMap(const float* uv);
+
+  // Colors all depth pixels from a BGR image.
+  void Apply(const uint8_t* bgr, uint32_t* rgba, int point_stride) const;
+
+  // Colors all depth pixels from a blend of two BGR images, weight (0 to 1)
+  // being how much of bgr_next to use.
+  void Apply(const uint8_t* bgr, const uint8_t* bgr_next, float weight,
+             uint32_t* rgba, int point_stride) const;
+
+  bool IsBilinear() const {
+    return bilinear;
+  }
+};
+
+// Builds the nearest neighbour table behind ColorRegistration::SetUVMap.
+// Pixels that land on the last color pixel get -1 and are listed in
+// edge_pixels.
+void BuildOffsetsScalar(const float* uv, int count, int width, int height,
+                        int32_t* offsets, std::vector<int32_t>* edge_pixels);
+void BuildOffsetsAVX2(const float* uv, int count, int width, int height,
+                      int32_t* offsets, std::vector<int32_t>* edge_pixels);
+
+// The table lookup loops behind ColorRegistration::Apply. weight is in
+// 1/ColorRegistration::c_WEIGHT_ONE units and bgr_next is only read when it
+// is non-zero. Lanes with a negative offset come out black.
+void GatherColorsScalar(const int32_t* offsets, int count, const uint8_t* bgr, const uint8_t* bgr_next,
+                        int weight, uint32_t* rgba, int point_stride);
+void GatherColorsAVX2(const int32_t* offsets, int count, const uint8_t* bgr, const uint8_t* bgr_next,
+                      int weight, uint32_t* rgba, int point_stride);
+
+#endif // COLOR_REGISTRATION_H_
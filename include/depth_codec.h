@@ -0,0 +1,86 @@
+#ifndef DEPTH_CODEC_H_
+#define DEPTH_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+// Lossless compression for 16-bit depth images (and the other per-pixel
+// 16-bit planes that come with them, like the vertex x and y and the
+// confidence map).
+//
+// The image is cut into bands of rows that are coded independently, so
+// several threads can encode or decode one image. Each band predicts every
+// pixel either from its neighbors (left + up - up_left) or from the same
+// pixel in the previous image, whichever codes smaller. The
+// residuals are zigzagged and bit packed in blocks of 16, each block as wide
+// as its largest residual, so decoding has no data dependent branches. Runs
+// of all-zero blocks, which is what invalid regions and static background
+// turn into, take a single byte.
+//
+// Encoded image: a PlaneHeader, the byte size of every band, then the bands.
+class DepthCodec {
+public:
+  enum Prediction {
+    PREDICT_SPATIAL = 0,
+    PREDICT_TEMPORAL = 1
+  };
+
+  struct PlaneHeader {
+    uint16_t width;
+    uint16_t height;
+    uint16_t band_rows;
+    uint16_t reserved;
+  };
+
+private:
+  struct Band {
+    std::vector<uint16_t> spatial;
+    std::vector<uint16_t> temporal;
+    // Room for the worst case, of which size bytes are used
+    std::vector<uint8_t> data;
+    size_t size;
+    // Whether the band of the last Decode came out whole
+    bool decoded;
+  };
+
+  const int width;
+  const int height;
+  const int band_rows;
+  const int band_count;
+  std::vector<Band> bands;
+  // Where every band of the image being decoded starts, with one more entry
+  // for the end of the last
+  std::vector<size_t> band_offsets;
+
+  // The image being coded, kept here so the band tasks only capture this
+  const int16_t* coding_plane;
+  const int16_t* coding_previous;
+  int coding_stride;
+  const uint8_t* decoding_data;
+  int16_t* decoding_plane;
+
+  void EncodeBand(int band, const int16_t* plane, const int16_t* previous, int stride);
+  bool DecodeBand(int band);
+
+public:
+  DepthCodec(int width, int height, int band_rows = 16);
+
+  int BandCount() const;
+
+  // Appends the encoding of the image at plane[i*stride] to out. previous is
+  // the image before it, laid out the same way, or NULL for an image that
+  // has to decode on its own. Returns the encoded size.
+  size_t Encode(const int16_t* plane, const int16_t* previous, int stride,
+                std::vector<uint8_t>* out, ThreadPool* pool = NULL);
+
+  // Decodes size bytes of data into plane[i*stride]. previous has to be the
+  // image that was passed to Encode, and may be the same memory as plane.
+  // Returns false if the data is damaged or doesn't fit the codec.
+  bool Decode(const uint8_t* data, size_t size, const int16_t* previous, int stride,
+              int16_t* plane, ThreadPool* pool = NULL);
+};
+
+#endif // DEPTH_CODEC_H_
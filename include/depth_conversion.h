@@ -0,0 +1,51 @@
+#ifndef DEPTH_CONVERSION_H_
+#define DEPTH_CONVERSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cloud_stream.h"
+
+// Converts DepthSense vertices (interleaved int16 x, y, z in mm) into the xyz
+// of an organized point cloud. Each output point is written as four floats
+// (x, y, z, 1) at points + i*point_stride, matching the layout of
+// pcl::PointXYZRGB::data. Vertices with z outside [min_z, max_z] come out as
+// NaN so the cloud stays organized without inventing points at the origin.
+// If colors is given, colors[i] goes into the 32 bits after w (the rgba of
+// pcl::PointXYZRGB) while the point is being written anyway; otherwise the
+// color is left alone.
+void ConvertVertices(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                     float* points, int point_stride, const uint32_t* colors = NULL);
+
+// The individual implementations, ConvertVertices picks the best one the CPU
+// supports the first time it is called.
+void ConvertVerticesScalar(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                           float* points, int point_stride, const uint32_t* colors);
+void ConvertVerticesSSE41(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                          float* points, int point_stride, const uint32_t* colors);
+void ConvertVerticesAVX2(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                         float* points, int point_stride, const uint32_t* colors);
+
+// Name of the implementation ConvertVertices dispatches to
+const char* ConvertVerticesKernelName();
+
+// Converts vertices like ConvertVertices, but straight into the StreamPoints
+// of a CloudStream, for a display that takes nothing else: x, y and z, NaN
+// out of range, then colors[i], given in the layout of
+// pcl::PointXYZRGB::rgba and written as the bytes R, G, B, A.
+void ConvertStreamPoints(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                         const uint32_t* colors, StreamPoint* points);
+
+// Its implementations, picked along with ConvertVertices'
+void ConvertStreamPointsScalar(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                               const uint32_t* colors, StreamPoint* points);
+void ConvertStreamPointsAVX2(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                             const uint32_t* colors, StreamPoint* points);
+
+// Gives count vertices the depths in z, scaling x and y with them so that
+// filtered points stay on the ray of their pixel. Vertices whose depth
+// doesn't change keep exactly the same x and y, and vertices with z <= 0 keep
+// theirs too. out may be vertices.
+void SetVertexDepths(const int16_t* vertices, const int16_t* z, int count, int16_t* out);
+
+#endif // DEPTH_CONVERSION_H_
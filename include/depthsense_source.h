@@ -0,0 +1,35 @@
+#ifndef DEPTHSENSE_SOURCE_H_
+#define DEPTHSENSE_SOURCE_H_
+
+#include <DepthSense.hxx>
+
+#include "frame_source.h"
+
+// Frames from one DS325 attached to the local DepthSense server. Each source
+// has its own context, so sources for different devices run independently.
+class DepthSenseSource : public FrameSource {
+  const int device_index;
+  DepthSense::Context context;
+  DepthSense::DepthNode dnode;
+  DepthSense::ColorNode cnode;
+  bool device_found;
+
+  void OnNewDepthSample(DepthSense::DepthNode node, DepthSense::DepthNode::NewSampleReceivedData data);
+  void OnNewColorSample(DepthSense::ColorNode node, DepthSense::ColorNode::NewSampleReceivedData data);
+  void ConfigureDepthNode();
+  void ConfigureColorNode();
+  void ConfigureNode(DepthSense::Node node);
+  void OnNodeConnected(DepthSense::Device device, DepthSense::Device::NodeAddedData data);
+  void OnNodeDisconnected(DepthSense::Device device, DepthSense::Device::NodeRemovedData data);
+  void OnDeviceConnected(DepthSense::Context context, DepthSense::Context::DeviceAddedData data);
+  void OnDeviceDisconnected(DepthSense::Context context, DepthSense::Context::DeviceRemovedData data);
+
+public:
+  // device_index picks the device in the order the server lists them
+  explicit DepthSenseSource(int device_index = 0);
+
+  bool Run();
+  void Stop();
+};
+
+#endif // DEPTHSENSE_SOURCE_H_
@@ -0,0 +1,67 @@
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+
+static const int DEPTH_WIDTH = 320;
+static const int DEPTH_HEIGHT = 240;
+static const int COLOR_WIDTH = 640;
+static const int COLOR_HEIGHT = 480;
+const int c_PIXEL_COUNT = DEPTH_WIDTH * DEPTH_HEIGHT; // 320x240
+const int c_COLOR_PIXEL_COUNT = COLOR_WIDTH * COLOR_HEIGHT; // 640x480
+const int c_MIN_Z = 100; // discard points closer than this
+const int c_MAX_Z = 2000; // discard points farther than this
+
+// What the DS325 reports for pixels it couldn't measure
+const int16_t c_SATURATED_Z = 32001;
+
+// Same layout as DepthSense::Vertex, in mm
+struct Vertex {
+  int16_t x, y, z;
+};
+
+// Same layout as DepthSense::UV, in [0, 1) of the color image
+struct UV {
+  float u, v;
+};
+
+// Pinhole parameters of the depth camera, in depth pixels
+struct Intrinsics {
+  float fx, fy, cx, cy;
+};
+
+// Nominal QVGA depth intrinsics of the DS325, for sources that don't have
+// calibrated ones.
+const Intrinsics c_DS325_DEPTH_INTRINSICS = {224.5f, 230.9f, 160.0f, 120.0f};
+
+// A rigid transform [R | t] as a row-major 3x4 matrix, t in mm. Camera
+// poses map camera coordinates (x right, y up, z forward) to world
+// coordinates.
+struct Pose {
+  float m[12];
+};
+
+// One depth sample, as handed out by a FrameSource. The arrays hold
+// c_PIXEL_COUNT entries and are only valid during the callback.
+struct DepthFrame {
+  // Capture time in microseconds
+  uint64_t timestamp;
+  const Vertex* vertices;
+  const UV* uv_map;
+  const int16_t* confidence;
+  Intrinsics intrinsics;
+  // Samples lost before this one
+  int32_t dropped;
+};
+
+// One color sample, as handed out by a FrameSource. bgr holds
+// 3*c_COLOR_PIXEL_COUNT bytes and is only valid during the callback.
+struct ColorFrame {
+  // Capture time in microseconds
+  uint64_t timestamp;
+  const uint8_t* bgr;
+  // Samples lost before this one
+  int32_t dropped;
+};
+
+#endif // FRAME_H_
@@ -0,0 +1,62 @@
+#ifndef FRAME_SOURCE_H_
+#define FRAME_SOURCE_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "frame.h"
+
+// Receives the frames a FrameSource produces. Both callbacks come from the
+// thread that called FrameSource::Run.
+class FrameSink {
+public:
+  virtual ~FrameSink() {}
+  virtual void OnDepthFrame(const DepthFrame& frame) = 0;
+  virtual void OnColorFrame(const ColorFrame& frame) = 0;
+};
+
+// Something that produces depth and color frames: the camera, a recording or
+// a synthetic scene.
+class FrameSource {
+protected:
+  FrameSink* sink;
+
+public:
+  FrameSource() : sink(NULL) {}
+  virtual ~FrameSource() {}
+
+  void SetSink(FrameSink* _sink) {
+    sink = _sink;
+  }
+
+  // Delivers frames to the sink until the source runs out or Stop is called.
+  // Returns false if the source couldn't be started.
+  virtual bool Run() = 0;
+
+  // Makes Run return. Safe to call from any thread.
+  virtual void Stop() = 0;
+};
+
+// Forwards frames to several sinks, in order.
+class FrameTee : public FrameSink {
+  std::vector<FrameSink*> sinks;
+
+public:
+  void AddSink(FrameSink* sink) {
+    sinks.push_back(sink);
+  }
+
+  void OnDepthFrame(const DepthFrame& frame) {
+    for (size_t i = 0; i < sinks.size(); i++) {
+      sinks[i]->OnDepthFrame(frame);
+    }
+  }
+
+  void OnColorFrame(const ColorFrame& frame) {
+    for (size_t i = 0; i < sinks.size(); i++) {
+      sinks[i]->OnColorFrame(frame);
+    }
+  }
+};
+
+#endif // FRAME_SOURCE_H_
@@ -0,0 +1,250 @@
+#ifndef FRAME_SYNCHRONIZER_H_
+#define FRAME_SYNCHRONIZER_H_
+
+#include <chrono>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+// How a depth frame gets its color.
+enum SyncPolicy {
+  // Use the color frame captured closest in time
+  SYNC_NEAREST,
+  // Blend the color frames captured just before and just after
+  SYNC_INTERPOLATE
+};
+
+// Pairs depth and color samples by capture timestamp.
+//
+// Both streams are kept in small preallocated rings. Samples are written
+// straight into the ring slots, so nothing is allocated or locked on the
+// capture path; a full ring simply gives up its oldest sample. A depth sample
+// is emitted once it can be decided: a color frame at or after its timestamp
+// has arrived, or it is being pushed out of the ring. Depth samples with no
+// color within the tolerance are dropped and counted.
+//
+// All calls are expected from the capture thread (the SDK dispatches both
+// nodes' events from Context::run).
+template <typename DepthT, typename ColorT>
+class FrameSynchronizer {
+public:
+  struct Pair {
+    const DepthT* depth;
+    uint64_t depth_timestamp;
+    const ColorT* color;
+    // Only set by SYNC_INTERPOLATE: the later color frame, and how far
+    // (0 to 1) the depth timestamp lies from color towards color_next.
+    const ColorT* color_next;
+    float weight;
+    // Color timestamp minus depth timestamp of the closest color frame, in
+    // timestamp units
+    int64_t skew;
+  };
+
+  struct Stats {
+    uint64_t matched;
+    uint64_t unmatched;
+    uint64_t interpolated;
+    // Depth samples pushed out of a full ring before they could be decided
+    uint64_t depth_evicted;
+    double mean_skew;
+    int64_t max_skew;
+    // Time between a depth sample being committed and its pair being
+    // emitted, in microseconds
+    double mean_latency;
+    int64_t max_latency;
+  };
+
+private:
+  struct Entry {
+    uint64_t timestamp;
+    // steady_clock time the sample was committed, for the latency stats
+    int64_t arrival;
+  };
+
+  const int64_t tolerance;
+  const SyncPolicy policy;
+
+  const int depth_capacity;
+  const int color_capacity;
+
+  std::vector<DepthT> depth_slots;
+  std::vector<Entry> depth_entries;
+  // Oldest pending depth sample and number of pending ones
+  int depth_head;
+  int depth_count;
+
+  std::vector<ColorT> color_slots;
+  std::vector<Entry> color_entries;
+  // Slot the next color sample goes into and number of valid ones
+  int color_head;
+  int color_count;
+
+  uint64_t matched;
+  uint64_t unmatched;
+  uint64_t depth_evicted;
+  uint64_t interpolated;
+  int64_t total_skew;
+  int64_t max_skew;
+  int64_t total_latency;
+  int64_t max_latency;
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // i = 0 is the newest color sample
+  int ColorIndex(int i) const {
+    return (color_head - 1 - i + 2*color_capacity) % color_capacity;
+  }
+
+  // Fills pair for the oldest pending depth sample. Returns false if no
+  // color is within tolerance.
+  bool Match(const Entry& depth, int depth_slot, Pair* pair) {
+    int64_t t = (int64_t)depth.timestamp;
+    int before = -1;
+    int after = -1;
+    for (int i = 0; i < color_count; i++) {
+      int index = ColorIndex(i);
+      int64_t color_t = (int64_t)color_entries[index].timestamp;
+      if (color_t >= t) {
+        after = index;
+      } else {
+        before = index;
+        break;
+      }
+    }
+
+    int64_t before_skew = before >= 0 ? t - (int64_t)color_entries[before].timestamp : -1;
+    int64_t after_skew = after >= 0 ? (int64_t)color_entries[after].timestamp - t : -1;
+
+    pair->depth = &depth_slots[depth_slot];
+    pair->depth_timestamp = depth.timestamp;
+    pair->color_next = NULL;
+    pair->weight = 0;
+
+    if (policy == SYNC_INTERPOLATE && before >= 0 && after >= 0 &&
+        before_skew <= tolerance && after_skew <= tolerance && before_skew + after_skew > 0) {
+      pair->color = &color_slots[before];
+      pair->color_next = &color_slots[after];
+      pair->weight = (float)before_skew / (float)(before_skew + after_skew);
+      pair->skew = before_skew < after_skew ? -before_skew : after_skew;
+      interpolated++;
+      return true;
+    }
+
+    int nearest = -1;
+    if (before >= 0 && (after < 0 || before_skew < after_skew)) {
+      nearest = before;
+      pair->skew = -before_skew;
+    } else if (after >= 0) {
+      nearest = after;
+      pair->skew = after_skew;
+    }
+    if (nearest < 0 || llabs(pair->skew) > tolerance) {
+      return false;
+    }
+    pair->color = &color_slots[nearest];
+    return true;
+  }
+
+public:
+  // tolerance is in the same units as the timestamps (microseconds for the
+  // DepthSense SDK).
+  FrameSynchronizer(int64_t tolerance, SyncPolicy policy, int depth_capacity = 4, int color_capacity = 4)
+      : tolerance(tolerance), policy(policy),
+        depth_capacity(depth_capacity), color_capacity(color_capacity),
+        depth_slots(depth_capacity), depth_entries(depth_capacity), depth_head(0), depth_count(0),
+        color_slots(color_capacity), color_entries(color_capacity), color_head(0), color_count(0),
+        matched(0), unmatched(0), depth_evicted(0), interpolated(0),
+        total_skew(0), max_skew(0), total_latency(0), max_latency(0) {}
+
+  // The slot the next depth sample should be written into. If the ring is
+  // full the oldest pending sample is given up for it.
+  DepthT& DepthSlot() {
+    if (depth_count == depth_capacity) {
+      depth_head = (depth_head + 1) % depth_capacity;
+      depth_count--;
+      depth_evicted++;
+    }
+    return depth_slots[(depth_head + depth_count) % depth_capacity];
+  }
+
+  void CommitDepth(uint64_t timestamp) {
+    Entry& entry = depth_entries[(depth_head + depth_count) % depth_capacity];
+    entry.timestamp = timestamp;
+    entry.arrival = Now();
+    depth_count++;
+  }
+
+  // The slot the next color sample should be written into. This overwrites
+  // the oldest color frame, so pairs returned by Pop must be used before the
+  // next call.
+  ColorT& ColorSlot() {
+    return color_slots[color_head];
+  }
+
+  void CommitColor(uint64_t timestamp) {
+    Entry& entry = color_entries[color_head];
+    entry.timestamp = timestamp;
+    entry.arrival = Now();
+    color_head = (color_head + 1) % color_capacity;
+    if (color_count < color_capacity) {
+      color_count++;
+    }
+  }
+
+  // Emits the next depth sample that could be paired. The pointers in pair
+  // stay valid until the next DepthSlot or ColorSlot call.
+  bool Pop(Pair* pair) {
+    while (depth_count > 0) {
+      Entry& depth = depth_entries[depth_head];
+      // Wait for a color frame at or after the depth timestamp, unless the
+      // depth ring is about to give this sample up anyway.
+      bool decidable = depth_count == depth_capacity ||
+          (color_count > 0 && color_entries[ColorIndex(0)].timestamp >= depth.timestamp);
+      if (!decidable) {
+        return false;
+      }
+
+      int slot = depth_head;
+      depth_head = (depth_head + 1) % depth_capacity;
+      depth_count--;
+
+      if (!Match(depth, slot, pair)) {
+        unmatched++;
+        continue;
+      }
+
+      int64_t skew = llabs(pair->skew);
+      int64_t latency = Now() - depth.arrival;
+      matched++;
+      total_skew += skew;
+      total_latency += latency;
+      if (skew > max_skew) {
+        max_skew = skew;
+      }
+      if (latency > max_latency) {
+        max_latency = latency;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  Stats GetStats() const {
+    Stats stats;
+    stats.matched = matched;
+    stats.unmatched = unmatched;
+    stats.interpolated = interpolated;
+    stats.depth_evicted = depth_evicted;
+    stats.mean_skew = matched > 0 ? (double)total_skew / matched : 0;
+    stats.max_skew = max_skew;
+    stats.mean_latency = matched > 0 ? (double)total_latency / matched : 0;
+    stats.max_latency = max_latency;
+    return stats;
+  }
+};
+
+#endif // FRAME_SYNCHRONIZER_H_
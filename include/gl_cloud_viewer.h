@@ -0,0 +1,104 @@
+#ifndef GL_CLOUD_VIEWER_H_
+#define GL_CLOUD_VIEWER_H_
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "cloud_stream.h"
+#include "point_budget.h"
+
+class GLCanvas;
+class PipelineStage;
+class PointRenderer;
+
+// Shows clouds in a GLUT window, drawn by the point renderer of gpu_test.
+//
+// The viewer is a CloudStream over the renderer's ring of regions in one GL
+// buffer, which is persistently mapped where the driver supports it. The
+// capture side writes every cloud straight into GPU visible memory, and the
+// window draws the newest one, instead of the deep copy and the trip
+// through VTK of PCL's viewer.
+//
+// Open, Show and the destructor belong on the thread that runs the window,
+// the main thread for GLUT. BeginWrite and EndWrite can be called from any
+// one other thread, and Close from any thread.
+class GlCloudViewer : public CloudStream {
+  const std::string title;
+  const int max_points;
+  int window;
+  int window_width;
+  int window_height;
+
+  GLCanvas* canvas;
+  PointRenderer* renderer;
+  PipelineStage* show_stage;
+  // Whether the window has to be drawn again without a new cloud, as after
+  // it was uncovered or resized
+  bool redraw;
+
+  PointBudget* point_budget;
+  // GL_TIME_ELAPSED queries of the frames that drew a new cloud, used as a
+  // ring. Results are read back frames later, when the GPU has them, so
+  // timing never stalls the window.
+  std::vector<unsigned int> timer_queries;
+  uint64_t queries_issued;
+  uint64_t queries_read;
+  // The first cloud isn't timed, as its draw also has the driver finishing
+  // the shaders
+  bool drew_cloud;
+
+  std::function<void()> on_idle;
+  std::atomic<bool> closing;
+
+  // Held from BeginWrite to EndWrite, so the GL objects aren't released
+  // while a cloud is being written into their mapped memory
+  std::mutex writing;
+
+  // GLUT callbacks take no user data, and there is only ever one window
+  static GlCloudViewer* s_viewer;
+  static void OnDisplay();
+  static void OnReshape(int width, int height);
+  static void OnClose();
+
+  void Draw();
+  // Reports the draw times the GPU has finished measuring to the budget
+  void ReadDrawTimes();
+  // Deletes the GL objects while the window's context is still current
+  void Release();
+
+public:
+  // A window titled title for clouds of up to max_points points
+  GlCloudViewer(const std::string& title, int max_points);
+  ~GlCloudViewer();
+
+  // Opens the window and sets up the renderer. Returns false when there is
+  // no OpenGL 3.3.
+  bool Open();
+
+  // Report the time the GPU takes to draw each new cloud to budget, a few
+  // frames after it was drawn
+  void SetPointBudget(PointBudget* budget);
+
+  // Call idle on the window thread between frames, as to write clouds from
+  // there
+  void SetIdleCallback(const std::function<void()>& idle);
+
+  // Draws clouds as they arrive until the window is closed or Close is
+  // called
+  void Show();
+
+  // Makes Show return
+  void Close();
+
+  // CloudStream, for the capture side. Once the window is closed every
+  // cloud is dropped.
+  StreamPoint* BeginWrite();
+  void EndWrite(StreamPoint* points, int count);
+  int GetMaxPoints();
+};
+
+#endif // GL_CLOUD_VIEWER_H_
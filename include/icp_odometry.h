@@ -0,0 +1,134 @@
+#ifndef ICP_ODOMETRY_H_
+#define ICP_ODOMETRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame.h"
+#include "normal_estimator.h"
+
+class ThreadPool;
+
+// One pyramid level of a frame for the ICP kernels. Points and normals are
+// xyz at points + i*point_stride and normals + i*normal_stride floats, NaN
+// where missing. Reference levels need normals, current levels don't.
+struct IcpLevel {
+  int width;
+  int height;
+  Intrinsics intrinsics;
+  const float* points;
+  int point_stride;
+  const float* normals;
+  int normal_stride;
+};
+
+// Values the kernels accumulate: the upper triangle of J^T J row by row, J^T r,
+// r^2 and the number of correspondences.
+const int c_ICP_SUMS = 21 + 6 + 1 + 1;
+
+// Tracks the camera from frame to frame with point-to-plane ICP, for moving
+// the DS325 by hand.
+//
+// Points of the new frame are matched with the points of the previous frame
+// they project onto (projective association), which needs no search. Each
+// iteration linearizes the point-to-plane distances around the current
+// estimate and solves the 6x6 normal equations for a small motion. That runs
+// coarse to fine over an image pyramid, each level half the size of the one
+// below, so large motions are caught at the cheap levels and refined at the
+// full resolution.
+//
+// The normal equations are summed in row bands on a ThreadPool, with AVX2
+// kernels doing 8 pixels at a time.
+class IcpOdometry {
+public:
+  struct Stats {
+    // Of the last frame: ICP iterations over all levels, correspondences
+    // and RMS point-to-plane distance in mm at the finest level
+    int iterations;
+    int correspondences;
+    float rms_error;
+  };
+
+private:
+  struct Level {
+    int width;
+    int height;
+    Intrinsics intrinsics;
+    std::vector<float> points;
+    std::vector<float> normals;
+    NormalEstimator normal_estimator;
+
+    Level(int width, int height, const Intrinsics& intrinsics);
+  };
+
+  const int level_count;
+  // Pyramids of the previous frame and the new one, swapped after tracking
+  std::vector<Level> reference;
+  std::vector<Level> current;
+  bool has_reference;
+
+  Pose pose;
+  // Motion of the last frame, the first guess for the next one
+  Pose velocity;
+  Stats stats;
+
+  std::vector<double> band_sums;
+  // The iteration being summed, kept here so the band tasks only capture
+  // this
+  IcpLevel reduce_current;
+  IcpLevel reduce_reference;
+  const float* reduce_transform;
+  float reduce_distance;
+  int reduce_rows;
+
+  void BuildPyramid(const float* points, int point_stride, std::vector<Level>* levels);
+  void EstimateNormals(std::vector<Level>* levels, ThreadPool* pool);
+  bool Align(Pose* motion, ThreadPool* pool);
+  void ReduceBand(int band);
+
+public:
+  // intrinsics are the depth camera's at full resolution
+  IcpOdometry(const Intrinsics& intrinsics, int width = DEPTH_WIDTH, int height = DEPTH_HEIGHT,
+              int level_count = 3);
+
+  // Starts over, with the next frame at the identity pose
+  void Reset();
+
+  // Tracks one organized cloud, points as xyz at points + i*point_stride
+  // floats and NaN where missing, like ConvertVertices writes them. Returns
+  // false when the frame couldn't be aligned with the one before, in which
+  // case the pose holds and tracking continues from this frame. Bands run on
+  // pool when given.
+  bool Track(const float* points, int point_stride, ThreadPool* pool = NULL);
+
+  // Pose of the last tracked frame in the coordinates of the first
+  const Pose& GetPose() const {
+    return pose;
+  }
+
+  Stats GetStats() const {
+    return stats;
+  }
+};
+
+// The kernels, summing the normal equations for rows [row_begin, row_end) of
+// current into sums (c_ICP_SUMS values, added to). transform is a row-major
+// 3x4 matrix taking current points into the reference camera. Pairs further
+// apart than max_distance are left out. Track picks the best implementation
+// the CPU supports the first time it is called.
+void IcpReduceScalar(const IcpLevel& current, const IcpLevel& reference, const float* transform,
+                     float max_distance, int row_begin, int row_end, double* sums);
+void IcpReduceAVX2(const IcpLevel& current, const IcpLevel& reference, const float* transform,
+                   float max_distance, int row_begin, int row_end, double* sums);
+
+// Name of the implementation Track dispatches to
+const char* IcpKernelName();
+
+// Pose helpers: a*b, the inverse of a rigid transform, and its rotation as a
+// unit quaternion x, y, z, w
+Pose ComposePoses(const Pose& a, const Pose& b);
+Pose InvertPose(const Pose& pose);
+void PoseQuaternion(const Pose& pose, float* quaternion);
+
+#endif // ICP_ODOMETRY_H_
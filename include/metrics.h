@@ -0,0 +1,155 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+// Per-stage timing and drop counting for the capture pipeline.
+//
+// Every thread that records gets its own set of histograms, which only that
+// thread writes, so recording is a clock read and a few relaxed stores with
+// no locking or shared cache lines. A MetricsExporter thread sums the sets
+// every interval and writes what changed since the last export.
+//
+// Histograms have 8 buckets per power of two of nanoseconds, which puts the
+// percentiles within about 6% of the real value.
+//
+// Built without DS325_ENABLE_METRICS, the macros below expand to nothing and
+// MetricsExporter only reports that metrics are off.
+
+enum MetricStage {
+  // Copying a sample out of the source's callback
+  STAGE_DEPTH_INPUT,
+  STAGE_COLOR_INPUT,
+  // Drops only: depth frames that found no color frame to pair with
+  STAGE_PAIRING,
+  STAGE_TEMPORAL_FILTER,
+  STAGE_SPATIAL_FILTER,
+  STAGE_CONVERSION,
+  STAGE_REGISTRATION,
+  STAGE_ODOMETRY,
+  STAGE_FUSION,
+  STAGE_MESHING,
+  STAGE_NORMALS,
+  STAGE_DOWNSAMPLING,
+  // Triangulating the published organized cloud
+  STAGE_SURFACE_MESH,
+  STAGE_PLANES,
+  // A whole pair, from popping it to publishing its cloud. Drops are clouds
+  // overwritten before the display took them.
+  STAGE_PROCESSING,
+  // Handing a cloud to the viewer
+  STAGE_DISPLAY,
+  // From the depth callback to the display taking the cloud
+  STAGE_END_TO_END,
+  c_STAGE_COUNT
+};
+
+// Values that are set rather than timed; exports show the latest
+enum MetricGauge {
+  // Points of a full cloud at the detail PointBudget picked
+  GAUGE_POINT_BUDGET,
+  c_GAUGE_COUNT
+};
+
+const char* MetricStageName(MetricStage stage);
+const char* MetricGaugeName(MetricGauge gauge);
+
+#ifdef DS325_ENABLE_METRICS
+
+namespace metrics {
+
+// CLOCK_MONOTONIC in nanoseconds
+inline uint64_t Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+void Record(MetricStage stage, uint64_t nanoseconds);
+void AddDrops(MetricStage stage, uint64_t count);
+void SetGauge(MetricGauge gauge, int64_t value);
+
+// Records the time from construction to destruction
+class ScopedTimer {
+  const MetricStage stage;
+  const uint64_t start;
+
+public:
+  explicit ScopedTimer(MetricStage stage) : stage(stage), start(Now()) {}
+
+  ~ScopedTimer() {
+    Record(stage, Now() - start);
+  }
+};
+
+}
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+// Times the rest of the enclosing scope as stage
+#define METRICS_SCOPE(stage) metrics::ScopedTimer METRICS_CONCAT(metrics_timer_, __LINE__)(stage)
+#define METRICS_RECORD(stage, nanoseconds) metrics::Record(stage, nanoseconds)
+#define METRICS_DROPS(stage, count) metrics::AddDrops(stage, count)
+#define METRICS_GAUGE(gauge, value) metrics::SetGauge(gauge, value)
+
+#else
+
+namespace metrics {
+
+inline uint64_t Now() {
+  return 0;
+}
+
+}
+
+#define METRICS_SCOPE(stage) do {} while (0)
+#define METRICS_RECORD(stage, nanoseconds) do {} while (0)
+#define METRICS_DROPS(stage, count) do {} while (0)
+#define METRICS_GAUGE(gauge, value) do {} while (0)
+
+#endif
+
+// Writes the metrics of every stage as one JSON object per line, every
+// interval, covering the time since the line before:
+//
+//   {"time": 2.000, "interval": 1.000, "stages": {"conversion": {"count": 60,
+//    "p50_us": 812.5, "p99_us": 1015.6, "max_us": 1043.2, "drops": 0}, ...},
+//    "gauges": {"point_budget": 19200}}
+//
+// Stages with nothing recorded in the interval, and gauges that were never
+// set, are left out.
+class MetricsExporter {
+  FILE* file;
+  int interval_ms;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping;
+  uint64_t start_time;
+  uint64_t last_time;
+  // Bucket and drop counts of every stage at the last export
+  std::vector<uint64_t> last_buckets;
+  std::vector<uint64_t> last_drops;
+
+  void ExportLoop();
+  void Export();
+
+public:
+  MetricsExporter();
+  ~MetricsExporter();
+
+  // Starts exporting to path, or to stdout for "-". Returns false when the
+  // file can't be opened or metrics are compiled out.
+  bool Start(const std::string& path, int interval_ms = 1000);
+  // Writes a last line and stops
+  void Stop();
+};
+
+#endif // METRICS_H_
@@ -0,0 +1,96 @@
+#ifndef MULTI_CAMERA_H_
+#define MULTI_CAMERA_H_
+
+#include <string>
+#include <vector>
+
+#include "capture_pipeline.h"
+#include "frame_source.h"
+#include "thread_pool.h"
+
+// Captures from several cameras at once and merges their clouds into one.
+//
+// Every camera has a source, a CapturePipeline and a thread of its own, so
+// the cameras don't wait on each other and the capture work spreads over the
+// cores. Each pipeline publishes into its own triple buffer. Merge, on the
+// display side, takes the newest cloud of every camera, moves it into the
+// rig's coordinates with the camera's extrinsics and appends it to the
+// merged cloud, in parallel over the cameras and chunks of their points.
+//
+// Any FrameSource can stand in for a camera, so a rig can be replayed from a
+// recording per camera.
+class MultiCameraCapture {
+public:
+  typedef CapturePipeline::Cloud Cloud;
+
+private:
+  struct Camera {
+    FrameSource* source;
+    CapturePipeline* pipeline;
+    Pose extrinsics;
+    // Whether the pipeline has published a cloud yet
+    bool has_cloud;
+  };
+
+  // Points of one camera's cloud for a merge task, and where the first of
+  // them goes in the merged cloud
+  struct MergeTask {
+    const Cloud* cloud;
+    const Pose* extrinsics;
+    int begin;
+    int end;
+    int offset;
+  };
+
+  const int threads_per_camera;
+  std::vector<Camera> cameras;
+  ThreadPool merge_pool;
+  // The merge in progress, kept here so the tasks only capture this.
+  // merge_tasks has room for the largest clouds of every camera.
+  std::vector<MergeTask> merge_tasks;
+  Cloud* merging;
+
+  void MergeChunk(int task);
+
+public:
+  // Every camera's pipeline splits its frames over threads_per_camera
+  // threads, its capture thread included.
+  explicit MultiCameraCapture(int threads_per_camera = 1);
+  ~MultiCameraCapture();
+
+  // Adds a camera that takes its frames from source, which is deleted with
+  // the capture. extrinsics move its points into the rig's coordinates.
+  // Call before Run.
+  void AddCamera(FrameSource* source, const Pose& extrinsics);
+
+  int CameraCount() const {
+    return cameras.size();
+  }
+
+  // For configuring a camera's processing before Run
+  CapturePipeline& GetPipeline(int camera) {
+    return *cameras[camera].pipeline;
+  }
+
+  // Runs every camera on its own thread until all of their sources end.
+  // Returns false if any of them couldn't be started.
+  bool Run();
+  // Ends every camera. Safe to call from any thread.
+  void Stop();
+
+  // Display side: merges the newest cloud of every camera into merged.
+  // Organized clouds stay organized, stacked top to bottom in camera order.
+  // Returns false, leaving merged as it was, when no camera has published
+  // since the last call.
+  bool Merge(Cloud* merged);
+
+  void PrintStats();
+};
+
+// Reads one pose per camera, a line each as "tx ty tz qx qy qz qw" in meters,
+// the same format EnableOdometry writes without the timestamp. Lines
+// starting with # are skipped. Returns false if the file can't be read, has
+// a zero quaternion or has fewer than camera_count poses.
+bool LoadExtrinsics(const std::string& path, int camera_count, std::vector<Pose>* extrinsics);
+
+#endif // MULTI_CAMERA_H_
@@ -0,0 +1,68 @@
+#ifndef NORMAL_ESTIMATOR_H_
+#define NORMAL_ESTIMATOR_H_
+
+#include <stddef.h>
+#include <vector>
+
+class ThreadPool;
+
+enum NormalMethod {
+  // Cross product of the central differences to the 4 direct neighbors.
+  // Cheapest and sharpest at edges, but as noisy as the depth.
+  NORMALS_CROSS_PRODUCT,
+  // Cross product of the horizontal and vertical differences averaged over
+  // a window, with the averages read from integral images so the window
+  // size doesn't change the cost.
+  NORMALS_INTEGRAL
+};
+
+// Per-point normals for an organized cloud, using the pixel grid for
+// neighbors instead of a search.
+//
+// Points are read as xyz at points + i*point_stride floats, NaN where a
+// pixel has no point, which is what ConvertVertices writes. Differences
+// across a depth jump of more than max_depth_change times the depth are
+// taken as an edge and left out. Normals are written as xyz at
+// normals + i*normal_stride, unit length and facing the camera, or NaN where
+// there is no point or not enough valid neighbors around it; the rest of
+// each output is left alone, so normals can go straight into the data_n of
+// a pcl::Normal.
+//
+// Rows are split into bands that run on a ThreadPool.
+class NormalEstimator {
+  const int width;
+  const int height;
+  const NormalMethod method;
+  const int radius;
+  const float max_depth_change;
+
+  // NORMALS_INTEGRAL: integral images of the horizontal and vertical
+  // differences and of how many there are, c_CHANNELS values per entry,
+  // (width + 1) x (height + 1) entries with a row and column of zeros first
+  std::vector<double> integral;
+
+  // The cloud Compute is working on, kept here so the tasks only capture
+  // this
+  const float* points;
+  int point_stride;
+  float* normals;
+  int normal_stride;
+
+  int BandCount() const;
+  void CrossProductBand(int band) const;
+  void IntegrateRows(int band);
+  void IntegrateColumns(int stripe);
+  void IntegralBand(int band) const;
+
+public:
+  // radius is the half size of the NORMALS_INTEGRAL window in pixels.
+  NormalEstimator(int width, int height, NormalMethod method = NORMALS_INTEGRAL, int radius = 3,
+                  float max_depth_change = 0.02f);
+
+  // Estimates normals for the width x height points. Bands run on pool when
+  // given.
+  void Compute(const float* points, int point_stride, float* normals, int normal_stride,
+               ThreadPool* pool = NULL);
+};
+
+#endif // NORMAL_ESTIMATOR_H_
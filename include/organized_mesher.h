@@ -0,0 +1,98 @@
+#ifndef ORGANIZED_MESHER_H_
+#define ORGANIZED_MESHER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+// Triangulates an organized cloud straight from its pixel grid.
+//
+// Every 2x2 block of pixels is a quad that is split into two triangles along
+// the diagonal from its top right to its bottom left pixel. A triangle is
+// kept when its three points are valid and no edge jumps in depth by more
+// than max_depth_jump times the nearer end, which is what separates an edge
+// in the scene from a surface seen at a glancing angle.
+//
+// The triangles go into an index buffer with fixed slots, six indices per
+// quad, and rejected triangles are left degenerate as three zero indices,
+// which renderers draw as nothing. A frame only rewrites the slots of quads
+// that changed, so the buffer can be updated in place, or uploaded in part.
+// CompactIndices writes out just the kept triangles instead.
+//
+// All memory is allocated up front for the largest grid, so meshing a frame
+// doesn't touch the heap.
+class OrganizedMesher {
+public:
+  struct Stats {
+    // Of the last Compute: triangles kept, and quads whose triangles changed
+    int triangles;
+    int changed_quads;
+  };
+
+private:
+  const int max_width;
+  const int max_height;
+  const float max_depth_jump;
+  // Of the last Compute
+  int width;
+  int height;
+
+  // Depth of every pixel, 0 where missing
+  std::vector<float> depth;
+  // Per quad: bit 0 for its first triangle kept, bit 1 for its second
+  std::vector<uint8_t> masks;
+  std::vector<uint32_t> indices;
+  // Per band of quad rows: masks being computed, and counts
+  std::vector<uint8_t> band_masks;
+  std::vector<int> band_triangles;
+  std::vector<int> band_changed;
+
+  // The arguments of the Compute in progress
+  const float* points;
+  int point_stride;
+  bool rewrite_all;
+  Stats stats;
+
+  int BandCount() const;
+  void LoadDepth(int band);
+  void MeshBand(int band);
+
+public:
+  // Grids of up to max_width x max_height points can be meshed
+  OrganizedMesher(int max_width, int max_height, float max_depth_jump = 0.05f);
+
+  // Meshes an organized cloud of width x height points, xyz at
+  // points + i*point_stride floats and NaN where missing. Bands of rows
+  // mesh on pool when given. Returns the number of triangles.
+  int Compute(const float* points, int point_stride, int width, int height, ThreadPool* pool = NULL);
+
+  // The index buffer: IndexCount() indices, six per quad of the last grid,
+  // triangles indexing the points of the cloud.
+  const uint32_t* Indices() const {
+    return &indices[0];
+  }
+  int IndexCount() const {
+    return 6*(width - 1)*(height - 1);
+  }
+
+  // Writes only the kept triangles, three indices each, to out, which must
+  // have room for 3*GetStats().triangles. Returns the number of indices.
+  int CompactIndices(uint32_t* out) const;
+
+  Stats GetStats() const {
+    return stats;
+  }
+};
+
+// The kernel, classifying one row of quads between two rows of depths into
+// masks. Each row has quads + 1 depths. Compute picks the best
+// implementation the CPU supports the first time it is called.
+void MeshRowScalar(const float* z0, const float* z1, int quads, float max_depth_jump, uint8_t* masks);
+void MeshRowAVX2(const float* z0, const float* z1, int quads, float max_depth_jump, uint8_t* masks);
+
+// Name of the implementation Compute dispatches to
+const char* OrganizedMesherKernelName();
+
+#endif // ORGANIZED_MESHER_H_
@@ -0,0 +1,113 @@
+#ifndef PLANE_SEGMENTER_H_
+#define PLANE_SEGMENTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class ThreadPool;
+
+// A plane found in a cloud: the points p with normal . p + offset = 0, in mm
+struct Plane {
+  // Unit length, facing the camera
+  float normal[3];
+  float offset;
+  float centroid[3];
+  // Points labeled with the plane, and their RMS distance to it in mm
+  int points;
+  float rms_error;
+  // Stays the same for as long as the plane is found again in every frame
+  int id;
+};
+
+// Finds the large planes of an organized cloud, like tables, walls and
+// floors, by region growing on the pixel grid.
+//
+// The grid is divided into square cells and a plane is fitted to the points
+// of each cell. Cells that are flat enough seed regions in order of their
+// fit, and regions grow into neighboring cells whose planes agree with the
+// region's, refitting as they go. Regions smaller than min_points are
+// dropped. Every point is then labeled with the nearest plane of its own and
+// the neighboring cells, if close enough, and the planes are refitted to
+// their points.
+//
+// Planes carry over between frames: the planes of the last frame are grown
+// first, from the cells that still agree with them, so they keep their ids
+// and order while they stay in view.
+//
+// Points are read as xyz at points + i*point_stride floats, NaN where
+// missing. Cells are fitted and points labeled in bands of rows on a
+// ThreadPool.
+class PlaneSegmenter {
+public:
+  static const int c_MAX_PLANES = 32;
+  // Label of points on no plane
+  static const uint8_t c_NO_PLANE = 0xff;
+
+  // Sums of the points of a cell or region, enough to fit a plane
+  struct Moments {
+    double n;
+    double s[3];
+    // xx xy xz yy yz zz
+    double ss[6];
+  };
+
+private:
+  struct CellFit {
+    float normal[3];
+    float offset;
+    float centroid[3];
+    // Mean squared distance to the plane, in mm^2
+    float mse;
+    bool flat;
+  };
+
+  const int width;
+  const int height;
+  const int cells_x;
+  const int cells_y;
+  const float min_cos;
+  const int min_points;
+
+  std::vector<Moments> cell_moments;
+  std::vector<CellFit> cells;
+  // Per cell: the region it belongs to, or one of the values in the .cpp
+  std::vector<int> cell_regions;
+  // Flat cells in the order they seed regions, and the cells of the region
+  // being grown
+  std::vector<int> seeds;
+  std::vector<int> queue;
+  // Per band of cell rows, the moments of the points labeled with each plane
+  std::vector<Moments> band_moments;
+
+  std::vector<Plane> planes;
+  std::vector<Plane> previous;
+  int next_id;
+
+  // The arguments of the Compute in progress
+  const float* points;
+  int point_stride;
+  uint8_t* labels;
+
+  void FitCells(int cell_row);
+  bool Grow(int seed, int id);
+  void LabelBand(int cell_row);
+
+public:
+  // Planes in width x height clouds, of at least min_points points. Cells
+  // only join a region when their normal is within max_angle degrees of it.
+  PlaneSegmenter(int width, int height, int min_points = 2000, float max_angle = 10.0f);
+
+  // Finds the planes of a cloud and writes the index of the plane each
+  // point is on to labels, c_NO_PLANE for none. labels may be NULL. Bands
+  // run on pool when given. Returns the number of planes.
+  int Compute(const float* points, int point_stride, uint8_t* labels, ThreadPool* pool = NULL);
+
+  // The planes of the last Compute: those carried over from the frame before
+  // first, in the same order, then new ones from the flattest seed on
+  const std::vector<Plane>& Planes() const {
+    return planes;
+  }
+};
+
+#endif // PLANE_SEGMENTER_H_
@@ -0,0 +1,56 @@
+#ifndef POINT_BUDGET_H_
+#define POINT_BUDGET_H_
+
+#include <atomic>
+
+// Picks how coarse the published clouds are, so the display keeps up with a
+// target frame time.
+//
+// The display reports how long each of its frames took, rendering and
+// submitting the cloud. Assuming that time grows with the number of points,
+// the budget is the number of points that fits the target with some
+// headroom, and the level of detail is the finest one within the budget.
+// Reports are smoothed. After every change the budget ignores a few frames,
+// until clouds of the new detail arrive, and then measures afresh.
+//
+// Part of the frame time doesn't depend on the points, so the budget tends to
+// stay coarser than it needs to. When frames have been well under the target
+// for a while it tries the next finer detail, and waits longer before the
+// next try every time one turns out too slow.
+//
+// Detail is a stride: the pipeline keeps every stride-th pixel of every
+// stride-th row of the organized cloud, or with voxel downsampling on uses
+// stride times the leaf size.
+class PointBudget {
+  const double target_ms;
+  // Owned by the display thread
+  double smoothed_ms;
+  int settle_frames;
+  // Frames in a row well under the target, and how many it takes to try a
+  // finer detail
+  int calm_frames;
+  int probe_wait;
+  // Whether the last change was such a try
+  bool probing;
+  // Written by the display thread, read by the pipeline
+  std::atomic<int> stride;
+
+public:
+  static const int c_MAX_STRIDE = 8;
+
+  explicit PointBudget(double target_ms);
+
+  // Display side: how long the last frame took, in ms
+  void Update(double frame_ms);
+
+  // Pipeline side: the stride for the next cloud, from 1 for every point up
+  // to c_MAX_STRIDE
+  int Stride() const {
+    return stride.load(std::memory_order_relaxed);
+  }
+
+  // Points of a full cloud decimated with stride
+  static int Points(int stride);
+};
+
+#endif // POINT_BUDGET_H_
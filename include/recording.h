@@ -0,0 +1,243 @@
+#ifndef RECORDING_H_
+#define RECORDING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "depth_codec.h"
+#include "frame_source.h"
+#include "spsc_queue.h"
+#include "thread_pool.h"
+
+// Recording container for raw DS325 streams.
+//
+// The file is a header followed by append-only chunks, one per frame, each a
+// ChunkHeader and a payload padded to 16 bytes so the arrays in it can be used
+// in place. Closing the file appends an index of every chunk and a footer
+// pointing at it. A file that was never closed (the process died) is still
+// readable; its index is rebuilt by walking the chunks.
+//
+//   FileHeader
+//   ChunkHeader, payload          one per frame, in arrival order
+//   ...
+//   ChunkHeader, IndexEntry[]     stream STREAM_INDEX
+//   Footer
+//
+// A depth payload is a DepthChunk followed by the vertices, UV map and
+// confidence arrays; a color payload is the BGR image. A depth chunk flagged
+// CHUNK_COMPRESSED has a CompressedDepth after the DepthChunk, then the UV map
+// as is and the vertex x, y, z and confidence planes coded with DepthCodec.
+// Compressed chunks not flagged CHUNK_KEYFRAME are predicted from the depth
+// chunk before them.
+namespace recording {
+
+enum Stream {
+  STREAM_DEPTH = 0,
+  STREAM_COLOR = 1,
+  STREAM_COUNT = 2,
+  STREAM_INDEX = 0xffff
+};
+
+enum ChunkFlags {
+  CHUNK_COMPRESSED = 1,
+  CHUNK_KEYFRAME = 2
+};
+
+const uint32_t c_VERSION = 1;
+const int c_ALIGNMENT = 16;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+};
+
+struct ChunkHeader {
+  uint32_t magic;
+  uint16_t stream;
+  uint16_t flags;
+  // Frame number within the stream
+  uint32_t frame;
+  uint32_t payload_size;
+  uint64_t timestamp;
+  uint64_t reserved;
+};
+
+struct DepthChunk {
+  Intrinsics intrinsics;
+  int32_t dropped;
+  uint32_t reserved[3];
+};
+
+// The depth planes in the order they're stored
+enum Plane {
+  PLANE_X,
+  PLANE_Y,
+  PLANE_Z,
+  PLANE_CONFIDENCE,
+  PLANE_COUNT
+};
+
+struct CompressedDepth {
+  uint32_t plane_size[PLANE_COUNT];
+};
+
+struct IndexEntry {
+  // File offset of the ChunkHeader
+  uint64_t offset;
+  uint64_t timestamp;
+  uint32_t payload_size;
+  uint16_t stream;
+  uint16_t flags;
+  uint32_t frame;
+  uint32_t reserved;
+};
+
+struct Footer {
+  uint64_t index_offset;
+  uint32_t index_count;
+  char magic[4];
+};
+
+}
+
+// Records frames without holding up the thread that delivers them. The
+// callbacks only copy the frame into a free preallocated buffer and queue it;
+// a writer thread does the file IO. When the writer falls behind and no
+// buffer is free the frame is dropped and counted rather than waited for.
+// Depth is compressed on the writer thread and one more pool thread, with a
+// key frame every second so recordings can be sought.
+class RecordingWriter : public FrameSink {
+  struct Buffer {
+    uint16_t stream;
+    uint64_t timestamp;
+    uint32_t payload_size;
+    std::vector<uint8_t> payload;
+  };
+
+  std::vector<Buffer> buffers;
+  // Callback thread -> writer thread
+  SpscQueue<Buffer*> filled;
+  // Writer thread -> callback thread
+  SpscQueue<Buffer*> free_buffers;
+
+  std::thread writer;
+  std::atomic<bool> running;
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+
+  FILE* file;
+  uint64_t file_offset;
+  // Owned by the writer thread until it exits
+  std::vector<recording::IndexEntry> index;
+  uint32_t stream_frames[recording::STREAM_COUNT];
+
+  // Depth compression, all owned by the writer thread
+  const bool compress_depth;
+  DepthCodec codec;
+  ThreadPool pool;
+  std::vector<uint8_t> compressed;
+  // Planes of the last depth frame written, to predict the next one from
+  std::vector<Vertex> previous_vertices;
+  std::vector<int16_t> previous_confidence;
+  // Set by the first write that fails, after which nothing more is written
+  bool write_error;
+
+  std::atomic<uint64_t> written;
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> failed;
+  std::atomic<uint64_t> bytes;
+
+  Buffer* TakeBuffer();
+  void Queue(Buffer* buffer);
+  void WriterLoop();
+  bool WriteDepth(uint32_t frame, uint64_t timestamp, const uint8_t* payload);
+  bool WriteChunk(uint16_t stream, uint16_t flags, uint32_t frame, uint64_t timestamp,
+                  const void* payload, uint32_t size);
+
+public:
+  struct Stats {
+    uint64_t written;
+    uint64_t dropped;
+    // Frames lost to a failed write, which leaves the file without an index
+    uint64_t failed;
+    uint64_t bytes;
+  };
+
+  // buffer_count is how many frames may be waiting for the disk at once
+  explicit RecordingWriter(int buffer_count = 16, bool compress_depth = true);
+  ~RecordingWriter();
+
+  bool Open(const std::string& path);
+  // Flushes the queued frames and writes the index. Returns false if a write
+  // failed, in which case the file has no index.
+  bool Close();
+
+  void OnDepthFrame(const DepthFrame& frame);
+  void OnColorFrame(const ColorFrame& frame);
+
+  Stats GetStats() const;
+};
+
+// Maps a recording into memory and hands out frames that point straight into
+// the mapping, or for compressed depth into a decode buffer. Frames can be
+// looked up by number or by timestamp in constant time; reading compressed
+// depth in order decodes each frame once, seeking decodes from the key frame
+// before it.
+class RecordingReader {
+  int fd;
+  const uint8_t* data;
+  size_t size;
+
+  // Every chunk in file order
+  std::vector<recording::IndexEntry> entries;
+  // Per stream, positions in entries
+  std::vector<uint32_t> stream_entries[recording::STREAM_COUNT];
+
+  // Per stream, for each bucket of bucket_width microseconds after the first
+  // frame, the first frame at or after the start of the bucket.
+  std::vector<uint32_t> buckets[recording::STREAM_COUNT];
+  uint64_t bucket_width[recording::STREAM_COUNT];
+
+  // Compressed depth is decoded into these, in place over the previous frame
+  DepthCodec codec;
+  ThreadPool pool;
+  std::vector<Vertex> vertices;
+  std::vector<int16_t> confidence;
+  int decoded_frame;
+
+  bool DecodeDepth(int frame_number);
+  bool ReadIndex();
+  bool RebuildIndex();
+  void BuildBuckets(int stream);
+
+public:
+  RecordingReader();
+  ~RecordingReader();
+
+  bool Open(const std::string& path);
+  void Close();
+
+  int FrameCount(int stream) const;
+
+  // All chunks in the order they were recorded
+  int EntryCount() const;
+  const recording::IndexEntry& Entry(int i) const;
+
+  // Fill in frame with pointers into the mapping, valid until Close. Depth
+  // from a compressed chunk is only valid until the next GetDepth.
+  bool GetDepth(int frame_number, DepthFrame* frame);
+  bool GetColor(int frame_number, ColorFrame* frame) const;
+
+  // The last frame of stream captured at or before timestamp, or the first
+  // frame if they all come after it. -1 if the stream is empty.
+  int FindFrame(int stream, uint64_t timestamp) const;
+};
+
+#endif // RECORDING_H_
@@ -0,0 +1,28 @@
+#ifndef REPLAY_SOURCE_H_
+#define REPLAY_SOURCE_H_
+
+#include <atomic>
+#include <string>
+
+#include "frame_source.h"
+#include "recording.h"
+
+// Plays back a recording made with RecordingWriter.
+class ReplaySource : public FrameSource {
+  const std::string path;
+  const bool realtime;
+  const bool loop;
+  std::atomic<bool> stopped;
+  RecordingReader reader;
+
+public:
+  // Unless realtime is set, frames are produced as fast as they can be
+  // consumed. With loop set the recording starts over at the end, with
+  // timestamps continuing where the previous pass left off.
+  ReplaySource(const std::string& path, bool realtime, bool loop = false);
+
+  bool Run();
+  void Stop();
+};
+
+#endif // REPLAY_SOURCE_H_
@@ -0,0 +1,132 @@
+#ifndef SHARED_FRAMES_H_
+#define SHARED_FRAMES_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+
+// Hands frames to other processes on the same host through POSIX shared
+// memory, since only one process can hold the DS325.
+//
+// The publisher owns a ring of slots in a shared memory object. Every frame
+// is copied into the next slot, overwriting the oldest one, and subscribers
+// copy it back out. The publisher never waits for anyone: each slot carries a
+// sequence number that is odd while the slot is written, so a subscriber can
+// tell a frame was overwritten while it copied and skips ahead instead.
+// Subscribers that have caught up sleep on a futex in the ring header.
+//
+//   RingHeader, padded to c_ALIGNMENT
+//   slot_count slots of slot_size bytes: SlotHeader, then the payload
+//
+// A depth payload is the vertices, UV map and confidence arrays, a color
+// payload the BGR image, both as a recording stores them.
+namespace shared_frames {
+
+const uint32_t c_VERSION = 1;
+const int c_ALIGNMENT = 64;
+// At 60 depth and 30 color frames a second this is about 170 ms of frames
+const int c_DEFAULT_SLOTS = 16;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory atomics have to be lock free");
+
+struct RingHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  // Frames published so far. Frame n goes into slot n % slot_count.
+  std::atomic<uint64_t> published;
+  // Bumped after every frame and on close; subscribers wait on it
+  std::atomic<uint32_t> futex;
+  // Subscribers waiting on futex, so the publisher only wakes when needed
+  std::atomic<uint32_t> waiters;
+  // Set once the publisher has closed the ring
+  std::atomic<uint32_t> closed;
+};
+
+enum Stream {
+  STREAM_DEPTH = 0,
+  STREAM_COLOR = 1
+};
+
+struct SlotHeader {
+  // 2n + 1 while frame n is written into the slot, 2n + 2 once it's there
+  std::atomic<uint64_t> sequence;
+  uint32_t stream;
+  int32_t dropped;
+  uint64_t timestamp;
+  // CLOCK_MONOTONIC when the frame was published, in nanoseconds
+  uint64_t publish_time;
+  Intrinsics intrinsics;
+};
+
+}
+
+// Publishes the frames it receives to a shared memory ring.
+class SharedFramePublisher : public FrameSink {
+  shared_frames::RingHeader* header;
+  size_t mapping_size;
+  std::string name;
+
+  uint8_t* BeginSlot(uint64_t frame, shared_frames::SlotHeader** slot);
+  void EndSlot(uint64_t frame, shared_frames::SlotHeader* slot);
+
+public:
+  SharedFramePublisher();
+  ~SharedFramePublisher();
+
+  // Creates the ring under name, which starts with a slash, like "/ds325".
+  // A ring left under that name by an earlier publisher is replaced.
+  // Returns false when the shared memory can't be set up.
+  bool Open(const std::string& name, int slot_count = shared_frames::c_DEFAULT_SLOTS);
+  // Tells subscribers the stream ended and removes the ring
+  void Close();
+
+  void OnDepthFrame(const DepthFrame& frame);
+  void OnColorFrame(const ColorFrame& frame);
+};
+
+// Delivers the frames of a SharedFramePublisher's ring in another process.
+// A subscriber that falls behind skips to the newest frame. Every frame is
+// copied out of the shared memory and checked before the sink gets it, so
+// one the publisher overwrote during the copy is counted as torn and never
+// delivered. Run starts with the next frame published and returns once the
+// publisher closes the ring.
+class SharedFrameSubscriber : public FrameSource {
+public:
+  struct Stats {
+    uint64_t received;
+    // Frames overwritten before this subscriber got to them
+    uint64_t skipped;
+    // Frames overwritten while they were copied out, which are dropped
+    uint64_t torn;
+    // From publish to the start of the sink callback, in microseconds
+    double mean_latency;
+    int64_t max_latency;
+  };
+
+private:
+  const std::string name;
+  std::atomic<bool> stopped;
+  Stats stats;
+  // The frame being delivered, copied out of its slot
+  std::vector<uint8_t> payload;
+
+public:
+  explicit SharedFrameSubscriber(const std::string& name);
+
+  bool Run();
+  void Stop();
+
+  Stats GetStats() const {
+    return stats;
+  }
+};
+
+#endif // SHARED_FRAMES_H_
@@ -0,0 +1,127 @@
+#ifndef SPATIAL_FILTER_H_
+#define SPATIAL_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame.h"
+
+class ThreadPool;
+
+enum SpatialMode {
+  // Weighted average of the neighborhood, by distance in the image and in
+  // depth (and in color when guided). Also drops flying pixels.
+  SPATIAL_BILATERAL,
+  // Local linear fit of depth to the guide image. Smooths harder and keeps
+  // edges as sharp as the guide has them, but leaves flying pixels in.
+  SPATIAL_GUIDED
+};
+
+// What the bilateral kernels work on. Depth and luma are padded by radius
+// pixels of zeros on every side so the kernels never check bounds; they
+// point at pixel (0, 0) and rows are stride apart. Zero depth is an invalid
+// pixel.
+struct BilateralPlanes {
+  int width;
+  int height;
+  int stride;
+  int radius;
+  const int16_t* depth;
+  // Luminance of the guide image, NULL to weigh by depth only
+  const int16_t* luma;
+  // (2*radius + 1)^2 weights by offset, row by row
+  const float* spatial_weights;
+  // Weights by absolute depth difference in mm, c_DEPTH_WEIGHTS of them
+  const float* depth_weights;
+  // Weights by absolute luma difference, 256 of them
+  const float* luma_weights;
+  // Pixels whose neighbors weigh less than this in total are flying pixels
+  float min_support;
+};
+
+// Entries in BilateralPlanes::depth_weights. The last one is 0 and covers
+// every larger difference.
+const int c_DEPTH_WEIGHTS = 512;
+
+// Edge-preserving smoothing of the organized depth image, for the noise and
+// the flying pixels the DS325 leaves along object edges, optionally guided by
+// the registered color image.
+//
+// The image is split into tiles of rows that run on a ThreadPool. Bilateral
+// weights come from lookup tables, with AVX2 gathers doing 8 pixels at a
+// time. The guided filter is built from separable box filters over the
+// handful of per-pixel sums it needs, which vectorize along the rows.
+//
+// Only z is filtered. x and y are scaled with it so that points stay on the
+// ray of their pixel.
+class SpatialFilter {
+  const int width;
+  const int height;
+  const SpatialMode mode;
+  const int radius;
+  const float sigma_depth;
+  const float sigma_color;
+  const int stride;
+
+  std::vector<float> spatial_weights;
+  std::vector<float> depth_weights;
+  std::vector<float> luma_weights;
+  float min_support;
+
+  // Bilateral mode: padded planes for the kernels
+  std::vector<int16_t> depth;
+  std::vector<int16_t> luma;
+
+  // Guided mode: the guide image, and the per-pixel sums the fit is built
+  // from, before box filtering, after the horizontal pass and after both
+  std::vector<float> guide;
+  std::vector<std::vector<float> > inputs;
+  std::vector<std::vector<float> > row_sums;
+  std::vector<std::vector<float> > box_sums;
+
+  // The filtered depths
+  std::vector<int16_t> filtered;
+
+  // The frame Apply is filtering, kept here so the tile tasks only capture
+  // this
+  const Vertex* apply_vertices;
+  const uint32_t* apply_rgba;
+  Vertex* apply_out;
+  BilateralPlanes apply_planes;
+  float apply_regularization;
+
+  int TileCount() const;
+  BilateralPlanes GetPlanes() const;
+  void LoadBilateral(const Vertex* vertices, const uint32_t* rgba, int tile);
+  void FilterBilateral(int tile);
+  void LoadGuided(const Vertex* vertices, const uint32_t* rgba, int tile);
+  void FitGuided(float regularization, int tile);
+  void FinishGuided(const Vertex* vertices, Vertex* out, int tile);
+
+public:
+  // radius is in pixels, sigma_space in pixels, sigma_depth in mm and
+  // sigma_color in 8-bit luma steps. In guided mode the regularization is
+  // sigma_depth^2 when guided by depth and sigma_color^2 when guided by
+  // color.
+  SpatialFilter(int width, int height, SpatialMode mode, int radius = 2, float sigma_space = 1.5f,
+                float sigma_depth = 20.0f, float sigma_color = 12.0f);
+
+  // Filters one frame of vertices into out, which may be vertices.
+  // rgba is the registered color of every pixel in the layout of
+  // pcl::PointXYZRGB::rgba, or NULL to let depth guide itself. Tiles run on
+  // pool when given.
+  void Apply(const Vertex* vertices, const uint32_t* rgba, Vertex* out, ThreadPool* pool = NULL);
+};
+
+// The bilateral kernels, filtering rows [row_begin, row_end) into out, which
+// is laid out like the unpadded image. Invalid and flying pixels come out 0.
+// Apply picks the best implementation the CPU supports the first time it is
+// called.
+void BilateralRowsScalar(const BilateralPlanes& planes, int row_begin, int row_end, int16_t* out);
+void BilateralRowsAVX2(const BilateralPlanes& planes, int row_begin, int row_end, int16_t* out);
+
+// Name of the implementation Apply dispatches to
+const char* SpatialFilterKernelName();
+
+#endif // SPATIAL_FILTER_H_
@@ -0,0 +1,49 @@
+#ifndef SPSC_QUEUE_H_
+#define SPSC_QUEUE_H_
+
+#include <atomic>
+#include <stddef.h>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. Push fails instead of waiting when the queue is full.
+template <typename T>
+class SpscQueue {
+  std::vector<T> items;
+  const size_t capacity;
+
+  // Next slot to read, only written by the consumer
+  std::atomic<size_t> head;
+  // Next slot to write, only written by the producer
+  std::atomic<size_t> tail;
+
+public:
+  explicit SpscQueue(size_t capacity) : items(capacity + 1), capacity(capacity + 1), head(0), tail(0) {}
+
+  bool Push(const T& item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t next = (t + 1) % capacity;
+    if (next == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    items[t] = item;
+    tail.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool Pop(T* item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *item = items[h];
+    head.store((h + 1) % capacity, std::memory_order_release);
+    return true;
+  }
+
+  bool Empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+
+#endif // SPSC_QUEUE_H_
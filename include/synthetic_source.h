@@ -0,0 +1,50 @@
+#ifndef SYNTHETIC_SOURCE_H_
+#define SYNTHETIC_SOURCE_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_source.h"
+
+// A deterministic scene for running the pipeline without a camera: a back
+// wall, a floor and a ball circling in front of them, seen by a depth camera
+// at 60 fps and a color camera at 30 fps. The same seed always produces the
+// same frames, noise included.
+//
+// With camera motion on, the ball holds still and the cameras sway like a
+// handheld rig instead, along a path that CameraPose gives back exactly.
+class SyntheticSource : public FrameSource {
+  const int depth_frame_count;
+  const bool realtime;
+  const uint32_t seed;
+  std::atomic<bool> stopped;
+  bool camera_motion;
+
+  std::vector<Vertex> vertices;
+  std::vector<UV> uv_map;
+  std::vector<int16_t> confidence;
+  std::vector<uint8_t> bgr;
+
+  Pose PoseAt(uint64_t time) const;
+  void RenderDepth(uint64_t time, uint32_t frame);
+  void RenderColor(uint64_t time);
+
+public:
+  // Produces depth_frame_count depth frames (and the color frames between
+  // them), or runs until stopped if it is 0. Unless realtime is set, frames
+  // are produced as fast as they can be consumed.
+  SyntheticSource(int depth_frame_count, bool realtime, uint32_t seed = 325);
+
+  // Moves the cameras instead of the ball. Call before Run.
+  void SetCameraMotion(bool moving);
+
+  // Where the depth camera is at timestamp with camera motion on. The world
+  // frame is the depth camera's when it holds still.
+  static Pose CameraPose(uint64_t timestamp);
+
+  bool Run();
+  void Stop();
+};
+
+#endif // SYNTHETIC_SOURCE_H_
@@ -0,0 +1,79 @@
+#ifndef TEMPORAL_FILTER_H_
+#define TEMPORAL_FILTER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "frame.h"
+
+enum TemporalMode {
+  // Median of the last few samples of each pixel
+  TEMPORAL_MEDIAN,
+  // Exponentially decaying average of each pixel
+  TEMPORAL_EXPONENTIAL
+};
+
+struct TemporalParams {
+  // Depths outside [min_z, max_z] pass through untouched and leave the
+  // pixel's history alone
+  int16_t min_z;
+  int16_t max_z;
+  // A sample further than motion_threshold + z/32 mm from the pixel's last
+  // output is taken as motion, and restarts the pixel's history
+  int16_t motion_threshold;
+  // Weight of a new sample in exponential mode, Q15
+  int16_t alpha;
+};
+
+// Smooths depth over time to calm the DS325's flicker, per pixel. History is
+// kept as structure of arrays, one plane of count depths per sample slot, so
+// the kernels work on 16 pixels at a time.
+//
+// Only z is filtered. x and y are scaled with it so that points stay on the
+// ray of their pixel.
+class TemporalFilter {
+  const int count;
+  const TemporalMode mode;
+  const int history_length;
+  TemporalParams params;
+
+  std::vector<int16_t> z;
+  // Median mode: history_length planes of samples, the oldest at head
+  std::vector<int16_t> history;
+  int head;
+  // Median mode: the last output in mm. Exponential mode: the average in
+  // 1/8 mm.
+  std::vector<int16_t> state;
+  std::vector<int16_t> filtered;
+
+public:
+  // history_length is 3 or 5. alpha is the exponential mode weight of a new
+  // sample, in (0, 1].
+  TemporalFilter(int count, TemporalMode mode, int history_length = 5, float alpha = 0.3f,
+                 int16_t motion_threshold = 30, int16_t min_z = c_MIN_Z, int16_t max_z = c_MAX_Z);
+
+  // Forgets all history
+  void Reset();
+
+  // Filters one frame of count vertices into out, which may be vertices.
+  void Apply(const Vertex* vertices, Vertex* out);
+};
+
+// The kernels, filtering one plane of depths. slots points at history_length
+// sample planes and head is the slot the new sample replaces. Apply picks the
+// best implementation the CPU supports the first time it is called.
+void MedianFilterScalar(const TemporalParams& params, const int16_t* z, int count,
+                        int16_t* const* slots, int history_length, int head,
+                        int16_t* last, int16_t* out);
+void MedianFilterAVX2(const TemporalParams& params, const int16_t* z, int count,
+                      int16_t* const* slots, int history_length, int head,
+                      int16_t* last, int16_t* out);
+void ExponentialFilterScalar(const TemporalParams& params, const int16_t* z, int count,
+                             int16_t* average, int16_t* out);
+void ExponentialFilterAVX2(const TemporalParams& params, const int16_t* z, int count,
+                           int16_t* average, int16_t* out);
+
+// Name of the implementation Apply dispatches to
+const char* TemporalFilterKernelName();
+
+#endif // TEMPORAL_FILTER_H_
@@ -0,0 +1,55 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for splitting a frame's work into tasks. The
+// thread calling ParallelFor works on the tasks too, so a pool of n threads
+// starts n - 1 workers and a pool of 1 runs everything inline.
+//
+// ParallelFor calls on one pool must not overlap; give each thread that needs
+// one its own pool.
+class ThreadPool {
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+
+  // The job in progress, guarded by mutex except for next_task
+  const std::function<void(int)>* job;
+  int task_count;
+  std::atomic<int> next_task;
+  // Workers that haven't finished with the current job
+  int busy_workers;
+  // Bumped for every job so workers can tell a new one from a spurious wakeup
+  uint64_t generation;
+  bool stopping;
+
+  void WorkerLoop();
+  void RunTasks();
+
+public:
+  // threads is the total including the caller, 0 for one per core
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
+
+  int ThreadCount() const;
+
+  // Calls task(i) for every i in [0, count) across the pool and returns when
+  // they have all finished.
+  void ParallelFor(int count, const std::function<void(int)>& task);
+
+  // ParallelFor on pool, or every task inline on the calling thread when pool
+  // is NULL, for the stages that take an optional pool. Only a lambda
+  // capturing a single pointer fits in the std::function without allocating,
+  // so the stages keep a frame's inputs in members and capture just this.
+  static void Run(ThreadPool* pool, int count, const std::function<void(int)>& task);
+};
+
+#endif // THREAD_POOL_H_
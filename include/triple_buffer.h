@@ -0,0 +1,93 @@
+#ifndef TRIPLE_BUFFER_H_
+#define TRIPLE_BUFFER_H_
+
+#include <atomic>
+#include <stdint.h>
+
+// Lock-free single producer / single consumer handoff of the newest frame.
+//
+// Three preallocated slots rotate between the writer (back), the reader
+// (front) and a shared middle slot. Publishing swaps the back slot into the
+// middle and never waits on the reader; acquiring swaps the middle slot into
+// the front only if something new was published since the last acquire. A
+// frame that gets replaced in the middle before the reader picks it up is
+// counted as overwritten.
+template <typename T>
+class TripleBuffer {
+  // The middle slot index lives in the low bits, the "fresh" flag marks a
+  // published frame that the reader has not taken yet.
+  static const uint8_t c_INDEX_MASK = 0x3;
+  static const uint8_t c_FRESH = 0x4;
+
+  T slots[3];
+
+  // Owned by the writer thread
+  int back;
+  // Owned by the reader thread
+  int front;
+  // Shared between both
+  std::atomic<uint8_t> middle;
+
+  std::atomic<uint64_t> published;
+  std::atomic<uint64_t> consumed;
+  std::atomic<uint64_t> overwritten;
+
+public:
+  struct Stats {
+    uint64_t published;
+    uint64_t consumed;
+    uint64_t overwritten;
+  };
+
+  TripleBuffer() : back(0), front(1), middle(2), published(0), consumed(0), overwritten(0) {}
+
+  // Direct access to a slot, only meant for preallocating storage before the
+  // producer and consumer threads are started.
+  T& Slot(int i) {
+    return slots[i];
+  }
+
+  // Writer side: the slot that is safe to fill with the next frame.
+  T& Back() {
+    return slots[back];
+  }
+
+  // Writer side: hand the back slot to the reader and grab a free one.
+  // Returns true when that overwrote a frame the reader never took.
+  bool Publish() {
+    uint8_t prev = middle.exchange(back | c_FRESH, std::memory_order_acq_rel);
+    back = prev & c_INDEX_MASK;
+    if (prev & c_FRESH) {
+      overwritten.fetch_add(1, std::memory_order_relaxed);
+    }
+    published.fetch_add(1, std::memory_order_relaxed);
+    return prev & c_FRESH;
+  }
+
+  // Reader side: take the newest published frame, if there is one. Returns
+  // false when nothing new arrived, in which case Front() is unchanged.
+  bool Acquire() {
+    if (!(middle.load(std::memory_order_relaxed) & c_FRESH)) {
+      return false;
+    }
+    uint8_t prev = middle.exchange(front, std::memory_order_acq_rel);
+    front = prev & c_INDEX_MASK;
+    consumed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Reader side: the most recently acquired frame.
+  T& Front() {
+    return slots[front];
+  }
+
+  Stats GetStats() const {
+    Stats stats;
+    stats.published = published.load(std::memory_order_relaxed);
+    stats.consumed = consumed.load(std::memory_order_relaxed);
+    stats.overwritten = overwritten.load(std::memory_order_relaxed);
+    return stats;
+  }
+};
+
+#endif // TRIPLE_BUFFER_H_
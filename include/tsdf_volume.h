@@ -0,0 +1,138 @@
+#ifndef TSDF_VOLUME_H_
+#define TSDF_VOLUME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "frame.h"
+
+class ThreadPool;
+
+// Voxels along each edge of a block, and in a block
+const int c_TSDF_BLOCK_SIZE = 8;
+const int c_TSDF_BLOCK_VOXELS = c_TSDF_BLOCK_SIZE*c_TSDF_BLOCK_SIZE*c_TSDF_BLOCK_SIZE;
+
+// Fuses depth frames taken from known poses into a truncated signed distance
+// field, from which a surface mesh can be extracted.
+//
+// Space is split into blocks of 8x8x8 voxels that only exist where a frame
+// has seen a surface, so memory grows with the surface that was observed
+// rather than with the volume around it. Blocks are found through an open
+// addressing hash table of packed block coordinates and come out of a pool
+// that allocates them a chunk at a time and never gives them back until the
+// volume is destroyed.
+//
+// Every frame integrates the blocks its points fall into, split between the
+// threads of a ThreadPool. Blocks remember whether they changed, so mesh
+// extraction only redoes those and keeps the triangles of the rest.
+class TsdfVolume {
+public:
+  struct Stats {
+    // Blocks in the volume and the memory they and the table take
+    int blocks;
+    size_t bytes;
+    // Of the last Integrate: blocks within the truncation band of the frame
+    int visible_blocks;
+    // Of the last ExtractMesh: blocks meshed again and triangles in total
+    int meshed_blocks;
+    int triangles;
+  };
+
+private:
+  struct Voxel {
+    // Distance to the surface in units of the truncation distance, in
+    // [-1, 1], negative behind it. Only valid with a weight above 0.
+    float sdf;
+    float weight;
+  };
+
+  struct Block {
+    int32_t x, y, z;
+    // Integrate call this block was last visible in
+    uint32_t frame;
+    // Integrated into since the last ExtractMesh
+    bool changed;
+    Voxel voxels[c_TSDF_BLOCK_VOXELS];
+  };
+
+  struct Slot {
+    uint64_t key;
+    // Index into the pool, -1 for an empty slot
+    int32_t block;
+  };
+
+  const float voxel_size;
+  const float truncation;
+  const float max_weight;
+
+  // The pool: fixed size chunks of blocks, handed out in order
+  std::vector<Block*> chunks;
+  int block_count;
+
+  std::vector<Slot> table;
+  int table_bits;
+
+  uint32_t frame;
+  std::vector<int> visible;
+  // Block keys each band of rows saw this frame
+  std::vector<std::vector<uint64_t> > band_keys;
+
+  // Triangles of every block, as 9 floats each
+  std::vector<std::vector<float> > block_meshes;
+  std::vector<int> remesh;
+  Stats stats;
+
+  // The frame Integrate is fusing, kept here so the tasks only capture this
+  struct Input {
+    const float* points;
+    int point_stride;
+    int width;
+    int height;
+    Intrinsics intrinsics;
+    Pose pose;
+    Pose inverse_pose;
+  };
+  Input input;
+
+  Block& GetBlock(int index) const;
+  int AllocateBlock(uint64_t key);
+  int FindBlock(uint64_t key) const;
+  void Rehash(int bits);
+
+  void CollectBlocks(const float* points, int point_stride, int width, int height, const Pose& pose,
+                     int band);
+  void IntegrateBlock(Block* block, const float* points, int point_stride, int width, int height,
+                      const Intrinsics& intrinsics, const Pose& inverse_pose);
+  void MeshBlock(int index);
+  // Tasks of Integrate and ExtractMesh
+  void CollectTask(int band);
+  void IntegrateTask(int task);
+  void MeshTask(int task);
+
+public:
+  // voxel_size and truncation in mm. Voxels average at most max_weight
+  // frames, so the model can still follow changes.
+  explicit TsdfVolume(float voxel_size = 8.0f, float truncation = 30.0f, float max_weight = 64.0f);
+  ~TsdfVolume();
+
+  // Drops every block, keeping their memory for reuse
+  void Reset();
+
+  // Fuses one organized cloud of width x height points, xyz at
+  // points + i*point_stride floats and NaN where missing, seen by a camera
+  // with these intrinsics at pose. Blocks integrate on pool when given.
+  void Integrate(const float* points, int point_stride, int width, int height,
+                 const Intrinsics& intrinsics, const Pose& pose, ThreadPool* pool = NULL);
+
+  // Writes the surface as triangles, 9 floats each, in the coordinates of
+  // the poses. Only blocks that changed since the last call, and their
+  // neighbors, are meshed again. Blocks mesh on pool when given.
+  void ExtractMesh(std::vector<float>* triangles, ThreadPool* pool = NULL);
+
+  Stats GetStats() const {
+    return stats;
+  }
+};
+
+#endif // TSDF_VOLUME_H_
@@ -0,0 +1,66 @@
+#ifndef VOXEL_DOWNSAMPLER_H_
+#define VOXEL_DOWNSAMPLER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "frame.h"
+
+// Averages the points of a cloud that fall in the same cube of leaf_size,
+// position and color, like pcl::VoxelGrid but without sorting and without
+// allocating once it has seen the largest cloud it's going to get.
+//
+// Voxels are found through an open addressing hash table of packed voxel
+// coordinates. Slots are stamped with the frame they were last used in, so
+// the table never has to be cleared between frames.
+class VoxelDownsampler {
+public:
+  typedef pcl::PointCloud<pcl::PointXYZRGB> Cloud;
+
+private:
+  struct Slot {
+    uint64_t key;
+    uint32_t generation;
+    // Index into voxels
+    uint32_t voxel;
+  };
+
+  struct Voxel {
+    float x, y, z;
+    uint32_t r, g, b;
+    uint32_t count;
+  };
+
+  float leaf_size;
+  float inverse_leaf_size;
+  std::vector<Slot> table;
+  uint64_t table_mask;
+  int table_bits;
+  uint32_t generation;
+  // In order of first use, so the output order is deterministic
+  std::vector<Voxel> voxels;
+  int voxel_count;
+
+  void Reserve(int point_count);
+  uint32_t FindVoxel(uint64_t key);
+
+public:
+  // leaf_size is in the units of the cloud, mm for the DS325. max_points is
+  // the largest cloud expected, for sizing the table up front.
+  explicit VoxelDownsampler(float leaf_size, int max_points = c_PIXEL_COUNT);
+
+  void SetLeafSize(float leaf_size);
+  float GetLeafSize() const {
+    return leaf_size;
+  }
+
+  // Writes one point per occupied voxel to output, which ends up unorganized
+  // and dense. NaN points in input are skipped. input and output must be
+  // different clouds.
+  void Apply(const Cloud& input, Cloud* output);
+};
+
+#endif // VOXEL_DOWNSAMPLER_H_
@@ -1,223 +1,473 @@
-
-#include <vector>
-#include <exception>
-#include <iostream>
-using namespace std;
-
-#include <DepthSense.hxx>
-using namespace DepthSense;
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
 
 #include <pcl/visualization/cloud_viewer.h>
 
-static const int DEPTH_WIDTH = 320;
-static const int DEPTH_HEIGHT = 240;
-static const int COLOR_WIDTH = 640;
-static const int COLOR_HEIGHT = 480;
-const int c_PIXEL_COUNT = DEPTH_WIDTH * DEPTH_HEIGHT; // 320x240
-const int c_MIN_Z = 100; // discard points closer than this
-const int c_MAX_Z = 2000; // discard points farther than this
-
-Context g_context;
-DepthNode g_dnode;
-ColorNode g_cnode;
-
-
-bool g_bDeviceFound = false;
-
-ProjectionHelper* g_pProjHelper = NULL;
-StereoCameraParameters g_scp;
-
-pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZRGB>);
-pcl::visualization::CloudViewer viewer("Simple Cloud Viewer");
-
-namespace GlobalData {
-  uint16_t depth_vals[c_PIXEL_COUNT];
-  uint16_t confidence_vals[c_PIXEL_COUNT];
-  //uint8_t pixelsColorAcqVGA[3*c_PIXEL_COUNT];
-  //uint8_t pixelsColorSyncVGA[3*c_PIXEL_COUNT];
-  DepthSense::UV uv_map[c_PIXEL_COUNT];
-  int colorPixelCol, colorPixelRow, colorPixelInd;
-  uint32_t depth_frames = 0;
-  uint32_t color_frames = 0;
-}
-
-void OnNewDepthSample(DepthNode node, DepthNode::NewSampleReceivedData data) {
-  //memcpy(&GlobalData::depth_vals, data.depthMap, sizeof(data.depthMap[0]) * c_PIXEL_COUNT);
-  memcpy(&GlobalData::uv_map, data.uvMap, sizeof(data.uvMap[0]) * c_PIXEL_COUNT);
-
-  for (int i = 0; i < c_PIXEL_COUNT; i++) {
-  	if (data.vertices[i].z > c_MAX_Z || data.vertices[i].z < c_MIN_Z) {
-  	  cloud->points[i] = pcl::PointXYZRGB(0, 0, 0);
-  	  continue;
-  	}
-    cloud->points[i].x = data.vertices[i].x;
-    cloud->points[i].y = data.vertices[i].y;
-    cloud->points[i].z = data.vertices[i].z;
+#include "capture_pipeline.h"
+#include "depthsense_source.h"
+#ifdef DS325_GL_VIEWER
+#include "gl_cloud_viewer.h"
+#endif
+#include "metrics.h"
+#include "multi_camera.h"
+#include "recording.h"
+#include "replay_source.h"
+#include "shared_frames.h"
+#include "synthetic_source.h"
+
+CapturePipeline* g_pipeline = NULL;
+MultiCameraCapture* g_capture = NULL;
+
+// Show the normal of every c_NORMAL_LEVEL-th point, c_NORMAL_LENGTH mm long
+const int c_NORMAL_LEVEL = 16;
+const float c_NORMAL_LENGTH = 20.0f;
+// --surface leaves gaps where depth jumps by more than this fraction
+const float c_SURFACE_DEPTH_JUMP = 0.05f;
+// --planes paints the points of each plane one of these, by plane id
+const uint32_t c_PLANE_COLORS[] = {0xffe6194b, 0xff3cb44b, 0xffffe119, 0xff4363d8, 0xfff58231, 0xff911eb4};
+const int c_PLANE_COLOR_COUNT = sizeof(c_PLANE_COLORS)/sizeof(c_PLANE_COLORS[0]);
+
+// Runs on the visualization thread. Picks up the newest complete cloud, if
+// one was published since the last call.
+void ShowLatestCloud(pcl::visualization::PCLVisualizer& viz) {
+  // A cloud's frame time is from handing it over here to the next call,
+  // which comes once the viewer has rendered it
+  static std::chrono::steady_clock::time_point shown;
+  static bool showing = false;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  PointBudget* budget = g_pipeline->GetPointBudget();
+  if (budget != NULL && showing) {
+    budget->Update(std::chrono::duration<double, std::milli>(now - shown).count());
+    showing = false;
   }
-
-  GlobalData::depth_frames++;
-  if (GlobalData::depth_frames <= GlobalData::color_frames) {
-    viewer.showCloud(cloud);
+  TripleBuffer<CapturePipeline::Frame>& frames = g_pipeline->GetFrames();
+  if (!frames.Acquire()) {
+    return;
   }
-}
-
-void OnNewColorSample(ColorNode node, ColorNode::NewSampleReceivedData data) {
-  for (int depth_index = 0; depth_index < c_PIXEL_COUNT; depth_index++) {
-    int color_col = ((float)GlobalData::uv_map[depth_index].u)*COLOR_WIDTH;
-    int color_row = ((float)GlobalData::uv_map[depth_index].v)*COLOR_HEIGHT;
-    if (color_row < 0 || color_row > COLOR_HEIGHT || color_col < 0 || color_col > COLOR_WIDTH) {
-      cloud->points[depth_index].b = 0;
-      cloud->points[depth_index].g = 0;
-      cloud->points[depth_index].r = 0;
-    } else {
-      int color_index = color_row*COLOR_WIDTH + color_col;
-      cloud->points[depth_index].b = data.colorMap[3*color_index + 0];
-      cloud->points[depth_index].g = data.colorMap[3*color_index + 1];
-      cloud->points[depth_index].r = data.colorMap[3*color_index + 2];
+  shown = now;
+  showing = true;
+  const CapturePipeline::Frame& frame = frames.Front();
+  METRICS_RECORD(STAGE_END_TO_END, metrics::Now() - frame.received);
+  METRICS_SCOPE(STAGE_DISPLAY);
+  // The front cloud is ours until the next Acquire, so planes are painted
+  // right into it
+  for (size_t i = 0; i < frame.plane_labels.size(); i++) {
+    const uint8_t label = frame.plane_labels[i];
+    if (label != PlaneSegmenter::c_NO_PLANE) {
+      frame.cloud->points[i].rgba = c_PLANE_COLORS[frame.planes[label].id % c_PLANE_COLOR_COUNT];
     }
   }
-
-  GlobalData::color_frames++;
-  if (GlobalData::color_frames <= GlobalData::depth_frames) {
-    viewer.showCloud(cloud);
+  pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> rgb(frame.cloud);
+  if (!viz.updatePointCloud<pcl::PointXYZRGB>(frame.cloud, rgb, "cloud")) {
+    viz.addPointCloud<pcl::PointXYZRGB>(frame.cloud, rgb, "cloud");
+  }
+  // There is no update for normals, they have to be added again
+  if (!frame.normals->points.empty()) {
+    viz.removePointCloud("normals");
+    viz.addPointCloudNormals<pcl::PointXYZRGB, pcl::Normal>(frame.cloud, frame.normals,
+        c_NORMAL_LEVEL, c_NORMAL_LENGTH, "normals");
+  }
+  if (!frame.triangles.empty()) {
+    // Reused, so the polygons keep their vectors from frame to frame
+    static std::vector<pcl::Vertices> polygons;
+    polygons.resize(frame.triangles.size()/3);
+    for (size_t i = 0; i < polygons.size(); i++) {
+      polygons[i].vertices.assign(&frame.triangles[3*i], &frame.triangles[3*i + 3]);
+    }
+    if (!viz.updatePolygonMesh<pcl::PointXYZRGB>(frame.cloud, polygons, "surface")) {
+      viz.addPolygonMesh<pcl::PointXYZRGB>(frame.cloud, polygons, "surface");
+    }
+  }
+  // Frames share a mesh until the next one is made
+  static std::shared_ptr<const CapturePipeline::Mesh> shown_mesh;
+  if (frame.mesh && frame.mesh != shown_mesh) {
+    if (!viz.updatePolygonMesh<pcl::PointXYZ>(frame.mesh->vertices, frame.mesh->polygons, "model")) {
+      viz.addPolygonMesh<pcl::PointXYZ>(frame.mesh->vertices, frame.mesh->polygons, "model");
+    }
+    shown_mesh = frame.mesh;
   }
 }
 
-void ConfigureDepthNode() {
-  g_dnode.newSampleReceivedEvent().connect(&OnNewDepthSample);
-
-  DepthNode::Configuration config = g_dnode.getConfiguration();
-  config.frameFormat = FRAME_FORMAT_QVGA;
-  config.framerate = 60;
-  config.mode = DepthNode::CAMERA_MODE_CLOSE_MODE;
-  config.saturation = true;
-
-  g_dnode.setEnableVertices(true);
-  g_dnode.setEnableUvMap(true);
-  //g_dnode.setEnableDepthMap( true );
-  //g_dnode.setEnableAccelerometer( true );
-  //g_dnode.setEnableConfidenceMap(true); 
-
-  try {
-    g_context.requestControl(g_dnode,0);
-    g_dnode.setConfiguration(config);
-  } catch (ArgumentException& e) {
-    printf("Argument Exception: %s\n",e.what());
-  } catch (UnauthorizedAccessException& e) {
-    printf("Unauthorized Access Exception: %s\n",e.what());
-  } catch (IOException& e) {
-    printf("IO Exception: %s\n",e.what());
-  } catch (InvalidOperationException& e) {
-    printf("Invalid Operation Exception: %s\n",e.what());
-  } catch (ConfigurationException& e) {
-    printf("Configuration Exception: %s\n",e.what());
-  } catch (StreamingException& e) {
-    printf("Streaming Exception: %s\n",e.what());
-  } catch (TimeoutException&) {
-    printf("TimeoutException\n");
+// Runs on the visualization thread with more than one camera
+void ShowMergedCloud(pcl::visualization::PCLVisualizer& viz) {
+  static CapturePipeline::Cloud::Ptr merged(new CapturePipeline::Cloud);
+  if (!g_capture->Merge(merged.get())) {
+    return;
+  }
+  METRICS_SCOPE(STAGE_DISPLAY);
+  pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> rgb(merged);
+  if (!viz.updatePointCloud<pcl::PointXYZRGB>(merged, rgb, "cloud")) {
+    viz.addPointCloud<pcl::PointXYZRGB>(merged, rgb, "cloud");
   }
 }
 
-
-void ConfigureColorNode() {
-  g_cnode.newSampleReceivedEvent().connect(&OnNewColorSample);
-
-  ColorNode::Configuration config = g_cnode.getConfiguration();
-  config.frameFormat = FRAME_FORMAT_VGA;
-  config.compression = COMPRESSION_TYPE_MJPEG;
-  config.powerLineFrequency = POWER_LINE_FREQUENCY_50HZ;
-  config.framerate = 30;
-
-  g_cnode.setEnableColorMap(true);
-
-  try {
-    g_context.requestControl(g_cnode,0);
-    g_cnode.setConfiguration(config);
-  } catch (ArgumentException& e) {
-    printf("Argument Exception: %s\n",e.what());
-  } catch (UnauthorizedAccessException& e) {
-    printf("Unauthorized Access Exception: %s\n",e.what());
-  } catch (IOException& e) {
-    printf("IO Exception: %s\n",e.what());
-  } catch (InvalidOperationException& e) {
-    printf("Invalid Operation Exception: %s\n",e.what());
-  } catch (ConfigurationException& e) {
-    printf("Configuration Exception: %s\n",e.what());
-  } catch (StreamingException& e) {
-    printf("Streaming Exception: %s\n",e.what());
-  } catch (TimeoutException&) {
-    printf("TimeoutException\n");
+#ifdef DS325_GL_VIEWER
+// Runs on the window thread with more than one camera
+void StreamMergedCloud(CloudStream* stream) {
+  static CapturePipeline::Cloud merged;
+  if (!g_capture->Merge(&merged)) {
+    return;
+  }
+  METRICS_SCOPE(STAGE_DISPLAY);
+  if (!CapturePipeline::StreamCloud(merged, stream)) {
+    METRICS_DROPS(STAGE_DISPLAY, 1);
   }
 }
 
-
-void ConfigureNode(Node node) {
-  if ((node.is<DepthNode>())&&(!g_dnode.isSet())) {
-    g_dnode = node.as<DepthNode>();
-    ConfigureDepthNode();
-    g_context.registerNode(node);
-  } else if ((node.is<ColorNode>())&&(!g_cnode.isSet())) {
-    g_cnode = node.as<ColorNode>();
-    ConfigureColorNode();
-    g_context.registerNode(node);
+// The GL viewer for clouds of up to max_points points, or NULL when there is
+// no GL to draw them with
+GlCloudViewer* OpenGlViewer(int max_points) {
+  GlCloudViewer* viewer = new GlCloudViewer("Simple Cloud Viewer", max_points);
+  if (!viewer->Open()) {
+    printf("Showing clouds with PCL instead\n");
+    delete viewer;
+    return NULL;
   }
+  return viewer;
 }
 
-void OnNodeConnected(Device device, Device::NodeAddedData data) {
-  ConfigureNode(data.node);
+// GLUT wants the main thread, so capture runs on another while the window
+// shows the clouds, until it is closed or capture fails. Closing the window
+// calls stop, which has to make capture return, as a live camera or a
+// looping replay never end on their own. Deletes viewer. Returns what
+// capture returned.
+bool ShowWhileCapturing(GlCloudViewer* viewer, const std::function<bool()>& capture,
+                        const std::function<void()>& stop) {
+  bool ok = false;
+  std::thread capture_thread([&] {
+    ok = capture();
+    if (!ok) {
+      viewer->Close();
+    }
+  });
+  viewer->Show();
+  stop();
+  capture_thread.join();
+  delete viewer;
+  return ok;
 }
-
-void OnNodeDisconnected(Device device, Device::NodeRemovedData data) {
-  if (data.node.is<ColorNode>() && (data.node.as<ColorNode>() == g_cnode)) {
-    g_cnode.unset();
-  } else if (data.node.is<DepthNode>() && (data.node.as<DepthNode>() == g_dnode)) {
-    g_dnode.unset();
+#endif
+
+// The processing options that apply to every camera
+void ConfigureFilters(CapturePipeline* pipeline, float leaf_size, const std::string& temporal_mode,
+                      const std::string& spatial_mode, bool color_guide) {
+  pipeline->SetVoxelLeafSize(leaf_size);
+  if (!temporal_mode.empty()) {
+    pipeline->EnableTemporalFilter(temporal_mode == "median" ? TEMPORAL_MEDIAN : TEMPORAL_EXPONENTIAL);
   }
-  printf("Node disconnected\n");
-}
-
-void OnDeviceConnected(Context context, Context::DeviceAddedData data) {
-  if (!g_bDeviceFound) {
-    data.device.nodeAddedEvent().connect(&OnNodeConnected);
-    data.device.nodeRemovedEvent().connect(&OnNodeDisconnected);
-    g_bDeviceFound = true;
+  if (!spatial_mode.empty()) {
+    pipeline->EnableSpatialFilter(spatial_mode == "bilateral" ? SPATIAL_BILATERAL : SPATIAL_GUIDED, color_guide);
   }
 }
 
-void OnDeviceDisconnected(Context context, Context::DeviceRemovedData data) {
-  g_bDeviceFound = false;
-  printf("Device disconnected\n");
+void PrintUsage(const char* name) {
+  printf("usage: %s [options]\n", name);
+  printf("  --synthetic     use the synthetic scene instead of the camera\n");
+  printf("  --replay FILE   play back a recording instead of using the camera, give\n");
+  printf("                  it again for every further camera\n");
+  printf("  --cameras N     capture from the first N cameras and merge their clouds\n");
+  printf("  --extrinsics FILE  pose of every camera in the rig, a line each as\n");
+  printf("                  \"tx ty tz qx qy qz qw\" in meters\n");
+  printf("  --record FILE   record the incoming frames\n");
+  printf("  --subscribe NAME take frames from another viewer's --publish NAME\n");
+  printf("  --publish NAME  share the incoming frames with other processes as NAME,\n");
+  printf("                  like /ds325\n");
+  printf("  --frames N      stop the synthetic scene after N depth frames\n");
+  printf("  --realtime      pace synthetic and replayed frames like the camera\n");
+  printf("  --loop          start the replay over when it ends\n");
+  printf("  --headless      process frames without showing them\n");
+  printf("  --voxel MM      show one averaged point per MM sized voxel\n");
+  printf("  --temporal MODE smooth depth over time, MODE is median or exponential\n");
+  printf("  --spatial MODE  smooth depth across the image, MODE is bilateral or guided\n");
+  printf("  --color-guide   let the color image guide the spatial filter\n");
+  printf("  --normals       estimate and show point normals\n");
+  printf("  --surface       show the cloud as a surface meshed from its pixel grid\n");
+  printf("  --planes        find the large planes and paint their points\n");
+  printf("  --odometry FILE track the camera and write its poses to FILE\n");
+  printf("  --fuse MM       fuse the clouds into a mesh with MM sized voxels\n");
+  printf("  --moving-camera move the synthetic camera instead of the ball\n");
+  printf("  --frame-budget MS  show clouds only as detailed as can be drawn in MS\n");
+  printf("  --metrics FILE  write per stage timings every second to FILE, - for stdout\n");
 }
 
 int main(int argc, char** argv) {
-  g_context = Context::create("localhost");
-  g_context.deviceAddedEvent().connect(&OnDeviceConnected);
-  g_context.deviceRemovedEvent().connect(&OnDeviceDisconnected);
-  cloud->points.resize(c_PIXEL_COUNT);
+  std::vector<std::string> replay_paths;
+  int camera_count = 1;
+  std::string extrinsics_path;
+  std::string record_path;
+  std::string subscribe_name;
+  std::string publish_name;
+  bool synthetic = false;
+  bool realtime = false;
+  bool loop = false;
+  bool headless = false;
+  int frame_count = 0;
+  float leaf_size = 0;
+  std::string temporal_mode;
+  std::string spatial_mode;
+  bool color_guide = false;
+  bool normals = false;
+  bool surface = false;
+  bool planes = false;
+  std::string pose_path;
+  bool moving_camera = false;
+  float fusion_voxel_size = 0;
+  std::string metrics_path;
+  float frame_budget = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--synthetic") == 0) {
+      synthetic = true;
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_paths.push_back(argv[++i]);
+    } else if (strcmp(argv[i], "--cameras") == 0 && i + 1 < argc) {
+      camera_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--extrinsics") == 0 && i + 1 < argc) {
+      extrinsics_path = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--subscribe") == 0 && i + 1 < argc) {
+      subscribe_name = argv[++i];
+    } else if (strcmp(argv[i], "--publish") == 0 && i + 1 < argc) {
+      publish_name = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frame_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--realtime") == 0) {
+      realtime = true;
+    } else if (strcmp(argv[i], "--loop") == 0) {
+      loop = true;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--voxel") == 0 && i + 1 < argc) {
+      leaf_size = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--temporal") == 0 && i + 1 < argc) {
+      temporal_mode = argv[++i];
+      if (temporal_mode != "median" && temporal_mode != "exponential") {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--spatial") == 0 && i + 1 < argc) {
+      spatial_mode = argv[++i];
+      if (spatial_mode != "bilateral" && spatial_mode != "guided") {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--color-guide") == 0) {
+      color_guide = true;
+    } else if (strcmp(argv[i], "--normals") == 0) {
+      normals = true;
+    } else if (strcmp(argv[i], "--surface") == 0) {
+      surface = true;
+    } else if (strcmp(argv[i], "--planes") == 0) {
+      planes = true;
+    } else if (strcmp(argv[i], "--odometry") == 0 && i + 1 < argc) {
+      pose_path = argv[++i];
+    } else if (strcmp(argv[i], "--fuse") == 0 && i + 1 < argc) {
+      fusion_voxel_size = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--moving-camera") == 0) {
+      moving_camera = true;
+    } else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+      frame_budget = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
 
-  // get list of devices already connected
-  vector<Device> da = g_context.getDevices();
+  camera_count = std::max(camera_count, (int)replay_paths.size());
+  if (camera_count > 1) {
+    if (!record_path.empty() || !publish_name.empty() || !subscribe_name.empty() || normals || surface ||
+        planes || !pose_path.empty() || fusion_voxel_size > 0 || frame_budget > 0) {
+      printf("--record, --publish, --subscribe, --normals, --surface, --planes, --odometry, --fuse and "
+          "--frame-budget take a single camera\n");
+      return 1;
+    }
+    if (!replay_paths.empty() && (int)replay_paths.size() != camera_count) {
+      printf("Give a recording for each of the %d cameras\n", camera_count);
+      return 1;
+    }
+    const Pose identity = {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}};
+    std::vector<Pose> extrinsics(camera_count, identity);
+    if (!extrinsics_path.empty() && !LoadExtrinsics(extrinsics_path, camera_count, &extrinsics)) {
+      return 1;
+    }
+    // The cores are shared out between the cameras
+    const int cores = std::max(1u, std::thread::hardware_concurrency());
+    MultiCameraCapture capture(std::max(1, cores/camera_count));
+    for (int c = 0; c < camera_count; c++) {
+      FrameSource* source;
+      if (synthetic) {
+        source = new SyntheticSource(frame_count, realtime, 325 + c);
+      } else if (!replay_paths.empty()) {
+        source = new ReplaySource(replay_paths[c], realtime, loop);
+      } else {
+        source = new DepthSenseSource(c);
+      }
+      capture.AddCamera(source, extrinsics[c]);
+      ConfigureFilters(&capture.GetPipeline(c), leaf_size, temporal_mode, spatial_mode, color_guide);
+    }
+    g_capture = &capture;
 
-  // only use first device
-  if (da.size() >= 1) {
-    g_bDeviceFound = true;
-    da[0].nodeAddedEvent().connect(&OnNodeConnected);
-    da[0].nodeRemovedEvent().connect(&OnNodeDisconnected);
-    vector<Node> na = da[0].getNodes();
-    cout << "found " << (int)na.size() << " nodes\n";
-    for (int n = 0; n < (int)na.size(); n++) {
-      ConfigureNode(na[n]);
+    MetricsExporter exporter;
+    if (!metrics_path.empty() && !exporter.Start(metrics_path)) {
+      return 1;
+    }
+    // Runs the cameras to the end and reports on them
+    std::function<bool()> run_cameras = [&] {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bool ok = capture.Run();
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      exporter.Stop();
+
+      capture.PrintStats();
+      uint64_t published = 0;
+      for (int c = 0; c < camera_count; c++) {
+        published += capture.GetPipeline(c).GetFrames().GetStats().published;
+      }
+      printf("processed %lu clouds from %d cameras in %.2f s (%.1f fps)\n",
+          (unsigned long)published, camera_count, elapsed.count(), published/elapsed.count());
+      return ok;
+    };
+#ifdef DS325_GL_VIEWER
+    GlCloudViewer* gl_viewer = headless ? NULL : OpenGlViewer(camera_count*c_PIXEL_COUNT);
+    if (gl_viewer != NULL) {
+      gl_viewer->SetIdleCallback([gl_viewer] {
+        StreamMergedCloud(gl_viewer);
+      });
+      return ShowWhileCapturing(gl_viewer, run_cameras, [&capture] { capture.Stop(); }) ? 0 : 1;
     }
+#endif
+    pcl::visualization::CloudViewer* viewer = NULL;
+    if (!headless) {
+      viewer = new pcl::visualization::CloudViewer("Simple Cloud Viewer");
+      viewer->runOnVisualizationThread(&ShowMergedCloud, "merged_cloud");
+    }
+    bool ok = run_cameras();
+    if (viewer != NULL) {
+      while (ok && !viewer->wasStopped()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+      delete viewer;
+    }
+    return ok ? 0 : 1;
+  }
+
+  FrameSource* source;
+  if (synthetic) {
+    SyntheticSource* synthetic_source = new SyntheticSource(frame_count, realtime);
+    synthetic_source->SetCameraMotion(moving_camera);
+    source = synthetic_source;
+  } else if (!replay_paths.empty()) {
+    source = new ReplaySource(replay_paths[0], realtime, loop);
+  } else if (!subscribe_name.empty()) {
+    source = new SharedFrameSubscriber(subscribe_name);
+  } else {
+    source = new DepthSenseSource();
   }
 
-  g_context.startNodes();
-  g_context.run();
-  g_context.stopNodes();
-  if (g_cnode.isSet()) {
-    g_context.unregisterNode(g_cnode);
+  CapturePipeline pipeline;
+  ConfigureFilters(&pipeline, leaf_size, temporal_mode, spatial_mode, color_guide);
+  if (frame_budget > 0) {
+    pipeline.EnablePointBudget(frame_budget);
+  }
+  if (normals) {
+    pipeline.EnableNormals(NORMALS_INTEGRAL);
+  }
+  if (surface) {
+    pipeline.EnableSurfaceMesh(c_SURFACE_DEPTH_JUMP);
+  }
+  if (planes) {
+    pipeline.EnablePlaneSegmentation();
   }
-  if (g_dnode.isSet()) {
-    g_context.unregisterNode(g_dnode);
+  if (!pose_path.empty() && !pipeline.EnableOdometry(pose_path)) {
+    return 1;
+  }
+  if (fusion_voxel_size > 0) {
+    pipeline.EnableFusion(fusion_voxel_size);
+  }
+  g_pipeline = &pipeline;
+
+  FrameTee tee;
+  tee.AddSink(&pipeline);
+  RecordingWriter recorder;
+  if (!record_path.empty()) {
+    if (!recorder.Open(record_path)) {
+      return 1;
+    }
+    tee.AddSink(&recorder);
+  }
+  SharedFramePublisher publisher;
+  if (!publish_name.empty()) {
+    if (!publisher.Open(publish_name)) {
+      return 1;
+    }
+    tee.AddSink(&publisher);
+  }
+  source->SetSink(&tee);
+  MetricsExporter exporter;
+  if (!metrics_path.empty() && !exporter.Start(metrics_path)) {
+    return 1;
+  }
+
+  // Runs the source to the end and reports on it
+  bool recorded_ok = true;
+  std::function<bool()> run_source = [&] {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool ok = source->Run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    recorded_ok = recorder.Close();
+    publisher.Close();
+    exporter.Stop();
+
+    pipeline.PrintStats();
+    if (!record_path.empty()) {
+      RecordingWriter::Stats recorded = recorder.GetStats();
+      printf("recorded %lu frames (%.1f MB), dropped %lu, failed %lu\n", (unsigned long)recorded.written,
+          recorded.bytes/1e6, (unsigned long)recorded.dropped, (unsigned long)recorded.failed);
+    }
+    uint64_t published = pipeline.GetFrames().GetStats().published + pipeline.GetStreamedClouds();
+    printf("processed %lu clouds in %.2f s (%.1f fps)\n",
+        (unsigned long)published, elapsed.count(), published/elapsed.count());
+    return ok;
+  };
+
+#ifdef DS325_GL_VIEWER
+  // Normals, surfaces, planes and the fused mesh are only drawn by PCL
+  GlCloudViewer* gl_viewer = NULL;
+  if (!headless && !normals && !surface && !planes && fusion_voxel_size <= 0) {
+    gl_viewer = OpenGlViewer(c_PIXEL_COUNT);
+  }
+  if (gl_viewer != NULL) {
+    // The pipeline writes every cloud straight into the viewer's GL buffer
+    pipeline.SetCloudStream(gl_viewer);
+    gl_viewer->SetPointBudget(pipeline.GetPointBudget());
+    bool ok = ShowWhileCapturing(gl_viewer, run_source, [source] { source->Stop(); });
+    delete source;
+    return ok && recorded_ok ? 0 : 1;
+  }
+#endif
+  pcl::visualization::CloudViewer* viewer = NULL;
+  if (!headless) {
+    viewer = new pcl::visualization::CloudViewer("Simple Cloud Viewer");
+    viewer->runOnVisualizationThread(&ShowLatestCloud, "latest_cloud");
+  }
+  bool ok = run_source();
+
+  // Finite sources leave the last cloud up until the window is closed
+  if (viewer != NULL) {
+    while (ok && !viewer->wasStopped()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    delete viewer;
   }
-  return 0;
+  delete source;
+  return ok && recorded_ok ? 0 : 1;
 }
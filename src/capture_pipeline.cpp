@@ -0,0 +1,456 @@
+#include "capture_pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "depth_conversion.h"
+
+namespace {
+
+// How many depth frames between printing the handoff and sync counters
+const int c_STATS_INTERVAL = 300;
+
+// Depth runs at 60 fps and color at 30 fps, so every depth frame has a color
+// frame within half a color period. Timestamps are in microseconds.
+const int64_t c_SYNC_TOLERANCE_US = 20000;
+
+// Only used once SetVoxelLeafSize turns downsampling on, in mm
+const float c_DEFAULT_LEAF_SIZE = 10.0f;
+
+// Depth frames between meshes of the fused surface
+const int c_MESH_INTERVAL = 30;
+
+const Pose c_IDENTITY_POSE = {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}};
+
+// Keeps every stride-th entry of every stride-th row of a depth image sized
+// grid, like the points of a cloud or their labels. output may be input.
+template <typename T>
+void DecimateGrid(const T* input, int stride, T* output) {
+  const int width = (DEPTH_WIDTH + stride - 1)/stride;
+  const int height = (DEPTH_HEIGHT + stride - 1)/stride;
+  // In place every entry moves to an index at or below its own, so going
+  // forward never overwrites an entry still to be read
+  for (int row = 0; row < height; row++) {
+    const T* in = &input[row*stride*DEPTH_WIDTH];
+    T* out = &output[row*width];
+    for (int col = 0; col < width; col++) {
+      out[col] = in[col*stride];
+    }
+  }
+}
+
+// The same for an organized cloud
+template <typename Point>
+void Decimate(const pcl::PointCloud<Point>& input, int stride, pcl::PointCloud<Point>* output) {
+  const int width = (DEPTH_WIDTH + stride - 1)/stride;
+  const int height = (DEPTH_HEIGHT + stride - 1)/stride;
+  if (output != &input) {
+    output->points.resize(width*height);
+  }
+  DecimateGrid(&input.points[0], stride, &output->points[0]);
+  output->points.resize(width*height);
+  output->width = width;
+  output->height = height;
+  output->is_dense = false;
+}
+
+}
+
+CapturePipeline::CapturePipeline(SyncPolicy policy, int threads)
+    : sync(c_SYNC_TOLERANCE_US, policy),
+      registration(c_PIXEL_COUNT, COLOR_WIDTH, COLOR_HEIGHT), pool(threads),
+      temporal_filter(NULL), spatial_filter(NULL), color_guided(false), normal_estimator(NULL),
+      surface_mesher(NULL), plane_segmenter(NULL), track_camera(false), odometry(NULL), pose_file(NULL), tracking_lost(0), volume(NULL),
+      fused_frames(0), downsample(false), leaf_size(c_DEFAULT_LEAF_SIZE), downsampler(c_DEFAULT_LEAF_SIZE),
+      point_budget(NULL), cloud_stream(NULL), streamed(0), stream_dropped(0), depth_frames(0), color_frames(0), dropped_depth(0), dropped_color(0), reported_unmatched(0) {
+  colors.resize(c_PIXEL_COUNT);
+  for (int i = 0; i < 3; i++) {
+    Cloud::Ptr& cloud = frames.Slot(i).cloud;
+    cloud.reset(new Cloud);
+    cloud->points.resize(c_PIXEL_COUNT);
+    // Out of range pixels are NaN, so the clouds are organized but not dense
+    cloud->width = DEPTH_WIDTH;
+    cloud->height = DEPTH_HEIGHT;
+    cloud->is_dense = false;
+    frames.Slot(i).normals.reset(new Normals);
+    frames.Slot(i).pose = c_IDENTITY_POSE;
+    frames.Slot(i).received = 0;
+  }
+  organized.points.resize(c_PIXEL_COUNT);
+  organized.width = DEPTH_WIDTH;
+  organized.height = DEPTH_HEIGHT;
+  organized.is_dense = false;
+}
+
+CapturePipeline::~CapturePipeline() {
+  delete temporal_filter;
+  delete spatial_filter;
+  delete normal_estimator;
+  delete surface_mesher;
+  delete plane_segmenter;
+  delete odometry;
+  delete volume;
+  delete point_budget;
+  if (pose_file != NULL) {
+    fclose(pose_file);
+  }
+}
+
+void CapturePipeline::EnableTemporalFilter(TemporalMode mode) {
+  delete temporal_filter;
+  temporal_filter = new TemporalFilter(c_PIXEL_COUNT, mode);
+  smoothed.resize(c_PIXEL_COUNT);
+}
+
+void CapturePipeline::EnableSpatialFilter(SpatialMode mode, bool color_guided) {
+  delete spatial_filter;
+  spatial_filter = new SpatialFilter(DEPTH_WIDTH, DEPTH_HEIGHT, mode);
+  smoothed.resize(c_PIXEL_COUNT);
+  this->color_guided = color_guided;
+}
+
+void CapturePipeline::EnableNormals(NormalMethod method) {
+  delete normal_estimator;
+  normal_estimator = new NormalEstimator(DEPTH_WIDTH, DEPTH_HEIGHT, method);
+}
+
+void CapturePipeline::EnableSurfaceMesh(float max_depth_jump) {
+  delete surface_mesher;
+  surface_mesher = new OrganizedMesher(DEPTH_WIDTH, DEPTH_HEIGHT, max_depth_jump);
+  // Room for every triangle of a full cloud, so publishing never allocates
+  for (int i = 0; i < 3; i++) {
+    frames.Slot(i).triangles.reserve(6*(DEPTH_WIDTH - 1)*(DEPTH_HEIGHT - 1));
+  }
+}
+
+void CapturePipeline::EnablePlaneSegmentation() {
+  delete plane_segmenter;
+  plane_segmenter = new PlaneSegmenter(DEPTH_WIDTH, DEPTH_HEIGHT);
+  for (int i = 0; i < 3; i++) {
+    frames.Slot(i).planes.reserve(PlaneSegmenter::c_MAX_PLANES);
+    frames.Slot(i).plane_labels.reserve(c_PIXEL_COUNT);
+  }
+}
+
+bool CapturePipeline::EnableOdometry(const std::string& pose_path) {
+  track_camera = true;
+  if (pose_path.empty()) {
+    return true;
+  }
+  pose_file = fopen(pose_path.c_str(), "w");
+  if (pose_file == NULL) {
+    printf("Couldn't open %s for writing\n", pose_path.c_str());
+    return false;
+  }
+  fprintf(pose_file, "# timestamp tx ty tz qx qy qz qw\n");
+  return true;
+}
+
+void CapturePipeline::EnableFusion(float voxel_size) {
+  track_camera = true;
+  delete volume;
+  volume = new TsdfVolume(voxel_size);
+}
+
+void CapturePipeline::SetVoxelLeafSize(float leaf_size) {
+  downsample = leaf_size > 0;
+  if (downsample) {
+    this->leaf_size = leaf_size;
+    downsampler.SetLeafSize(leaf_size);
+  }
+}
+
+void CapturePipeline::EnablePointBudget(double target_ms) {
+  delete point_budget;
+  point_budget = new PointBudget(target_ms);
+}
+
+void CapturePipeline::SetCloudStream(CloudStream* stream) {
+  cloud_stream = stream;
+  // Decimated vertices go here on their way into the stream
+  smoothed.resize(c_PIXEL_COUNT);
+}
+
+bool CapturePipeline::StreamCloud(const Cloud& cloud, CloudStream* stream) {
+  const int count = cloud.points.size();
+  if (count > stream->GetMaxPoints()) {
+    return false;
+  }
+  StreamPoint* points = stream->BeginWrite();
+  if (points == NULL) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    const pcl::PointXYZRGB& point = cloud.points[i];
+    StreamPoint& out = points[i];
+    out.x = point.x;
+    out.y = point.y;
+    out.z = point.z;
+    // pcl keeps the color as 0xAARRGGBB, the stream as the bytes R, G, B, A
+    const uint32_t rgba = point.rgba;
+    out.rgba = (rgba & 0xff00ff00) | ((rgba >> 16) & 0xff) | ((rgba & 0xff) << 16);
+  }
+  stream->EndWrite(points, count);
+  return true;
+}
+
+// Whether the points can go straight into the cloud stream, which they can
+// when no other stage needs the cloud
+bool CapturePipeline::StreamsDirectly() const {
+  return cloud_stream != NULL && !downsample && !track_camera && normal_estimator == NULL &&
+         surface_mesher == NULL && plane_segmenter == NULL;
+}
+
+// Converts the vertices and their colors into a region of the cloud stream,
+// keeping every stride-th pixel of every stride-th row
+void CapturePipeline::StreamVertices(const Vertex* vertices, int stride) {
+  int count = c_PIXEL_COUNT;
+  if (stride > 1) {
+    METRICS_SCOPE(STAGE_DOWNSAMPLING);
+    DecimateGrid(vertices, stride, &smoothed[0]);
+    DecimateGrid(&colors[0], stride, &colors[0]);
+    vertices = &smoothed[0];
+    count = PointBudget::Points(stride);
+  }
+  StreamPoint* points = count <= cloud_stream->GetMaxPoints() ? cloud_stream->BeginWrite() : NULL;
+  if (points == NULL) {
+    stream_dropped++;
+    METRICS_DROPS(STAGE_DISPLAY, 1);
+    return;
+  }
+  {
+    METRICS_SCOPE(STAGE_CONVERSION);
+    ConvertStreamPoints((const int16_t*)vertices, count, c_MIN_Z, c_MAX_Z, &colors[0], points);
+  }
+  cloud_stream->EndWrite(points, count);
+  streamed++;
+}
+
+// Meshes the fused surface into a new Mesh, since the display side may
+// still be showing the last one
+void CapturePipeline::PublishMesh() {
+  METRICS_SCOPE(STAGE_MESHING);
+  volume->ExtractMesh(&triangles, &pool);
+  std::shared_ptr<Mesh> next(new Mesh);
+  next->vertices.reset(new pcl::PointCloud<pcl::PointXYZ>);
+  const int vertex_count = triangles.size()/3;
+  next->vertices->points.resize(vertex_count);
+  next->vertices->width = vertex_count;
+  next->vertices->height = 1;
+  for (int i = 0; i < vertex_count; i++) {
+    pcl::PointXYZ& point = next->vertices->points[i];
+    point.x = triangles[3*i];
+    point.y = triangles[3*i + 1];
+    point.z = triangles[3*i + 2];
+  }
+  next->polygons.resize(vertex_count/3);
+  for (int i = 0; i < vertex_count/3; i++) {
+    next->polygons[i].vertices.resize(3);
+    for (int k = 0; k < 3; k++) {
+      next->polygons[i].vertices[k] = 3*i + k;
+    }
+  }
+  mesh = next;
+}
+
+// Turns every depth sample the synchronizer could pair into a cloud for the
+// viewer.
+void CapturePipeline::PublishPairs() {
+  Synchronizer::Pair pair;
+  while (sync.Pop(&pair)) {
+    METRICS_SCOPE(STAGE_PROCESSING);
+    const uint8_t* bgr_next = pair.color_next ? pair.color_next->color_map : NULL;
+    registration.SetUVMap((const float*)pair.depth->uv_map);
+    const Vertex* vertices = pair.depth->vertices;
+    if (temporal_filter != NULL) {
+      METRICS_SCOPE(STAGE_TEMPORAL_FILTER);
+      temporal_filter->Apply(vertices, &smoothed[0]);
+      vertices = &smoothed[0];
+    }
+    {
+      METRICS_SCOPE(STAGE_REGISTRATION);
+      registration.Apply(pair.color->color_map, bgr_next, pair.weight, &colors[0], 1);
+    }
+    if (spatial_filter != NULL) {
+      METRICS_SCOPE(STAGE_SPATIAL_FILTER);
+      spatial_filter->Apply(vertices, color_guided ? &colors[0] : NULL, &smoothed[0], &pool);
+      vertices = &smoothed[0];
+    }
+    const int stride = point_budget != NULL ? point_budget->Stride() : 1;
+    if (StreamsDirectly()) {
+      StreamVertices(vertices, stride);
+      continue;
+    }
+    Frame& frame = frames.Back();
+    frame.received = pair.depth->received;
+    const bool decimate = !downsample && stride > 1;
+    Cloud* cloud = downsample || decimate ? &organized : frame.cloud.get();
+    // The slot may still hold a decimated cloud
+    if (cloud->points.size() != c_PIXEL_COUNT) {
+      cloud->points.resize(c_PIXEL_COUNT);
+      cloud->width = DEPTH_WIDTH;
+      cloud->height = DEPTH_HEIGHT;
+    }
+    {
+      METRICS_SCOPE(STAGE_CONVERSION);
+      ConvertVertices((const int16_t*)vertices, c_PIXEL_COUNT, c_MIN_Z, c_MAX_Z,
+          cloud->points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), &colors[0]);
+    }
+    if (track_camera) {
+      // The first frame has nothing to track against
+      const bool first = odometry == NULL;
+      if (first) {
+        odometry = new IcpOdometry(pair.depth->intrinsics);
+      }
+      bool tracked;
+      {
+        METRICS_SCOPE(STAGE_ODOMETRY);
+        tracked = odometry->Track(cloud->points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), &pool);
+      }
+      if (!tracked && !first) {
+        tracking_lost++;
+        METRICS_DROPS(STAGE_ODOMETRY, 1);
+      }
+      frame.pose = odometry->GetPose();
+      // Where tracking was lost the pose is stale, so the frame stays out
+      if (volume != NULL && !tracked && !first) {
+        METRICS_DROPS(STAGE_FUSION, 1);
+      } else if (volume != NULL) {
+        {
+          METRICS_SCOPE(STAGE_FUSION);
+          volume->Integrate(cloud->points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float), DEPTH_WIDTH,
+              DEPTH_HEIGHT, pair.depth->intrinsics, frame.pose, &pool);
+        }
+        if (++fused_frames % c_MESH_INTERVAL == 0) {
+          PublishMesh();
+        }
+      }
+      frame.mesh = mesh;
+      if (pose_file != NULL) {
+        const float* m = frame.pose.m;
+        float q[4];
+        PoseQuaternion(frame.pose, q);
+        fprintf(pose_file, "%.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", pair.depth_timestamp*1e-6,
+            m[3]*1e-3f, m[7]*1e-3f, m[11]*1e-3f, q[0], q[1], q[2], q[3]);
+      }
+    }
+    if (plane_segmenter != NULL) {
+      METRICS_SCOPE(STAGE_PLANES);
+      // Downsampled clouds have no pixel grid to label
+      frame.plane_labels.resize(downsample ? 0 : c_PIXEL_COUNT);
+      plane_segmenter->Compute(cloud->points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float),
+          downsample ? NULL : &frame.plane_labels[0], &pool);
+      frame.planes = plane_segmenter->Planes();
+    }
+    if (downsample) {
+      METRICS_SCOPE(STAGE_DOWNSAMPLING);
+      if (point_budget != NULL) {
+        downsampler.SetLeafSize(leaf_size*stride);
+      }
+      downsampler.Apply(organized, frame.cloud.get());
+    } else {
+      if (normal_estimator != NULL) {
+        METRICS_SCOPE(STAGE_NORMALS);
+        Normals& normals = *frame.normals;
+        if (normals.points.size() != c_PIXEL_COUNT) {
+          normals.points.resize(c_PIXEL_COUNT);
+          normals.width = DEPTH_WIDTH;
+          normals.height = DEPTH_HEIGHT;
+          normals.is_dense = false;
+        }
+        normal_estimator->Compute(cloud->points[0].data, sizeof(pcl::PointXYZRGB)/sizeof(float),
+            normals.points[0].data_n, sizeof(pcl::Normal)/sizeof(float), &pool);
+      }
+      // Odometry, fusion, planes and normals have had the full cloud
+      if (decimate) {
+        METRICS_SCOPE(STAGE_DOWNSAMPLING);
+        Decimate(organized, stride, frame.cloud.get());
+        if (normal_estimator != NULL) {
+          Decimate(*frame.normals, stride, frame.normals.get());
+        }
+        if (plane_segmenter != NULL) {
+          DecimateGrid(&frame.plane_labels[0], stride, &frame.plane_labels[0]);
+          frame.plane_labels.resize(frame.cloud->points.size());
+        }
+      }
+      if (surface_mesher != NULL) {
+        METRICS_SCOPE(STAGE_SURFACE_MESH);
+        const Cloud& published = *frame.cloud;
+        const int triangles = surface_mesher->Compute(published.points[0].data,
+            sizeof(pcl::PointXYZRGB)/sizeof(float), published.width, published.height, &pool);
+        frame.triangles.resize(3*triangles);
+        surface_mesher->CompactIndices(frame.triangles.data());
+      }
+    }
+    if (cloud_stream != NULL && !StreamCloud(*frame.cloud, cloud_stream)) {
+      stream_dropped++;
+      METRICS_DROPS(STAGE_DISPLAY, 1);
+    }
+    if (frames.Publish()) {
+      METRICS_DROPS(STAGE_PROCESSING, 1);
+    }
+  }
+#ifdef DS325_ENABLE_METRICS
+  const uint64_t unmatched = sync.GetStats().unmatched;
+  METRICS_DROPS(STAGE_PAIRING, unmatched - reported_unmatched);
+  reported_unmatched = unmatched;
+#endif
+}
+
+void CapturePipeline::PrintStats() {
+  TripleBuffer<Frame>::Stats handoff = frames.GetStats();
+  Synchronizer::Stats pairing = sync.GetStats();
+  printf("published: %lu, displayed: %lu, overwritten: %lu, dropped depth: %lu, dropped color: %lu\n",
+      (unsigned long)handoff.published, (unsigned long)handoff.consumed, (unsigned long)handoff.overwritten,
+      (unsigned long)dropped_depth, (unsigned long)dropped_color);
+  printf("paired: %lu, unpaired: %lu, evicted: %lu, skew mean/max: %.0f/%ld us, latency mean/max: %.0f/%ld us\n",
+      (unsigned long)pairing.matched, (unsigned long)pairing.unmatched, (unsigned long)pairing.depth_evicted,
+      pairing.mean_skew, (long)pairing.max_skew, pairing.mean_latency, (long)pairing.max_latency);
+  if (cloud_stream != NULL) {
+    printf("streamed: %lu, dropped: %lu\n", (unsigned long)streamed, (unsigned long)stream_dropped);
+  }
+  if (odometry != NULL) {
+    IcpOdometry::Stats tracking = odometry->GetStats();
+    printf("odometry: lost %lu times, last frame %d iterations, %d correspondences, %.2f mm rms\n",
+        (unsigned long)tracking_lost, tracking.iterations, tracking.correspondences, tracking.rms_error);
+  }
+  if (volume != NULL) {
+    TsdfVolume::Stats fusion = volume->GetStats();
+    printf("fusion: %d blocks (%.1f MB), %d visible, %d triangles\n", fusion.blocks, fusion.bytes/1e6,
+        fusion.visible_blocks, fusion.triangles);
+  }
+}
+
+void CapturePipeline::OnDepthFrame(const DepthFrame& frame) {
+  {
+    METRICS_SCOPE(STAGE_DEPTH_INPUT);
+    DepthSample& sample = sync.DepthSlot();
+    memcpy(sample.vertices, frame.vertices, sizeof(sample.vertices));
+    memcpy(sample.uv_map, frame.uv_map, sizeof(sample.uv_map));
+    sample.intrinsics = frame.intrinsics;
+    sample.received = metrics::Now();
+    sync.CommitDepth(frame.timestamp);
+  }
+  dropped_depth += frame.dropped;
+  METRICS_DROPS(STAGE_DEPTH_INPUT, frame.dropped);
+
+  depth_frames++;
+  PublishPairs();
+  if (depth_frames % c_STATS_INTERVAL == 0) {
+    PrintStats();
+  }
+}
+
+void CapturePipeline::OnColorFrame(const ColorFrame& frame) {
+  {
+    METRICS_SCOPE(STAGE_COLOR_INPUT);
+    ColorSample& sample = sync.ColorSlot();
+    memcpy(sample.color_map, frame.bgr, sizeof(sample.color_map));
+    sync.CommitColor(frame.timestamp);
+  }
+  dropped_color += frame.dropped;
+  METRICS_DROPS(STAGE_COLOR_INPUT, frame.dropped);
+
+  color_frames++;
+  PublishPairs();
+}
@@ -0,0 +1,306 @@
+#include "color_registration.h"
+
+#include <immintrin.h>
+#include <math.h>
+
+namespace {
+
+const uint32_t c_ALPHA = 0xff000000;
+const uint32_t c_BLACK = c_ALPHA;
+
+// Weights are scaled by c_WEIGHT_ONE, so products are scaled back with this
+const int c_WEIGHT_SHIFT = 7;
+static_assert(1 << c_WEIGHT_SHIFT == ColorRegistration::c_WEIGHT_ONE,
+              "c_WEIGHT_SHIFT has to match c_WEIGHT_ONE");
+
+typedef void (*GatherFunc)(const int32_t*, int, const uint8_t*, const uint8_t*, int, uint32_t*, int);
+typedef void (*BuildOffsetsFunc)(const float*, int, int, int, int32_t*, std::vector<int32_t>*);
+
+bool HasAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+const GatherFunc& GetGather() {
+  static const GatherFunc gather = HasAVX2() ? &GatherColorsAVX2 : &GatherColorsScalar;
+  return gather;
+}
+
+const BuildOffsetsFunc& GetBuildOffsets() {
+  static const BuildOffsetsFunc build = HasAVX2() ? &BuildOffsetsAVX2 : &BuildOffsetsScalar;
+  return build;
+}
+
+inline uint32_t Pack(int b, int g, int r) {
+  return c_ALPHA | (r << 16) | (g << 8) | b;
+}
+
+inline int Mix(int a, int b, int weight) {
+  return a + (((b - a)*weight) >> c_WEIGHT_SHIFT);
+}
+
+}
+
+ColorRegistration::ColorRegistration(int depth_count, int color_width, int color_height, bool bilinear)
+    : depth_count(depth_count), color_width(color_width), color_height(color_height), bilinear(bilinear) {
+  if (bilinear) {
+    bilinear_entries.resize(depth_count);
+  } else {
+    offsets.resize(depth_count);
+    edge_pixels.reserve(depth_count);
+  }
+}
+
+void ColorRegistration::SetUVMap(const float* uv) {
+  if (bilinear) {
+    SetUVMapBilinear(uv);
+  } else {
+    SetUVMapNearest(uv);
+  }
+}
+
+void ColorRegistration::SetUVMapNearest(const float* uv) {
+  edge_pixels.clear();
+  GetBuildOffsets()(uv, depth_count, color_width, color_height, &offsets[0], &edge_pixels);
+}
+
+void ColorRegistration::SetUVMapBilinear(const float* uv) {
+  for (int i = 0; i < depth_count; i++) {
+    BilinearEntry& entry = bilinear_entries[i];
+    float u = uv[2*i + 0];
+    float v = uv[2*i + 1];
+    // Same coverage as the nearest lookup
+    if (!(u >= 0 && u < 1 && v >= 0 && v < 1)) {
+      entry.offset = -1;
+      continue;
+    }
+    // Sample positions relative to pixel centers
+    float x = u*color_width - 0.5f;
+    float y = v*color_height - 0.5f;
+    // x and y are at least -0.5, so this is floor without the libm call
+    int col = (int)(x + 1.0f) - 1;
+    int row = (int)(y + 1.0f) - 1;
+    float frac_x = x - col;
+    float frac_y = y - row;
+    if (col < 0) {
+      col = 0;
+      frac_x = 0;
+    }
+    if (row < 0) {
+      row = 0;
+      frac_y = 0;
+    }
+    entry.offset = 3*(row*color_width + col);
+    entry.step_x = col + 1 < color_width ? 3 : 0;
+    entry.step_y = row + 1 < color_height ? 3*color_width : 0;
+    entry.weight_x = (uint16_t)(frac_x*c_WEIGHT_ONE + 0.5f);
+    entry.weight_y = (uint16_t)(frac_y*c_WEIGHT_ONE + 0.5f);
+  }
+}
+
+void ColorRegistration::Apply(const uint8_t* bgr, uint32_t* rgba, int point_stride) const {
+  if (bilinear) {
+    ApplyBilinear(bgr, NULL, 0, rgba, point_stride);
+    return;
+  }
+  GetGather()(&offsets[0], depth_count, bgr, NULL, 0, rgba, point_stride);
+  PatchEdgePixels(bgr, NULL, 0, rgba, point_stride);
+}
+
+void ColorRegistration::Apply(const uint8_t* bgr, const uint8_t* bgr_next, float weight,
+                              uint32_t* rgba, int point_stride) const {
+  int fixed_weight = (int)(weight*c_WEIGHT_ONE + 0.5f);
+  if (fixed_weight <= 0 || bgr_next == NULL) {
+    Apply(bgr, rgba, point_stride);
+    return;
+  }
+  if (fixed_weight >= c_WEIGHT_ONE) {
+    Apply(bgr_next, rgba, point_stride);
+    return;
+  }
+  if (bilinear) {
+    ApplyBilinear(bgr, bgr_next, fixed_weight, rgba, point_stride);
+    return;
+  }
+  GetGather()(&offsets[0], depth_count, bgr, bgr_next, fixed_weight, rgba, point_stride);
+  PatchEdgePixels(bgr, bgr_next, fixed_weight, rgba, point_stride);
+}
+
+void ColorRegistration::PatchEdgePixels(const uint8_t* bgr, const uint8_t* bgr_next, int weight,
+                                        uint32_t* rgba, int point_stride) const {
+  const int last_offset = 3*(color_width*color_height - 1);
+  for (size_t i = 0; i < edge_pixels.size(); i++) {
+    const uint8_t* pixel = bgr + last_offset;
+    int b = pixel[0];
+    int g = pixel[1];
+    int r = pixel[2];
+    if (weight > 0) {
+      const uint8_t* next = bgr_next + last_offset;
+      b = Mix(b, next[0], weight);
+      g = Mix(g, next[1], weight);
+      r = Mix(r, next[2], weight);
+    }
+    rgba[edge_pixels[i]*point_stride] = Pack(b, g, r);
+  }
+}
+
+void ColorRegistration::ApplyBilinear(const uint8_t* bgr, const uint8_t* bgr_next, int weight,
+                                      uint32_t* rgba, int point_stride) const {
+  const int one = c_WEIGHT_ONE;
+  const int shift = 14;
+  for (int i = 0; i < depth_count; i++) {
+    const BilinearEntry& entry = bilinear_entries[i];
+    if (entry.offset < 0) {
+      rgba[i*point_stride] = c_BLACK;
+      continue;
+    }
+    int wx = entry.weight_x;
+    int wy = entry.weight_y;
+    int channels[3];
+    for (int c = 0; c < 3; c++) {
+      const uint8_t* p = bgr + entry.offset + c;
+      int top = p[0]*(one - wx) + p[entry.step_x]*wx;
+      int bottom = p[entry.step_y]*(one - wx) + p[entry.step_y + entry.step_x]*wx;
+      channels[c] = (top*(one - wy) + bottom*wy + one*one/2) >> shift;
+      if (weight > 0) {
+        const uint8_t* n = bgr_next + entry.offset + c;
+        top = n[0]*(one - wx) + n[entry.step_x]*wx;
+        bottom = n[entry.step_y]*(one - wx) + n[entry.step_y + entry.step_x]*wx;
+        channels[c] = Mix(channels[c], (top*(one - wy) + bottom*wy + one*one/2) >> shift, weight);
+      }
+    }
+    rgba[i*point_stride] = Pack(channels[0], channels[1], channels[2]);
+  }
+}
+
+namespace {
+
+void BuildOffsetRange(const float* uv, int begin, int end, int width, int height,
+                      int32_t* offsets, std::vector<int32_t>* edge_pixels) {
+  const int32_t last_offset = 3*(width*height - 1);
+  for (int i = begin; i < end; i++) {
+    // floor rather than truncation, so slightly negative coordinates don't
+    // land in the first row or column
+    int col = (int)floorf(uv[2*i + 0]*width);
+    int row = (int)floorf(uv[2*i + 1]*height);
+    bool valid = col >= 0 && col < width && row >= 0 && row < height;
+    int32_t offset = valid ? 3*(row*width + col) : -1;
+    if (offset == last_offset) {
+      edge_pixels->push_back(i);
+      offset = -1;
+    }
+    offsets[i] = offset;
+  }
+}
+
+}
+
+void BuildOffsetsScalar(const float* uv, int count, int width, int height,
+                        int32_t* offsets, std::vector<int32_t>* edge_pixels) {
+  BuildOffsetRange(uv, 0, count, width, height, offsets, edge_pixels);
+}
+
+__attribute__((target("avx2")))
+void BuildOffsetsAVX2(const float* uv, int count, int width, int height,
+                      int32_t* offsets, std::vector<int32_t>* edge_pixels) {
+  const __m256 width_f = _mm256_set1_ps(width);
+  const __m256 height_f = _mm256_set1_ps(height);
+  const __m256i width_v = _mm256_set1_epi32(width);
+  const __m256i height_v = _mm256_set1_epi32(height);
+  const __m256i minus_one = _mm256_set1_epi32(-1);
+  const __m256i last_offset = _mm256_set1_epi32(3*(width*height - 1));
+  // Undoes the lane interleaving of _mm256_shuffle_ps across two registers
+  const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 a = _mm256_loadu_ps(uv + 2*i);
+    __m256 b = _mm256_loadu_ps(uv + 2*i + 8);
+    __m256 u = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), order);
+    __m256 v = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), order);
+    // NaN and huge coordinates convert to INT_MIN and fail the range test
+    __m256i col = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(u, width_f)));
+    __m256i row = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_mul_ps(v, height_f)));
+    __m256i valid = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi32(col, minus_one), _mm256_cmpgt_epi32(width_v, col)),
+        _mm256_and_si256(_mm256_cmpgt_epi32(row, minus_one), _mm256_cmpgt_epi32(height_v, row)));
+    __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(row, width_v), col);
+    __m256i offset = _mm256_add_epi32(index, _mm256_add_epi32(index, index));
+    offset = _mm256_blendv_epi8(minus_one, offset, valid);
+    __m256i edge = _mm256_cmpeq_epi32(offset, last_offset);
+    int edge_mask = _mm256_movemask_ps(_mm256_castsi256_ps(edge));
+    if (edge_mask) {
+      for (int j = 0; j < 8; j++) {
+        if (edge_mask & (1 << j)) {
+          edge_pixels->push_back(i + j);
+        }
+      }
+      offset = _mm256_blendv_epi8(offset, minus_one, edge);
+    }
+    _mm256_storeu_si256((__m256i*)(offsets + i), offset);
+  }
+  BuildOffsetRange(uv, i, count, width, height, offsets, edge_pixels);
+}
+
+void GatherColorsScalar(const int32_t* offsets, int count, const uint8_t* bgr, const uint8_t* bgr_next,
+                        int weight, uint32_t* rgba, int point_stride) {
+  for (int i = 0; i < count; i++) {
+    int32_t offset = offsets[i];
+    if (offset < 0) {
+      rgba[i*point_stride] = c_BLACK;
+      continue;
+    }
+    const uint8_t* pixel = bgr + offset;
+    int b = pixel[0];
+    int g = pixel[1];
+    int r = pixel[2];
+    if (weight > 0) {
+      const uint8_t* next = bgr_next + offset;
+      b = Mix(b, next[0], weight);
+      g = Mix(g, next[1], weight);
+      r = Mix(r, next[2], weight);
+    }
+    rgba[i*point_stride] = Pack(b, g, r);
+  }
+}
+
+// Gathers 4 bytes at each offset (the BGR pixel plus the next byte, which is
+// masked off), 8 pixels at a time.
+__attribute__((target("avx2")))
+void GatherColorsAVX2(const int32_t* offsets, int count, const uint8_t* bgr, const uint8_t* bgr_next,
+                      int weight, uint32_t* rgba, int point_stride) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i invalid = _mm256_set1_epi32(-1);
+  const __m256i rgb_mask = _mm256_set1_epi32(0x00ffffff);
+  const __m256i alpha = _mm256_set1_epi32(c_ALPHA);
+  const __m256i weight_v = _mm256_set1_epi16(weight);
+  uint32_t colors[8] __attribute__((aligned(32)));
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i offset = _mm256_loadu_si256((const __m256i*)(offsets + i));
+    __m256i valid = _mm256_cmpgt_epi32(offset, invalid);
+    __m256i color = _mm256_mask_i32gather_epi32(zero, (const int*)bgr, offset, valid, 1);
+    if (weight > 0) {
+      __m256i next = _mm256_mask_i32gather_epi32(zero, (const int*)bgr_next, offset, valid, 1);
+      // color + (next - color)*weight, per byte in 16 bit lanes
+      __m256i lo = _mm256_unpacklo_epi8(color, zero);
+      __m256i hi = _mm256_unpackhi_epi8(color, zero);
+      __m256i lo_diff = _mm256_sub_epi16(_mm256_unpacklo_epi8(next, zero), lo);
+      __m256i hi_diff = _mm256_sub_epi16(_mm256_unpackhi_epi8(next, zero), hi);
+      lo = _mm256_add_epi16(lo, _mm256_srai_epi16(_mm256_mullo_epi16(lo_diff, weight_v), c_WEIGHT_SHIFT));
+      hi = _mm256_add_epi16(hi, _mm256_srai_epi16(_mm256_mullo_epi16(hi_diff, weight_v), c_WEIGHT_SHIFT));
+      color = _mm256_packus_epi16(lo, hi);
+    }
+    color = _mm256_or_si256(_mm256_and_si256(color, rgb_mask), alpha);
+    if (point_stride == 1) {
+      _mm256_storeu_si256((__m256i*)(rgba + i), color);
+      continue;
+    }
+    _mm256_store_si256((__m256i*)colors, color);
+    for (int j = 0; j < 8; j++) {
+      rgba[(i + j)*point_stride] = colors[j];
+    }
+  }
+  GatherColorsScalar(offsets + i, count - i, bgr, bgr_next, weight, rgba + i*point_stride, point_stride);
+}
@@ -0,0 +1,324 @@
+#include "depth_codec.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "thread_pool.h"
+
+namespace {
+
+// Residuals are coded in blocks of c_BLOCK pixels. A block starts with a byte
+// holding the bit width of its largest zigzagged residual, followed by every
+// residual packed in that many bits. A byte with the high bit set stands for
+// (byte & 0x7f) + 1 blocks of zeros instead.
+const int c_BLOCK = 16;
+const int c_MAX_WIDTH = 16;
+const int c_MAX_ZERO_BLOCKS = 128;
+const uint8_t c_ZERO_BLOCKS = 0x80;
+// The decoder reads 8 bytes at a time, so bands end with this much padding
+const int c_PADDING = 8;
+
+inline uint16_t ZigZag(int residual) {
+  int16_t r = residual;
+  return (uint16_t)((r << 1) ^ (r >> 15));
+}
+
+inline int16_t UnZigZag(uint32_t z) {
+  return (int16_t)((z >> 1) ^ -(z & 1));
+}
+
+inline int BitWidth(uint32_t bits) {
+  return bits == 0 ? 0 : 32 - __builtin_clz(bits);
+}
+
+inline int PackedBytes(int count, int width) {
+  return (count*width + 7)/8;
+}
+
+// Bytes the residuals take with the block coding, to pick the cheaper
+// prediction for a band.
+int CodedSize(const uint16_t* residuals, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i += c_BLOCK) {
+    int n = std::min(c_BLOCK, count - i);
+    uint32_t bits = 0;
+    for (int j = 0; j < n; j++) {
+      bits |= residuals[i + j];
+    }
+    size += 1 + PackedBytes(n, BitWidth(bits));
+  }
+  return size;
+}
+
+// Writes the residuals as blocks to out, which has room for the worst case.
+// Returns the bytes written.
+size_t PutBlocks(const uint16_t* residuals, int count, uint8_t* out) {
+  uint8_t* start = out;
+  int zero_blocks = 0;
+  for (int i = 0; i < count; i += c_BLOCK) {
+    int n = std::min(c_BLOCK, count - i);
+    uint32_t bits = 0;
+    for (int j = 0; j < n; j++) {
+      bits |= residuals[i + j];
+    }
+    if (bits == 0 && zero_blocks < c_MAX_ZERO_BLOCKS) {
+      zero_blocks++;
+      continue;
+    }
+    if (zero_blocks > 0) {
+      *out++ = c_ZERO_BLOCKS | (zero_blocks - 1);
+      zero_blocks = 0;
+      if (bits == 0) {
+        zero_blocks = 1;
+        continue;
+      }
+    }
+    int width = BitWidth(bits);
+    *out++ = width;
+    uint64_t pending = 0;
+    int pending_bits = 0;
+    for (int j = 0; j < n; j++) {
+      pending |= (uint64_t)residuals[i + j] << pending_bits;
+      pending_bits += width;
+      while (pending_bits >= 8) {
+        *out++ = (uint8_t)pending;
+        pending >>= 8;
+        pending_bits -= 8;
+      }
+    }
+    if (pending_bits > 0) {
+      *out++ = (uint8_t)pending;
+    }
+  }
+  if (zero_blocks > 0) {
+    *out++ = c_ZERO_BLOCKS | (zero_blocks - 1);
+  }
+  memset(out, 0, c_PADDING);
+  return out + c_PADDING - start;
+}
+
+// Unpacks count residuals from a band's blocks. Returns false if the data
+// runs out early, runs over or is damaged.
+bool GetBlocks(const uint8_t* data, const uint8_t* end, int count, int16_t* residuals) {
+  end -= c_PADDING;
+  int i = 0;
+  while (i < count) {
+    if (data >= end) {
+      return false;
+    }
+    uint8_t header = *data++;
+    if (header & c_ZERO_BLOCKS) {
+      int n = std::min(count - i, ((header & ~c_ZERO_BLOCKS) + 1)*c_BLOCK);
+      memset(residuals + i, 0, n*sizeof(int16_t));
+      i += n;
+      continue;
+    }
+    int n = std::min(c_BLOCK, count - i);
+    int width = header;
+    if (width > c_MAX_WIDTH || data + PackedBytes(n, width) > end) {
+      return false;
+    }
+    const uint32_t mask = (1u << width) - 1;
+    for (int j = 0; j < n; j++) {
+      int bit = j*width;
+      uint64_t word;
+      memcpy(&word, data + (bit >> 3), sizeof(word));
+      residuals[i + j] = UnZigZag((word >> (bit & 7)) & mask);
+    }
+    data += PackedBytes(n, width);
+    i += n;
+  }
+  return data == end;
+}
+
+// With the gradient predictor a pixel is the one above it plus the sum of
+// the residuals to its left, so the only dependency between pixels is one add.
+void DecodeSpatial(const int16_t* residuals, int width, int rows, int stride, int16_t* plane) {
+  const int row_stride = width*stride;
+  // The first row of a band only looks left, so bands decode on their own
+  uint16_t sum = 0;
+  for (int col = 0; col < width; col++) {
+    sum += residuals[col];
+    plane[col*stride] = sum;
+  }
+  for (int row = 1; row < rows; row++) {
+    int16_t* out = plane + row*row_stride;
+    const int16_t* up = out - row_stride;
+    const int16_t* residual = residuals + row*width;
+    sum = 0;
+    for (int col = 0; col < width; col++) {
+      sum += residual[col];
+      out[col*stride] = (uint16_t)up[col*stride] + sum;
+    }
+  }
+}
+
+void DecodeTemporal(const int16_t* residuals, int count, int stride,
+                    const int16_t* previous, int16_t* plane) {
+  for (int i = 0; i < count; i++) {
+    plane[i*stride] = (int16_t)(previous[i*stride] + residuals[i]);
+  }
+}
+
+}
+
+DepthCodec::DepthCodec(int width, int height, int band_rows)
+    : width(width), height(height), band_rows(band_rows),
+      band_count((height + band_rows - 1)/band_rows), bands(band_count), band_offsets(band_count + 1),
+      coding_plane(NULL), coding_previous(NULL), coding_stride(1), decoding_data(NULL),
+      decoding_plane(NULL) {
+  for (int i = 0; i < band_count; i++) {
+    bands[i].spatial.resize(width*band_rows);
+    bands[i].temporal.resize(width*band_rows);
+    int blocks = (width*band_rows + c_BLOCK - 1)/c_BLOCK;
+    bands[i].data.resize(1 + blocks*(1 + PackedBytes(c_BLOCK, c_MAX_WIDTH)) + c_PADDING);
+  }
+}
+
+int DepthCodec::BandCount() const {
+  return band_count;
+}
+
+void DepthCodec::EncodeBand(int band, const int16_t* plane, const int16_t* previous, int stride) {
+  Band& b = bands[band];
+  const int row_begin = band*band_rows;
+  const int rows = std::min(band_rows, height - row_begin);
+  const int row_stride = width*stride;
+  plane += row_begin*row_stride;
+
+  // The gradient predictor, left + up - up_left. The first row of a band
+  // only looks left, so bands decode independently.
+  uint16_t* spatial = &b.spatial[0];
+  int16_t left = 0;
+  for (int col = 0; col < width; col++) {
+    spatial[col] = ZigZag(plane[col*stride] - left);
+    left = plane[col*stride];
+  }
+  for (int row = 1; row < rows; row++) {
+    const int16_t* in = plane + row*row_stride;
+    const int16_t* up = in - row_stride;
+    uint16_t* residual = spatial + row*width;
+    int16_t left_delta = 0;
+    for (int col = 0; col < width; col++) {
+      int16_t delta = in[col*stride] - up[col*stride];
+      residual[col] = ZigZag(delta - left_delta);
+      left_delta = delta;
+    }
+  }
+
+  const uint16_t* residuals = spatial;
+  uint8_t mode = PREDICT_SPATIAL;
+  if (previous != NULL) {
+    previous += row_begin*row_stride;
+    uint16_t* temporal = &b.temporal[0];
+    for (int i = 0; i < rows*width; i++) {
+      temporal[i] = ZigZag(plane[i*stride] - previous[i*stride]);
+    }
+    if (CodedSize(temporal, rows*width) < CodedSize(spatial, rows*width)) {
+      residuals = temporal;
+      mode = PREDICT_TEMPORAL;
+    }
+  }
+
+  b.data[0] = mode;
+  b.size = 1 + PutBlocks(residuals, rows*width, &b.data[1]);
+}
+
+size_t DepthCodec::Encode(const int16_t* plane, const int16_t* previous, int stride,
+                          std::vector<uint8_t>* out, ThreadPool* pool) {
+  coding_plane = plane;
+  coding_previous = previous;
+  coding_stride = stride;
+  ThreadPool::Run(pool, band_count, [this](int band) {
+    EncodeBand(band, coding_plane, coding_previous, coding_stride);
+  });
+
+  size_t start = out->size();
+  size_t size = sizeof(PlaneHeader) + band_count*sizeof(uint32_t);
+  for (int band = 0; band < band_count; band++) {
+    size += bands[band].size;
+  }
+  out->resize(start + size);
+  uint8_t* dest = &(*out)[start];
+
+  PlaneHeader header;
+  header.width = width;
+  header.height = height;
+  header.band_rows = band_rows;
+  header.reserved = 0;
+  memcpy(dest, &header, sizeof(header));
+  dest += sizeof(header);
+  for (int band = 0; band < band_count; band++) {
+    uint32_t band_size = bands[band].size;
+    memcpy(dest, &band_size, sizeof(band_size));
+    dest += sizeof(band_size);
+  }
+  for (int band = 0; band < band_count; band++) {
+    memcpy(dest, &bands[band].data[0], bands[band].size);
+    dest += bands[band].size;
+  }
+  return size;
+}
+
+bool DepthCodec::DecodeBand(int band) {
+  const uint8_t* begin = decoding_data + band_offsets[band];
+  const uint8_t* end = decoding_data + band_offsets[band + 1];
+  const int row_begin = band*band_rows;
+  const int rows = std::min(band_rows, height - row_begin);
+  const size_t first = (size_t)row_begin*width*coding_stride;
+  if (end - begin < 1 + c_PADDING) {
+    return false;
+  }
+  uint8_t mode = *begin++;
+  // The band's encoder scratch holds the residuals
+  int16_t* residuals = (int16_t*)&bands[band].spatial[0];
+  if (!GetBlocks(begin, end, rows*width, residuals)) {
+    return false;
+  }
+  if (mode == PREDICT_SPATIAL) {
+    DecodeSpatial(residuals, width, rows, coding_stride, decoding_plane + first);
+    return true;
+  }
+  if (mode == PREDICT_TEMPORAL && coding_previous != NULL) {
+    DecodeTemporal(residuals, rows*width, coding_stride, coding_previous + first, decoding_plane + first);
+    return true;
+  }
+  return false;
+}
+
+bool DepthCodec::Decode(const uint8_t* data, size_t size, const int16_t* previous, int stride,
+                        int16_t* plane, ThreadPool* pool) {
+  PlaneHeader header;
+  size_t table_size = sizeof(header) + band_count*sizeof(uint32_t);
+  if (size < table_size) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.width != width || header.height != height || header.band_rows != band_rows) {
+    return false;
+  }
+
+  band_offsets[0] = table_size;
+  for (int band = 0; band < band_count; band++) {
+    uint32_t band_size;
+    memcpy(&band_size, data + sizeof(header) + band*sizeof(uint32_t), sizeof(band_size));
+    band_offsets[band + 1] = band_offsets[band] + band_size;
+  }
+  if (band_offsets[band_count] != size) {
+    return false;
+  }
+
+  coding_previous = previous;
+  coding_stride = stride;
+  decoding_data = data;
+  decoding_plane = plane;
+  ThreadPool::Run(pool, band_count, [this](int band) {
+    bands[band].decoded = DecodeBand(band);
+  });
+  for (int band = 0; band < band_count; band++) {
+    if (!bands[band].decoded) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,201 @@
+#include "depth_conversion.h"
+
+#include <immintrin.h>
+#include <limits>
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+typedef void (*ConvertFunc)(const int16_t*, int, int16_t, int16_t, float*, int, const uint32_t*);
+typedef void (*StreamFunc)(const int16_t*, int, int16_t, int16_t, const uint32_t*, StreamPoint*);
+
+struct Kernel {
+  ConvertFunc func;
+  StreamFunc stream;
+  const char* name;
+};
+
+Kernel SelectKernel() {
+  __builtin_cpu_init();
+  Kernel kernel;
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.func = &ConvertVerticesAVX2;
+    kernel.stream = &ConvertStreamPointsAVX2;
+    kernel.name = "avx2";
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    kernel.func = &ConvertVerticesSSE41;
+    kernel.stream = &ConvertStreamPointsScalar;
+    kernel.name = "sse4.1";
+  } else {
+    kernel.func = &ConvertVerticesScalar;
+    kernel.stream = &ConvertStreamPointsScalar;
+    kernel.name = "scalar";
+  }
+  return kernel;
+}
+
+const Kernel& GetKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+// The color sits right after the (x, y, z, w) floats, in the same cache line
+inline void SetColor(float* point, uint32_t color) {
+  memcpy(point + 4, &color, sizeof(color));
+}
+
+// pcl keeps the color as 0xAARRGGBB, streams as the bytes R, G, B, A
+inline uint32_t StreamColor(uint32_t rgba) {
+  return (rgba & 0xff00ff00) | ((rgba >> 16) & 0xff) | ((rgba & 0xff) << 16);
+}
+
+}
+
+void ConvertVertices(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                     float* points, int point_stride, const uint32_t* colors) {
+  GetKernel().func(vertices, count, min_z, max_z, points, point_stride, colors);
+}
+
+void ConvertStreamPoints(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                         const uint32_t* colors, StreamPoint* points) {
+  GetKernel().stream(vertices, count, min_z, max_z, colors, points);
+}
+
+const char* ConvertVerticesKernelName() {
+  return GetKernel().name;
+}
+
+void SetVertexDepths(const int16_t* vertices, const int16_t* z, int count, int16_t* out) {
+  for (int i = 0; i < count; i++) {
+    const int16_t* vertex = vertices + 3*i;
+    int16_t original = vertex[2];
+    float scale = original > 0 ? (float)z[i]/original : 1.0f;
+    out[3*i] = (int16_t)lrintf(vertex[0]*scale);
+    out[3*i + 1] = (int16_t)lrintf(vertex[1]*scale);
+    out[3*i + 2] = z[i];
+  }
+}
+
+void ConvertVerticesScalar(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                           float* points, int point_stride, const uint32_t* colors) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (int i = 0; i < count; i++) {
+    const int16_t* vertex = vertices + 3*i;
+    float* point = points + i*point_stride;
+    bool valid = vertex[2] >= min_z && vertex[2] <= max_z;
+    point[0] = valid ? vertex[0] : nan;
+    point[1] = valid ? vertex[1] : nan;
+    point[2] = valid ? vertex[2] : nan;
+    point[3] = 1.0f;
+    if (colors != NULL) {
+      SetColor(point, colors[i]);
+    }
+  }
+}
+
+// One point per register: (x, y, z, 1), with the range test broadcast from
+// the z lane into a mask.
+__attribute__((target("sse4.1")))
+void ConvertVerticesSSE41(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                          float* points, int point_stride, const uint32_t* colors) {
+  const __m128 nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 min_v = _mm_set1_ps(min_z);
+  const __m128 max_v = _mm_set1_ps(max_z);
+  // The w lane is never replaced by NaN
+  const __m128 w_mask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+  // Each load reads 8 bytes, 2 past the end of the vertex, so the last
+  // vertex is left to the scalar loop.
+  int i = 0;
+  for (; i < count - 1; i++) {
+    __m128i raw = _mm_loadl_epi64((const __m128i*)(vertices + 3*i));
+    __m128 v = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(raw));
+    v = _mm_blend_ps(v, one, 0x8);
+    __m128 z = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2));
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(z, min_v), _mm_cmple_ps(z, max_v));
+    valid = _mm_or_ps(valid, w_mask);
+    _mm_storeu_ps(points + i*point_stride, _mm_blendv_ps(nan, v, valid));
+    if (colors != NULL) {
+      SetColor(points + i*point_stride, colors[i]);
+    }
+  }
+  ConvertVerticesScalar(vertices + 3*i, count - i, min_z, max_z, points + i*point_stride, point_stride,
+      colors != NULL ? colors + i : NULL);
+}
+
+// Two points per register, one in each 128 bit lane.
+__attribute__((target("avx2")))
+void ConvertVerticesAVX2(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                         float* points, int point_stride, const uint32_t* colors) {
+  const __m256 nan = _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 min_v = _mm256_set1_ps(min_z);
+  const __m256 max_v = _mm256_set1_ps(max_z);
+  const __m256 w_mask = _mm256_castsi256_ps(_mm256_set_epi32(-1, 0, 0, 0, -1, 0, 0, 0));
+  // (x0, y0, z0, 0, x1, y1, z1, 0) as int16 from 2 packed vertices
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+
+  // Each load reads 16 bytes for 12 bytes of vertices, so stop while a full
+  // load still fits.
+  int i = 0;
+  for (; i + 2 < count; i += 2) {
+    __m128i raw = _mm_loadu_si128((const __m128i*)(vertices + 3*i));
+    __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_shuffle_epi8(raw, spread)));
+    v = _mm256_blend_ps(v, one, 0x88);
+    __m256 z = _mm256_permute_ps(v, _MM_SHUFFLE(2, 2, 2, 2));
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(z, min_v, _CMP_GE_OQ), _mm256_cmp_ps(z, max_v, _CMP_LE_OQ));
+    valid = _mm256_or_ps(valid, w_mask);
+    v = _mm256_blendv_ps(nan, v, valid);
+    _mm_storeu_ps(points + i*point_stride, _mm256_castps256_ps128(v));
+    _mm_storeu_ps(points + (i + 1)*point_stride, _mm256_extractf128_ps(v, 1));
+    if (colors != NULL) {
+      SetColor(points + i*point_stride, colors[i]);
+      SetColor(points + (i + 1)*point_stride, colors[i + 1]);
+    }
+  }
+  ConvertVerticesScalar(vertices + 3*i, count - i, min_z, max_z, points + i*point_stride, point_stride,
+      colors != NULL ? colors + i : NULL);
+}
+
+void ConvertStreamPointsScalar(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                               const uint32_t* colors, StreamPoint* points) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (int i = 0; i < count; i++) {
+    const int16_t* vertex = vertices + 3*i;
+    StreamPoint& point = points[i];
+    bool valid = vertex[2] >= min_z && vertex[2] <= max_z;
+    point.x = valid ? vertex[0] : nan;
+    point.y = valid ? vertex[1] : nan;
+    point.z = valid ? vertex[2] : nan;
+    point.rgba = StreamColor(colors[i]);
+  }
+}
+
+// Two points per register like ConvertVerticesAVX2, with their colors
+// swizzled and blended into the w lanes, so both go out in one store.
+__attribute__((target("avx2")))
+void ConvertStreamPointsAVX2(const int16_t* vertices, int count, int16_t min_z, int16_t max_z,
+                             const uint32_t* colors, StreamPoint* points) {
+  const __m256 nan = _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN());
+  const __m256 min_v = _mm256_set1_ps(min_z);
+  const __m256 max_v = _mm256_set1_ps(max_z);
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+  // Swaps the R and B bytes of two colors, then moves them to lanes 3 and 7
+  const __m128i swizzle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i color_lanes = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+
+  int i = 0;
+  for (; i + 2 < count; i += 2) {
+    __m128i raw = _mm_loadu_si128((const __m128i*)(vertices + 3*i));
+    __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_shuffle_epi8(raw, spread)));
+    __m256 z = _mm256_permute_ps(v, _MM_SHUFFLE(2, 2, 2, 2));
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(z, min_v, _CMP_GE_OQ), _mm256_cmp_ps(z, max_v, _CMP_LE_OQ));
+    v = _mm256_blendv_ps(nan, v, valid);
+    __m128i rgba = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)(colors + i)), swizzle);
+    __m256 c = _mm256_castsi256_ps(_mm256_permutevar8x32_epi32(_mm256_castsi128_si256(rgba), color_lanes));
+    _mm256_storeu_ps(&points[i].x, _mm256_blend_ps(v, c, 0x88));
+  }
+  ConvertStreamPointsScalar(vertices + 3*i, count - i, min_z, max_z, colors + i, points + i);
+}
@@ -0,0 +1,173 @@
+#include "depthsense_source.h"
+
+#include <iostream>
+#include <stdio.h>
+using namespace std;
+
+using namespace DepthSense;
+
+DepthSenseSource::DepthSenseSource(int device_index) : device_index(device_index), device_found(false) {}
+
+void DepthSenseSource::OnNewDepthSample(DepthNode node, DepthNode::NewSampleReceivedData data) {
+  DepthFrame frame;
+  frame.timestamp = data.timeOfCapture;
+  frame.vertices = (const ::Vertex*)(const DepthSense::Vertex*)data.vertices;
+  frame.uv_map = (const ::UV*)(const DepthSense::UV*)data.uvMap;
+  frame.confidence = data.confidenceMap;
+  const IntrinsicParameters& intrinsics = data.stereoCameraParameters.depthIntrinsics;
+  frame.intrinsics.fx = intrinsics.fx;
+  frame.intrinsics.fy = intrinsics.fy;
+  frame.intrinsics.cx = intrinsics.cx;
+  frame.intrinsics.cy = intrinsics.cy;
+  frame.dropped = data.droppedSampleCount;
+  sink->OnDepthFrame(frame);
+}
+
+void DepthSenseSource::OnNewColorSample(ColorNode node, ColorNode::NewSampleReceivedData data) {
+  ColorFrame frame;
+  frame.timestamp = data.timeOfCapture;
+  frame.bgr = data.colorMap;
+  frame.dropped = data.droppedSampleCount;
+  sink->OnColorFrame(frame);
+}
+
+void DepthSenseSource::ConfigureDepthNode() {
+  dnode.newSampleReceivedEvent().connect(this, &DepthSenseSource::OnNewDepthSample);
+
+  DepthNode::Configuration config = dnode.getConfiguration();
+  config.frameFormat = FRAME_FORMAT_QVGA;
+  config.framerate = 60;
+  config.mode = DepthNode::CAMERA_MODE_CLOSE_MODE;
+  config.saturation = true;
+
+  dnode.setEnableVertices(true);
+  dnode.setEnableUvMap(true);
+  //dnode.setEnableDepthMap( true );
+  //dnode.setEnableAccelerometer( true );
+  dnode.setEnableConfidenceMap(true);
+
+  try {
+    context.requestControl(dnode,0);
+    dnode.setConfiguration(config);
+  } catch (ArgumentException& e) {
+    printf("Argument Exception: %s\n",e.what());
+  } catch (UnauthorizedAccessException& e) {
+    printf("Unauthorized Access Exception: %s\n",e.what());
+  } catch (IOException& e) {
+    printf("IO Exception: %s\n",e.what());
+  } catch (InvalidOperationException& e) {
+    printf("Invalid Operation Exception: %s\n",e.what());
+  } catch (ConfigurationException& e) {
+    printf("Configuration Exception: %s\n",e.what());
+  } catch (StreamingException& e) {
+    printf("Streaming Exception: %s\n",e.what());
+  } catch (TimeoutException&) {
+    printf("TimeoutException\n");
+  }
+}
+
+void DepthSenseSource::ConfigureColorNode() {
+  cnode.newSampleReceivedEvent().connect(this, &DepthSenseSource::OnNewColorSample);
+
+  ColorNode::Configuration config = cnode.getConfiguration();
+  config.frameFormat = FRAME_FORMAT_VGA;
+  config.compression = COMPRESSION_TYPE_MJPEG;
+  config.powerLineFrequency = POWER_LINE_FREQUENCY_50HZ;
+  config.framerate = 30;
+
+  cnode.setEnableColorMap(true);
+
+  try {
+    context.requestControl(cnode,0);
+    cnode.setConfiguration(config);
+  } catch (ArgumentException& e) {
+    printf("Argument Exception: %s\n",e.what());
+  } catch (UnauthorizedAccessException& e) {
+    printf("Unauthorized Access Exception: %s\n",e.what());
+  } catch (IOException& e) {
+    printf("IO Exception: %s\n",e.what());
+  } catch (InvalidOperationException& e) {
+    printf("Invalid Operation Exception: %s\n",e.what());
+  } catch (ConfigurationException& e) {
+    printf("Configuration Exception: %s\n",e.what());
+  } catch (StreamingException& e) {
+    printf("Streaming Exception: %s\n",e.what());
+  } catch (TimeoutException&) {
+    printf("TimeoutException\n");
+  }
+}
+
+void DepthSenseSource::ConfigureNode(Node node) {
+  if ((node.is<DepthNode>())&&(!dnode.isSet())) {
+    dnode = node.as<DepthNode>();
+    ConfigureDepthNode();
+    context.registerNode(node);
+  } else if ((node.is<ColorNode>())&&(!cnode.isSet())) {
+    cnode = node.as<ColorNode>();
+    ConfigureColorNode();
+    context.registerNode(node);
+  }
+}
+
+void DepthSenseSource::OnNodeConnected(Device device, Device::NodeAddedData data) {
+  ConfigureNode(data.node);
+}
+
+void DepthSenseSource::OnNodeDisconnected(Device device, Device::NodeRemovedData data) {
+  if (data.node.is<ColorNode>() && (data.node.as<ColorNode>() == cnode)) {
+    cnode.unset();
+  } else if (data.node.is<DepthNode>() && (data.node.as<DepthNode>() == dnode)) {
+    dnode.unset();
+  }
+  printf("Node disconnected\n");
+}
+
+void DepthSenseSource::OnDeviceConnected(Context context, Context::DeviceAddedData data) {
+  // Only the device that is now at our index
+  vector<Device> da = context.getDevices();
+  if (!device_found && device_index < (int)da.size() && da[device_index].getSerialNumber() == data.device.getSerialNumber()) {
+    data.device.nodeAddedEvent().connect(this, &DepthSenseSource::OnNodeConnected);
+    data.device.nodeRemovedEvent().connect(this, &DepthSenseSource::OnNodeDisconnected);
+    device_found = true;
+  }
+}
+
+void DepthSenseSource::OnDeviceDisconnected(Context context, Context::DeviceRemovedData data) {
+  device_found = false;
+  printf("Device disconnected\n");
+}
+
+bool DepthSenseSource::Run() {
+  context = Context::create("localhost");
+  context.deviceAddedEvent().connect(this, &DepthSenseSource::OnDeviceConnected);
+  context.deviceRemovedEvent().connect(this, &DepthSenseSource::OnDeviceDisconnected);
+
+  // get list of devices already connected
+  vector<Device> da = context.getDevices();
+
+  if (device_index < (int)da.size()) {
+    device_found = true;
+    da[device_index].nodeAddedEvent().connect(this, &DepthSenseSource::OnNodeConnected);
+    da[device_index].nodeRemovedEvent().connect(this, &DepthSenseSource::OnNodeDisconnected);
+    vector<Node> na = da[device_index].getNodes();
+    cout << "found " << (int)na.size() << " nodes\n";
+    for (int n = 0; n < (int)na.size(); n++) {
+      ConfigureNode(na[n]);
+    }
+  }
+
+  context.startNodes();
+  context.run();
+  context.stopNodes();
+  if (cnode.isSet()) {
+    context.unregisterNode(cnode);
+  }
+  if (dnode.isSet()) {
+    context.unregisterNode(dnode);
+  }
+  return true;
+}
+
+void DepthSenseSource::Stop() {
+  context.quit();
+}
@@ -0,0 +1,214 @@
+#include "gl_cloud_viewer.h"
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+#include <GL/freeglut.h>
+
+#include <chrono>
+#include <stddef.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#include "gl_canvas.h"
+#include "metrics.h"
+#include "point_renderer.h"
+
+// The capture side writes StreamPoints into memory the renderer reads as
+// PointVertex
+static_assert(sizeof(StreamPoint) == sizeof(PointVertex) &&
+              offsetof(StreamPoint, rgba) == offsetof(PointVertex, rgba),
+              "StreamPoint and PointVertex must have the same layout");
+
+namespace {
+
+// The window starts out at twice the size of a depth image, and the points
+// are drawn at that size however the window is resized
+const int c_WIDTH = 640;
+const int c_HEIGHT = 480;
+
+// How long the window thread sleeps when there is nothing new to draw
+const int c_IDLE_SLEEP_MS = 2;
+
+// Draws that can be timed before the first of them is read back
+const int c_TIMER_QUERIES = 4;
+
+}
+
+GlCloudViewer* GlCloudViewer::s_viewer = NULL;
+
+GlCloudViewer::GlCloudViewer(const std::string& title, int max_points)
+    : title(title), max_points(max_points), window(0), window_width(c_WIDTH), window_height(c_HEIGHT),
+      canvas(NULL), renderer(NULL), show_stage(NULL), redraw(true), point_budget(NULL),
+      queries_issued(0), queries_read(0), drew_cloud(false), closing(false) {}
+
+GlCloudViewer::~GlCloudViewer() {
+  if (window != 0) {
+    glutSetWindow(window);
+    Release();
+    glutCloseFunc(NULL);
+    glutDestroyWindow(window);
+  }
+  s_viewer = NULL;
+}
+
+bool GlCloudViewer::Open() {
+  int argc = 1;
+  char* argv[1] = {(char*)title.c_str()};
+  glutInit(&argc, argv);
+  glutInitContextVersion(3, 3);
+  glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_ALPHA);
+  glutInitWindowSize(c_WIDTH, c_HEIGHT);
+  // Closing the window ends Show rather than the process
+  glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_CONTINUE_EXECUTION);
+  window = glutCreateWindow(title.c_str());
+  s_viewer = this;
+  glutDisplayFunc(&OnDisplay);
+  glutReshapeFunc(&OnReshape);
+  glutCloseFunc(&OnClose);
+
+  glewExperimental = GL_TRUE;
+  GLenum error = glewInit();
+  if (error != GLEW_OK) {
+    printf("Couldn't initialize GLEW: %s\n", glewGetErrorString(error));
+    return false;
+  }
+  if (!GLEW_VERSION_3_3) {
+    printf("The GL viewer needs OpenGL 3.3, this is %s\n", glGetString(GL_VERSION));
+    return false;
+  }
+  glDisable(GL_DEPTH_TEST);
+  glClearColor(0, 0, 0, 0);
+
+  // The canvas first, the stages set their attributes up in its vertex array
+  canvas = new GLCanvas();
+  renderer = new PointRenderer("points", c_WIDTH, c_HEIGHT, max_points);
+  show_stage = new PipelineStage("show_points", c_WIDTH, c_HEIGHT, "shaders/show_points.frag");
+  std::vector<PipelineSource*> sources(1, renderer);
+  std::vector<PipelineStage*> stages(1, show_stage);
+  canvas->SetStages(sources, stages);
+  timer_queries.resize(c_TIMER_QUERIES);
+  glGenQueries(c_TIMER_QUERIES, &timer_queries[0]);
+  return true;
+}
+
+void GlCloudViewer::SetPointBudget(PointBudget* budget) {
+  point_budget = budget;
+}
+
+void GlCloudViewer::SetIdleCallback(const std::function<void()>& idle) {
+  on_idle = idle;
+}
+
+void GlCloudViewer::Show() {
+  while (!closing) {
+    glutMainLoopEvent();
+    // The window may have been closed in there, taking the renderer along
+    if (closing) {
+      break;
+    }
+    if (on_idle) {
+      on_idle();
+    }
+    if (redraw || renderer->HasNewCloud()) {
+      Draw();
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(c_IDLE_SLEEP_MS));
+    }
+  }
+}
+
+void GlCloudViewer::Close() {
+  closing = true;
+}
+
+void GlCloudViewer::Draw() {
+  METRICS_SCOPE(STAGE_DISPLAY);
+  ReadDrawTimes();
+  // With every query still waiting on the GPU, this draw goes untimed
+  const bool timed = point_budget != NULL && drew_cloud && renderer->HasNewCloud() &&
+                     queries_issued - queries_read < (uint64_t)c_TIMER_QUERIES;
+  if (timed) {
+    glBeginQuery(GL_TIME_ELAPSED, timer_queries[queries_issued % c_TIMER_QUERIES]);
+  }
+  const bool new_cloud = renderer->Render();
+  // The back buffer is undefined after a swap, so the last stage always
+  // draws, from the points drawn before when there is no new cloud
+  canvas->Render(0, window_width, window_height, true);
+  if (timed) {
+    glEndQuery(GL_TIME_ELAPSED);
+    // Should the cloud have gone missing after all, the query is used again
+    // by the next draw
+    if (new_cloud) {
+      queries_issued++;
+    }
+  }
+  drew_cloud = drew_cloud || new_cloud;
+  glutSwapBuffers();
+  redraw = false;
+}
+
+void GlCloudViewer::ReadDrawTimes() {
+  while (queries_read < queries_issued) {
+    const GLuint query = timer_queries[queries_read % c_TIMER_QUERIES];
+    GLint available = 0;
+    glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      return;
+    }
+    GLuint64 elapsed_ns = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+    point_budget->Update(elapsed_ns*1e-6);
+    queries_read++;
+  }
+}
+
+void GlCloudViewer::Release() {
+  std::lock_guard<std::mutex> lock(writing);
+  if (!timer_queries.empty()) {
+    glDeleteQueries(timer_queries.size(), &timer_queries[0]);
+    timer_queries.clear();
+  }
+  delete show_stage;
+  delete renderer;
+  delete canvas;
+  show_stage = NULL;
+  renderer = NULL;
+  canvas = NULL;
+}
+
+void GlCloudViewer::OnDisplay() {
+  s_viewer->redraw = true;
+}
+
+void GlCloudViewer::OnReshape(int width, int height) {
+  s_viewer->window_width = width;
+  s_viewer->window_height = height;
+  s_viewer->redraw = true;
+}
+
+// GLUT makes the window's context current for this, before it goes
+void GlCloudViewer::OnClose() {
+  s_viewer->closing = true;
+  s_viewer->Release();
+  s_viewer->window = 0;
+}
+
+StreamPoint* GlCloudViewer::BeginWrite() {
+  writing.lock();
+  PointVertex* points = renderer != NULL ? renderer->GetRing().BeginWrite() : NULL;
+  if (points == NULL) {
+    writing.unlock();
+    return NULL;
+  }
+  return reinterpret_cast<StreamPoint*>(points);
+}
+
+void GlCloudViewer::EndWrite(StreamPoint* points, int count) {
+  renderer->GetRing().EndWrite(reinterpret_cast<PointVertex*>(points), count);
+  writing.unlock();
+}
+
+int GlCloudViewer::GetMaxPoints() {
+  return max_points;
+}
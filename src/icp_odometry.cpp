@@ -0,0 +1,509 @@
+#include "icp_odometry.h"
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <functional>
+#include <immintrin.h>
+#include <limits>
+#include <math.h>
+
+#include "thread_pool.h"
+
+namespace {
+
+typedef void (*ReduceFunc)(const IcpLevel&, const IcpLevel&, const float*, float, int, int, double*);
+
+struct Kernel {
+  ReduceFunc func;
+  const char* name;
+};
+
+Kernel SelectKernel() {
+  __builtin_cpu_init();
+  Kernel kernel;
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.func = &IcpReduceAVX2;
+    kernel.name = "avx2";
+  } else {
+    kernel.func = &IcpReduceScalar;
+    kernel.name = "scalar";
+  }
+  return kernel;
+}
+
+const Kernel& GetKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+// Rows per task at full resolution, halved with every level
+const int c_BAND_ROWS = 16;
+
+// Per level, finest first: ICP iterations, and how far apart in mm matched
+// points may be. The coarse levels take the large motions.
+const int c_ITERATIONS[] = {4, 5, 8, 10};
+const float c_MAX_DISTANCE[] = {40.0f, 60.0f, 100.0f, 150.0f};
+const int c_MAX_LEVELS = 4;
+
+// Fewer correspondences than this at a level is losing track, as a share
+// of the level's pixels
+const float c_MIN_MATCHED = 0.05f;
+
+// A step smaller than this, in radians and mm, has converged
+const float c_MIN_ROTATION_STEP = 1e-5f;
+const float c_MIN_TRANSLATION_STEP = 0.01f;
+
+// More motion than this between two frames, in radians and mm, can't be a
+// hand at 60 fps and is taken as a failed alignment
+const float c_MAX_ROTATION = 0.2f;
+const float c_MAX_TRANSLATION = 150.0f;
+
+// Halves a level, averaging the points of each 2x2 block that are on the
+// same surface as the nearest of them
+const float c_MAX_DEPTH_CHANGE = 0.03f;
+
+const Pose c_IDENTITY = {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}};
+
+IcpLevel LevelView(int width, int height, const Intrinsics& intrinsics,
+                   const std::vector<float>& points, const std::vector<float>& normals) {
+  IcpLevel view;
+  view.width = width;
+  view.height = height;
+  view.intrinsics = intrinsics;
+  view.points = &points[0];
+  view.point_stride = 4;
+  view.normals = normals.empty() ? NULL : &normals[0];
+  view.normal_stride = 4;
+  return view;
+}
+
+// Adds one correspondence's residual and Jacobian to the sums
+template <typename T>
+inline void Accumulate(const T* j, T r, T* sums) {
+  int k = 0;
+  for (int a = 0; a < 6; a++) {
+    for (int b = a; b < 6; b++) {
+      sums[k++] += j[a]*j[b];
+    }
+  }
+  for (int a = 0; a < 6; a++) {
+    sums[k++] += j[a]*r;
+  }
+  sums[k++] += r*r;
+  sums[k] += 1;
+}
+
+// The transform for a small motion, rotation vector then translation
+Pose ExpMotion(const Eigen::Matrix<double, 6, 1>& step) {
+  Eigen::Vector3d omega = step.head<3>();
+  double angle = omega.norm();
+  Eigen::Matrix3d r = Eigen::Matrix3d::Identity();
+  if (angle > 0) {
+    r = Eigen::AngleAxisd(angle, omega/angle).toRotationMatrix();
+  }
+  Pose pose;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      pose.m[4*i + j] = (float)r(i, j);
+    }
+    pose.m[4*i + 3] = (float)step(3 + i);
+  }
+  return pose;
+}
+
+}
+
+Pose ComposePoses(const Pose& a, const Pose& b) {
+  Pose c;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 4; j++) {
+      c.m[4*i + j] = a.m[4*i]*b.m[j] + a.m[4*i + 1]*b.m[4 + j] + a.m[4*i + 2]*b.m[8 + j];
+    }
+    c.m[4*i + 3] += a.m[4*i + 3];
+  }
+  return c;
+}
+
+Pose InvertPose(const Pose& pose) {
+  Pose inverse;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      inverse.m[4*i + j] = pose.m[4*j + i];
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    inverse.m[4*i + 3] = -(inverse.m[4*i]*pose.m[3] + inverse.m[4*i + 1]*pose.m[7] +
+                           inverse.m[4*i + 2]*pose.m[11]);
+  }
+  return inverse;
+}
+
+void PoseQuaternion(const Pose& pose, float* quaternion) {
+  Eigen::Matrix3f r;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      r(i, j) = pose.m[4*i + j];
+    }
+  }
+  Eigen::Quaternionf q(r);
+  q.normalize();
+  quaternion[0] = q.x();
+  quaternion[1] = q.y();
+  quaternion[2] = q.z();
+  quaternion[3] = q.w();
+}
+
+// Smoothed normals: with noisy ones the solve underestimates motions that
+// only a few points constrain
+IcpOdometry::Level::Level(int width, int height, const Intrinsics& intrinsics)
+    : width(width), height(height), intrinsics(intrinsics), points(4*width*height),
+      normals(4*width*height), normal_estimator(width, height, NORMALS_INTEGRAL, 2) {}
+
+IcpOdometry::IcpOdometry(const Intrinsics& intrinsics, int width, int height, int level_count)
+    : level_count(std::max(1, std::min(level_count, c_MAX_LEVELS))) {
+  reference.reserve(this->level_count);
+  current.reserve(this->level_count);
+  Intrinsics k = intrinsics;
+  for (int l = 0; l < this->level_count; l++) {
+    reference.push_back(Level(width >> l, height >> l, k));
+    current.push_back(Level(width >> l, height >> l, k));
+    // Pixel centers move when 2x2 blocks become one pixel
+    k.fx *= 0.5f;
+    k.fy *= 0.5f;
+    k.cx = (k.cx + 0.5f)*0.5f - 0.5f;
+    k.cy = (k.cy + 0.5f)*0.5f - 0.5f;
+  }
+  Reset();
+}
+
+void IcpOdometry::Reset() {
+  has_reference = false;
+  pose = c_IDENTITY;
+  velocity = c_IDENTITY;
+  stats.iterations = 0;
+  stats.correspondences = 0;
+  stats.rms_error = 0;
+}
+
+void IcpOdometry::BuildPyramid(const float* points, int point_stride, std::vector<Level>* levels) {
+  Level& base = (*levels)[0];
+  for (int i = 0; i < base.width*base.height; i++) {
+    std::copy(points + i*point_stride, points + i*point_stride + 3, &base.points[4*i]);
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for (int l = 1; l < level_count; l++) {
+    const Level& fine = (*levels)[l - 1];
+    Level& coarse = (*levels)[l];
+    for (int y = 0; y < coarse.height; y++) {
+      for (int x = 0; x < coarse.width; x++) {
+        const float* block[4];
+        float nearest = std::numeric_limits<float>::max();
+        for (int k = 0; k < 4; k++) {
+          block[k] = &fine.points[4*((2*y + k/2)*fine.width + 2*x + k%2)];
+          if (block[k][2] < nearest) {
+            nearest = block[k][2];
+          }
+        }
+        float sum[3] = {0, 0, 0};
+        int count = 0;
+        for (int k = 0; k < 4; k++) {
+          if (block[k][2] <= nearest*(1 + c_MAX_DEPTH_CHANGE)) {
+            sum[0] += block[k][0];
+            sum[1] += block[k][1];
+            sum[2] += block[k][2];
+            count++;
+          }
+        }
+        float* out = &coarse.points[4*(y*coarse.width + x)];
+        for (int c = 0; c < 3; c++) {
+          out[c] = count > 0 ? sum[c]/count : nan;
+        }
+      }
+    }
+  }
+}
+
+void IcpOdometry::EstimateNormals(std::vector<Level>* levels, ThreadPool* pool) {
+  for (int l = 0; l < level_count; l++) {
+    Level& level = (*levels)[l];
+    level.normal_estimator.Compute(&level.points[0], 4, &level.normals[0], 4, pool);
+  }
+}
+
+// Finds the motion taking the current frame's points into the reference
+// frame, starting from the guess in motion.
+bool IcpOdometry::Align(Pose* motion, ThreadPool* pool) {
+  stats.iterations = 0;
+  for (int l = level_count - 1; l >= 0; l--) {
+    const Level& ref = reference[l];
+    const Level& cur = current[l];
+    reduce_reference = LevelView(ref.width, ref.height, ref.intrinsics, ref.points, ref.normals);
+    reduce_current = LevelView(cur.width, cur.height, cur.intrinsics, cur.points, std::vector<float>());
+    reduce_distance = c_MAX_DISTANCE[l];
+    reduce_rows = std::max(1, c_BAND_ROWS >> l);
+    const int band_count = (cur.height + reduce_rows - 1)/reduce_rows;
+    band_sums.resize(band_count*c_ICP_SUMS);
+
+    // The motion before the last step, and the error there
+    Pose previous = *motion;
+    double previous_error = std::numeric_limits<double>::max();
+    for (int iteration = 0; iteration < c_ITERATIONS[l]; iteration++) {
+      std::fill(band_sums.begin(), band_sums.end(), 0.0);
+      reduce_transform = motion->m;
+      ThreadPool::Run(pool, band_count, [this](int band) {
+        ReduceBand(band);
+      });
+      double sums[c_ICP_SUMS] = {0};
+      for (int band = 0; band < band_count; band++) {
+        for (int k = 0; k < c_ICP_SUMS; k++) {
+          sums[k] += band_sums[band*c_ICP_SUMS + k];
+        }
+      }
+      stats.iterations++;
+
+      const double count = sums[c_ICP_SUMS - 1];
+      if (count < c_MIN_MATCHED*cur.width*cur.height) {
+        return false;
+      }
+      Eigen::Matrix<double, 6, 6> a;
+      Eigen::Matrix<double, 6, 1> b;
+      int k = 0;
+      for (int i = 0; i < 6; i++) {
+        for (int j = i; j < 6; j++) {
+          a(i, j) = a(j, i) = sums[k++];
+        }
+      }
+      for (int i = 0; i < 6; i++) {
+        b(i) = sums[k++];
+      }
+      // A step that made things worse went past the minimum, which happens
+      // when few points pin down a direction; the level is done
+      const double error = sums[c_ICP_SUMS - 2]/count;
+      if (error > previous_error) {
+        *motion = previous;
+        break;
+      }
+      previous = *motion;
+      previous_error = error;
+      if (l == 0) {
+        stats.correspondences = (int)count;
+        stats.rms_error = (float)sqrt(error);
+      }
+
+      Eigen::LDLT<Eigen::Matrix<double, 6, 6> > solver(a);
+      if (solver.info() != Eigen::Success) {
+        return false;
+      }
+      Eigen::Matrix<double, 6, 1> step = solver.solve(-b);
+      if (!step.allFinite()) {
+        return false;
+      }
+      *motion = ComposePoses(ExpMotion(step), *motion);
+      if (step.head<3>().norm() < c_MIN_ROTATION_STEP && step.tail<3>().norm() < c_MIN_TRANSLATION_STEP) {
+        break;
+      }
+    }
+  }
+  const float* m = motion->m;
+  const float angle = acosf(std::max(-1.0f, std::min(1.0f, (m[0] + m[5] + m[10] - 1)*0.5f)));
+  const float distance = sqrtf(m[3]*m[3] + m[7]*m[7] + m[11]*m[11]);
+  return angle <= c_MAX_ROTATION && distance <= c_MAX_TRANSLATION;
+}
+
+void IcpOdometry::ReduceBand(int band) {
+  const int row_begin = band*reduce_rows;
+  const int row_end = std::min(reduce_current.height, row_begin + reduce_rows);
+  GetKernel().func(reduce_current, reduce_reference, reduce_transform, reduce_distance, row_begin,
+                   row_end, &band_sums[band*c_ICP_SUMS]);
+}
+
+bool IcpOdometry::Track(const float* points, int point_stride, ThreadPool* pool) {
+  BuildPyramid(points, point_stride, &current);
+  bool tracked = false;
+  if (has_reference) {
+    Pose motion = velocity;
+    tracked = Align(&motion, pool);
+    if (tracked) {
+      pose = ComposePoses(pose, motion);
+      velocity = motion;
+    } else {
+      velocity = c_IDENTITY;
+    }
+  }
+  // This frame is the next one's reference
+  EstimateNormals(&current, pool);
+  reference.swap(current);
+  has_reference = true;
+  return tracked;
+}
+
+const char* IcpKernelName() {
+  return GetKernel().name;
+}
+
+namespace {
+
+// The scalar reduction of row y from column x_begin on, which also finishes
+// the rows the AVX2 kernel can't fill 8 lanes of
+void ReduceRow(const IcpLevel& current, const IcpLevel& reference, const float* transform,
+               float max_squared, int y, int x_begin, double* sums) {
+  const float* t = transform;
+  const Intrinsics& k = reference.intrinsics;
+  for (int x = x_begin; x < current.width; x++) {
+    const float* p = current.points + (y*current.width + x)*current.point_stride;
+    float q[3];
+    for (int i = 0; i < 3; i++) {
+      q[i] = t[4*i]*p[0] + t[4*i + 1]*p[1] + t[4*i + 2]*p[2] + t[4*i + 3];
+    }
+    // Also false for NaN
+    if (!(p[2] > 0 && q[2] > 0)) {
+      continue;
+    }
+    float inverse_z = 1.0f/q[2];
+    int u = (int)lrintf(k.fx*q[0]*inverse_z + k.cx);
+    int v = (int)lrintf(k.cy - k.fy*q[1]*inverse_z);
+    if (u < 0 || u >= reference.width || v < 0 || v >= reference.height) {
+      continue;
+    }
+    const int j = v*reference.width + u;
+    const float* r = reference.points + j*reference.point_stride;
+    const float* n = reference.normals + j*reference.normal_stride;
+    if (!(r[2] > 0 && n[2] == n[2])) {
+      continue;
+    }
+    float d[3] = {q[0] - r[0], q[1] - r[1], q[2] - r[2]};
+    if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > max_squared) {
+      continue;
+    }
+    double jacobian[6] = {
+      q[1]*n[2] - q[2]*n[1],
+      q[2]*n[0] - q[0]*n[2],
+      q[0]*n[1] - q[1]*n[0],
+      n[0], n[1], n[2]
+    };
+    Accumulate<double>(jacobian, n[0]*d[0] + n[1]*d[1] + n[2]*d[2], sums);
+  }
+}
+
+}
+
+void IcpReduceScalar(const IcpLevel& current, const IcpLevel& reference, const float* transform,
+                     float max_distance, int row_begin, int row_end, double* sums) {
+  for (int y = row_begin; y < row_end; y++) {
+    ReduceRow(current, reference, transform, max_distance*max_distance, y, 0, sums);
+  }
+}
+
+// 8 pixels of a row at a time, gathering both the current points (which may
+// be interleaved with other fields) and their matches. Sums are kept per lane
+// in float for a row, then added up in double.
+__attribute__((target("avx2")))
+void IcpReduceAVX2(const IcpLevel& current, const IcpLevel& reference, const float* transform,
+                   float max_distance, int row_begin, int row_end, double* sums) {
+  const Intrinsics& k = reference.intrinsics;
+  __m256 t[12];
+  for (int i = 0; i < 12; i++) {
+    t[i] = _mm256_set1_ps(transform[i]);
+  }
+  const __m256 fx = _mm256_set1_ps(k.fx);
+  const __m256 fy = _mm256_set1_ps(k.fy);
+  const __m256 cx = _mm256_set1_ps(k.cx);
+  const __m256 cy = _mm256_set1_ps(k.cy);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 max_squared = _mm256_set1_ps(max_distance*max_distance);
+  const __m256i ref_width = _mm256_set1_epi32(reference.width);
+  const __m256i ref_height = _mm256_set1_epi32(reference.height);
+  const __m256i minus_one = _mm256_set1_epi32(-1);
+  const __m256i point_stride = _mm256_set1_epi32(reference.point_stride);
+  const __m256i normal_stride = _mm256_set1_epi32(reference.normal_stride);
+  const __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                           _mm256_set1_epi32(current.point_stride));
+
+  for (int y = row_begin; y < row_end; y++) {
+    __m256 acc[c_ICP_SUMS];
+    for (int i = 0; i < c_ICP_SUMS; i++) {
+      acc[i] = zero;
+    }
+    int x = 0;
+    for (; x + 8 <= current.width; x += 8) {
+      const float* base = current.points + (y*current.width + x)*current.point_stride;
+      __m256 p[3];
+      for (int i = 0; i < 3; i++) {
+        p[i] = _mm256_i32gather_ps(base + i, lanes, 4);
+      }
+      __m256 q[3];
+      for (int i = 0; i < 3; i++) {
+        q[i] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(t[4*i], p[0]), _mm256_mul_ps(t[4*i + 1], p[1])),
+                             _mm256_add_ps(_mm256_mul_ps(t[4*i + 2], p[2]), t[4*i + 3]));
+      }
+      __m256 ok = _mm256_and_ps(_mm256_cmp_ps(p[2], zero, _CMP_GT_OQ), _mm256_cmp_ps(q[2], zero, _CMP_GT_OQ));
+
+      __m256 inverse_z = _mm256_div_ps(one, q[2]);
+      __m256i u = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(fx, q[0]), inverse_z), cx));
+      __m256i v = _mm256_cvtps_epi32(_mm256_sub_ps(cy, _mm256_mul_ps(_mm256_mul_ps(fy, q[1]), inverse_z)));
+      __m256i inside = _mm256_and_si256(
+          _mm256_and_si256(_mm256_cmpgt_epi32(u, minus_one), _mm256_cmpgt_epi32(ref_width, u)),
+          _mm256_and_si256(_mm256_cmpgt_epi32(v, minus_one), _mm256_cmpgt_epi32(ref_height, v)));
+      inside = _mm256_and_si256(inside, _mm256_castps_si256(ok));
+      // Lanes that miss gather pixel 0 and are masked off below
+      __m256i j = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(v, ref_width), u), inside);
+      __m256i point_index = _mm256_mullo_epi32(j, point_stride);
+      __m256i normal_index = _mm256_mullo_epi32(j, normal_stride);
+      __m256 r[3];
+      __m256 n[3];
+      for (int i = 0; i < 3; i++) {
+        r[i] = _mm256_i32gather_ps(reference.points + i, point_index, 4);
+        n[i] = _mm256_i32gather_ps(reference.normals + i, normal_index, 4);
+      }
+      ok = _mm256_and_ps(_mm256_castsi256_ps(inside), _mm256_cmp_ps(r[2], zero, _CMP_GT_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(n[2], n[2], _CMP_EQ_OQ));
+
+      __m256 d[3];
+      for (int i = 0; i < 3; i++) {
+        d[i] = _mm256_sub_ps(q[i], r[i]);
+      }
+      __m256 squared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], d[0]), _mm256_mul_ps(d[1], d[1])),
+                                     _mm256_mul_ps(d[2], d[2]));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(squared, max_squared, _CMP_LE_OQ));
+
+      __m256 jacobian[6] = {
+        _mm256_sub_ps(_mm256_mul_ps(q[1], n[2]), _mm256_mul_ps(q[2], n[1])),
+        _mm256_sub_ps(_mm256_mul_ps(q[2], n[0]), _mm256_mul_ps(q[0], n[2])),
+        _mm256_sub_ps(_mm256_mul_ps(q[0], n[1]), _mm256_mul_ps(q[1], n[0])),
+        n[0], n[1], n[2]
+      };
+      __m256 residual = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n[0], d[0]), _mm256_mul_ps(n[1], d[1])),
+                                      _mm256_mul_ps(n[2], d[2]));
+      // Masked lanes may hold NaN, so zero them rather than multiply
+      for (int i = 0; i < 6; i++) {
+        jacobian[i] = _mm256_and_ps(jacobian[i], ok);
+      }
+      residual = _mm256_and_ps(residual, ok);
+
+      int s = 0;
+      for (int a = 0; a < 6; a++) {
+        for (int b = a; b < 6; b++) {
+          acc[s] = _mm256_add_ps(acc[s], _mm256_mul_ps(jacobian[a], jacobian[b]));
+          s++;
+        }
+      }
+      for (int a = 0; a < 6; a++) {
+        acc[s] = _mm256_add_ps(acc[s], _mm256_mul_ps(jacobian[a], residual));
+        s++;
+      }
+      acc[s] = _mm256_add_ps(acc[s], _mm256_mul_ps(residual, residual));
+      acc[s + 1] = _mm256_add_ps(acc[s + 1], _mm256_and_ps(one, ok));
+    }
+
+    for (int i = 0; i < c_ICP_SUMS; i++) {
+      float lane[8];
+      _mm256_storeu_ps(lane, acc[i]);
+      sums[i] += (double)lane[0] + lane[1] + lane[2] + lane[3] + lane[4] + lane[5] + lane[6] + lane[7];
+    }
+    if (x < current.width) {
+      ReduceRow(current, reference, transform, max_distance*max_distance, y, x, sums);
+    }
+  }
+}
@@ -0,0 +1,289 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace {
+
+const char* c_STAGE_NAMES[c_STAGE_COUNT] = {
+  "depth_input",
+  "color_input",
+  "pairing",
+  "temporal_filter",
+  "spatial_filter",
+  "conversion",
+  "registration",
+  "odometry",
+  "fusion",
+  "meshing",
+  "normals",
+  "downsampling",
+  "surface_mesh",
+  "planes",
+  "processing",
+  "display",
+  "end_to_end"
+};
+
+const char* c_GAUGE_NAMES[c_GAUGE_COUNT] = {
+  "point_budget"
+};
+
+// Buckets per power of two, and the largest power with its own buckets:
+// 2^36 ns is about a minute, anything longer goes in the last bucket
+const int c_SUB_BITS = 3;
+const int c_SUBS = 1 << c_SUB_BITS;
+const int c_MAX_EXPONENT = 36;
+// Values below c_SUBS get a bucket each, then c_SUBS per power of two
+const int c_BUCKETS = (c_MAX_EXPONENT - c_SUB_BITS + 2)*c_SUBS;
+
+#ifdef DS325_ENABLE_METRICS
+
+int Bucket(uint64_t value) {
+  if (value < (uint64_t)c_SUBS) {
+    return value;
+  }
+  const int exponent = 63 - __builtin_clzll(value);
+  if (exponent > c_MAX_EXPONENT) {
+    return c_BUCKETS - 1;
+  }
+  const int shift = exponent - c_SUB_BITS;
+  return (shift + 1)*c_SUBS + ((value >> shift) & (c_SUBS - 1));
+}
+
+// The middle of the values that fall into bucket
+double BucketValue(int bucket) {
+  if (bucket < c_SUBS) {
+    return bucket;
+  }
+  const int shift = bucket/c_SUBS - 1;
+  const uint64_t low = (uint64_t)(c_SUBS + bucket % c_SUBS) << shift;
+  return low + ((1ull << shift) - 1)/2.0;
+}
+
+#endif
+
+}
+
+const char* MetricStageName(MetricStage stage) {
+  return c_STAGE_NAMES[stage];
+}
+
+const char* MetricGaugeName(MetricGauge gauge) {
+  return c_GAUGE_NAMES[gauge];
+}
+
+#ifdef DS325_ENABLE_METRICS
+
+namespace {
+
+// Written only by the thread it belongs to, with plain relaxed stores, and
+// read by the exporter
+struct StageMetrics {
+  std::atomic<uint64_t> buckets[c_BUCKETS];
+  std::atomic<uint64_t> drops;
+  // Largest value since the exporter last took it
+  std::atomic<uint64_t> max;
+};
+
+struct ThreadMetrics {
+  StageMetrics stages[c_STAGE_COUNT];
+};
+
+std::mutex g_threads_mutex;
+// Never freed, so the counts of threads that ended still get exported
+std::vector<ThreadMetrics*> g_threads;
+thread_local ThreadMetrics* t_metrics = NULL;
+
+std::atomic<int64_t> g_gauges[c_GAUGE_COUNT];
+std::atomic<bool> g_gauges_set[c_GAUGE_COUNT];
+
+ThreadMetrics* LocalMetrics() {
+  if (t_metrics == NULL) {
+    ThreadMetrics* local = new ThreadMetrics;
+    for (int s = 0; s < c_STAGE_COUNT; s++) {
+      StageMetrics& stage = local->stages[s];
+      for (int b = 0; b < c_BUCKETS; b++) {
+        stage.buckets[b].store(0, std::memory_order_relaxed);
+      }
+      stage.drops.store(0, std::memory_order_relaxed);
+      stage.max.store(0, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(g_threads_mutex);
+    g_threads.push_back(local);
+    t_metrics = local;
+  }
+  return t_metrics;
+}
+
+// Only this thread writes counter, so it needs no read-modify-write
+void Add(std::atomic<uint64_t>* counter, uint64_t value) {
+  counter->store(counter->load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+}
+
+void metrics::Record(MetricStage stage, uint64_t nanoseconds) {
+  StageMetrics& metrics = LocalMetrics()->stages[stage];
+  Add(&metrics.buckets[Bucket(nanoseconds)], 1);
+  // The exporter swaps max for 0, so a value can land in the interval after
+  // the one it belongs to, but it isn't lost
+  if (nanoseconds > metrics.max.load(std::memory_order_relaxed)) {
+    metrics.max.store(nanoseconds, std::memory_order_relaxed);
+  }
+}
+
+void metrics::AddDrops(MetricStage stage, uint64_t count) {
+  if (count > 0) {
+    Add(&LocalMetrics()->stages[stage].drops, count);
+  }
+}
+
+void metrics::SetGauge(MetricGauge gauge, int64_t value) {
+  g_gauges[gauge].store(value, std::memory_order_relaxed);
+  g_gauges_set[gauge].store(true, std::memory_order_relaxed);
+}
+
+MetricsExporter::MetricsExporter()
+    : file(NULL), interval_ms(0), stopping(false), start_time(0), last_time(0),
+      last_buckets(c_STAGE_COUNT*c_BUCKETS), last_drops(c_STAGE_COUNT) {}
+
+MetricsExporter::~MetricsExporter() {
+  Stop();
+}
+
+bool MetricsExporter::Start(const std::string& path, int interval_ms) {
+  Stop();
+  if (path == "-") {
+    file = stdout;
+  } else {
+    file = fopen(path.c_str(), "w");
+    if (file == NULL) {
+      printf("Couldn't open %s for writing\n", path.c_str());
+      return false;
+    }
+  }
+  this->interval_ms = interval_ms;
+  stopping = false;
+  start_time = last_time = metrics::Now();
+  thread = std::thread(&MetricsExporter::ExportLoop, this);
+  return true;
+}
+
+void MetricsExporter::Stop() {
+  if (file == NULL) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  thread.join();
+  Export();
+  if (file != stdout) {
+    fclose(file);
+  }
+  file = NULL;
+}
+
+void MetricsExporter::ExportLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!wake.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return stopping; })) {
+    Export();
+  }
+}
+
+void MetricsExporter::Export() {
+  std::vector<uint64_t> buckets(c_STAGE_COUNT*c_BUCKETS);
+  std::vector<uint64_t> drops(c_STAGE_COUNT);
+  std::vector<uint64_t> max(c_STAGE_COUNT);
+  {
+    std::lock_guard<std::mutex> lock(g_threads_mutex);
+    for (size_t t = 0; t < g_threads.size(); t++) {
+      for (int s = 0; s < c_STAGE_COUNT; s++) {
+        StageMetrics& stage = g_threads[t]->stages[s];
+        for (int b = 0; b < c_BUCKETS; b++) {
+          buckets[s*c_BUCKETS + b] += stage.buckets[b].load(std::memory_order_relaxed);
+        }
+        drops[s] += stage.drops.load(std::memory_order_relaxed);
+        max[s] = std::max(max[s], stage.max.exchange(0, std::memory_order_relaxed));
+      }
+    }
+  }
+
+  const uint64_t now = metrics::Now();
+  fprintf(file, "{\"time\": %.3f, \"interval\": %.3f, \"stages\": {", (now - start_time)*1e-9,
+      (now - last_time)*1e-9);
+  last_time = now;
+  bool first = true;
+  for (int s = 0; s < c_STAGE_COUNT; s++) {
+    // What this interval added
+    uint64_t* stage_buckets = &buckets[s*c_BUCKETS];
+    uint64_t count = 0;
+    for (int b = 0; b < c_BUCKETS; b++) {
+      const uint64_t total = stage_buckets[b];
+      stage_buckets[b] -= last_buckets[s*c_BUCKETS + b];
+      last_buckets[s*c_BUCKETS + b] = total;
+      count += stage_buckets[b];
+    }
+    const uint64_t stage_drops = drops[s] - last_drops[s];
+    last_drops[s] = drops[s];
+    if (count == 0 && stage_drops == 0) {
+      continue;
+    }
+
+    double p50 = 0;
+    double p99 = 0;
+    uint64_t seen = 0;
+    for (int b = 0; b < c_BUCKETS && seen < count; b++) {
+      const uint64_t before = seen;
+      seen += stage_buckets[b];
+      if (before < (count + 1)/2 && seen >= (count + 1)/2) {
+        p50 = BucketValue(b);
+      }
+      if (before < count - count/100 && seen >= count - count/100) {
+        p99 = BucketValue(b);
+      }
+    }
+    // A bucket's middle can be past the largest value in it
+    p50 = std::min(p50, (double)max[s]);
+    p99 = std::min(p99, (double)max[s]);
+    fprintf(file, "%s\"%s\": {\"count\": %lu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+        "\"drops\": %lu}", first ? "" : ", ", c_STAGE_NAMES[s], (unsigned long)count, p50*1e-3, p99*1e-3,
+        max[s]*1e-3, (unsigned long)stage_drops);
+    first = false;
+  }
+  fprintf(file, "}, \"gauges\": {");
+  first = true;
+  for (int g = 0; g < c_GAUGE_COUNT; g++) {
+    if (g_gauges_set[g].load(std::memory_order_relaxed)) {
+      fprintf(file, "%s\"%s\": %ld", first ? "" : ", ", c_GAUGE_NAMES[g],
+          (long)g_gauges[g].load(std::memory_order_relaxed));
+      first = false;
+    }
+  }
+  fprintf(file, "}}\n");
+  fflush(file);
+}
+
+#else
+
+MetricsExporter::MetricsExporter()
+    : file(NULL), interval_ms(0), stopping(false), start_time(0), last_time(0) {}
+
+MetricsExporter::~MetricsExporter() {}
+
+bool MetricsExporter::Start(const std::string& path, int interval_ms) {
+  printf("Metrics were compiled out, build with DS325_ENABLE_METRICS to export them\n");
+  return false;
+}
+
+void MetricsExporter::Stop() {}
+
+void MetricsExporter::ExportLoop() {}
+
+void MetricsExporter::Export() {}
+
+#endif
@@ -0,0 +1,175 @@
+#include "multi_camera.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <thread>
+
+namespace {
+
+// Points per merge task, and the most tasks a camera's cloud makes
+const int c_MERGE_CHUNK = 16384;
+const int c_CAMERA_TASKS = (DEPTH_WIDTH*DEPTH_HEIGHT + c_MERGE_CHUNK - 1)/c_MERGE_CHUNK;
+
+}
+
+MultiCameraCapture::MultiCameraCapture(int threads_per_camera)
+    : threads_per_camera(threads_per_camera), merging(NULL) {}
+
+MultiCameraCapture::~MultiCameraCapture() {
+  for (size_t c = 0; c < cameras.size(); c++) {
+    delete cameras[c].source;
+    delete cameras[c].pipeline;
+  }
+}
+
+void MultiCameraCapture::AddCamera(FrameSource* source, const Pose& extrinsics) {
+  Camera camera;
+  camera.source = source;
+  camera.pipeline = new CapturePipeline(SYNC_NEAREST, threads_per_camera);
+  camera.extrinsics = extrinsics;
+  camera.has_cloud = false;
+  source->SetSink(camera.pipeline);
+  cameras.push_back(camera);
+  merge_tasks.reserve(cameras.size()*c_CAMERA_TASKS);
+}
+
+bool MultiCameraCapture::Run() {
+  std::vector<char> started(cameras.size());
+  std::vector<std::thread> threads;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    threads.push_back(std::thread([this, c, &started] {
+      // Run returns right away when the camera can't start, while the others
+      // may go on for as long as they are watched
+      started[c] = cameras[c].source->Run();
+      if (!started[c]) {
+        printf("Camera %d couldn't be started\n", (int)c);
+      }
+    }));
+  }
+  bool ok = true;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    threads[c].join();
+    ok = ok && started[c];
+  }
+  return ok;
+}
+
+void MultiCameraCapture::Stop() {
+  for (size_t c = 0; c < cameras.size(); c++) {
+    cameras[c].source->Stop();
+  }
+}
+
+void MultiCameraCapture::MergeChunk(int t) {
+  const MergeTask& task = merge_tasks[t];
+  const float* m = task.extrinsics->m;
+  const pcl::PointXYZRGB* in = &task.cloud->points[0];
+  pcl::PointXYZRGB* out = &merging->points[task.offset - task.begin];
+  for (int i = task.begin; i < task.end; i++) {
+    // Missing points are NaN and stay that way
+    const float x = in[i].x;
+    const float y = in[i].y;
+    const float z = in[i].z;
+    out[i].x = m[0]*x + m[1]*y + m[2]*z + m[3];
+    out[i].y = m[4]*x + m[5]*y + m[6]*z + m[7];
+    out[i].z = m[8]*x + m[9]*y + m[10]*z + m[11];
+    out[i].rgba = in[i].rgba;
+  }
+}
+
+bool MultiCameraCapture::Merge(Cloud* merged) {
+  bool fresh = false;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    if (cameras[c].pipeline->GetFrames().Acquire()) {
+      cameras[c].has_cloud = true;
+      fresh = true;
+    }
+  }
+  if (!fresh) {
+    return false;
+  }
+
+  merge_tasks.clear();
+  bool organized = true;
+  int total = 0;
+  for (size_t c = 0; c < cameras.size(); c++) {
+    if (!cameras[c].has_cloud) {
+      continue;
+    }
+    const Cloud* cloud = cameras[c].pipeline->GetFrames().Front().cloud.get();
+    const int size = cloud->points.size();
+    organized = organized && cloud->width == DEPTH_WIDTH && cloud->height > 1;
+    for (int begin = 0; begin < size; begin += c_MERGE_CHUNK) {
+      MergeTask task;
+      task.cloud = cloud;
+      task.extrinsics = &cameras[c].extrinsics;
+      task.begin = begin;
+      task.end = std::min(begin + c_MERGE_CHUNK, size);
+      task.offset = total + begin;
+      merge_tasks.push_back(task);
+    }
+    total += size;
+  }
+
+  merged->points.resize(total);
+  merged->width = organized ? DEPTH_WIDTH : total;
+  merged->height = organized ? total/DEPTH_WIDTH : 1;
+  merged->is_dense = false;
+  merging = merged;
+  ThreadPool::Run(&merge_pool, merge_tasks.size(), [this](int task) {
+    MergeChunk(task);
+  });
+  return true;
+}
+
+void MultiCameraCapture::PrintStats() {
+  for (size_t c = 0; c < cameras.size(); c++) {
+    printf("camera %d:\n", (int)c);
+    cameras[c].pipeline->PrintStats();
+  }
+}
+
+bool LoadExtrinsics(const std::string& path, int camera_count, std::vector<Pose>* extrinsics) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    printf("Couldn't open %s\n", path.c_str());
+    return false;
+  }
+  extrinsics->clear();
+  char line[256];
+  int line_number = 0;
+  while ((int)extrinsics->size() < camera_count && fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    float t[3];
+    float q[4];
+    if (line[0] == '#' ||
+        sscanf(line, "%f %f %f %f %f %f %f", &t[0], &t[1], &t[2], &q[0], &q[1], &q[2], &q[3]) != 7) {
+      continue;
+    }
+    const float norm = sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    // Also false for NaN
+    if (!(norm > 0)) {
+      printf("%s:%d: the rotation quaternion is zero\n", path.c_str(), line_number);
+      fclose(file);
+      return false;
+    }
+    const float x = q[0]/norm;
+    const float y = q[1]/norm;
+    const float z = q[2]/norm;
+    const float w = q[3]/norm;
+    // Meters to mm, as the clouds are
+    Pose pose = {{
+      1 - 2*(y*y + z*z), 2*(x*y - z*w), 2*(x*z + y*w), 1000*t[0],
+      2*(x*y + z*w), 1 - 2*(x*x + z*z), 2*(y*z - x*w), 1000*t[1],
+      2*(x*z - y*w), 2*(y*z + x*w), 1 - 2*(x*x + y*y), 1000*t[2]
+    }};
+    extrinsics->push_back(pose);
+  }
+  fclose(file);
+  if ((int)extrinsics->size() < camera_count) {
+    printf("%s has %d poses for %d cameras\n", path.c_str(), (int)extrinsics->size(), camera_count);
+    return false;
+  }
+  return true;
+}
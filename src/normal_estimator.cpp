@@ -0,0 +1,219 @@
+#include "normal_estimator.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <math.h>
+
+#include "thread_pool.h"
+
+namespace {
+
+// Rows per task when working by rows, columns per task when integrating down
+// the columns
+const int c_BAND_ROWS = 16;
+const int c_STRIPE_COLUMNS = 64;
+
+// Integral image channels: the sums of the horizontal differences, how many
+// there are, then the same for the vertical ones
+enum Channel {
+  HORIZONTAL_X,
+  HORIZONTAL_Y,
+  HORIZONTAL_Z,
+  HORIZONTAL_COUNT,
+  VERTICAL_X,
+  VERTICAL_Y,
+  VERTICAL_Z,
+  VERTICAL_COUNT,
+  c_CHANNELS
+};
+
+inline bool HasPoint(const float* p) {
+  return p[2] == p[2];
+}
+
+// Whether neighbor is a point on the same surface as center
+inline bool SameSurface(const float* center, const float* neighbor, float max_depth_change) {
+  return HasPoint(neighbor) && fabsf(neighbor[2] - center[2]) <= max_depth_change*center[2];
+}
+
+// The difference across center along one image axis, from the neighbor
+// before to the one after. A neighbor that is missing or over an edge is
+// replaced by the center, so the difference turns one-sided, and is doubled
+// to stay on the same scale. Returns false when both are.
+inline bool Difference(const float* center, const float* before, const float* after,
+                       float max_depth_change, float* d) {
+  const float* a = before != NULL && SameSurface(center, before, max_depth_change) ? before : center;
+  const float* b = after != NULL && SameSurface(center, after, max_depth_change) ? after : center;
+  if (a == b) {
+    return false;
+  }
+  float scale = a == center || b == center ? 2.0f : 1.0f;
+  d[0] = (b[0] - a[0])*scale;
+  d[1] = (b[1] - a[1])*scale;
+  d[2] = (b[2] - a[2])*scale;
+  return true;
+}
+
+inline void WriteNaN(float* normal) {
+  normal[0] = normal[1] = normal[2] = std::numeric_limits<float>::quiet_NaN();
+}
+
+// Normalized u x v turned towards the camera at the origin, or NaN
+inline void WriteNormal(const float* u, const float* v, const float* point, float* normal) {
+  float n[3] = {
+    u[1]*v[2] - u[2]*v[1],
+    u[2]*v[0] - u[0]*v[2],
+    u[0]*v[1] - u[1]*v[0]
+  };
+  float length = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+  if (!(length > 0)) {
+    WriteNaN(normal);
+    return;
+  }
+  if (n[0]*point[0] + n[1]*point[1] + n[2]*point[2] > 0) {
+    length = -length;
+  }
+  float scale = 1.0f/length;
+  normal[0] = n[0]*scale;
+  normal[1] = n[1]*scale;
+  normal[2] = n[2]*scale;
+}
+
+}
+
+NormalEstimator::NormalEstimator(int width, int height, NormalMethod method, int radius,
+                                 float max_depth_change)
+    : width(width), height(height), method(method), radius(radius),
+      max_depth_change(max_depth_change), points(NULL), point_stride(0), normals(NULL),
+      normal_stride(0) {
+  if (method == NORMALS_INTEGRAL) {
+    // The first row and column stay zero for good
+    integral.assign((size_t)(width + 1)*(height + 1)*c_CHANNELS, 0.0);
+  }
+}
+
+int NormalEstimator::BandCount() const {
+  return (height + c_BAND_ROWS - 1)/c_BAND_ROWS;
+}
+
+void NormalEstimator::CrossProductBand(int band) const {
+  const int row_end = std::min(height, (band + 1)*c_BAND_ROWS);
+  const int row_stride = width*point_stride;
+  for (int y = band*c_BAND_ROWS; y < row_end; y++) {
+    for (int x = 0; x < width; x++) {
+      const float* p = points + (y*width + x)*point_stride;
+      float* normal = normals + (y*width + x)*normal_stride;
+      float u[3];
+      float v[3];
+      if (!HasPoint(p) ||
+          !Difference(p, x > 0 ? p - point_stride : NULL, x + 1 < width ? p + point_stride : NULL,
+                      max_depth_change, u) ||
+          !Difference(p, y > 0 ? p - row_stride : NULL, y + 1 < height ? p + row_stride : NULL,
+                      max_depth_change, v)) {
+        WriteNaN(normal);
+        continue;
+      }
+      WriteNormal(u, v, p, normal);
+    }
+  }
+}
+
+// The differences at every pixel of the band, summed along each row
+void NormalEstimator::IntegrateRows(int band) {
+  const int row_end = std::min(height, (band + 1)*c_BAND_ROWS);
+  const int row_stride = width*point_stride;
+  for (int y = band*c_BAND_ROWS; y < row_end; y++) {
+    double sums[c_CHANNELS] = {0};
+    double* entry = &integral[((size_t)(y + 1)*(width + 1) + 1)*c_CHANNELS];
+    for (int x = 0; x < width; x++, entry += c_CHANNELS) {
+      const float* p = points + (y*width + x)*point_stride;
+      float d[3];
+      if (HasPoint(p)) {
+        if (Difference(p, x > 0 ? p - point_stride : NULL, x + 1 < width ? p + point_stride : NULL,
+                       max_depth_change, d)) {
+          sums[HORIZONTAL_X] += d[0];
+          sums[HORIZONTAL_Y] += d[1];
+          sums[HORIZONTAL_Z] += d[2];
+          sums[HORIZONTAL_COUNT] += 1;
+        }
+        if (Difference(p, y > 0 ? p - row_stride : NULL, y + 1 < height ? p + row_stride : NULL,
+                       max_depth_change, d)) {
+          sums[VERTICAL_X] += d[0];
+          sums[VERTICAL_Y] += d[1];
+          sums[VERTICAL_Z] += d[2];
+          sums[VERTICAL_COUNT] += 1;
+        }
+      }
+      std::copy(sums, sums + c_CHANNELS, entry);
+    }
+  }
+}
+
+// Adds each row of the stripe's columns onto the one below, top to bottom
+void NormalEstimator::IntegrateColumns(int stripe) {
+  const int begin = (1 + stripe*c_STRIPE_COLUMNS)*c_CHANNELS;
+  const int end = (1 + std::min(width, (stripe + 1)*c_STRIPE_COLUMNS))*c_CHANNELS;
+  const size_t row_size = (size_t)(width + 1)*c_CHANNELS;
+  for (int y = 2; y <= height; y++) {
+    const double* above = &integral[(y - 1)*row_size];
+    double* row = &integral[y*row_size];
+    for (int i = begin; i < end; i++) {
+      row[i] += above[i];
+    }
+  }
+}
+
+// Sums the differences over the window around every point
+void NormalEstimator::IntegralBand(int band) const {
+  const int row_end = std::min(height, (band + 1)*c_BAND_ROWS);
+  const size_t row_size = (size_t)(width + 1)*c_CHANNELS;
+  for (int y = band*c_BAND_ROWS; y < row_end; y++) {
+    const double* top = &integral[std::max(0, y - radius)*row_size];
+    const double* bottom = &integral[(std::min(height - 1, y + radius) + 1)*row_size];
+    for (int x = 0; x < width; x++) {
+      const float* p = points + (y*width + x)*point_stride;
+      float* normal = normals + (y*width + x)*normal_stride;
+      if (!HasPoint(p)) {
+        WriteNaN(normal);
+        continue;
+      }
+      const int left = std::max(0, x - radius)*c_CHANNELS;
+      const int right = (std::min(width - 1, x + radius) + 1)*c_CHANNELS;
+      // Only the sums need double precision, the rest is done in float
+      float sums[c_CHANNELS];
+      for (int c = 0; c < c_CHANNELS; c++) {
+        sums[c] = (float)(bottom[right + c] - top[right + c] - bottom[left + c] + top[left + c]);
+      }
+      if (sums[HORIZONTAL_COUNT] == 0 || sums[VERTICAL_COUNT] == 0) {
+        WriteNaN(normal);
+        continue;
+      }
+      // The averages would only scale the cross product, so the sums do
+      WriteNormal(sums + HORIZONTAL_X, sums + VERTICAL_X, p, normal);
+    }
+  }
+}
+
+void NormalEstimator::Compute(const float* points, int point_stride, float* normals, int normal_stride,
+                              ThreadPool* pool) {
+  this->points = points;
+  this->point_stride = point_stride;
+  this->normals = normals;
+  this->normal_stride = normal_stride;
+  if (method == NORMALS_CROSS_PRODUCT) {
+    ThreadPool::Run(pool, BandCount(), [this](int band) {
+      CrossProductBand(band);
+    });
+    return;
+  }
+  ThreadPool::Run(pool, BandCount(), [this](int band) {
+    IntegrateRows(band);
+  });
+  ThreadPool::Run(pool, (width + c_STRIPE_COLUMNS - 1)/c_STRIPE_COLUMNS, [this](int stripe) {
+    IntegrateColumns(stripe);
+  });
+  ThreadPool::Run(pool, BandCount(), [this](int band) {
+    IntegralBand(band);
+  });
+}
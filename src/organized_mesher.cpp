@@ -0,0 +1,227 @@
+#include "organized_mesher.h"
+
+#include <algorithm>
+#include <functional>
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+
+#include "thread_pool.h"
+
+namespace {
+
+// Quad rows per band
+const int c_BAND_ROWS = 16;
+
+typedef void (*MeshRowFunc)(const float*, const float*, int, float, uint8_t*);
+
+struct Kernel {
+  MeshRowFunc mesh_row;
+  const char* name;
+};
+
+Kernel SelectKernel() {
+  __builtin_cpu_init();
+  Kernel kernel;
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.mesh_row = &MeshRowAVX2;
+    kernel.name = "avx2";
+  } else {
+    kernel.mesh_row = &MeshRowScalar;
+    kernel.name = "scalar";
+  }
+  return kernel;
+}
+
+const Kernel& GetKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+// Whether the edge between depths p and q is on a surface
+inline bool Connected(float p, float q, float max_depth_jump) {
+  const float nearer = std::min(p, q);
+  return nearer > 0 && fabsf(p - q) <= max_depth_jump*nearer;
+}
+
+__attribute__((target("avx2")))
+inline __m256 ConnectedAVX2(__m256 p, __m256 q, __m256 max_depth_jump) {
+  const __m256 nearer = _mm256_min_ps(p, q);
+  const __m256 jump = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(p, q));
+  return _mm256_and_ps(_mm256_cmp_ps(nearer, _mm256_setzero_ps(), _CMP_GT_OQ),
+                       _mm256_cmp_ps(jump, _mm256_mul_ps(max_depth_jump, nearer), _CMP_LE_OQ));
+}
+
+}
+
+// Quad corners: a b on top, c d below. Triangles a c b and b c d.
+void MeshRowScalar(const float* z0, const float* z1, int quads, float max_depth_jump, uint8_t* masks) {
+  for (int i = 0; i < quads; i++) {
+    const float a = z0[i];
+    const float b = z0[i + 1];
+    const float c = z1[i];
+    const float d = z1[i + 1];
+    const bool diagonal = Connected(b, c, max_depth_jump);
+    const bool first = diagonal && Connected(a, b, max_depth_jump) && Connected(a, c, max_depth_jump);
+    const bool second = diagonal && Connected(b, d, max_depth_jump) && Connected(c, d, max_depth_jump);
+    masks[i] = first | (second << 1);
+  }
+}
+
+__attribute__((target("avx2")))
+void MeshRowAVX2(const float* z0, const float* z1, int quads, float max_depth_jump, uint8_t* masks) {
+  const __m256 jump = _mm256_set1_ps(max_depth_jump);
+  // Dwords 0 and 4 hold the masks of quads 0-3 and 4-7 after packing
+  const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+  int i = 0;
+  for (; i + 8 <= quads; i += 8) {
+    const __m256 a = _mm256_loadu_ps(z0 + i);
+    const __m256 b = _mm256_loadu_ps(z0 + i + 1);
+    const __m256 c = _mm256_loadu_ps(z1 + i);
+    const __m256 d = _mm256_loadu_ps(z1 + i + 1);
+    const __m256 diagonal = ConnectedAVX2(b, c, jump);
+    const __m256 first = _mm256_and_ps(diagonal, _mm256_and_ps(ConnectedAVX2(a, b, jump), ConnectedAVX2(a, c, jump)));
+    const __m256 second = _mm256_and_ps(diagonal, _mm256_and_ps(ConnectedAVX2(b, d, jump), ConnectedAVX2(c, d, jump)));
+    __m256i bits = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(first), _mm256_set1_epi32(1)),
+                                   _mm256_and_si256(_mm256_castps_si256(second), _mm256_set1_epi32(2)));
+    bits = _mm256_packs_epi32(bits, bits);
+    bits = _mm256_packus_epi16(bits, bits);
+    bits = _mm256_permutevar8x32_epi32(bits, gather);
+    _mm_storel_epi64((__m128i*)(masks + i), _mm256_castsi256_si128(bits));
+  }
+  MeshRowScalar(z0 + i, z1 + i, quads - i, max_depth_jump, masks + i);
+}
+
+const char* OrganizedMesherKernelName() {
+  return GetKernel().name;
+}
+
+OrganizedMesher::OrganizedMesher(int max_width, int max_height, float max_depth_jump)
+    : max_width(max_width), max_height(max_height), max_depth_jump(max_depth_jump), width(0), height(0),
+      depth(max_width*max_height), masks((max_width - 1)*(max_height - 1)),
+      indices(6*(max_width - 1)*(max_height - 1)), points(NULL), point_stride(0), rewrite_all(true) {
+  const int bands = (max_height - 1 + c_BAND_ROWS - 1)/c_BAND_ROWS;
+  band_masks.resize(bands*max_width);
+  band_triangles.resize(bands);
+  band_changed.resize(bands);
+  memset(&stats, 0, sizeof(stats));
+}
+
+int OrganizedMesher::BandCount() const {
+  return (height - 1 + c_BAND_ROWS - 1)/c_BAND_ROWS;
+}
+
+// Loads the depths of the rows of band's quads, all but the band's last row
+// of pixels, which the next band loads. The last band loads it too.
+void OrganizedMesher::LoadDepth(int band) {
+  const int begin = band*c_BAND_ROWS;
+  const int end = band + 1 == BandCount() ? height : std::min(begin + c_BAND_ROWS, height);
+  for (int i = begin*width; i < end*width; i++) {
+    const float z = points[i*point_stride + 2];
+    depth[i] = z == z ? z : 0.0f;
+  }
+}
+
+void OrganizedMesher::MeshBand(int band) {
+  const int quads = width - 1;
+  const int begin = band*c_BAND_ROWS;
+  const int end = std::min(begin + c_BAND_ROWS, height - 1);
+  uint8_t* row_masks = &band_masks[band*max_width];
+  int triangles = 0;
+  int changed = 0;
+  for (int row = begin; row < end; row++) {
+    GetKernel().mesh_row(&depth[row*width], &depth[(row + 1)*width], quads, max_depth_jump, row_masks);
+    uint8_t* old_masks = &masks[row*quads];
+    for (int q = 0; q < quads; q++) {
+      // Most of a frame is the same as the last one, so unchanged runs of 8
+      // quads are skipped. Mask bits are triangles, so counting bits counts
+      // triangles.
+      if (!rewrite_all && q % 8 == 0 && q + 8 <= quads) {
+        uint64_t now, before;
+        memcpy(&now, row_masks + q, 8);
+        memcpy(&before, old_masks + q, 8);
+        if (now == before) {
+          triangles += __builtin_popcountll(now);
+          q += 7;
+          continue;
+        }
+      }
+      const uint8_t mask = row_masks[q];
+      triangles += (mask & 1) + (mask >> 1);
+      if (mask == old_masks[q] && !rewrite_all) {
+        continue;
+      }
+      old_masks[q] = mask;
+      changed++;
+      const uint32_t a = row*width + q;
+      const uint32_t b = a + 1;
+      const uint32_t c = a + width;
+      const uint32_t d = c + 1;
+      uint32_t* slot = &indices[6*(row*quads + q)];
+      if (mask & 1) {
+        slot[0] = a;
+        slot[1] = c;
+        slot[2] = b;
+      } else {
+        slot[0] = slot[1] = slot[2] = 0;
+      }
+      if (mask & 2) {
+        slot[3] = b;
+        slot[4] = c;
+        slot[5] = d;
+      } else {
+        slot[3] = slot[4] = slot[5] = 0;
+      }
+    }
+  }
+  band_triangles[band] = triangles;
+  band_changed[band] = changed;
+}
+
+int OrganizedMesher::Compute(const float* points, int point_stride, int width, int height, ThreadPool* pool) {
+  width = std::min(width, max_width);
+  height = std::min(height, max_height);
+  // Quad indices depend on the grid size, so a new one rewrites every slot
+  rewrite_all = width != this->width || height != this->height;
+  this->width = width;
+  this->height = height;
+  this->points = points;
+  this->point_stride = point_stride;
+  if (width < 2 || height < 2) {
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+  }
+  ThreadPool::Run(pool, BandCount(), [this](int band) {
+    LoadDepth(band);
+  });
+  ThreadPool::Run(pool, BandCount(), [this](int band) {
+    MeshBand(band);
+  });
+  stats.triangles = 0;
+  stats.changed_quads = 0;
+  for (int band = 0; band < BandCount(); band++) {
+    stats.triangles += band_triangles[band];
+    stats.changed_quads += band_changed[band];
+  }
+  rewrite_all = false;
+  return stats.triangles;
+}
+
+int OrganizedMesher::CompactIndices(uint32_t* out) const {
+  const int quad_count = (width - 1)*(height - 1);
+  int count = 0;
+  for (int q = 0; q < quad_count; q++) {
+    const uint32_t* slot = &indices[6*q];
+    if (masks[q] & 1) {
+      out[count++] = slot[0];
+      out[count++] = slot[1];
+      out[count++] = slot[2];
+    }
+    if (masks[q] & 2) {
+      out[count++] = slot[3];
+      out[count++] = slot[4];
+      out[count++] = slot[5];
+    }
+  }
+  return count;
+}
@@ -0,0 +1,278 @@
+#include "plane_segmenter.h"
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <functional>
+#include <math.h>
+#include <string.h>
+
+#include "thread_pool.h"
+
+namespace {
+
+// Cells are c_CELL_SIZE pixels square
+const int c_CELL_SIZE = 8;
+// A cell needs this many points to be fitted
+const int c_MIN_CELL_POINTS = c_CELL_SIZE*c_CELL_SIZE*3/4;
+// Flat cells have an RMS distance to their plane of at most this times
+// their depth, which is about the noise of the DS325
+const float c_FLAT_RMS = 0.004f;
+// Points and cells are on a plane within this times their depth
+const float c_MAX_DISTANCE = 0.01f;
+
+// cell_regions of cells in no region yet, and of cells of regions that
+// turned out too small
+const int c_FREE = -1;
+const int c_REJECTED = -2;
+
+void Clear(PlaneSegmenter::Moments* m) {
+  memset(m, 0, sizeof(*m));
+}
+
+inline void Add(PlaneSegmenter::Moments* m, float x, float y, float z) {
+  m->n += 1;
+  m->s[0] += x;
+  m->s[1] += y;
+  m->s[2] += z;
+  m->ss[0] += x*x;
+  m->ss[1] += x*y;
+  m->ss[2] += x*z;
+  m->ss[3] += y*y;
+  m->ss[4] += y*z;
+  m->ss[5] += z*z;
+}
+
+void Add(PlaneSegmenter::Moments* m, const PlaneSegmenter::Moments& other) {
+  m->n += other.n;
+  for (int i = 0; i < 3; i++) {
+    m->s[i] += other.s[i];
+  }
+  for (int i = 0; i < 6; i++) {
+    m->ss[i] += other.ss[i];
+  }
+}
+
+// Least squares plane of at least 3 points: the normal is the direction the
+// points vary least in, turned towards the camera at the origin. Returns the
+// mean squared distance to the plane.
+float Fit(const PlaneSegmenter::Moments& m, float* normal, float* offset, float* centroid) {
+  const Eigen::Vector3d mean(m.s[0]/m.n, m.s[1]/m.n, m.s[2]/m.n);
+  Eigen::Matrix3d covariance;
+  covariance << m.ss[0], m.ss[1], m.ss[2],
+                m.ss[1], m.ss[3], m.ss[4],
+                m.ss[2], m.ss[4], m.ss[5];
+  covariance = covariance/m.n - mean*mean.transpose();
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+  solver.computeDirect(covariance);
+  // Eigenvalues come in increasing order
+  Eigen::Vector3d n = solver.eigenvectors().col(0);
+  if (n.dot(mean) > 0) {
+    n = -n;
+  }
+  for (int i = 0; i < 3; i++) {
+    normal[i] = n[i];
+    centroid[i] = mean[i];
+  }
+  *offset = -n.dot(mean);
+  return std::max(0.0, solver.eigenvalues()[0]);
+}
+
+inline float Distance(const float* normal, float offset, const float* p) {
+  return fabsf(normal[0]*p[0] + normal[1]*p[1] + normal[2]*p[2] + offset);
+}
+
+inline float Cosine(const float* a, const float* b) {
+  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+}
+
+PlaneSegmenter::PlaneSegmenter(int width, int height, int min_points, float max_angle)
+    : width(width), height(height), cells_x(width/c_CELL_SIZE), cells_y(height/c_CELL_SIZE),
+      min_cos(cosf(max_angle*(float)M_PI/180.0f)), min_points(min_points), cell_moments(cells_x*cells_y),
+      cells(cells_x*cells_y), cell_regions(cells_x*cells_y), band_moments(cells_y*c_MAX_PLANES), next_id(0),
+      points(NULL), point_stride(0), labels(NULL) {
+  seeds.reserve(cells_x*cells_y);
+  queue.reserve(cells_x*cells_y);
+  planes.reserve(c_MAX_PLANES);
+  previous.reserve(c_MAX_PLANES);
+}
+
+void PlaneSegmenter::FitCells(int cell_row) {
+  for (int cx = 0; cx < cells_x; cx++) {
+    const int cell = cell_row*cells_x + cx;
+    Moments& m = cell_moments[cell];
+    Clear(&m);
+    for (int y = cell_row*c_CELL_SIZE; y < (cell_row + 1)*c_CELL_SIZE; y++) {
+      const float* p = points + (y*width + cx*c_CELL_SIZE)*point_stride;
+      for (int x = 0; x < c_CELL_SIZE; x++, p += point_stride) {
+        if (p[2] == p[2]) {
+          Add(&m, p[0], p[1], p[2]);
+        }
+      }
+    }
+    CellFit& fit = cells[cell];
+    fit.flat = false;
+    if (m.n < c_MIN_CELL_POINTS) {
+      continue;
+    }
+    fit.mse = Fit(m, fit.normal, &fit.offset, fit.centroid);
+    const float max_rms = c_FLAT_RMS*fit.centroid[2];
+    fit.flat = fit.mse <= max_rms*max_rms;
+  }
+}
+
+// Grows a region from seed over the free flat cells that agree with it.
+// Keeps it as a plane with id, or a new id when id is negative, if it is
+// large enough.
+bool PlaneSegmenter::Grow(int seed, int id) {
+  const int region = planes.size();
+  Moments moments = cell_moments[seed];
+  Plane plane;
+  Fit(moments, plane.normal, &plane.offset, plane.centroid);
+  queue.clear();
+  queue.push_back(seed);
+  cell_regions[seed] = region;
+  for (size_t i = 0; i < queue.size(); i++) {
+    const int cell = queue[i];
+    const int cx = cell%cells_x;
+    const int cy = cell/cells_x;
+    const int neighbors[4] = {
+      cx > 0 ? cell - 1 : -1,
+      cx + 1 < cells_x ? cell + 1 : -1,
+      cy > 0 ? cell - cells_x : -1,
+      cy + 1 < cells_y ? cell + cells_x : -1
+    };
+    for (int k = 0; k < 4; k++) {
+      const int next = neighbors[k];
+      if (next < 0 || cell_regions[next] != c_FREE || !cells[next].flat) {
+        continue;
+      }
+      const CellFit& fit = cells[next];
+      if (Cosine(fit.normal, plane.normal) < min_cos ||
+          Distance(plane.normal, plane.offset, fit.centroid) > c_MAX_DISTANCE*fit.centroid[2]) {
+        continue;
+      }
+      cell_regions[next] = region;
+      queue.push_back(next);
+      Add(&moments, cell_moments[next]);
+      Fit(moments, plane.normal, &plane.offset, plane.centroid);
+    }
+  }
+  if (moments.n < min_points) {
+    for (size_t i = 0; i < queue.size(); i++) {
+      cell_regions[queue[i]] = c_REJECTED;
+    }
+    return false;
+  }
+  plane.id = id >= 0 ? id : next_id++;
+  planes.push_back(plane);
+  return true;
+}
+
+void PlaneSegmenter::LabelBand(int cell_row) {
+  Moments* moments = &band_moments[cell_row*c_MAX_PLANES];
+  for (size_t i = 0; i < planes.size(); i++) {
+    Clear(&moments[i]);
+  }
+  // The last band also takes the rows and columns past the last full cells
+  const int y_end = cell_row + 1 == cells_y ? height : (cell_row + 1)*c_CELL_SIZE;
+  for (int cx = 0; cx < cells_x; cx++) {
+    // Candidates are the planes of the cell and of its neighbors
+    int candidates[9];
+    int candidate_count = 0;
+    for (int ny = std::max(cell_row - 1, 0); ny <= std::min(cell_row + 1, cells_y - 1); ny++) {
+      for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, cells_x - 1); nx++) {
+        const int region = cell_regions[ny*cells_x + nx];
+        if (region >= 0 && std::find(candidates, candidates + candidate_count, region) ==
+            candidates + candidate_count) {
+          candidates[candidate_count++] = region;
+        }
+      }
+    }
+    const int x_end = cx + 1 == cells_x ? width : (cx + 1)*c_CELL_SIZE;
+    for (int y = cell_row*c_CELL_SIZE; y < y_end; y++) {
+      for (int x = cx*c_CELL_SIZE; x < x_end; x++) {
+        const int i = y*width + x;
+        const float* p = points + i*point_stride;
+        uint8_t label = c_NO_PLANE;
+        if (p[2] == p[2]) {
+          float best = c_MAX_DISTANCE*p[2];
+          for (int c = 0; c < candidate_count; c++) {
+            const Plane& plane = planes[candidates[c]];
+            const float distance = Distance(plane.normal, plane.offset, p);
+            if (distance <= best) {
+              best = distance;
+              label = candidates[c];
+            }
+          }
+          if (label != c_NO_PLANE) {
+            Add(&moments[label], p[0], p[1], p[2]);
+          }
+        }
+        if (labels != NULL) {
+          labels[i] = label;
+        }
+      }
+    }
+  }
+}
+
+int PlaneSegmenter::Compute(const float* points, int point_stride, uint8_t* labels, ThreadPool* pool) {
+  this->points = points;
+  this->point_stride = point_stride;
+  this->labels = labels;
+  ThreadPool::Run(pool, cells_y, [this](int cell_row) {
+    FitCells(cell_row);
+  });
+
+  seeds.clear();
+  for (int cell = 0; cell < cells_x*cells_y; cell++) {
+    cell_regions[cell] = c_FREE;
+    if (cells[cell].flat) {
+      seeds.push_back(cell);
+    }
+  }
+  std::sort(seeds.begin(), seeds.end(), [this](int a, int b) {
+    return cells[a].mse < cells[b].mse;
+  });
+  planes.clear();
+  // The planes of the last frame first, each from its best fitting cell
+  // that still agrees with it
+  for (size_t i = 0; i < previous.size() && (int)planes.size() < c_MAX_PLANES; i++) {
+    const Plane& last = previous[i];
+    for (size_t s = 0; s < seeds.size(); s++) {
+      const CellFit& fit = cells[seeds[s]];
+      if (cell_regions[seeds[s]] == c_FREE && Cosine(fit.normal, last.normal) >= min_cos &&
+          Distance(last.normal, last.offset, fit.centroid) <= c_MAX_DISTANCE*fit.centroid[2]) {
+        Grow(seeds[s], last.id);
+        break;
+      }
+    }
+  }
+  for (size_t s = 0; s < seeds.size() && (int)planes.size() < c_MAX_PLANES; s++) {
+    if (cell_regions[seeds[s]] == c_FREE) {
+      Grow(seeds[s], -1);
+    }
+  }
+
+  ThreadPool::Run(pool, cells_y, [this](int cell_row) {
+    LabelBand(cell_row);
+  });
+  // Refit the planes to the points labeled with them
+  for (size_t i = 0; i < planes.size(); i++) {
+    Moments moments = band_moments[i];
+    for (int band = 1; band < cells_y; band++) {
+      Add(&moments, band_moments[band*c_MAX_PLANES + i]);
+    }
+    Plane& plane = planes[i];
+    plane.points = moments.n;
+    if (moments.n >= 3) {
+      plane.rms_error = sqrtf(Fit(moments, plane.normal, &plane.offset, plane.centroid));
+    } else {
+      plane.rms_error = 0;
+    }
+  }
+  previous = planes;
+  return planes.size();
+}
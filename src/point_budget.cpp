@@ -0,0 +1,68 @@
+#include "point_budget.h"
+
+#include <algorithm>
+
+#include "frame.h"
+#include "metrics.h"
+
+namespace {
+
+// Weight of the newest report in the smoothed frame time
+const double c_SMOOTHING = 0.2;
+// The budget aims this far below the target
+const double c_HEADROOM = 0.9;
+// Frames to wait after a change, for clouds of the new detail to arrive
+const int c_SETTLE_FRAMES = 5;
+// Frames have to be this far under the target before a finer detail is
+// tried, the first time after this many frames and at most this many after
+// failed tries
+const double c_CALM = 0.5;
+const int c_PROBE_FRAMES = 30;
+const int c_MAX_PROBE_FRAMES = 480;
+
+}
+
+PointBudget::PointBudget(double target_ms)
+    : target_ms(target_ms), smoothed_ms(0), settle_frames(0), calm_frames(0), probe_wait(c_PROBE_FRAMES),
+      probing(false), stride(1) {
+  METRICS_GAUGE(GAUGE_POINT_BUDGET, Points(1));
+}
+
+int PointBudget::Points(int stride) {
+  return ((DEPTH_WIDTH + stride - 1)/stride)*((DEPTH_HEIGHT + stride - 1)/stride);
+}
+
+void PointBudget::Update(double frame_ms) {
+  if (settle_frames > 0) {
+    settle_frames--;
+    return;
+  }
+  smoothed_ms = smoothed_ms > 0 ? smoothed_ms + c_SMOOTHING*(frame_ms - smoothed_ms) : frame_ms;
+  const int current = stride.load(std::memory_order_relaxed);
+  const double budget = Points(current)*c_HEADROOM*target_ms/smoothed_ms;
+  int next = 1;
+  while (next < c_MAX_STRIDE && Points(next) > budget) {
+    next++;
+  }
+  if (probing) {
+    probing = false;
+    probe_wait = next > current ? std::min(2*probe_wait, c_MAX_PROBE_FRAMES) : c_PROBE_FRAMES;
+  }
+  if (next == current && current > 1 && smoothed_ms < c_CALM*target_ms) {
+    if (++calm_frames >= probe_wait) {
+      next = current - 1;
+      probing = true;
+    }
+  } else if (next == current) {
+    calm_frames = 0;
+  }
+  if (next == current) {
+    return;
+  }
+  calm_frames = 0;
+  // Frame times start over with the new detail
+  smoothed_ms = 0;
+  settle_frames = c_SETTLE_FRAMES;
+  stride.store(next, std::memory_order_relaxed);
+  METRICS_GAUGE(GAUGE_POINT_BUDGET, Points(next));
+}
@@ -0,0 +1,540 @@
+#include "recording.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace recording;
+
+namespace {
+
+const char c_FILE_MAGIC[8] = {'D', 'S', '3', '2', '5', 'R', 'E', 'C'};
+const char c_FOOTER_MAGIC[4] = {'D', 'I', 'D', 'X'};
+// "CHNK"
+const uint32_t c_CHUNK_MAGIC = 0x4b4e4843;
+
+const uint32_t c_DEPTH_PAYLOAD_SIZE = sizeof(DepthChunk) +
+    c_PIXEL_COUNT*(sizeof(Vertex) + sizeof(UV) + sizeof(int16_t));
+const uint32_t c_COLOR_PAYLOAD_SIZE = 3*c_COLOR_PIXEL_COUNT;
+
+// Compressed depth frames between key frames, a second at 60 fps
+const uint32_t c_KEYFRAME_INTERVAL = 60;
+// Threads coding depth, counting the writer thread or the replay thread
+const int c_CODEC_THREADS = 2;
+
+// How long the writer thread sleeps when it finds nothing queued, in case a
+// wakeup was missed
+const int c_WRITER_POLL_MS = 5;
+
+uint64_t Padded(uint64_t size) {
+  return (size + c_ALIGNMENT - 1) & ~(uint64_t)(c_ALIGNMENT - 1);
+}
+
+// Where plane lives in a depth payload, and its stride in int16s
+int16_t* PlaneData(Vertex* vertices, int16_t* confidence, int plane, int* stride) {
+  *stride = plane == PLANE_CONFIDENCE ? 1 : 3;
+  return plane == PLANE_CONFIDENCE ? confidence : &vertices[0].x + plane;
+}
+
+}
+
+RecordingWriter::RecordingWriter(int buffer_count, bool compress_depth)
+    : buffers(buffer_count), filled(buffer_count), free_buffers(buffer_count),
+      running(false), file(NULL), file_offset(0), compress_depth(compress_depth),
+      codec(DEPTH_WIDTH, DEPTH_HEIGHT), pool(compress_depth ? c_CODEC_THREADS : 1),
+      previous_vertices(c_PIXEL_COUNT), previous_confidence(c_PIXEL_COUNT),
+      write_error(false), written(0), dropped(0), failed(0), bytes(0) {
+  for (int i = 0; i < buffer_count; i++) {
+    buffers[i].payload.resize(std::max(c_DEPTH_PAYLOAD_SIZE, c_COLOR_PAYLOAD_SIZE));
+    free_buffers.Push(&buffers[i]);
+  }
+}
+
+RecordingWriter::~RecordingWriter() {
+  Close();
+}
+
+bool RecordingWriter::Open(const std::string& path) {
+  Close();
+  file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    printf("Couldn't open %s for writing\n", path.c_str());
+    return false;
+  }
+  FileHeader header;
+  memcpy(header.magic, c_FILE_MAGIC, sizeof(header.magic));
+  header.version = c_VERSION;
+  header.header_size = Padded(sizeof(FileHeader));
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    printf("Couldn't write to %s\n", path.c_str());
+    fclose(file);
+    file = NULL;
+    return false;
+  }
+  file_offset = sizeof(header);
+  write_error = false;
+
+  index.clear();
+  index.reserve(1 << 16);
+  for (int i = 0; i < STREAM_COUNT; i++) {
+    stream_frames[i] = 0;
+  }
+  running = true;
+  writer = std::thread(&RecordingWriter::WriterLoop, this);
+  return true;
+}
+
+bool RecordingWriter::Close() {
+  if (file == NULL) {
+    return true;
+  }
+  running = false;
+  wake.notify_one();
+  writer.join();
+
+  // The index goes in its own chunk, followed by the footer pointing at it.
+  // After a failed write the chunks end in a partial one and the index would
+  // point at frames that aren't there, so the file is left without one and
+  // readers rebuild it from the chunks that made it.
+  if (!write_error) {
+    Footer footer;
+    footer.index_offset = file_offset;
+    footer.index_count = index.size();
+    memcpy(footer.magic, c_FOOTER_MAGIC, sizeof(footer.magic));
+    if (WriteChunk(STREAM_INDEX, 0, 0, 0, index.empty() ? NULL : &index[0], index.size()*sizeof(IndexEntry))) {
+      write_error = fwrite(&footer, sizeof(footer), 1, file) != 1;
+    }
+  }
+  if (fclose(file) != 0) {
+    write_error = true;
+  }
+  file = NULL;
+  if (write_error) {
+    printf("Writing the recording failed, %lu frames weren't written\n",
+        (unsigned long)failed.load(std::memory_order_relaxed));
+  }
+  return !write_error;
+}
+
+RecordingWriter::Buffer* RecordingWriter::TakeBuffer() {
+  Buffer* buffer;
+  if (file == NULL) {
+    return NULL;
+  }
+  if (!free_buffers.Pop(&buffer)) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+  return buffer;
+}
+
+void RecordingWriter::Queue(Buffer* buffer) {
+  // Can't fail, there are only as many buffers as queue slots
+  filled.Push(buffer);
+  wake.notify_one();
+}
+
+void RecordingWriter::OnDepthFrame(const DepthFrame& frame) {
+  Buffer* buffer = TakeBuffer();
+  if (buffer == NULL) {
+    return;
+  }
+  uint8_t* payload = &buffer->payload[0];
+  DepthChunk chunk;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.intrinsics = frame.intrinsics;
+  chunk.dropped = frame.dropped;
+  memcpy(payload, &chunk, sizeof(chunk));
+  payload += sizeof(chunk);
+  memcpy(payload, frame.vertices, c_PIXEL_COUNT*sizeof(Vertex));
+  payload += c_PIXEL_COUNT*sizeof(Vertex);
+  memcpy(payload, frame.uv_map, c_PIXEL_COUNT*sizeof(UV));
+  payload += c_PIXEL_COUNT*sizeof(UV);
+  if (frame.confidence != NULL) {
+    memcpy(payload, frame.confidence, c_PIXEL_COUNT*sizeof(int16_t));
+  } else {
+    memset(payload, 0, c_PIXEL_COUNT*sizeof(int16_t));
+  }
+
+  buffer->stream = STREAM_DEPTH;
+  buffer->timestamp = frame.timestamp;
+  buffer->payload_size = c_DEPTH_PAYLOAD_SIZE;
+  Queue(buffer);
+}
+
+void RecordingWriter::OnColorFrame(const ColorFrame& frame) {
+  Buffer* buffer = TakeBuffer();
+  if (buffer == NULL) {
+    return;
+  }
+  memcpy(&buffer->payload[0], frame.bgr, c_COLOR_PAYLOAD_SIZE);
+  buffer->stream = STREAM_COLOR;
+  buffer->timestamp = frame.timestamp;
+  buffer->payload_size = c_COLOR_PAYLOAD_SIZE;
+  Queue(buffer);
+}
+
+void RecordingWriter::WriterLoop() {
+  for (;;) {
+    // Anything queued before Close flipped running gets written
+    bool stopping = !running;
+    Buffer* buffer;
+    while (filled.Pop(&buffer)) {
+      uint32_t frame = stream_frames[buffer->stream]++;
+      bool ok;
+      if (buffer->stream == STREAM_DEPTH && compress_depth) {
+        ok = WriteDepth(frame, buffer->timestamp, &buffer->payload[0]);
+      } else {
+        ok = WriteChunk(buffer->stream, 0, frame, buffer->timestamp, &buffer->payload[0], buffer->payload_size);
+      }
+      free_buffers.Push(buffer);
+      (ok ? written : failed).fetch_add(1, std::memory_order_relaxed);
+    }
+    if (stopping) {
+      break;
+    }
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    wake.wait_for(lock, std::chrono::milliseconds(c_WRITER_POLL_MS));
+  }
+}
+
+bool RecordingWriter::WriteDepth(uint32_t frame, uint64_t timestamp, const uint8_t* payload) {
+  if (write_error) {
+    return false;
+  }
+  const DepthChunk* chunk = (const DepthChunk*)payload;
+  Vertex* vertices = (Vertex*)(payload + sizeof(DepthChunk));
+  const UV* uv_map = (const UV*)(vertices + c_PIXEL_COUNT);
+  int16_t* confidence = (int16_t*)(uv_map + c_PIXEL_COUNT);
+  bool key = frame % c_KEYFRAME_INTERVAL == 0;
+
+  compressed.resize(sizeof(DepthChunk) + sizeof(CompressedDepth));
+  memcpy(&compressed[0], chunk, sizeof(DepthChunk));
+  compressed.insert(compressed.end(), (const uint8_t*)uv_map, (const uint8_t*)(uv_map + c_PIXEL_COUNT));
+  CompressedDepth sizes;
+  for (int plane = 0; plane < PLANE_COUNT; plane++) {
+    int stride;
+    const int16_t* current = PlaneData(vertices, confidence, plane, &stride);
+    const int16_t* previous = PlaneData(&previous_vertices[0], &previous_confidence[0], plane, &stride);
+    sizes.plane_size[plane] = codec.Encode(current, key ? NULL : previous, stride, &compressed, &pool);
+  }
+  memcpy(&compressed[sizeof(DepthChunk)], &sizes, sizeof(sizes));
+  memcpy(&previous_vertices[0], vertices, c_PIXEL_COUNT*sizeof(Vertex));
+  memcpy(&previous_confidence[0], confidence, c_PIXEL_COUNT*sizeof(int16_t));
+
+  uint16_t flags = CHUNK_COMPRESSED | (key ? CHUNK_KEYFRAME : 0);
+  return WriteChunk(STREAM_DEPTH, flags, frame, timestamp, &compressed[0], compressed.size());
+}
+
+bool RecordingWriter::WriteChunk(uint16_t stream, uint16_t flags, uint32_t frame, uint64_t timestamp,
+                                 const void* payload, uint32_t size) {
+  static const uint8_t padding[c_ALIGNMENT] = {0};
+  // Once a write has failed the offsets no longer match the file
+  if (write_error) {
+    return false;
+  }
+
+  ChunkHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = c_CHUNK_MAGIC;
+  header.stream = stream;
+  header.flags = flags;
+  header.frame = frame;
+  header.payload_size = size;
+  header.timestamp = timestamp;
+  uint64_t padded = Padded(size);
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      (size > 0 && fwrite(payload, 1, size, file) != size) ||
+      fwrite(padding, 1, padded - size, file) != padded - size) {
+    write_error = true;
+    return false;
+  }
+
+  if (stream != STREAM_INDEX) {
+    IndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = file_offset;
+    entry.timestamp = timestamp;
+    entry.payload_size = size;
+    entry.stream = stream;
+    entry.flags = flags;
+    entry.frame = frame;
+    index.push_back(entry);
+  }
+  file_offset += sizeof(header) + padded;
+  bytes.fetch_add(sizeof(header) + padded, std::memory_order_relaxed);
+  return true;
+}
+
+RecordingWriter::Stats RecordingWriter::GetStats() const {
+  Stats stats;
+  stats.written = written.load(std::memory_order_relaxed);
+  stats.dropped = dropped.load(std::memory_order_relaxed);
+  stats.failed = failed.load(std::memory_order_relaxed);
+  stats.bytes = bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+RecordingReader::RecordingReader()
+    : fd(-1), data(NULL), size(0), codec(DEPTH_WIDTH, DEPTH_HEIGHT), pool(c_CODEC_THREADS),
+      vertices(c_PIXEL_COUNT), confidence(c_PIXEL_COUNT), decoded_frame(-1) {}
+
+RecordingReader::~RecordingReader() {
+  Close();
+}
+
+bool RecordingReader::Open(const std::string& path) {
+  Close();
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("Couldn't open %s\n", path.c_str());
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FileHeader)) {
+    printf("%s is not a DS325 recording\n", path.c_str());
+    Close();
+    return false;
+  }
+  size = info.st_size;
+  void* mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    printf("Couldn't map %s\n", path.c_str());
+    data = NULL;
+    Close();
+    return false;
+  }
+  data = (const uint8_t*)mapping;
+
+  const FileHeader* header = (const FileHeader*)data;
+  if (memcmp(header->magic, c_FILE_MAGIC, sizeof(header->magic)) != 0 || header->version != c_VERSION) {
+    printf("%s is not a DS325 recording\n", path.c_str());
+    Close();
+    return false;
+  }
+
+  if (!ReadIndex()) {
+    printf("%s has no index, it wasn't closed properly. Rebuilding it.\n", path.c_str());
+    RebuildIndex();
+  }
+  for (int stream = 0; stream < STREAM_COUNT; stream++) {
+    stream_entries[stream].clear();
+  }
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].stream < STREAM_COUNT) {
+      stream_entries[entries[i].stream].push_back(i);
+    }
+  }
+  for (int stream = 0; stream < STREAM_COUNT; stream++) {
+    BuildBuckets(stream);
+  }
+  return true;
+}
+
+void RecordingReader::Close() {
+  if (data != NULL) {
+    munmap((void*)data, size);
+    data = NULL;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  size = 0;
+  entries.clear();
+  decoded_frame = -1;
+}
+
+bool RecordingReader::ReadIndex() {
+  if (size < sizeof(FileHeader) + sizeof(Footer)) {
+    return false;
+  }
+  const Footer* footer = (const Footer*)(data + size - sizeof(Footer));
+  if (memcmp(footer->magic, c_FOOTER_MAGIC, sizeof(footer->magic)) != 0 ||
+      footer->index_offset + sizeof(ChunkHeader) > size) {
+    return false;
+  }
+  const ChunkHeader* chunk = (const ChunkHeader*)(data + footer->index_offset);
+  uint64_t index_size = (uint64_t)footer->index_count*sizeof(IndexEntry);
+  if (chunk->magic != c_CHUNK_MAGIC || chunk->stream != STREAM_INDEX || chunk->payload_size != index_size ||
+      footer->index_offset + sizeof(ChunkHeader) + index_size > size) {
+    return false;
+  }
+  const IndexEntry* index = (const IndexEntry*)(chunk + 1);
+  entries.assign(index, index + footer->index_count);
+  return true;
+}
+
+bool RecordingReader::RebuildIndex() {
+  entries.clear();
+  uint64_t offset = ((const FileHeader*)data)->header_size;
+  while (offset + sizeof(ChunkHeader) <= size) {
+    const ChunkHeader* chunk = (const ChunkHeader*)(data + offset);
+    // Stops at the first damaged or cut off chunk
+    if (chunk->magic != c_CHUNK_MAGIC || chunk->stream == STREAM_INDEX ||
+        offset + sizeof(ChunkHeader) + chunk->payload_size > size) {
+      break;
+    }
+    IndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = offset;
+    entry.timestamp = chunk->timestamp;
+    entry.payload_size = chunk->payload_size;
+    entry.stream = chunk->stream;
+    entry.flags = chunk->flags;
+    entry.frame = chunk->frame;
+    entries.push_back(entry);
+    offset += sizeof(ChunkHeader) + Padded(chunk->payload_size);
+  }
+  return !entries.empty();
+}
+
+void RecordingReader::BuildBuckets(int stream) {
+  const std::vector<uint32_t>& frames = stream_entries[stream];
+  buckets[stream].clear();
+  bucket_width[stream] = 1;
+  if (frames.size() < 2) {
+    return;
+  }
+  uint64_t first = entries[frames.front()].timestamp;
+  uint64_t last = entries[frames.back()].timestamp;
+  if (last <= first) {
+    return;
+  }
+  // One bucket per average frame period, so each bucket holds about one frame
+  uint64_t width = std::max<uint64_t>(1, (last - first)/(frames.size() - 1));
+  bucket_width[stream] = width;
+  size_t count = (last - first)/width + 1;
+  buckets[stream].resize(count);
+  size_t frame = 0;
+  for (size_t bucket = 0; bucket < count; bucket++) {
+    uint64_t start = first + bucket*width;
+    while (frame + 1 < frames.size() && entries[frames[frame]].timestamp < start) {
+      frame++;
+    }
+    buckets[stream][bucket] = frame;
+  }
+}
+
+int RecordingReader::FrameCount(int stream) const {
+  return stream_entries[stream].size();
+}
+
+int RecordingReader::EntryCount() const {
+  return entries.size();
+}
+
+const IndexEntry& RecordingReader::Entry(int i) const {
+  return entries[i];
+}
+
+// Decodes a compressed depth frame into vertices and confidence, along with
+// the frames since the last key frame if they aren't decoded already.
+bool RecordingReader::DecodeDepth(int frame_number) {
+  if (frame_number == decoded_frame) {
+    return true;
+  }
+  const std::vector<uint32_t>& frames = stream_entries[STREAM_DEPTH];
+  int first = frame_number;
+  while (first > 0 && first != decoded_frame + 1 && !(entries[frames[first]].flags & CHUNK_KEYFRAME)) {
+    first--;
+  }
+
+  for (int n = first; n <= frame_number; n++) {
+    const IndexEntry& entry = entries[frames[n]];
+    bool key = entry.flags & CHUNK_KEYFRAME;
+    const uint8_t* payload = data + entry.offset + sizeof(ChunkHeader);
+    const uint8_t* end = payload + entry.payload_size;
+    if (!(entry.flags & CHUNK_COMPRESSED) || (!key && n != decoded_frame + 1)) {
+      decoded_frame = -1;
+      return false;
+    }
+    CompressedDepth sizes;
+    memcpy(&sizes, payload + sizeof(DepthChunk), sizeof(sizes));
+    payload += sizeof(DepthChunk) + sizeof(CompressedDepth) + c_PIXEL_COUNT*sizeof(UV);
+    for (int plane = 0; plane < PLANE_COUNT; plane++) {
+      int stride;
+      int16_t* out = PlaneData(&vertices[0], &confidence[0], plane, &stride);
+      if (payload + sizes.plane_size[plane] > end ||
+          !codec.Decode(payload, sizes.plane_size[plane], key ? NULL : out, stride, out, &pool)) {
+        decoded_frame = -1;
+        return false;
+      }
+      payload += sizes.plane_size[plane];
+    }
+    decoded_frame = n;
+  }
+  return true;
+}
+
+bool RecordingReader::GetDepth(int frame_number, DepthFrame* frame) {
+  if (frame_number < 0 || frame_number >= FrameCount(STREAM_DEPTH)) {
+    return false;
+  }
+  const IndexEntry& entry = entries[stream_entries[STREAM_DEPTH][frame_number]];
+  const uint8_t* payload = data + entry.offset + sizeof(ChunkHeader);
+  const DepthChunk* chunk = (const DepthChunk*)payload;
+  frame->timestamp = entry.timestamp;
+  frame->intrinsics = chunk->intrinsics;
+  frame->dropped = chunk->dropped;
+
+  if (entry.flags & CHUNK_COMPRESSED) {
+    size_t header_size = sizeof(DepthChunk) + sizeof(CompressedDepth);
+    if (entry.payload_size < header_size + c_PIXEL_COUNT*sizeof(UV) || !DecodeDepth(frame_number)) {
+      return false;
+    }
+    frame->vertices = &vertices[0];
+    frame->uv_map = (const UV*)(payload + header_size);
+    frame->confidence = &confidence[0];
+    return true;
+  }
+
+  if (entry.payload_size != c_DEPTH_PAYLOAD_SIZE) {
+    return false;
+  }
+  payload += sizeof(DepthChunk);
+  frame->vertices = (const Vertex*)payload;
+  payload += c_PIXEL_COUNT*sizeof(Vertex);
+  frame->uv_map = (const UV*)payload;
+  payload += c_PIXEL_COUNT*sizeof(UV);
+  frame->confidence = (const int16_t*)payload;
+  return true;
+}
+
+bool RecordingReader::GetColor(int frame_number, ColorFrame* frame) const {
+  if (frame_number < 0 || frame_number >= FrameCount(STREAM_COLOR)) {
+    return false;
+  }
+  const IndexEntry& entry = entries[stream_entries[STREAM_COLOR][frame_number]];
+  if (entry.payload_size != c_COLOR_PAYLOAD_SIZE || entry.flags != 0) {
+    return false;
+  }
+  frame->timestamp = entry.timestamp;
+  frame->bgr = data + entry.offset + sizeof(ChunkHeader);
+  frame->dropped = 0;
+  return true;
+}
+
+int RecordingReader::FindFrame(int stream, uint64_t timestamp) const {
+  const std::vector<uint32_t>& frames = stream_entries[stream];
+  if (frames.empty()) {
+    return -1;
+  }
+  uint64_t first = entries[frames.front()].timestamp;
+  if (timestamp <= first || buckets[stream].empty()) {
+    return 0;
+  }
+  size_t bucket = std::min<uint64_t>((timestamp - first)/bucket_width[stream], buckets[stream].size() - 1);
+  int frame = buckets[stream][bucket];
+  // The bucket gets us within a frame or two
+  while (frame > 0 && entries[frames[frame]].timestamp > timestamp) {
+    frame--;
+  }
+  while (frame + 1 < (int)frames.size() && entries[frames[frame + 1]].timestamp <= timestamp) {
+    frame++;
+  }
+  return frame;
+}
@@ -0,0 +1,60 @@
+#include "replay_source.h"
+
+#include <chrono>
+#include <thread>
+
+using namespace recording;
+
+ReplaySource::ReplaySource(const std::string& path, bool realtime, bool loop)
+    : path(path), realtime(realtime), loop(loop), stopped(false) {}
+
+bool ReplaySource::Run() {
+  if (!reader.Open(path)) {
+    return false;
+  }
+  int count = reader.EntryCount();
+  if (count == 0) {
+    reader.Close();
+    return true;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint64_t first_time = reader.Entry(0).timestamp;
+  uint64_t last_time = first_time;
+  // Added to the recorded timestamps so they keep increasing when looping
+  uint64_t time_offset = 0;
+
+  DepthFrame depth;
+  ColorFrame color;
+  int i = 0;
+  while (!stopped) {
+    if (i == count) {
+      if (!loop) {
+        break;
+      }
+      i = 0;
+      time_offset = last_time + 1 - first_time;
+    }
+
+    // Frames come straight out of the mapping in the order they were recorded
+    const IndexEntry& entry = reader.Entry(i++);
+    uint64_t timestamp = entry.timestamp + time_offset;
+    last_time = timestamp;
+    if (realtime) {
+      std::this_thread::sleep_until(start + std::chrono::microseconds(timestamp - first_time));
+    }
+    if (entry.stream == STREAM_DEPTH && reader.GetDepth(entry.frame, &depth)) {
+      depth.timestamp = timestamp;
+      sink->OnDepthFrame(depth);
+    } else if (entry.stream == STREAM_COLOR && reader.GetColor(entry.frame, &color)) {
+      color.timestamp = timestamp;
+      sink->OnColorFrame(color);
+    }
+  }
+  reader.Close();
+  return true;
+}
+
+void ReplaySource::Stop() {
+  stopped = true;
+}
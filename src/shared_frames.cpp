@@ -0,0 +1,283 @@
+#include "shared_frames.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace shared_frames;
+
+namespace {
+
+const char c_RING_MAGIC[8] = {'D', 'S', '3', '2', '5', 'S', 'H', 'M'};
+
+// How long a subscriber sleeps before looking at stopped again
+const long c_WAIT_TIMEOUT_NS = 100000000;
+
+const size_t c_DEPTH_PAYLOAD = c_PIXEL_COUNT*(sizeof(Vertex) + sizeof(UV) + sizeof(int16_t));
+const size_t c_COLOR_PAYLOAD = 3*c_COLOR_PIXEL_COUNT;
+
+size_t Padded(size_t size) {
+  return (size + c_ALIGNMENT - 1) & ~(size_t)(c_ALIGNMENT - 1);
+}
+
+uint64_t MonotonicNanoseconds() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+// Not FUTEX_PRIVATE, the word is shared between processes
+void FutexWait(std::atomic<uint32_t>* word, uint32_t value, long timeout_ns) {
+  timespec timeout = {0, timeout_ns};
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+SlotHeader* Slot(RingHeader* header, uint64_t frame) {
+  uint8_t* base = (uint8_t*)header + header->header_size;
+  return (SlotHeader*)(base + (frame % header->slot_count)*header->slot_size);
+}
+
+uint8_t* Payload(SlotHeader* slot) {
+  return (uint8_t*)slot + Padded(sizeof(SlotHeader));
+}
+
+}
+
+SharedFramePublisher::SharedFramePublisher() : header(NULL), mapping_size(0) {}
+
+SharedFramePublisher::~SharedFramePublisher() {
+  Close();
+}
+
+bool SharedFramePublisher::Open(const std::string& _name, int slot_count) {
+  Close();
+  const size_t header_size = Padded(sizeof(RingHeader));
+  const size_t slot_size = Padded(Padded(sizeof(SlotHeader)) + std::max(c_DEPTH_PAYLOAD, c_COLOR_PAYLOAD));
+  const size_t size = header_size + slot_count*slot_size;
+
+  // Subscribers of an earlier ring keep their mapping of it, which they
+  // leave once they see it closed
+  shm_unlink(_name.c_str());
+  int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+  if (fd < 0) {
+    printf("Couldn't create shared memory %s\n", _name.c_str());
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    printf("Couldn't size shared memory %s to %lu bytes\n", _name.c_str(), (unsigned long)size);
+    close(fd);
+    shm_unlink(_name.c_str());
+    return false;
+  }
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Couldn't map shared memory %s\n", _name.c_str());
+    shm_unlink(_name.c_str());
+    return false;
+  }
+  name = _name;
+  mapping_size = size;
+  // A fresh object is all zeros, which is every slot's sequence before its
+  // first frame
+  header = new (mapping) RingHeader;
+  header->version = c_VERSION;
+  header->header_size = header_size;
+  header->slot_count = slot_count;
+  header->slot_size = slot_size;
+  header->published.store(0);
+  header->futex.store(0);
+  header->waiters.store(0);
+  header->closed.store(0);
+  // Subscribers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header->magic, c_RING_MAGIC, sizeof(header->magic));
+  return true;
+}
+
+void SharedFramePublisher::Close() {
+  if (header == NULL) {
+    return;
+  }
+  header->closed.store(1, std::memory_order_release);
+  header->futex.fetch_add(1, std::memory_order_release);
+  FutexWakeAll(&header->futex);
+  munmap(header, mapping_size);
+  shm_unlink(name.c_str());
+  header = NULL;
+}
+
+// Marks the slot of frame as being written, which makes subscribers still
+// reading the frame before it see it torn
+uint8_t* SharedFramePublisher::BeginSlot(uint64_t frame, SlotHeader** slot) {
+  *slot = Slot(header, frame);
+  (*slot)->sequence.store(2*frame + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  return Payload(*slot);
+}
+
+void SharedFramePublisher::EndSlot(uint64_t frame, SlotHeader* slot) {
+  slot->publish_time = MonotonicNanoseconds();
+  slot->sequence.store(2*frame + 2, std::memory_order_release);
+  header->published.store(frame + 1, std::memory_order_release);
+  // Ordered before reading waiters: a subscriber that registers after this
+  // finds the futex changed and doesn't sleep
+  header->futex.fetch_add(1);
+  if (header->waiters.load() > 0) {
+    FutexWakeAll(&header->futex);
+  }
+}
+
+void SharedFramePublisher::OnDepthFrame(const DepthFrame& frame) {
+  if (header == NULL) {
+    return;
+  }
+  const uint64_t index = header->published.load(std::memory_order_relaxed);
+  SlotHeader* slot;
+  uint8_t* payload = BeginSlot(index, &slot);
+  slot->stream = STREAM_DEPTH;
+  slot->dropped = frame.dropped;
+  slot->timestamp = frame.timestamp;
+  slot->intrinsics = frame.intrinsics;
+  memcpy(payload, frame.vertices, c_PIXEL_COUNT*sizeof(Vertex));
+  payload += c_PIXEL_COUNT*sizeof(Vertex);
+  memcpy(payload, frame.uv_map, c_PIXEL_COUNT*sizeof(UV));
+  payload += c_PIXEL_COUNT*sizeof(UV);
+  memcpy(payload, frame.confidence, c_PIXEL_COUNT*sizeof(int16_t));
+  EndSlot(index, slot);
+}
+
+void SharedFramePublisher::OnColorFrame(const ColorFrame& frame) {
+  if (header == NULL) {
+    return;
+  }
+  const uint64_t index = header->published.load(std::memory_order_relaxed);
+  SlotHeader* slot;
+  uint8_t* payload = BeginSlot(index, &slot);
+  slot->stream = STREAM_COLOR;
+  slot->dropped = frame.dropped;
+  slot->timestamp = frame.timestamp;
+  memcpy(payload, frame.bgr, c_COLOR_PAYLOAD);
+  EndSlot(index, slot);
+}
+
+SharedFrameSubscriber::SharedFrameSubscriber(const std::string& name)
+    : name(name), stopped(false) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+bool SharedFrameSubscriber::Run() {
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    printf("No frames are published under %s\n", name.c_str());
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(RingHeader)) {
+    printf("%s is not a frame ring\n", name.c_str());
+    close(fd);
+    return false;
+  }
+  const size_t size = info.st_size;
+  // Writable for the waiter count only
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("Couldn't map %s\n", name.c_str());
+    return false;
+  }
+  RingHeader* header = (RingHeader*)mapping;
+  if (memcmp(header->magic, c_RING_MAGIC, sizeof(header->magic)) != 0 || header->version != c_VERSION ||
+      header->header_size + (size_t)header->slot_count*header->slot_size > size) {
+    printf("%s is not a frame ring\n", name.c_str());
+    munmap(mapping, size);
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  payload.resize(std::max(c_DEPTH_PAYLOAD, c_COLOR_PAYLOAD));
+  double latency_sum = 0;
+  uint64_t next = header->published.load(std::memory_order_acquire);
+  while (!stopped) {
+    const uint32_t futex = header->futex.load(std::memory_order_acquire);
+    const uint64_t published = header->published.load(std::memory_order_acquire);
+    if (next == published) {
+      if (header->closed.load(std::memory_order_acquire)) {
+        break;
+      }
+      header->waiters.fetch_add(1);
+      FutexWait(&header->futex, futex, c_WAIT_TIMEOUT_NS);
+      header->waiters.fetch_sub(1);
+      continue;
+    }
+    // Behind, so the older frames are being overwritten; the newest one
+    // is the likeliest to still be whole
+    if (next < published - 1) {
+      stats.skipped += published - 1 - next;
+      next = published - 1;
+    }
+
+    SlotHeader* slot = Slot(header, next);
+    const uint64_t sequence = 2*next + 2;
+    if (slot->sequence.load(std::memory_order_acquire) != sequence) {
+      stats.skipped++;
+      next++;
+      continue;
+    }
+    // Copy the frame out, then make sure the publisher didn't start on the
+    // slot meanwhile, so the sink never sees a torn frame
+    const uint32_t stream = slot->stream;
+    const int32_t dropped = slot->dropped;
+    const uint64_t timestamp = slot->timestamp;
+    const uint64_t publish_time = slot->publish_time;
+    const Intrinsics intrinsics = slot->intrinsics;
+    memcpy(&payload[0], Payload(slot), stream == STREAM_DEPTH ? c_DEPTH_PAYLOAD : c_COLOR_PAYLOAD);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->sequence.load(std::memory_order_relaxed) != sequence) {
+      stats.torn++;
+      next++;
+      continue;
+    }
+    const int64_t latency = (int64_t)(MonotonicNanoseconds() - publish_time)/1000;
+    if (stream == STREAM_DEPTH) {
+      DepthFrame frame;
+      frame.timestamp = timestamp;
+      frame.vertices = (const Vertex*)&payload[0];
+      frame.uv_map = (const UV*)&payload[c_PIXEL_COUNT*sizeof(Vertex)];
+      frame.confidence = (const int16_t*)&payload[c_PIXEL_COUNT*(sizeof(Vertex) + sizeof(UV))];
+      frame.intrinsics = intrinsics;
+      frame.dropped = dropped;
+      sink->OnDepthFrame(frame);
+    } else {
+      ColorFrame frame;
+      frame.timestamp = timestamp;
+      frame.bgr = &payload[0];
+      frame.dropped = dropped;
+      sink->OnColorFrame(frame);
+    }
+    stats.received++;
+    latency_sum += latency;
+    stats.max_latency = std::max(stats.max_latency, latency);
+    stats.mean_latency = latency_sum/stats.received;
+    next++;
+  }
+  munmap(mapping, size);
+  return true;
+}
+
+void SharedFrameSubscriber::Stop() {
+  stopped = true;
+}
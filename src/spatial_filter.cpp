@@ -0,0 +1,403 @@
+#include "spatial_filter.h"
+
+#include <algorithm>
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "depth_conversion.h"
+#include "thread_pool.h"
+
+namespace {
+
+typedef void (*BilateralFunc)(const BilateralPlanes&, int, int, int16_t*);
+
+struct Kernel {
+  BilateralFunc func;
+  const char* name;
+};
+
+Kernel SelectKernel() {
+  __builtin_cpu_init();
+  Kernel kernel;
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.func = &BilateralRowsAVX2;
+    kernel.name = "avx2";
+  } else {
+    kernel.func = &BilateralRowsScalar;
+    kernel.name = "scalar";
+  }
+  return kernel;
+}
+
+const Kernel& GetKernel() {
+  static const Kernel kernel = SelectKernel();
+  return kernel;
+}
+
+// Rows per task. The 320x240 image makes 15 tiles, enough to keep a few
+// cores busy without the tiles getting too small.
+const int c_TILE_ROWS = 16;
+
+// A pixel is kept when its neighbors weigh at least this much of what they
+// would on a flat surface. Pixels on an edge or a corner keep a quarter to a
+// half, a pixel floating between two surfaces keeps next to nothing.
+const float c_MIN_SUPPORT = 0.25f;
+
+// The per-pixel sums behind the guided filter: how many valid pixels, the
+// guide I and depth p over them, I*I and I*p. Then the fit a and b of every
+// window and how many windows were fit.
+enum GuidedChannel {
+  SUM_VALID,
+  SUM_GUIDE,
+  SUM_DEPTH,
+  SUM_GUIDE_SQUARED,
+  SUM_CROSS,
+  SUM_FITTED,
+  SUM_A,
+  SUM_B,
+  GUIDED_CHANNELS
+};
+
+inline bool Valid(int16_t z) {
+  return z >= c_MIN_Z && z <= c_MAX_Z;
+}
+
+// 8-bit luminance of a packed pcl::PointXYZRGB::rgba color, BT.601 weights
+inline int Luma(uint32_t rgba) {
+  int b = rgba & 0xff;
+  int g = (rgba >> 8) & 0xff;
+  int r = (rgba >> 16) & 0xff;
+  return (77*r + 150*g + 29*b + 128) >> 8;
+}
+
+// Sums of in over windows of 2*radius + 1 pixels along a row. in has radius
+// pixels of zeros before and after the row. Summed directly rather than as a
+// running sum, which doesn't drift and vectorizes across the row.
+void HorizontalSums(const float* in, int width, int radius, float* out) {
+  std::fill(out, out + width, 0.0f);
+  for (int k = -radius; k <= radius; k++) {
+    const float* shifted = in + k;
+    for (int x = 0; x < width; x++) {
+      out[x] += shifted[x];
+    }
+  }
+}
+
+// Sums over windows of 2*radius + 1 rows of the horizontal sums, for one row,
+// with zeros past the top and bottom.
+void VerticalSums(const float* in, int width, int height, int radius, int y, float* out) {
+  std::fill(out, out + width, 0.0f);
+  for (int row = std::max(0, y - radius); row <= std::min(height - 1, y + radius); row++) {
+    const float* sums = in + row*width;
+    for (int x = 0; x < width; x++) {
+      out[x] += sums[x];
+    }
+  }
+}
+
+inline int16_t BilateralPixel(const BilateralPlanes& p, int x, int y) {
+  const int16_t center = p.depth[y*p.stride + x];
+  if (center <= 0) {
+    return 0;
+  }
+  const int center_luma = p.luma != NULL ? p.luma[y*p.stride + x] : 0;
+  const int size = 2*p.radius + 1;
+  float sum_w = 0;
+  float sum_wz = 0;
+  float support = 0;
+  for (int dy = 0; dy < size; dy++) {
+    const int offset = (y + dy - p.radius)*p.stride + x - p.radius;
+    const int16_t* row = p.depth + offset;
+    for (int dx = 0; dx < size; dx++) {
+      int n = row[dx];
+      if (n <= 0) {
+        continue;
+      }
+      int d = std::min(abs(n - center), c_DEPTH_WEIGHTS - 1);
+      float w = p.depth_weights[d]*p.spatial_weights[dy*size + dx];
+      support += w;
+      if (p.luma != NULL) {
+        w *= p.luma_weights[abs(p.luma[offset + dx] - center_luma)];
+      }
+      sum_w += w;
+      sum_wz += w*(float)n;
+    }
+  }
+  // The center pixel weighs exactly 1
+  if (support - 1.0f < p.min_support) {
+    return 0;
+  }
+  return (int16_t)lrintf(sum_wz/sum_w);
+}
+
+}
+
+SpatialFilter::SpatialFilter(int width, int height, SpatialMode mode, int radius, float sigma_space,
+                             float sigma_depth, float sigma_color)
+    : width(width), height(height), mode(mode), radius(radius), sigma_depth(sigma_depth),
+      sigma_color(sigma_color), stride(width + 2*radius), apply_vertices(NULL), apply_rgba(NULL),
+      apply_out(NULL), apply_regularization(0) {
+  const int size = 2*radius + 1;
+  spatial_weights.resize(size*size);
+  float total = 0;
+  for (int dy = -radius; dy <= radius; dy++) {
+    for (int dx = -radius; dx <= radius; dx++) {
+      float w = expf(-(dx*dx + dy*dy)/(2*sigma_space*sigma_space));
+      spatial_weights[(dy + radius)*size + dx + radius] = w;
+      total += w;
+    }
+  }
+  // Leave the center out, it always has full weight
+  min_support = c_MIN_SUPPORT*(total - 1.0f);
+
+  depth_weights.resize(c_DEPTH_WEIGHTS);
+  for (int d = 0; d < c_DEPTH_WEIGHTS - 1; d++) {
+    depth_weights[d] = expf(-d*d/(2*sigma_depth*sigma_depth));
+  }
+  depth_weights[c_DEPTH_WEIGHTS - 1] = 0;
+  luma_weights.resize(256);
+  for (int d = 0; d < 256; d++) {
+    luma_weights[d] = expf(-d*d/(2*sigma_color*sigma_color));
+  }
+
+  if (mode == SPATIAL_BILATERAL) {
+    // The padding stays zero for good
+    depth.assign(stride*(height + 2*radius), 0);
+    luma.assign(stride*(height + 2*radius), 0);
+  } else {
+    guide.resize(width*height);
+    // Padded on both ends of every row, the padding stays zero for good
+    inputs.assign(GUIDED_CHANNELS, std::vector<float>(stride*height, 0.0f));
+    row_sums.assign(GUIDED_CHANNELS, std::vector<float>(width*height));
+    box_sums.assign(GUIDED_CHANNELS, std::vector<float>(width*height));
+  }
+  filtered.resize(width*height);
+}
+
+int SpatialFilter::TileCount() const {
+  return (height + c_TILE_ROWS - 1)/c_TILE_ROWS;
+}
+
+BilateralPlanes SpatialFilter::GetPlanes() const {
+  BilateralPlanes planes;
+  planes.width = width;
+  planes.height = height;
+  planes.stride = stride;
+  planes.radius = radius;
+  planes.depth = &depth[radius*stride + radius];
+  planes.luma = &luma[radius*stride + radius];
+  planes.spatial_weights = &spatial_weights[0];
+  planes.depth_weights = &depth_weights[0];
+  planes.luma_weights = &luma_weights[0];
+  planes.min_support = min_support;
+  return planes;
+}
+
+void SpatialFilter::LoadBilateral(const Vertex* vertices, const uint32_t* rgba, int tile) {
+  const int row_end = std::min(height, (tile + 1)*c_TILE_ROWS);
+  for (int y = tile*c_TILE_ROWS; y < row_end; y++) {
+    int16_t* depth_row = &depth[(y + radius)*stride + radius];
+    const Vertex* vertex_row = vertices + y*width;
+    for (int x = 0; x < width; x++) {
+      int16_t z = vertex_row[x].z;
+      depth_row[x] = Valid(z) ? z : 0;
+    }
+    if (rgba != NULL) {
+      int16_t* luma_row = &luma[(y + radius)*stride + radius];
+      const uint32_t* color_row = rgba + y*width;
+      for (int x = 0; x < width; x++) {
+        luma_row[x] = Luma(color_row[x]);
+      }
+    }
+  }
+}
+
+// The sums for every pixel, and their horizontal pass
+void SpatialFilter::LoadGuided(const Vertex* vertices, const uint32_t* rgba, int tile) {
+  const int row_end = std::min(height, (tile + 1)*c_TILE_ROWS);
+  for (int y = tile*c_TILE_ROWS; y < row_end; y++) {
+    const int padded = y*stride + radius;
+    for (int x = 0; x < width; x++) {
+      int pixel = y*width + x;
+      int16_t z = vertices[pixel].z;
+      float valid = Valid(z) ? 1.0f : 0.0f;
+      float p = valid*z;
+      float i = rgba != NULL ? Luma(rgba[pixel]) : p;
+      guide[pixel] = i;
+      inputs[SUM_VALID][padded + x] = valid;
+      inputs[SUM_GUIDE][padded + x] = valid*i;
+      inputs[SUM_DEPTH][padded + x] = p;
+      inputs[SUM_GUIDE_SQUARED][padded + x] = valid*i*i;
+      inputs[SUM_CROSS][padded + x] = i*p;
+    }
+    for (int c = SUM_VALID; c <= SUM_CROSS; c++) {
+      HorizontalSums(&inputs[c][padded], width, radius, &row_sums[c][y*width]);
+    }
+  }
+}
+
+// Fits depth = a*guide + b in the window around every pixel, from the valid
+// pixels in it, then starts box filtering the fits.
+void SpatialFilter::FitGuided(float regularization, int tile) {
+  const int row_end = std::min(height, (tile + 1)*c_TILE_ROWS);
+  for (int y = tile*c_TILE_ROWS; y < row_end; y++) {
+    float* sums[SUM_FITTED];
+    for (int c = SUM_VALID; c <= SUM_CROSS; c++) {
+      sums[c] = &box_sums[c][y*width];
+      VerticalSums(&row_sums[c][0], width, height, radius, y, sums[c]);
+    }
+    const int padded = y*stride + radius;
+    float* fitted = &inputs[SUM_FITTED][padded];
+    float* a = &inputs[SUM_A][padded];
+    float* b = &inputs[SUM_B][padded];
+    for (int x = 0; x < width; x++) {
+      float count = sums[SUM_VALID][x];
+      float scale = 1.0f/std::max(count, 1.0f);
+      float mean_i = sums[SUM_GUIDE][x]*scale;
+      float mean_p = sums[SUM_DEPTH][x]*scale;
+      float variance = sums[SUM_GUIDE_SQUARED][x]*scale - mean_i*mean_i;
+      float covariance = sums[SUM_CROSS][x]*scale - mean_i*mean_p;
+      // Windows without a valid pixel get a = b = 0 and don't count
+      fitted[x] = count >= 1.0f ? 1.0f : 0.0f;
+      a[x] = covariance/(variance + regularization);
+      b[x] = mean_p - a[x]*mean_i;
+    }
+    for (int c = SUM_FITTED; c <= SUM_B; c++) {
+      HorizontalSums(&inputs[c][padded], width, radius, &row_sums[c][y*width]);
+    }
+  }
+}
+
+// Averages the fits of all windows over each valid pixel and applies them to
+// its guide value.
+void SpatialFilter::FinishGuided(const Vertex* vertices, Vertex* out, int tile) {
+  const int row_begin = tile*c_TILE_ROWS;
+  const int row_end = std::min(height, row_begin + c_TILE_ROWS);
+  for (int y = row_begin; y < row_end; y++) {
+    float* sums[GUIDED_CHANNELS];
+    for (int c = SUM_FITTED; c <= SUM_B; c++) {
+      sums[c] = &box_sums[c][y*width];
+      VerticalSums(&row_sums[c][0], width, height, radius, y, sums[c]);
+    }
+    const float* i = &guide[y*width];
+    int16_t* z = &filtered[y*width];
+    const Vertex* vertex = vertices + y*width;
+    for (int x = 0; x < width; x++) {
+      // A valid pixel is in at least its own window
+      float q = (sums[SUM_A][x]*i[x] + sums[SUM_B][x])/std::max(sums[SUM_FITTED][x], 1.0f);
+      z[x] = Valid(vertex[x].z) ? (int16_t)lrintf(q) : 0;
+    }
+  }
+  const int first = row_begin*width;
+  SetVertexDepths((const int16_t*)(vertices + first), &filtered[first], (row_end - row_begin)*width,
+      (int16_t*)(out + first));
+}
+
+// Filters the tile's rows from the planes LoadBilateral filled
+void SpatialFilter::FilterBilateral(int tile) {
+  const int row_begin = tile*c_TILE_ROWS;
+  const int row_end = std::min(height, row_begin + c_TILE_ROWS);
+  GetKernel().func(apply_planes, row_begin, row_end, &filtered[0]);
+  const int first = row_begin*width;
+  SetVertexDepths((const int16_t*)(apply_vertices + first), &filtered[first],
+      (row_end - row_begin)*width, (int16_t*)(apply_out + first));
+}
+
+void SpatialFilter::Apply(const Vertex* vertices, const uint32_t* rgba, Vertex* out, ThreadPool* pool) {
+  apply_vertices = vertices;
+  apply_rgba = rgba;
+  apply_out = out;
+  // Each round reads rows of the tiles around it from the round before, so
+  // the rounds can't be merged.
+  if (mode == SPATIAL_BILATERAL) {
+    apply_planes = GetPlanes();
+    if (rgba == NULL) {
+      apply_planes.luma = NULL;
+    }
+    ThreadPool::Run(pool, TileCount(), [this](int tile) {
+      LoadBilateral(apply_vertices, apply_rgba, tile);
+    });
+    ThreadPool::Run(pool, TileCount(), [this](int tile) {
+      FilterBilateral(tile);
+    });
+  } else {
+    ThreadPool::Run(pool, TileCount(), [this](int tile) {
+      LoadGuided(apply_vertices, apply_rgba, tile);
+    });
+    apply_regularization = rgba != NULL ? sigma_color*sigma_color : sigma_depth*sigma_depth;
+    ThreadPool::Run(pool, TileCount(), [this](int tile) {
+      FitGuided(apply_regularization, tile);
+    });
+    ThreadPool::Run(pool, TileCount(), [this](int tile) {
+      FinishGuided(apply_vertices, apply_out, tile);
+    });
+  }
+}
+
+const char* SpatialFilterKernelName() {
+  return GetKernel().name;
+}
+
+void BilateralRowsScalar(const BilateralPlanes& planes, int row_begin, int row_end, int16_t* out) {
+  for (int y = row_begin; y < row_end; y++) {
+    for (int x = 0; x < planes.width; x++) {
+      out[y*planes.width + x] = BilateralPixel(planes, x, y);
+    }
+  }
+}
+
+// 8 pixels of a row at a time, in 32 bit lanes for the gathers. Sums are
+// taken in the same order as the scalar kernel, so the two agree exactly.
+__attribute__((target("avx2")))
+void BilateralRowsAVX2(const BilateralPlanes& planes, int row_begin, int row_end, int16_t* out) {
+  const BilateralPlanes& p = planes;
+  const int size = 2*p.radius + 1;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max_index = _mm256_set1_epi32(c_DEPTH_WEIGHTS - 1);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 min_support = _mm256_set1_ps(p.min_support);
+  for (int y = row_begin; y < row_end; y++) {
+    int x = 0;
+    for (; x + 8 <= p.width; x += 8) {
+      const int center_offset = y*p.stride + x;
+      __m256i center = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(p.depth + center_offset)));
+      __m256i center_luma = zero;
+      if (p.luma != NULL) {
+        center_luma = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(p.luma + center_offset)));
+      }
+      __m256 sum_w = _mm256_setzero_ps();
+      __m256 sum_wz = _mm256_setzero_ps();
+      __m256 support = _mm256_setzero_ps();
+      for (int dy = 0; dy < size; dy++) {
+        const int offset = (y + dy - p.radius)*p.stride + x - p.radius;
+        for (int dx = 0; dx < size; dx++) {
+          __m256i n = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(p.depth + offset + dx)));
+          __m256i d = _mm256_min_epi32(_mm256_abs_epi32(_mm256_sub_epi32(n, center)), max_index);
+          __m256 w = _mm256_mul_ps(_mm256_i32gather_ps(p.depth_weights, d, 4),
+                                   _mm256_set1_ps(p.spatial_weights[dy*size + dx]));
+          w = _mm256_and_ps(w, _mm256_castsi256_ps(_mm256_cmpgt_epi32(n, zero)));
+          support = _mm256_add_ps(support, w);
+          if (p.luma != NULL) {
+            __m256i l = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(p.luma + offset + dx)));
+            __m256i dl = _mm256_abs_epi32(_mm256_sub_epi32(l, center_luma));
+            w = _mm256_mul_ps(w, _mm256_i32gather_ps(p.luma_weights, dl, 4));
+          }
+          sum_w = _mm256_add_ps(sum_w, w);
+          sum_wz = _mm256_add_ps(sum_wz, _mm256_mul_ps(w, _mm256_cvtepi32_ps(n)));
+        }
+      }
+      // Invalid centers divide by zero, and are masked off with the flying
+      // pixels
+      __m256i z = _mm256_cvtps_epi32(_mm256_div_ps(sum_wz, sum_w));
+      __m256 keep = _mm256_cmp_ps(_mm256_sub_ps(support, one), min_support, _CMP_GE_OQ);
+      keep = _mm256_and_ps(keep, _mm256_castsi256_ps(_mm256_cmpgt_epi32(center, zero)));
+      z = _mm256_and_si256(z, _mm256_castps_si256(keep));
+      z = _mm256_permute4x64_epi64(_mm256_packs_epi32(z, z), _MM_SHUFFLE(3, 1, 2, 0));
+      _mm_storeu_si128((__m128i*)(out + y*p.width + x), _mm256_castsi256_si128(z));
+    }
+    for (; x < p.width; x++) {
+      out[y*p.width + x] = BilateralPixel(p, x, y);
+    }
+  }
+}
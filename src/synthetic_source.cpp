@@ -0,0 +1,294 @@
+#include "synthetic_source.h"
+
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include <thread>
+
+namespace {
+
+const uint64_t c_START_TIME = 1000000;
+const uint64_t c_DEPTH_PERIOD = 16667;
+const uint64_t c_COLOR_PERIOD = 33333;
+// The color camera isn't triggered together with the depth camera
+const uint64_t c_COLOR_OFFSET = 4000;
+
+// Color camera, 25 mm to the right of the depth camera
+const float c_BASELINE = 25.0f;
+const float c_COLOR_F = 587.3f;
+
+// Scene, in mm in depth camera coordinates (x right, y up, z forward)
+const float c_WALL_Z = 1500.0f;
+const float c_FLOOR_Y = -400.0f;
+const float c_BALL_RADIUS = 150.0f;
+const float c_BALL_ORBIT = 250.0f;
+const float c_BALL_Y = -150.0f;
+const float c_BALL_Z = 900.0f;
+// Radians per second
+const float c_BALL_SPEED = 1.5f;
+// Window in the wall showing a far background, to exercise the range filter
+const float c_WINDOW_X0 = 200.0f;
+const float c_WINDOW_Y0 = 150.0f;
+const float c_FAR_Z = 4000.0f;
+
+enum Material {
+  MATERIAL_WALL,
+  MATERIAL_FLOOR,
+  MATERIAL_BALL,
+  MATERIAL_FAR
+};
+
+// The camera sway of camera motion, amplitudes in mm and radians and
+// angular frequencies in radians per second
+const float c_SWAY_X = 120.0f;
+const float c_SWAY_Y = 40.0f;
+const float c_SWAY_Z = 150.0f;
+const float c_SWAY_YAW = 0.08f;
+const float c_SWAY_PITCH = 0.05f;
+const float c_SWAY_ROLL = 0.03f;
+
+struct Hit {
+  // Distance along the ray, which is the depth in camera coordinates
+  float z;
+  // Where the ray hit, in world coordinates
+  float x_world, y_world, z_world;
+  Material material;
+};
+
+struct Ball {
+  float x, y, z;
+};
+
+// A ray from a camera pixel in world coordinates. The direction is the
+// pixel's (dx, dy, 1) turned by the camera, so distances along it are depths.
+struct Ray {
+  float origin[3];
+  float direction[3];
+};
+
+Ball BallAt(uint64_t time) {
+  float angle = c_BALL_SPEED*(time - c_START_TIME)*1e-6f;
+  Ball ball;
+  ball.x = c_BALL_ORBIT*cosf(angle);
+  ball.y = c_BALL_Y;
+  ball.z = c_BALL_Z + c_BALL_ORBIT*sinf(angle);
+  return ball;
+}
+
+Ray CameraRay(const Pose& pose, float origin_x, float dx, float dy) {
+  const float* m = pose.m;
+  Ray ray;
+  for (int i = 0; i < 3; i++) {
+    ray.origin[i] = m[4*i]*origin_x + m[4*i + 3];
+    ray.direction[i] = m[4*i]*dx + m[4*i + 1]*dy + m[4*i + 2];
+  }
+  return ray;
+}
+
+Hit Trace(const Ray& ray, const Ball& ball) {
+  const float* o = ray.origin;
+  const float* d = ray.direction;
+  Hit hit;
+  hit.z = FLT_MAX;
+  hit.material = MATERIAL_FAR;
+  if (d[2] > 0) {
+    hit.z = (c_WALL_Z - o[2])/d[2];
+    hit.material = MATERIAL_WALL;
+    float wall_x = o[0] + d[0]*hit.z;
+    float wall_y = o[1] + d[1]*hit.z;
+    if (wall_x > c_WINDOW_X0 && wall_y > c_WINDOW_Y0) {
+      hit.z = (c_FAR_Z - o[2])/d[2];
+      hit.material = MATERIAL_FAR;
+    }
+  }
+
+  if (d[1] < 0) {
+    float floor_z = (c_FLOOR_Y - o[1])/d[1];
+    if (floor_z < hit.z) {
+      hit.z = floor_z;
+      hit.material = MATERIAL_FLOOR;
+    }
+  }
+
+  float cx = o[0] - ball.x;
+  float cy = o[1] - ball.y;
+  float cz = o[2] - ball.z;
+  float a = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+  float b = 2*(d[0]*cx + d[1]*cy + d[2]*cz);
+  float c = cx*cx + cy*cy + cz*cz - c_BALL_RADIUS*c_BALL_RADIUS;
+  float discriminant = b*b - 4*a*c;
+  if (discriminant >= 0) {
+    float ball_z = (-b - sqrtf(discriminant))/(2*a);
+    if (ball_z > 0 && ball_z < hit.z) {
+      hit.z = ball_z;
+      hit.material = MATERIAL_BALL;
+    }
+  }
+  hit.x_world = o[0] + d[0]*hit.z;
+  hit.y_world = o[1] + d[1]*hit.z;
+  hit.z_world = o[2] + d[2]*hit.z;
+  return hit;
+}
+
+// Deterministic per-pixel noise
+uint32_t Hash(uint32_t seed, uint32_t frame, uint32_t pixel) {
+  uint32_t h = seed*0x9e3779b9u ^ frame*0x85ebca6bu ^ pixel*0xc2b2ae35u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+}
+
+SyntheticSource::SyntheticSource(int depth_frame_count, bool realtime, uint32_t seed)
+    : depth_frame_count(depth_frame_count), realtime(realtime), seed(seed), stopped(false),
+      camera_motion(false),
+      vertices(c_PIXEL_COUNT), uv_map(c_PIXEL_COUNT), confidence(c_PIXEL_COUNT),
+      bgr(3*c_COLOR_PIXEL_COUNT) {}
+
+void SyntheticSource::SetCameraMotion(bool moving) {
+  camera_motion = moving;
+}
+
+Pose SyntheticSource::CameraPose(uint64_t timestamp) {
+  float t = (timestamp - c_START_TIME)*1e-6f;
+  float yaw = c_SWAY_YAW*sinf(0.7f*t);
+  float pitch = c_SWAY_PITCH*sinf(0.9f*t + 1.0f);
+  float roll = c_SWAY_ROLL*sinf(0.5f*t);
+  float cy = cosf(yaw), sy = sinf(yaw);
+  float cp = cosf(pitch), sp = sinf(pitch);
+  float cr = cosf(roll), sr = sinf(roll);
+  // Yaw about y, then pitch about x, then roll about z
+  Pose pose = {{
+    cy*cr + sy*sp*sr, -cy*sr + sy*sp*cr, sy*cp, c_SWAY_X*sinf(0.6f*t),
+    cp*sr, cp*cr, -sp, c_SWAY_Y*sinf(0.8f*t + 0.5f),
+    -sy*cr + cy*sp*sr, sy*sr + cy*sp*cr, cy*cp, c_SWAY_Z*sinf(0.4f*t)
+  }};
+  return pose;
+}
+
+Pose SyntheticSource::PoseAt(uint64_t time) const {
+  if (camera_motion) {
+    return CameraPose(time);
+  }
+  Pose identity = {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}};
+  return identity;
+}
+
+void SyntheticSource::RenderDepth(uint64_t time, uint32_t frame) {
+  const Intrinsics& k = c_DS325_DEPTH_INTRINSICS;
+  Ball ball = BallAt(camera_motion ? c_START_TIME : time);
+  Pose pose = PoseAt(time);
+  for (int row = 0; row < DEPTH_HEIGHT; row++) {
+    for (int col = 0; col < DEPTH_WIDTH; col++) {
+      int i = row*DEPTH_WIDTH + col;
+      float dx = (col - k.cx)/k.fx;
+      float dy = (k.cy - row)/k.fy;
+      Hit hit = Trace(CameraRay(pose, 0, dx, dy), ball);
+
+      uint32_t noise = Hash(seed, frame, i);
+      // A few pixels drop out, the rest get +-2 mm of noise
+      if (noise % 200 == 0 || hit.z >= c_SATURATED_Z) {
+        vertices[i].x = vertices[i].y = vertices[i].z = c_SATURATED_Z;
+        uv_map[i].u = uv_map[i].v = -FLT_MAX;
+        confidence[i] = 0;
+        continue;
+      }
+      float z = hit.z + (int)(noise % 5) - 2;
+      vertices[i].x = (int16_t)(dx*z);
+      vertices[i].y = (int16_t)(dy*z);
+      vertices[i].z = (int16_t)z;
+      uv_map[i].u = (c_COLOR_F*(dx*z - c_BASELINE)/z + COLOR_WIDTH/2)/COLOR_WIDTH;
+      uv_map[i].v = (COLOR_HEIGHT/2 - c_COLOR_F*dy)/COLOR_HEIGHT;
+      confidence[i] = (int16_t)(2000000.0f/(z + 100));
+    }
+  }
+}
+
+void SyntheticSource::RenderColor(uint64_t time) {
+  Ball ball = BallAt(camera_motion ? c_START_TIME : time);
+  Pose pose = PoseAt(time);
+  for (int row = 0; row < COLOR_HEIGHT; row++) {
+    for (int col = 0; col < COLOR_WIDTH; col++) {
+      float dx = (col - COLOR_WIDTH/2)/c_COLOR_F;
+      float dy = (COLOR_HEIGHT/2 - row)/c_COLOR_F;
+      Hit hit = Trace(CameraRay(pose, c_BASELINE, dx, dy), ball);
+      float x = hit.x_world;
+      float y = hit.y_world;
+      uint8_t* pixel = &bgr[3*(row*COLOR_WIDTH + col)];
+      switch (hit.material) {
+      case MATERIAL_WALL: {
+        // 100 mm checkerboard
+        bool dark = (((int)floorf(x/100) + (int)floorf(y/100)) & 1) != 0;
+        pixel[0] = dark ? 60 : 200;
+        pixel[1] = dark ? 60 : 200;
+        pixel[2] = dark ? 60 : 200;
+        break;
+      }
+      case MATERIAL_FLOOR:
+        pixel[0] = 40;
+        pixel[1] = (uint8_t)(80 + hit.z/20);
+        pixel[2] = 120;
+        break;
+      case MATERIAL_BALL: {
+        // Shaded by how squarely the surface faces the camera
+        float shade = (ball.z - hit.z_world)/c_BALL_RADIUS;
+        pixel[0] = 30;
+        pixel[1] = 30;
+        pixel[2] = (uint8_t)(80 + 175*shade);
+        break;
+      }
+      case MATERIAL_FAR:
+        pixel[0] = 230;
+        pixel[1] = 180;
+        pixel[2] = 120;
+        break;
+      }
+    }
+  }
+}
+
+bool SyntheticSource::Run() {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint64_t depth_time = c_START_TIME;
+  uint64_t color_time = c_START_TIME + c_COLOR_OFFSET;
+  uint32_t depth_frames = 0;
+
+  while (!stopped && (depth_frame_count == 0 || depth_frames < (uint32_t)depth_frame_count)) {
+    bool depth_next = depth_time <= color_time;
+    uint64_t time = depth_next ? depth_time : color_time;
+    if (realtime) {
+      std::this_thread::sleep_until(start + std::chrono::microseconds(time - c_START_TIME));
+    }
+
+    if (depth_next) {
+      RenderDepth(time, depth_frames);
+      DepthFrame frame;
+      frame.timestamp = time;
+      frame.vertices = &vertices[0];
+      frame.uv_map = &uv_map[0];
+      frame.confidence = &confidence[0];
+      frame.intrinsics = c_DS325_DEPTH_INTRINSICS;
+      frame.dropped = 0;
+      sink->OnDepthFrame(frame);
+      depth_time += c_DEPTH_PERIOD;
+      depth_frames++;
+    } else {
+      RenderColor(time);
+      ColorFrame frame;
+      frame.timestamp = time;
+      frame.bgr = &bgr[0];
+      frame.dropped = 0;
+      sink->OnColorFrame(frame);
+      color_time += c_COLOR_PERIOD;
+    }
+  }
+  return true;
+}
+
+void SyntheticSource::Stop() {
+  stopped = true;
+}
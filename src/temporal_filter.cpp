@@ -0,0 +1,248 @@
+#include "temporal_filter.h"
+
+#include <algorithm>
+#include <immintrin.h>
+#include <stdlib.h>
+
+#include "depth_conversion.h"
+
+namespace {
+
+typedef void (*MedianFunc)(const TemporalParams&, const int16_t*, int, int16_t* const*, int, int,
+                           int16_t*, int16_t*);
+typedef void (*ExponentialFunc)(const TemporalParams&, const int16_t*, int, int16_t*, int16_t*);
+
+struct Kernels {
+  MedianFunc median;
+  ExponentialFunc exponential;
+  const char* name;
+};
+
+Kernels SelectKernels() {
+  __builtin_cpu_init();
+  Kernels kernels;
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.median = &MedianFilterAVX2;
+    kernels.exponential = &ExponentialFilterAVX2;
+    kernels.name = "avx2";
+  } else {
+    kernels.median = &MedianFilterScalar;
+    kernels.exponential = &ExponentialFilterScalar;
+    kernels.name = "scalar";
+  }
+  return kernels;
+}
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = SelectKernels();
+  return kernels;
+}
+
+// The exponential average is kept in 1/8 mm
+const int c_AVERAGE_SHIFT = 3;
+
+inline int Min(int a, int b) {
+  return a < b ? a : b;
+}
+
+inline int Max(int a, int b) {
+  return a > b ? a : b;
+}
+
+inline int Median3(int a, int b, int c) {
+  return Max(Min(a, b), Min(Max(a, b), c));
+}
+
+// Drops the smallest and largest of a..d, leaving the median of five as the
+// median of the two left and e.
+inline int Median5(int a, int b, int c, int d, int e) {
+  return Median3(Max(Min(a, b), Min(c, d)), Min(Max(a, b), Max(c, d)), e);
+}
+
+inline bool Moved(const TemporalParams& params, int z, int last) {
+  return abs(z - last) > params.motion_threshold + (z >> 5);
+}
+
+inline void MedianPixel(const TemporalParams& params, const int16_t* z, int i,
+                        int16_t* const* slots, int history_length, int head,
+                        int16_t* last, int16_t* out) {
+  int16_t sample = z[i];
+  if (sample < params.min_z || sample > params.max_z) {
+    out[i] = sample;
+    return;
+  }
+  if (Moved(params, sample, last[i])) {
+    for (int k = 0; k < history_length; k++) {
+      slots[k][i] = sample;
+    }
+  } else {
+    slots[head][i] = sample;
+  }
+  int median;
+  if (history_length == 5) {
+    median = Median5(slots[0][i], slots[1][i], slots[2][i], slots[3][i], slots[4][i]);
+  } else {
+    median = Median3(slots[0][i], slots[1][i], slots[2][i]);
+  }
+  last[i] = median;
+  out[i] = median;
+}
+
+inline void ExponentialPixel(const TemporalParams& params, const int16_t* z, int i,
+                             int16_t* average, int16_t* out) {
+  int16_t sample = z[i];
+  if (sample < params.min_z || sample > params.max_z) {
+    out[i] = sample;
+    return;
+  }
+  int scaled = sample << c_AVERAGE_SHIFT;
+  int value = average[i];
+  if (Moved(params, sample, value >> c_AVERAGE_SHIFT)) {
+    value = scaled;
+  } else {
+    // Same rounding as _mm256_mulhrs_epi16
+    value += ((scaled - value)*params.alpha + 0x4000) >> 15;
+  }
+  average[i] = value;
+  out[i] = (value + (1 << (c_AVERAGE_SHIFT - 1))) >> c_AVERAGE_SHIFT;
+}
+
+__attribute__((target("avx2")))
+inline __m256i Median3AVX2(__m256i a, __m256i b, __m256i c) {
+  return _mm256_max_epi16(_mm256_min_epi16(a, b), _mm256_min_epi16(_mm256_max_epi16(a, b), c));
+}
+
+// Lanes where z is in range, and lanes where it also moved away from last
+__attribute__((target("avx2")))
+inline void ClassifyAVX2(const TemporalParams& params, __m256i sample, __m256i last,
+                         __m256i* valid, __m256i* moved) {
+  __m256i invalid = _mm256_or_si256(_mm256_cmpgt_epi16(_mm256_set1_epi16(params.min_z), sample),
+                                    _mm256_cmpgt_epi16(sample, _mm256_set1_epi16(params.max_z)));
+  *valid = _mm256_andnot_si256(invalid, _mm256_set1_epi16(-1));
+  __m256i threshold = _mm256_add_epi16(_mm256_set1_epi16(params.motion_threshold), _mm256_srai_epi16(sample, 5));
+  __m256i distance = _mm256_abs_epi16(_mm256_subs_epi16(sample, last));
+  *moved = _mm256_and_si256(*valid, _mm256_cmpgt_epi16(distance, threshold));
+}
+
+}
+
+TemporalFilter::TemporalFilter(int count, TemporalMode mode, int history_length, float alpha,
+                               int16_t motion_threshold, int16_t min_z, int16_t max_z)
+    : count(count), mode(mode), history_length(history_length == 3 ? 3 : 5),
+      z(count), filtered(count) {
+  params.min_z = min_z;
+  // The exponential average has to fit in an int16 at 1/8 mm
+  params.max_z = std::min<int>(max_z, (32767 >> c_AVERAGE_SHIFT) - 1);
+  params.motion_threshold = motion_threshold;
+  params.alpha = std::max(1, std::min(32767, (int)(alpha*32768)));
+  if (mode == TEMPORAL_MEDIAN) {
+    history.resize(this->history_length*count);
+  }
+  state.resize(count);
+  Reset();
+}
+
+void TemporalFilter::Reset() {
+  std::fill(history.begin(), history.end(), 0);
+  std::fill(state.begin(), state.end(), 0);
+  head = 0;
+}
+
+void TemporalFilter::Apply(const Vertex* vertices, Vertex* out) {
+  for (int i = 0; i < count; i++) {
+    z[i] = vertices[i].z;
+  }
+
+  if (mode == TEMPORAL_MEDIAN) {
+    int16_t* slots[5];
+    for (int k = 0; k < history_length; k++) {
+      slots[k] = &history[k*count];
+    }
+    GetKernels().median(params, &z[0], count, slots, history_length, head, &state[0], &filtered[0]);
+    head = (head + 1) % history_length;
+  } else {
+    GetKernels().exponential(params, &z[0], count, &state[0], &filtered[0]);
+  }
+
+  SetVertexDepths((const int16_t*)vertices, &filtered[0], count, (int16_t*)out);
+}
+
+const char* TemporalFilterKernelName() {
+  return GetKernels().name;
+}
+
+void MedianFilterScalar(const TemporalParams& params, const int16_t* z, int count,
+                        int16_t* const* slots, int history_length, int head,
+                        int16_t* last, int16_t* out) {
+  for (int i = 0; i < count; i++) {
+    MedianPixel(params, z, i, slots, history_length, head, last, out);
+  }
+}
+
+__attribute__((target("avx2")))
+void MedianFilterAVX2(const TemporalParams& params, const int16_t* z, int count,
+                      int16_t* const* slots, int history_length, int head,
+                      int16_t* last, int16_t* out) {
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i sample = _mm256_loadu_si256((const __m256i*)(z + i));
+    __m256i previous = _mm256_loadu_si256((const __m256i*)(last + i));
+    __m256i valid, moved;
+    ClassifyAVX2(params, sample, previous, &valid, &moved);
+
+    // The new sample replaces the oldest, or all of them on motion
+    __m256i s[5];
+    for (int k = 0; k < history_length; k++) {
+      s[k] = _mm256_loadu_si256((const __m256i*)(slots[k] + i));
+      s[k] = _mm256_blendv_epi8(s[k], sample, k == head ? valid : moved);
+      _mm256_storeu_si256((__m256i*)(slots[k] + i), s[k]);
+    }
+
+    __m256i median;
+    if (history_length == 5) {
+      __m256i low = _mm256_max_epi16(_mm256_min_epi16(s[0], s[1]), _mm256_min_epi16(s[2], s[3]));
+      __m256i high = _mm256_min_epi16(_mm256_max_epi16(s[0], s[1]), _mm256_max_epi16(s[2], s[3]));
+      median = Median3AVX2(low, high, s[4]);
+    } else {
+      median = Median3AVX2(s[0], s[1], s[2]);
+    }
+    _mm256_storeu_si256((__m256i*)(last + i), _mm256_blendv_epi8(previous, median, valid));
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(sample, median, valid));
+  }
+  for (; i < count; i++) {
+    MedianPixel(params, z, i, slots, history_length, head, last, out);
+  }
+}
+
+void ExponentialFilterScalar(const TemporalParams& params, const int16_t* z, int count,
+                             int16_t* average, int16_t* out) {
+  for (int i = 0; i < count; i++) {
+    ExponentialPixel(params, z, i, average, out);
+  }
+}
+
+__attribute__((target("avx2")))
+void ExponentialFilterAVX2(const TemporalParams& params, const int16_t* z, int count,
+                           int16_t* average, int16_t* out) {
+  const __m256i alpha = _mm256_set1_epi16(params.alpha);
+  const __m256i half = _mm256_set1_epi16(1 << (c_AVERAGE_SHIFT - 1));
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i sample = _mm256_loadu_si256((const __m256i*)(z + i));
+    __m256i value = _mm256_loadu_si256((const __m256i*)(average + i));
+    __m256i valid, moved;
+    ClassifyAVX2(params, sample, _mm256_srai_epi16(value, c_AVERAGE_SHIFT), &valid, &moved);
+
+    __m256i scaled = _mm256_slli_epi16(sample, c_AVERAGE_SHIFT);
+    __m256i blended = _mm256_add_epi16(value, _mm256_mulhrs_epi16(_mm256_sub_epi16(scaled, value), alpha));
+    blended = _mm256_blendv_epi8(blended, scaled, moved);
+    value = _mm256_blendv_epi8(value, blended, valid);
+    _mm256_storeu_si256((__m256i*)(average + i), value);
+
+    __m256i rounded = _mm256_srai_epi16(_mm256_add_epi16(value, half), c_AVERAGE_SHIFT);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(sample, rounded, valid));
+  }
+  for (; i < count; i++) {
+    ExponentialPixel(params, z, i, average, out);
+  }
+}
@@ -0,0 +1,87 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads)
+    : job(NULL), task_count(0), next_task(0), busy_workers(0), generation(0), stopping(false) {
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (int i = 1; i < threads; i++) {
+    workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work_ready.notify_all();
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+int ThreadPool::ThreadCount() const {
+  return workers.size() + 1;
+}
+
+void ThreadPool::RunTasks() {
+  int i;
+  while ((i = next_task.fetch_add(1)) < task_count) {
+    (*job)(i);
+  }
+}
+
+void ThreadPool::WorkerLoop() {
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    work_ready.wait(lock, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    lock.unlock();
+    RunTasks();
+    lock.lock();
+    if (--busy_workers == 0) {
+      work_done.notify_one();
+    }
+  }
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)>& task) {
+  if (workers.empty() || count <= 1) {
+    for (int i = 0; i < count; i++) {
+      task(i);
+    }
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  job = &task;
+  task_count = count;
+  next_task = 0;
+  busy_workers = workers.size();
+  generation++;
+  lock.unlock();
+  work_ready.notify_all();
+
+  RunTasks();
+
+  lock.lock();
+  work_done.wait(lock, [&] { return busy_workers == 0; });
+  job = NULL;
+}
+
+void ThreadPool::Run(ThreadPool* pool, int count, const std::function<void(int)>& task) {
+  if (pool != NULL) {
+    pool->ParallelFor(count, task);
+  } else {
+    for (int i = 0; i < count; i++) {
+      task(i);
+    }
+  }
+}
@@ -0,0 +1,480 @@
+#include "tsdf_volume.h"
+
+#include <algorithm>
+#include <functional>
+#include <math.h>
+
+#include "icp_odometry.h"
+#include "thread_pool.h"
+
+namespace {
+
+// Blocks are allocated this many at a time
+const int c_CHUNK_BLOCKS = 256;
+
+// Rows per task when looking for the blocks a frame touches, and blocks per
+// task when integrating and meshing
+const int c_BAND_ROWS = 16;
+const int c_BLOCKS_PER_TASK = 16;
+
+// Blocks are 64 mm across at the default voxel size, far larger than a
+// pixel, so looking for them at every other pixel misses none
+const int c_ALLOCATION_STEP = 2;
+
+// Block coordinates are packed 21 bits each, like voxel keys
+const int c_KEY_BITS = 21;
+const int32_t c_KEY_OFFSET = 1 << (c_KEY_BITS - 1);
+const uint64_t c_KEY_MASK = (1 << c_KEY_BITS) - 1;
+
+// Corners of a cube as bits x, y, z, and the 6 tetrahedra around its
+// diagonal from corner 0 to corner 7 that fill it
+const int c_TETRAHEDRA[6][4] = {
+  {0, 1, 3, 7}, {0, 2, 3, 7}, {0, 2, 6, 7}, {0, 4, 6, 7}, {0, 4, 5, 7}, {0, 1, 5, 7}
+};
+
+inline int32_t FastFloor(float value) {
+  int32_t i = (int32_t)value;
+  return i - (value < i);
+}
+
+inline uint64_t BlockKey(int32_t x, int32_t y, int32_t z) {
+  return ((x + c_KEY_OFFSET) & c_KEY_MASK) << (2*c_KEY_BITS) |
+      ((y + c_KEY_OFFSET) & c_KEY_MASK) << c_KEY_BITS | ((z + c_KEY_OFFSET) & c_KEY_MASK);
+}
+
+inline void UnpackKey(uint64_t key, int32_t* x, int32_t* y, int32_t* z) {
+  *x = (int32_t)((key >> (2*c_KEY_BITS)) & c_KEY_MASK) - c_KEY_OFFSET;
+  *y = (int32_t)((key >> c_KEY_BITS) & c_KEY_MASK) - c_KEY_OFFSET;
+  *z = (int32_t)(key & c_KEY_MASK) - c_KEY_OFFSET;
+}
+
+inline void Transform(const Pose& pose, const float* p, float* out) {
+  const float* m = pose.m;
+  for (int i = 0; i < 3; i++) {
+    out[i] = m[4*i]*p[0] + m[4*i + 1]*p[1] + m[4*i + 2]*p[2] + m[4*i + 3];
+  }
+}
+
+// Where the surface crosses the edge from a to b
+inline void Crossing(const float* a, const float* b, float sdf_a, float sdf_b, float* out) {
+  float t = sdf_a/(sdf_a - sdf_b);
+  out[0] = a[0] + t*(b[0] - a[0]);
+  out[1] = a[1] + t*(b[1] - a[1]);
+  out[2] = a[2] + t*(b[2] - a[2]);
+}
+
+// Adds a triangle, wound counterclockwise seen from outside
+void AddTriangle(const float* a, const float* b, const float* c, const float* outward,
+                 std::vector<float>* triangles) {
+  float u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  float v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+  float n[3] = {u[1]*v[2] - u[2]*v[1], u[2]*v[0] - u[0]*v[2], u[0]*v[1] - u[1]*v[0]};
+  if (n[0]*outward[0] + n[1]*outward[1] + n[2]*outward[2] < 0) {
+    std::swap(b, c);
+  }
+  triangles->insert(triangles->end(), a, a + 3);
+  triangles->insert(triangles->end(), b, b + 3);
+  triangles->insert(triangles->end(), c, c + 3);
+}
+
+// Marching tetrahedra: the part of the surface inside one tetrahedron, one
+// triangle when a single corner is on its own side and two otherwise
+void MeshTetrahedron(const float* const* corners, const float* sdf, std::vector<float>* triangles) {
+  int inside[4];
+  int outside[4];
+  int inside_count = 0;
+  int outside_count = 0;
+  for (int k = 0; k < 4; k++) {
+    if (sdf[k] < 0) {
+      inside[inside_count++] = k;
+    } else {
+      outside[outside_count++] = k;
+    }
+  }
+  if (inside_count == 0 || outside_count == 0) {
+    return;
+  }
+  // From the inside corners towards the outside ones
+  float outward[3] = {0, 0, 0};
+  for (int c = 0; c < 3; c++) {
+    for (int k = 0; k < outside_count; k++) {
+      outward[c] += corners[outside[k]][c]/outside_count;
+    }
+    for (int k = 0; k < inside_count; k++) {
+      outward[c] -= corners[inside[k]][c]/inside_count;
+    }
+  }
+
+  if (inside_count == 2) {
+    // A quad around the tetrahedron, edges in order around it
+    float q[4][3];
+    const int edges[4][2] = {
+      {inside[0], outside[0]}, {inside[0], outside[1]}, {inside[1], outside[1]}, {inside[1], outside[0]}
+    };
+    for (int e = 0; e < 4; e++) {
+      int a = edges[e][0];
+      int b = edges[e][1];
+      Crossing(corners[a], corners[b], sdf[a], sdf[b], q[e]);
+    }
+    AddTriangle(q[0], q[1], q[2], outward, triangles);
+    AddTriangle(q[0], q[2], q[3], outward, triangles);
+    return;
+  }
+  // The corner that is on its own and the three edges leaving it
+  const int lone = inside_count == 1 ? inside[0] : outside[0];
+  const int* others = inside_count == 1 ? outside : inside;
+  float p[3][3];
+  for (int e = 0; e < 3; e++) {
+    Crossing(corners[lone], corners[others[e]], sdf[lone], sdf[others[e]], p[e]);
+  }
+  AddTriangle(p[0], p[1], p[2], outward, triangles);
+}
+
+}
+
+TsdfVolume::TsdfVolume(float voxel_size, float truncation, float max_weight)
+    : voxel_size(voxel_size), truncation(truncation), max_weight(max_weight), block_count(0),
+      table_bits(0), frame(0) {
+  Rehash(12);
+  stats.blocks = 0;
+  stats.bytes = 0;
+  stats.visible_blocks = 0;
+  stats.meshed_blocks = 0;
+  stats.triangles = 0;
+}
+
+TsdfVolume::~TsdfVolume() {
+  for (size_t i = 0; i < chunks.size(); i++) {
+    delete[] chunks[i];
+  }
+}
+
+void TsdfVolume::Reset() {
+  block_count = 0;
+  Slot empty = {0, -1};
+  std::fill(table.begin(), table.end(), empty);
+  block_meshes.clear();
+}
+
+TsdfVolume::Block& TsdfVolume::GetBlock(int index) const {
+  return chunks[index/c_CHUNK_BLOCKS][index % c_CHUNK_BLOCKS];
+}
+
+int TsdfVolume::FindBlock(uint64_t key) const {
+  // Fibonacci hashing, then linear probing
+  const uint64_t mask = table.size() - 1;
+  uint64_t slot = (key*0x9e3779b97f4a7c15ull) >> (64 - table_bits);
+  for (;;) {
+    const Slot& s = table[slot];
+    if (s.block < 0 || s.key == key) {
+      return s.block;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+// Grows the table to 2^bits slots and puts every block back in
+void TsdfVolume::Rehash(int bits) {
+  table_bits = bits;
+  Slot empty = {0, -1};
+  table.assign((size_t)1 << bits, empty);
+  const uint64_t mask = table.size() - 1;
+  for (int i = 0; i < block_count; i++) {
+    const Block& block = GetBlock(i);
+    uint64_t key = BlockKey(block.x, block.y, block.z);
+    uint64_t slot = (key*0x9e3779b97f4a7c15ull) >> (64 - table_bits);
+    while (table[slot].block >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot].key = key;
+    table[slot].block = i;
+  }
+}
+
+// Takes the next block from the pool and adds it to the table. The key must
+// not be in the table yet.
+int TsdfVolume::AllocateBlock(uint64_t key) {
+  // Keeps the table at most half full
+  if (2*(size_t)(block_count + 1) > table.size()) {
+    Rehash(table_bits + 1);
+  }
+  const int index = block_count++;
+  if (index/c_CHUNK_BLOCKS >= (int)chunks.size()) {
+    chunks.push_back(new Block[c_CHUNK_BLOCKS]);
+  }
+  Block& block = GetBlock(index);
+  UnpackKey(key, &block.x, &block.y, &block.z);
+  block.frame = 0;
+  block.changed = false;
+  for (int i = 0; i < c_TSDF_BLOCK_VOXELS; i++) {
+    block.voxels[i].sdf = 0;
+    block.voxels[i].weight = 0;
+  }
+
+  const uint64_t mask = table.size() - 1;
+  uint64_t slot = (key*0x9e3779b97f4a7c15ull) >> (64 - table_bits);
+  while (table[slot].block >= 0) {
+    slot = (slot + 1) & mask;
+  }
+  table[slot].key = key;
+  table[slot].block = index;
+  return index;
+}
+
+// Finds the blocks within the truncation distance of the points in a band of
+// rows, sampling along each point's viewing ray.
+void TsdfVolume::CollectBlocks(const float* points, int point_stride, int width, int height,
+                               const Pose& pose, int band) {
+  std::vector<uint64_t>& keys = band_keys[band];
+  keys.clear();
+  const float inverse_block_size = 1.0f/(voxel_size*c_TSDF_BLOCK_SIZE);
+  const int row_end = std::min(height, (band + 1)*c_BAND_ROWS);
+  for (int y = band*c_BAND_ROWS; y < row_end; y += c_ALLOCATION_STEP) {
+    for (int x = 0; x < width; x += c_ALLOCATION_STEP) {
+      const float* p = points + (y*width + x)*point_stride;
+      if (!(p[2] > 0)) {
+        continue;
+      }
+      const float length = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+      uint64_t last = ~0ull;
+      for (float s = -truncation; s <= truncation; s += voxel_size) {
+        float scale = 1 + s/length;
+        float camera[3] = {p[0]*scale, p[1]*scale, p[2]*scale};
+        float world[3];
+        Transform(pose, camera, world);
+        uint64_t key = BlockKey(FastFloor(world[0]*inverse_block_size),
+                                FastFloor(world[1]*inverse_block_size),
+                                FastFloor(world[2]*inverse_block_size));
+        if (key != last) {
+          keys.push_back(key);
+          last = key;
+        }
+      }
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+
+// Projects every voxel of the block into the frame and folds the distance
+// to the surface seen there into its running average
+void TsdfVolume::IntegrateBlock(Block* block, const float* points, int point_stride, int width, int height,
+                                const Intrinsics& intrinsics, const Pose& inverse_pose) {
+  const float* m = inverse_pose.m;
+  const float inverse_truncation = 1.0f/truncation;
+  float origin[3] = {
+    (block->x*c_TSDF_BLOCK_SIZE + 0.5f)*voxel_size,
+    (block->y*c_TSDF_BLOCK_SIZE + 0.5f)*voxel_size,
+    (block->z*c_TSDF_BLOCK_SIZE + 0.5f)*voxel_size
+  };
+  float corner[3];
+  Transform(inverse_pose, origin, corner);
+  // One voxel step along each world axis, in camera coordinates
+  const float step_x[3] = {m[0]*voxel_size, m[4]*voxel_size, m[8]*voxel_size};
+  const float step_y[3] = {m[1]*voxel_size, m[5]*voxel_size, m[9]*voxel_size};
+  const float step_z[3] = {m[2]*voxel_size, m[6]*voxel_size, m[10]*voxel_size};
+
+  bool changed = false;
+  Voxel* voxel = block->voxels;
+  for (int z = 0; z < c_TSDF_BLOCK_SIZE; z++) {
+    for (int y = 0; y < c_TSDF_BLOCK_SIZE; y++) {
+      float c[3];
+      for (int i = 0; i < 3; i++) {
+        c[i] = corner[i] + z*step_z[i] + y*step_y[i];
+      }
+      for (int x = 0; x < c_TSDF_BLOCK_SIZE; x++, voxel++) {
+        if (x > 0) {
+          c[0] += step_x[0];
+          c[1] += step_x[1];
+          c[2] += step_x[2];
+        }
+        if (!(c[2] > 0)) {
+          continue;
+        }
+        float inverse_z = 1.0f/c[2];
+        int u = (int)lrintf(intrinsics.fx*c[0]*inverse_z + intrinsics.cx);
+        int v = (int)lrintf(intrinsics.cy - intrinsics.fy*c[1]*inverse_z);
+        if (u < 0 || u >= width || v < 0 || v >= height) {
+          continue;
+        }
+        float depth = points[(v*width + u)*point_stride + 2];
+        // Also false for NaN
+        if (!(depth > 0)) {
+          continue;
+        }
+        float distance = depth - c[2];
+        if (distance < -truncation) {
+          continue;
+        }
+        float sdf = std::min(1.0f, distance*inverse_truncation);
+        float weight = voxel->weight;
+        voxel->sdf = (voxel->sdf*weight + sdf)/(weight + 1);
+        voxel->weight = std::min(max_weight, weight + 1);
+        changed = true;
+      }
+    }
+  }
+  if (changed) {
+    block->changed = true;
+  }
+}
+
+void TsdfVolume::CollectTask(int band) {
+  CollectBlocks(input.points, input.point_stride, input.width, input.height, input.pose, band);
+}
+
+void TsdfVolume::IntegrateTask(int task) {
+  const int end = std::min((int)visible.size(), (task + 1)*c_BLOCKS_PER_TASK);
+  for (int i = task*c_BLOCKS_PER_TASK; i < end; i++) {
+    IntegrateBlock(&GetBlock(visible[i]), input.points, input.point_stride, input.width, input.height,
+                   input.intrinsics, input.inverse_pose);
+  }
+}
+
+void TsdfVolume::Integrate(const float* points, int point_stride, int width, int height,
+                           const Intrinsics& intrinsics, const Pose& pose, ThreadPool* pool) {
+  frame++;
+  input.points = points;
+  input.point_stride = point_stride;
+  input.width = width;
+  input.height = height;
+  input.intrinsics = intrinsics;
+  input.pose = pose;
+  input.inverse_pose = InvertPose(pose);
+  const int band_count = (height + c_BAND_ROWS - 1)/c_BAND_ROWS;
+  band_keys.resize(band_count);
+  ThreadPool::Run(pool, band_count, [this](int band) {
+    CollectTask(band);
+  });
+
+  // Allocation changes the table, so it runs on this thread alone
+  visible.clear();
+  for (int band = 0; band < band_count; band++) {
+    const std::vector<uint64_t>& keys = band_keys[band];
+    for (size_t k = 0; k < keys.size(); k++) {
+      int index = FindBlock(keys[k]);
+      if (index < 0) {
+        index = AllocateBlock(keys[k]);
+      }
+      Block& block = GetBlock(index);
+      if (block.frame != frame) {
+        block.frame = frame;
+        visible.push_back(index);
+      }
+    }
+  }
+
+  const int task_count = (visible.size() + c_BLOCKS_PER_TASK - 1)/c_BLOCKS_PER_TASK;
+  ThreadPool::Run(pool, task_count, [this](int task) {
+    IntegrateTask(task);
+  });
+
+  stats.blocks = block_count;
+  stats.bytes = chunks.size()*c_CHUNK_BLOCKS*sizeof(Block) + table.size()*sizeof(Slot);
+  stats.visible_blocks = visible.size();
+}
+
+// Meshes the cubes whose first corner is in the block, which reach one
+// voxel into the blocks after it on each axis. Cubes with a corner that was
+// never observed are left out.
+void TsdfVolume::MeshBlock(int index) {
+  const Block& block = GetBlock(index);
+  std::vector<float>& triangles = block_meshes[index];
+  triangles.clear();
+  const int base_x = block.x*c_TSDF_BLOCK_SIZE;
+  const int base_y = block.y*c_TSDF_BLOCK_SIZE;
+  const int base_z = block.z*c_TSDF_BLOCK_SIZE;
+  // The block and the ones after it, indexed like cube corners
+  const Block* neighbors[8];
+  for (int k = 0; k < 8; k++) {
+    int neighbor = k == 0 ? index : FindBlock(BlockKey(block.x + (k & 1), block.y + ((k >> 1) & 1),
+                                                       block.z + ((k >> 2) & 1)));
+    neighbors[k] = neighbor >= 0 ? &GetBlock(neighbor) : NULL;
+  }
+  for (int z = 0; z < c_TSDF_BLOCK_SIZE; z++) {
+    for (int y = 0; y < c_TSDF_BLOCK_SIZE; y++) {
+      for (int x = 0; x < c_TSDF_BLOCK_SIZE; x++) {
+        float sdf[8];
+        float positions[8][3];
+        bool complete = true;
+        float low = 1;
+        float high = -1;
+        for (int k = 0; k < 8 && complete; k++) {
+          int cx = x + (k & 1);
+          int cy = y + ((k >> 1) & 1);
+          int cz = z + ((k >> 2) & 1);
+          const Block* owner = neighbors[cx/c_TSDF_BLOCK_SIZE + 2*(cy/c_TSDF_BLOCK_SIZE) +
+                                         4*(cz/c_TSDF_BLOCK_SIZE)];
+          const Voxel* voxel = owner == NULL ? NULL :
+              &owner->voxels[((cz % c_TSDF_BLOCK_SIZE)*c_TSDF_BLOCK_SIZE + cy % c_TSDF_BLOCK_SIZE)*
+                             c_TSDF_BLOCK_SIZE + cx % c_TSDF_BLOCK_SIZE];
+          complete = voxel != NULL && voxel->weight > 0;
+          if (complete) {
+            sdf[k] = voxel->sdf;
+            low = std::min(low, sdf[k]);
+            high = std::max(high, sdf[k]);
+            positions[k][0] = (base_x + cx + 0.5f)*voxel_size;
+            positions[k][1] = (base_y + cy + 0.5f)*voxel_size;
+            positions[k][2] = (base_z + cz + 0.5f)*voxel_size;
+          }
+        }
+        // No surface unless the signs differ. Values further apart than one
+        // cube can span are the edge of what was seen from behind a surface
+        // meeting what was seen in front of another, not a surface either.
+        if (!complete || low >= 0 || high < 0 || high - low > 1) {
+          continue;
+        }
+        for (int t = 0; t < 6; t++) {
+          const float* corners[4];
+          float values[4];
+          for (int k = 0; k < 4; k++) {
+            corners[k] = positions[c_TETRAHEDRA[t][k]];
+            values[k] = sdf[c_TETRAHEDRA[t][k]];
+          }
+          MeshTetrahedron(corners, values, &triangles);
+        }
+      }
+    }
+  }
+}
+
+void TsdfVolume::MeshTask(int task) {
+  const int end = std::min((int)remesh.size(), (task + 1)*c_BLOCKS_PER_TASK);
+  for (int i = task*c_BLOCKS_PER_TASK; i < end; i++) {
+    MeshBlock(remesh[i]);
+  }
+}
+
+void TsdfVolume::ExtractMesh(std::vector<float>* triangles, ThreadPool* pool) {
+  // Blocks before a changed one on any axis have cubes reaching into it
+  remesh.clear();
+  for (int i = 0; i < block_count; i++) {
+    Block& block = GetBlock(i);
+    if (!block.changed) {
+      continue;
+    }
+    block.changed = false;
+    for (int k = 0; k < 8; k++) {
+      int index = k == 0 ? i : FindBlock(BlockKey(block.x - (k & 1), block.y - ((k >> 1) & 1),
+                                                   block.z - ((k >> 2) & 1)));
+      if (index >= 0) {
+        remesh.push_back(index);
+      }
+    }
+  }
+  std::sort(remesh.begin(), remesh.end());
+  remesh.erase(std::unique(remesh.begin(), remesh.end()), remesh.end());
+
+  block_meshes.resize(block_count);
+  const int task_count = (remesh.size() + c_BLOCKS_PER_TASK - 1)/c_BLOCKS_PER_TASK;
+  ThreadPool::Run(pool, task_count, [this](int task) {
+    MeshTask(task);
+  });
+
+  triangles->clear();
+  for (int i = 0; i < block_count; i++) {
+    triangles->insert(triangles->end(), block_meshes[i].begin(), block_meshes[i].end());
+  }
+  stats.meshed_blocks = remesh.size();
+  stats.triangles = triangles->size()/9;
+}
@@ -0,0 +1,127 @@
+#include "voxel_downsampler.h"
+
+#include <cmath>
+
+namespace {
+
+// Voxel coordinates are packed 21 bits each, which covers +-10 m at 10 um
+const int c_KEY_BITS = 21;
+const int32_t c_KEY_OFFSET = 1 << (c_KEY_BITS - 1);
+const uint64_t c_KEY_MASK = (1 << c_KEY_BITS) - 1;
+
+inline int32_t FastFloor(float value) {
+  int32_t i = (int32_t)value;
+  return i - (value < i);
+}
+
+inline uint64_t VoxelKey(float x, float y, float z, float inverse_leaf_size) {
+  uint64_t ix = (FastFloor(x*inverse_leaf_size) + c_KEY_OFFSET) & c_KEY_MASK;
+  uint64_t iy = (FastFloor(y*inverse_leaf_size) + c_KEY_OFFSET) & c_KEY_MASK;
+  uint64_t iz = (FastFloor(z*inverse_leaf_size) + c_KEY_OFFSET) & c_KEY_MASK;
+  return ix << (2*c_KEY_BITS) | iy << c_KEY_BITS | iz;
+}
+
+}
+
+VoxelDownsampler::VoxelDownsampler(float leaf_size, int max_points)
+    : table_mask(0), table_bits(0), generation(0), voxel_count(0) {
+  SetLeafSize(leaf_size);
+  Reserve(max_points);
+}
+
+void VoxelDownsampler::SetLeafSize(float _leaf_size) {
+  leaf_size = _leaf_size;
+  inverse_leaf_size = 1.0f/leaf_size;
+}
+
+// Keeps the table at most half full, even if every point gets its own voxel
+void VoxelDownsampler::Reserve(int point_count) {
+  if ((int)voxels.size() >= point_count) {
+    return;
+  }
+  voxels.resize(point_count);
+  int bits = 1;
+  while ((1 << bits) < 2*point_count) {
+    bits++;
+  }
+  table_bits = bits;
+  table_mask = (1 << bits) - 1;
+  Slot empty = {0, 0, 0};
+  table.assign(1 << bits, empty);
+  generation = 0;
+}
+
+uint32_t VoxelDownsampler::FindVoxel(uint64_t key) {
+  // Fibonacci hashing, then linear probing
+  uint64_t slot = (key*0x9e3779b97f4a7c15ull) >> (64 - table_bits);
+  for (;;) {
+    Slot& s = table[slot];
+    if (s.generation != generation) {
+      s.key = key;
+      s.generation = generation;
+      s.voxel = voxel_count;
+      Voxel& voxel = voxels[voxel_count++];
+      voxel.x = voxel.y = voxel.z = 0;
+      voxel.r = voxel.g = voxel.b = 0;
+      voxel.count = 0;
+      return s.voxel;
+    }
+    if (s.key == key) {
+      return s.voxel;
+    }
+    slot = (slot + 1) & table_mask;
+  }
+}
+
+void VoxelDownsampler::Apply(const Cloud& input, Cloud* output) {
+  const int count = input.points.size();
+  Reserve(count);
+  // Slots from earlier frames all become free
+  if (++generation == 0) {
+    for (size_t i = 0; i < table.size(); i++) {
+      table[i].generation = 0;
+    }
+    generation = 1;
+  }
+  voxel_count = 0;
+
+  // Neighboring pixels usually share a voxel, so remember the last one
+  uint64_t last_key = ~0ull;
+  uint32_t last_voxel = 0;
+  for (int i = 0; i < count; i++) {
+    const pcl::PointXYZRGB& point = input.points[i];
+    if (std::isnan(point.z)) {
+      continue;
+    }
+    uint64_t key = VoxelKey(point.x, point.y, point.z, inverse_leaf_size);
+    if (key != last_key) {
+      last_key = key;
+      last_voxel = FindVoxel(key);
+    }
+    Voxel& voxel = voxels[last_voxel];
+    voxel.x += point.x;
+    voxel.y += point.y;
+    voxel.z += point.z;
+    voxel.r += point.r;
+    voxel.g += point.g;
+    voxel.b += point.b;
+    voxel.count++;
+  }
+
+  output->points.resize(voxel_count);
+  for (int i = 0; i < voxel_count; i++) {
+    const Voxel& voxel = voxels[i];
+    float scale = 1.0f/voxel.count;
+    pcl::PointXYZRGB& point = output->points[i];
+    point.x = voxel.x*scale;
+    point.y = voxel.y*scale;
+    point.z = voxel.z*scale;
+    point.data[3] = 1.0f;
+    // Rounded to nearest
+    point.rgba = 0xff000000 | (uint32_t)(voxel.r*scale + 0.5f) << 16 |
+        (uint32_t)(voxel.g*scale + 0.5f) << 8 | (uint32_t)(voxel.b*scale + 0.5f);
+  }
+  output->width = voxel_count;
+  output->height = 1;
+  output->is_dense = true;
+}